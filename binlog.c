@@ -0,0 +1,1130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "binlog.h"
+#include "snapshot.h"
+#include "compact.h"
+#include "replica.h"
+#include "srv.h"
+#include "conn.h"
+#include "job.h"
+#include "tube.h"
+#include "dlist.h"
+#include "times.h"
+
+/* records are gathered here, a record that doesn't fit gets its own */
+#define BINLOG_BUF_SIZE     (256 * 1024)
+
+#define BINLOG_NAME_FMT     "binlog.%u"
+#define BINLOG_NAME_SIZE    32
+#define SNAP_NAME_FMT       "snapshot.%u"
+
+/* how often binlog_cron() looks whether a thread is done, in usec */
+#define BG_POLL_USEC        (100 * 1000)
+
+/* what runs on the thread, see bg_start() */
+#define BG_NONE             0
+#define BG_FOLD             1
+#define BG_COMPACT          2
+#define BG_CHECKPOINT       3   /* in a child process instead */
+
+static int enabled;
+static int replaying;           /* binlog_init() is reading the files */
+static int dir_fd = -1;
+static int lock_fd = -1;
+static int cur_fd = -1;
+static uint32_t cur_seq;        /* the file being written */
+static uint32_t oldest_seq;     /* the first file still there */
+static int64_t cur_size;
+
+typedef struct seg_st {
+    uint32_t    refs;       /* jobs put in the file still alive */
+    int64_t     bytes;      /* of the file once it is closed */
+    int64_t     garbage;    /* of records in it no replay needs */
+} seg_t;
+
+/* segs[seq - seg_base] is file seq, for seq from oldest_seq to
+ * cur_seq. Once a snapshot is taken, file snap_seq - 1 stands for it
+ * and counts all the jobs it holds, see fold_install(). */
+static seg_t *segs;
+static uint32_t seg_base;
+static size_t seg_cap;
+
+/* the snapshot the files go on from, 0 if there is none */
+static uint32_t snap_seq;
+static uint64_t snap_bytes;
+
+/* Partitions log at the same time, see srv.h. The buffer and the
+ * files are theirs under this lock, while the rest is left to the
+ * callers with the locks of all partitions. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The thread doing file work off the event loop, one task at a time.
+ * Until it is done, seg_gc() keeps the files from bg_hold back. */
+static pthread_t bg_thread;
+static int bg_task;             /* BG_* */
+static int bg_started;          /* and binlog_cron() not told yet */
+static atomic_int bg_done;
+static int bg_ret;
+static uint32_t bg_hold;
+
+/* the fold writing snapshot.<fold_seq> */
+static uint32_t fold_seq;
+static uint32_t fold_snap;
+static uint32_t fold_from;
+static snap_stat_t fold_stat;
+static snap_stat_t last_fold;
+
+/* the compaction of file compact_seq, given the files up to before
+ * compact_end */
+static uint32_t compact_seq;
+static uint32_t compact_end;
+static int64_t compact_garbage; /* of the file when it started */
+static compact_stat_t compact_stat;
+
+/* what the child writing a checkpoint did, in memory it shares */
+typedef struct ckpt_res_st {
+    int         ret;
+    snap_stat_t stat;
+    uint64_t    cow_bytes;  /* its pages copied since the fork */
+} ckpt_res_t;
+
+/* the checkpoint writing snapshot.<fold_seq> */
+static pid_t ckpt_pid;
+static ckpt_res_t *ckpt_res;
+static int ckpt_pending;        /* asked for while the thread was busy */
+static int64_t ckpt_due;        /* of the next tasque_srv.checkpoint_sec */
+
+static char *wbuf;
+static size_t wbuf_len;
+static size_t wbuf_cap;
+
+static int dirty;               /* written and not synced yet */
+static int64_t sync_due;
+
+static uint64_t records_cnt;
+static uint64_t bytes_cnt;
+static uint64_t commit_cnt;
+static uint64_t fsync_cnt;
+static uint64_t snap_cnt;
+static int64_t restore_usec;
+static uint64_t compact_cnt;
+static uint64_t compact_read;
+static uint64_t compact_freed;
+static uint64_t compact_records;
+static int64_t compact_usec;
+static uint64_t ckpt_cnt;
+static int64_t ckpt_usec;
+static int64_t ckpt_fork_usec;
+static uint64_t ckpt_cow_pages;
+
+/* crc_table[k][b] is the crc of byte b followed by k zero bytes */
+static uint32_t crc_table[8][256];
+
+static void crc_init(void) {
+    uint32_t c;
+    int i, k;
+
+    for (i = 0; i < 256; ++i) {
+        c = i;
+        for (k = 0; k < 8; ++k) {
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[0][i] = c;
+    }
+    for (i = 0; i < 256; ++i) {
+        c = crc_table[0][i];
+        for (k = 1; k < 8; ++k) {
+            c = crc_table[0][c & 0xff] ^ (c >> 8);
+            crc_table[k][i] = c;
+        }
+    }
+}
+
+/* The CRC-32 of zlib, go on from `crc' with `len' more bytes. Eight
+ * bytes are taken at a time, with a table for each. */
+uint32_t binlog_crc32(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint32_t lo, hi;
+
+    crc = ~crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+        hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+            crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+            crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+            crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    }
+    while (len--) {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void fatal(const char *what, uint32_t seq) {
+    fprintf(stderr, "%s binlog.%u failed:%s\n", what, seq,
+            strerror(errno));
+    exit(1);
+}
+
+/* The entry counting the jobs put in file `seq'. The files folded
+ * into the snapshot count with it. */
+static seg_t *seg_ref(uint32_t seq) {
+    if (seq < oldest_seq) seq = oldest_seq;
+    return &segs[seq - seg_base];
+}
+
+/* Make room in segs for file `seq', counting no job yet. */
+static void seg_add(uint32_t seq) {
+    size_t need = seq - oldest_seq + 1, i;
+    seg_t *p;
+
+    if (oldest_seq - seg_base + need > seg_cap) {
+        /* drop the files gone first, then grow */
+        if (cur_seq >= oldest_seq) {
+            memmove(segs, segs + (oldest_seq - seg_base),
+                    (cur_seq - oldest_seq + 1) * sizeof(seg_t));
+        }
+        seg_base = oldest_seq;
+        if (need > seg_cap) {
+            p = realloc(segs, need * 2 * sizeof(seg_t));
+            if (!p) {
+                fprintf(stderr, "realloc binlog files failed\n");
+                exit(1);
+            }
+            segs = p;
+            seg_cap = need * 2;
+        }
+    }
+    for (i = cur_seq + 1; i <= seq; ++i) {
+        segs[i - seg_base].refs = 0;
+        segs[i - seg_base].bytes = 0;
+        segs[i - seg_base].garbage = 0;
+    }
+}
+
+/* Remove file `seq' of the log, or the snapshot if `snap'. */
+static void file_unlink(uint32_t seq, int snap) {
+    char name[BINLOG_NAME_SIZE];
+
+    snprintf(name, sizeof(name), snap ? SNAP_NAME_FMT : BINLOG_NAME_FMT,
+            seq);
+    if (unlinkat(dir_fd, name, 0) != 0 && errno != ENOENT) {
+        fprintf(stderr, "unlink %s failed:%s\n", name, strerror(errno));
+        exit(1);
+    }
+}
+
+static void seg_sync(void) {
+    if (fdatasync(cur_fd) != 0) {
+        fatal("fdatasync", cur_seq);
+    }
+    ++fsync_cnt;
+    dirty = 0;
+}
+
+/* Start writing file `seq'. */
+static void seg_open(uint32_t seq) {
+    char name[BINLOG_NAME_SIZE];
+    binlog_hdr_t h;
+
+    snprintf(name, sizeof(name), BINLOG_NAME_FMT, seq);
+    cur_fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (cur_fd < 0) {
+        fatal("open", seq);
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BINLOG_MAGIC, sizeof(h.magic));
+    h.version = BINLOG_VERSION;
+    h.rec_size = sizeof(jobrec_t);
+    h.seq = seq;
+    h.next_id = __atomic_load_n(&tasque_srv.next_job_id, __ATOMIC_RELAXED);
+    if (write(cur_fd, &h, sizeof(h)) != sizeof(h)) {
+        fatal("write", seq);
+    }
+
+    /* the new name must survive as well as what goes into it */
+    if (tasque_srv.binlog_fsync_ms != BINLOG_FSYNC_NEVER &&
+            fsync(dir_fd) != 0) {
+        fatal("fsync the directory of", seq);
+    }
+
+    seg_add(seq);
+    cur_seq = seq;
+    cur_size = sizeof(h);
+}
+
+/* Remove the files from the oldest on that no live job needs. A job
+ * updated in a later file than the one it was put in keeps that file
+ * around too, as the files only go in order. The snapshot goes with
+ * the file that stands for it, and what the thread reads stays. */
+static void seg_gc(void) {
+    while (oldest_seq < cur_seq && seg_ref(oldest_seq)->refs == 0 &&
+            !(bg_task && oldest_seq >= bg_hold)) {
+        file_unlink(oldest_seq, 0);
+        if (snap_seq && oldest_seq == snap_seq - 1) {
+            file_unlink(snap_seq, 1);
+            snap_seq = 0;
+            snap_bytes = 0;
+        }
+        ++oldest_seq;
+    }
+}
+
+/* Account for the latest update of `j' going to file `seq'. */
+static void seg_update(job_t *j, uint32_t seq) {
+    if (j->binlog_upd) {
+        seg_ref(j->binlog_upd)->garbage += sizeof(binlog_rec_t);
+    }
+    j->binlog_upd = seq;
+}
+
+/* Account for `j' being deleted: its records are garbage now. */
+static void seg_unref(job_t *j) {
+    seg_t *s = seg_ref(j->binlog_seq);
+
+    --s->refs;
+    s->garbage += sizeof(binlog_rec_t) + strlen(j->tube->name) +
+        j->rec.body_size;
+    if (j->binlog_upd) {
+        seg_ref(j->binlog_upd)->garbage += sizeof(binlog_rec_t);
+    }
+    j->binlog_seq = j->binlog_upd = 0;
+}
+
+static void *bg_run(void *arg) {
+    (void)arg;
+    if (bg_task == BG_FOLD) {
+        bg_ret = snapshot_fold(dir_fd, fold_snap, fold_from, fold_seq,
+                &fold_stat);
+    } else {
+        bg_ret = compact_file(dir_fd, compact_seq, compact_end,
+                tasque_srv.binlog_fsync_ms != BINLOG_FSYNC_NEVER,
+                &compact_stat);
+    }
+    atomic_store(&bg_done, 1);
+    return NULL;
+}
+
+/* Run `task' on the thread, keeping the files from `hold' on. */
+static void bg_start(int task, uint32_t hold) {
+    bg_task = task;
+    bg_hold = hold;
+    atomic_store(&bg_done, 0);
+    if (pthread_create(&bg_thread, NULL, bg_run, NULL) != 0) {
+        fprintf(stderr, "start binlog thread failed\n");
+        bg_task = BG_NONE;
+        return;
+    }
+    bg_started = 1;
+}
+
+/* Start folding the snapshot and the files after it into a new one
+ * if replaying them has come to cost more than reading it would: the
+ * files closed since are at least two and as big as the snapshot. */
+static void fold_start(void) {
+    uint32_t from = snap_seq ? snap_seq : oldest_seq, seq;
+    int64_t bytes = 0;
+
+    if (bg_task || replaying || cur_seq - from < 2) return;
+    for (seq = from; seq < cur_seq; ++seq) {
+        bytes += seg_ref(seq)->bytes;
+    }
+    if ((uint64_t)bytes < snap_bytes) return;
+
+    fold_seq = cur_seq;
+    fold_snap = snap_seq;
+    fold_from = from;
+    bg_start(BG_FOLD, oldest_seq);
+}
+
+/* Take the snapshot of a finished fold in place of the files before
+ * it: file fold_seq - 1 counts their jobs from now on. */
+static void fold_install(void) {
+    uint32_t seq = fold_seq, s;
+    uint32_t refs = 0;
+
+    if (bg_ret != 0) {
+        fprintf(stderr, "snapshot.%u failed, the log is kept\n", seq);
+        return;
+    }
+
+    for (s = oldest_seq; s < seq; ++s) {
+        refs += seg_ref(s)->refs;
+        file_unlink(s, 0);
+    }
+    if (snap_seq) file_unlink(snap_seq, 1);
+
+    oldest_seq = seq - 1;
+    seg_ref(oldest_seq)->refs = refs;
+    seg_ref(oldest_seq)->bytes = fold_stat.bytes;
+    seg_ref(oldest_seq)->garbage = 0;
+    snap_seq = seq;
+    snap_bytes = fold_stat.bytes;
+    last_fold = fold_stat;
+    ++snap_cnt;
+
+    if (tasque_srv.verbose) {
+        printf("snapshot.%u: %" PRIu64 " jobs, %" PRIu64 " bytes from %"
+                PRIu64 " in %" PRId64 " ms\n", seq, fold_stat.jobs,
+                fold_stat.bytes, fold_stat.read, fold_stat.usec / 1000);
+    }
+}
+
+/* Start compacting the closed file after the snapshot with the most
+ * garbage, if it is at least half garbage. */
+static void compact_start(void) {
+    uint32_t seq, best = 0;
+    int64_t most = 0;
+    seg_t *s;
+
+    if (bg_task || replaying) return;
+    for (seq = snap_seq ? snap_seq : oldest_seq; seq < cur_seq; ++seq) {
+        s = seg_ref(seq);
+        if (s->garbage * 2 >= s->bytes && s->garbage > most &&
+                !(seq == oldest_seq && s->refs == 0)) {
+            most = s->garbage;
+            best = seq;
+        }
+    }
+    if (!best) return;
+
+    /* everything logged is written by now, the deletes that made the
+     * garbage included */
+    compact_seq = best;
+    compact_end = cur_seq + 1;
+    compact_garbage = most;
+    bg_start(BG_COMPACT, best);
+}
+
+/* Account for a finished compaction: its file is the new one. */
+static void compact_install(void) {
+    seg_t *s = seg_ref(compact_seq);
+
+    if (bg_ret != 0) {
+        fprintf(stderr, "compact binlog.%u failed, it is kept\n",
+                compact_seq);
+        return;
+    }
+
+    s->bytes = compact_stat.after;
+    s->garbage -= compact_garbage;
+    if (s->garbage < 0) s->garbage = 0;
+    ++compact_cnt;
+    compact_read += compact_stat.read;
+    compact_freed += compact_stat.before - compact_stat.after;
+    compact_records += compact_stat.records;
+    compact_usec += compact_stat.usec;
+
+    if (tasque_srv.verbose) {
+        printf("binlog.%u: compacted from %" PRIu64 " to %" PRIu64
+                " bytes in %" PRId64 " ms\n", compact_seq,
+                compact_stat.before, compact_stat.after,
+                compact_stat.usec / 1000);
+    }
+}
+
+/* Close the file being written and go on to the next one. */
+static void seg_next(void) {
+    if (tasque_srv.binlog_fsync_ms != BINLOG_FSYNC_NEVER) {
+        seg_sync();
+    }
+    close(cur_fd);
+    seg_ref(cur_seq)->bytes = cur_size;
+    seg_open(cur_seq + 1);
+}
+
+static void seg_rotate(void) {
+    seg_next();
+    fold_start();
+    compact_start();
+}
+
+/* Write out the records gathered so far. */
+static void buf_out(void) {
+    size_t off = 0;
+    ssize_t r;
+
+    while (off < wbuf_len) {
+        r = write(cur_fd, wbuf + off, wbuf_len - off);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            fatal("write", cur_seq);
+        }
+        off += r;
+    }
+    replica_feed(wbuf, wbuf_len);
+    cur_size += wbuf_len;
+    bytes_cnt += wbuf_len;
+    wbuf_len = 0;
+}
+
+/* As buf_out(), and go on to a new file if the current one is full. */
+static void buf_write(void) {
+    buf_out();
+    if (cur_size >= tasque_srv.binlog_size) {
+        seg_rotate();
+    }
+}
+
+/* The bytes of pages this process has to itself, from what it shares
+ * with its parent since the fork, 0 if the kernel doesn't say. */
+static uint64_t private_dirty(void) {
+    char line[128];
+    unsigned long long kb = 0;
+    FILE *f;
+
+    if (!(f = fopen("/proc/self/smaps_rollup", "r"))) return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "Private_Dirty: %llu kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+/* Write the checkpoint in the child and leave. Should the server go
+ * away, so does the child, and the directory lock with it. */
+static void ckpt_child(void) {
+    int keep[] = {dir_fd, lock_fd};
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    srv_close_fds(keep, 2);
+    ckpt_res->ret = snapshot_write(dir_fd, fold_seq, &ckpt_res->stat);
+    ckpt_res->cow_bytes = private_dirty();
+    _exit(ckpt_res->ret == 0 ? 0 : 1);
+}
+
+/* Start a checkpoint: what is logged so far goes into the file being
+ * written, which is closed, and a child forked off the server writes
+ * the jobs in memory as they are then as the snapshot taking the
+ * place of the files up to it. The server goes on in the next file,
+ * the pages it changes in the meantime are copied by the kernel. */
+static void ckpt_start(void) {
+    int64_t start;
+    pid_t pid;
+
+    if (bg_task) {
+        ckpt_pending = 1;
+        return;
+    }
+    ckpt_pending = 0;
+    buf_out();
+    seg_next();
+
+    fold_seq = cur_seq;
+    memset(ckpt_res, 0, sizeof(*ckpt_res));
+    start = ustime();
+    pid = fork();
+    ckpt_fork_usec = ustime() - start;
+    if (pid < 0) {
+        fprintf(stderr, "fork for checkpoint failed:%s\n", strerror(errno));
+        return;
+    }
+    if (pid == 0) {
+        ckpt_child();
+    }
+
+    ckpt_pid = pid;
+    bg_task = BG_CHECKPOINT;
+    bg_hold = oldest_seq;
+    bg_started = 1;
+}
+
+/* Whether the child is done, with bg_ret set if it is. */
+static int ckpt_done(void) {
+    int status;
+    pid_t pid;
+
+    pid = waitpid(ckpt_pid, &status, WNOHANG);
+    if (pid == 0 || (pid < 0 && errno == EINTR)) return 0;
+    bg_ret = pid == ckpt_pid && WIFEXITED(status) &&
+        WEXITSTATUS(status) == 0 ? ckpt_res->ret : -1;
+    return 1;
+}
+
+/* Take the snapshot of a finished checkpoint as a fold's. */
+static void ckpt_install(void) {
+    fold_stat = ckpt_res->stat;
+    fold_install();
+    if (bg_ret != 0) return;
+
+    ++ckpt_cnt;
+    ckpt_usec = fold_stat.usec;
+    ckpt_cow_pages = ckpt_res->cow_bytes / sysconf(_SC_PAGESIZE);
+    if (tasque_srv.verbose) {
+        printf("checkpoint: fork %" PRId64 " us, %" PRIu64
+                " pages copied\n", ckpt_fork_usec, ckpt_cow_pages);
+    }
+}
+
+/* Take what the thread or the child did once it is done, and start
+ * it again if there is more to do. */
+static void bg_check(void) {
+    int task = bg_task;
+
+    if (task == BG_CHECKPOINT ? ckpt_done() :
+            task && atomic_load(&bg_done)) {
+        if (task != BG_CHECKPOINT) {
+            pthread_join(bg_thread, NULL);
+        }
+        bg_task = BG_NONE;
+        if (task == BG_FOLD) {
+            fold_install();
+        } else if (task == BG_COMPACT) {
+            compact_install();
+        } else {
+            ckpt_install();
+        }
+        seg_gc();
+    }
+    if (ckpt_pending) ckpt_start();
+    fold_start();
+    compact_start();
+}
+
+/* The size of a record of `type' for `j'. */
+size_t binlog_rec_size(job_t *j, int type) {
+    if (type != BINLOG_PUT) return sizeof(binlog_rec_t);
+    return sizeof(binlog_rec_t) + strlen(j->tube->name) + j->rec.body_size;
+}
+
+/* Write a record of `type' for `j' at `p', binlog_rec_size() bytes. */
+void binlog_rec_encode(job_t *j, int type, char *p) {
+    binlog_rec_t r;
+    size_t tube_len = 0, body_len = 0;
+
+    if (type == BINLOG_PUT) {
+        tube_len = strlen(j->tube->name);
+        body_len = j->rec.body_size;
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.len = tube_len + body_len;
+    r.type = type;
+    r.tube_len = tube_len;
+    r.rec = j->rec;
+
+    memcpy(p, &r, sizeof(r));
+    memcpy(p + sizeof(r), j->tube->name, tube_len);
+    memcpy(p + sizeof(r) + tube_len, j->body, body_len);
+    r.crc = binlog_crc32(0, p + sizeof(r.crc),
+            sizeof(r) - sizeof(r.crc) + r.len);
+    memcpy(p, &r.crc, sizeof(r.crc));
+}
+
+/* Add a record of `type' for `j' to the buffer. */
+static void rec_append(job_t *j, int type) {
+    size_t n = binlog_rec_size(j, type);
+    char *p;
+
+    if (wbuf_len + n > wbuf_cap) {
+        if (wbuf_len) buf_write();
+        if (n > wbuf_cap) {
+            p = realloc(wbuf, n);
+            if (!p) {
+                fprintf(stderr, "realloc binlog buffer failed\n");
+                exit(1);
+            }
+            wbuf = p;
+            wbuf_cap = n;
+        }
+    }
+
+    binlog_rec_encode(j, type, wbuf + wbuf_len);
+    wbuf_len += n;
+    ++records_cnt;
+}
+
+/* Log the new job `j' in full. */
+void binlog_put(job_t *j) {
+    if (!enabled || replaying) return;
+    pthread_mutex_lock(&lock);
+    rec_append(j, BINLOG_PUT);
+    j->binlog_seq = cur_seq;
+    ++seg_ref(cur_seq)->refs;
+    pthread_mutex_unlock(&lock);
+}
+
+/* Log the state of `j', if it is logged at all. */
+void binlog_update(job_t *j) {
+    if (!enabled || replaying || !j->binlog_seq) return;
+    pthread_mutex_lock(&lock);
+    rec_append(j, BINLOG_UPDATE);
+    seg_update(j, cur_seq);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Log that `j' is gone. */
+void binlog_delete(job_t *j) {
+    if (!enabled || replaying || !j->binlog_seq) return;
+    pthread_mutex_lock(&lock);
+    rec_append(j, BINLOG_DELETE);
+    seg_unref(j);
+    pthread_mutex_unlock(&lock);
+}
+
+/* The file `j' was put in, or that stands for the snapshot holding
+ * it. 0 if it isn't logged. */
+uint32_t binlog_job_file(job_t *j) {
+    if (!enabled || !j->binlog_seq) return 0;
+    return j->binlog_seq < oldest_seq ? oldest_seq : j->binlog_seq;
+}
+
+/* Write a snapshot of the jobs in memory from a child process, see
+ * ckpt_start(), or once the thread is done if it is busy. -1 returned
+ * if there is no binlog, otherwise 0. */
+int binlog_checkpoint(void) {
+    if (!enabled) return -1;
+    if (bg_task != BG_CHECKPOINT) ckpt_start();
+    return 0;
+}
+
+/* Write out what has been logged since the last call, all at once.
+ * Called before replies go out, so a client never hears of a change
+ * that isn't in the log. With BINLOG_FSYNC_ALWAYS it is on the disk
+ * as well, otherwise binlog_cron() syncs it later. Return when that
+ * is due if it wasn't yet, or when to look whether the thread just
+ * started is done, INT64_MAX otherwise. */
+int64_t binlog_flush(void) {
+    int64_t next = INT64_MAX;
+
+    if (!enabled) return INT64_MAX;
+
+    pthread_mutex_lock(&lock);
+    if (wbuf_len) {
+        buf_write();
+        ++commit_cnt;
+        seg_gc();
+
+        if (tasque_srv.binlog_fsync_ms == BINLOG_FSYNC_ALWAYS) {
+            seg_sync();
+        } else if (tasque_srv.binlog_fsync_ms > 0 && !dirty) {
+            dirty = 1;
+            sync_due = ustime() + tasque_srv.binlog_fsync_ms * 1000LL;
+            next = sync_due;
+        }
+    }
+    if (bg_started) {
+        /* binlog_cron() has to look out for the end of the thread */
+        bg_started = 0;
+        next = ustime() + BG_POLL_USEC;
+    }
+    pthread_mutex_unlock(&lock);
+    return next;
+}
+
+/* Write out what the cron has logged, sync the file if it is time,
+ * take what the thread did once it is done and start a checkpoint if
+ * one is due and anything was logged since the snapshot. Return when
+ * this should be called again. */
+int64_t binlog_cron(int64_t now) {
+    int64_t next;
+
+    if (!enabled) return INT64_MAX;
+
+    binlog_flush();
+    if (dirty && sync_due <= now) {
+        seg_sync();
+    }
+    bg_check();
+
+    if (tasque_srv.checkpoint_sec && ckpt_due <= now) {
+        ckpt_due = now + tasque_srv.checkpoint_sec * 1000000LL;
+        if (snap_seq != cur_seq || cur_size > (int64_t)sizeof(binlog_hdr_t)) {
+            binlog_checkpoint();
+        }
+    }
+
+    bg_started = 0;
+    next = dirty ? sync_due : INT64_MAX;
+    if (bg_task && now + BG_POLL_USEC < next) {
+        next = now + BG_POLL_USEC;
+    }
+    if (tasque_srv.checkpoint_sec && ckpt_due < next) {
+        next = ckpt_due;
+    }
+    return next;
+}
+
+/* Apply record `r' of file `seq', with the tube name and body at `p',
+ * to the jobs read so far, listed in `jobs' by the order they were
+ * put in. */
+static void replay_rec(binlog_rec_t *r, const char *p, uint32_t seq,
+        dlink *jobs) {
+    char name[MAX_TUBE_NAME_LEN];
+    job_t *j = job_find(r->rec.id);
+    int32_t body_size;
+    tube_t *t;
+
+    switch (r->type) {
+    case BINLOG_PUT:
+        if (j || r->tube_len >= MAX_TUBE_NAME_LEN ||
+                r->len != r->tube_len + (uint32_t)r->rec.body_size) {
+            return;
+        }
+        memcpy(name, p, r->tube_len);
+        name[r->tube_len] = '\0';
+        t = tube_find_or_create(name);
+        j = t ? job_create(r->rec.pri, r->rec.delay, r->rec.ttr,
+                r->rec.body_size, t, r->rec.id) : NULL;
+        if (!j) {
+            fprintf(stderr, "out of memory reading binlog.%u\n", seq);
+            exit(1);
+        }
+        j->rec = r->rec;
+        memcpy(j->body, p + r->tube_len, r->rec.body_size);
+        j->binlog_seq = seq;
+        ++seg_ref(seq)->refs;
+        dlink_add_tail(jobs, &j->link);
+        break;
+    case BINLOG_UPDATE:
+        if (!j) return;
+        body_size = j->rec.body_size;
+        j->rec = r->rec;
+        j->rec.body_size = body_size;
+        seg_update(j, seq);
+        break;
+    case BINLOG_DELETE:
+        if (!j) return;
+        seg_unref(j);
+        dlink_delete(&j->link);
+        j->rec.state = JOB_INVALID;
+        job_free(j);
+        break;
+    }
+}
+
+/* Read file `seq' into `jobs'. A record that is cut short or doesn't
+ * match its crc ends the file: it is what a crash leaves behind. */
+static void replay_file(uint32_t seq, dlink *jobs) {
+    char name[BINLOG_NAME_SIZE];
+    binlog_hdr_t h;
+    binlog_rec_t r;
+    struct stat st;
+    char *data;
+    size_t off, size, got = 0;
+    ssize_t n;
+    int fd;
+
+    snprintf(name, sizeof(name), BINLOG_NAME_FMT, seq);
+    fd = openat(dir_fd, name, O_RDWR);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fatal("open", seq);
+    }
+    size = st.st_size;
+    if (size < sizeof(h)) {
+        /* cut short as it was created, it holds nothing */
+        close(fd);
+        return;
+    }
+
+    if (!(data = malloc(size))) {
+        fprintf(stderr, "out of memory reading binlog.%u\n", seq);
+        exit(1);
+    }
+    while (got < size) {
+        n = read(fd, data + got, size - got);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            fatal("read", seq);
+        }
+        got += n;
+    }
+
+    memcpy(&h, data, sizeof(h));
+    if (memcmp(h.magic, BINLOG_MAGIC, sizeof(h.magic)) ||
+            h.version != BINLOG_VERSION ||
+            h.rec_size != sizeof(jobrec_t) || h.seq != seq) {
+        fprintf(stderr, "binlog.%u is not a binlog of this version\n",
+                seq);
+        exit(1);
+    }
+    if (h.next_id > tasque_srv.next_job_id) {
+        tasque_srv.next_job_id = h.next_id;
+    }
+
+    for (off = sizeof(h); size - off >= sizeof(r);
+            off += sizeof(r) + r.len) {
+        memcpy(&r, data + off, sizeof(r));
+        if (r.len > size - off - sizeof(r) ||
+                binlog_crc32(0, data + off + sizeof(r.crc),
+                    sizeof(r) - sizeof(r.crc) + r.len) != r.crc) {
+            break;
+        }
+        if (r.rec.id >= tasque_srv.next_job_id) {
+            tasque_srv.next_job_id = r.rec.id + 1;
+        }
+        replay_rec(&r, data + off + sizeof(r), seq, jobs);
+    }
+
+    if (off < size) {
+        fprintf(stderr, "binlog.%u: bad record at %zu, truncated\n",
+                seq, off);
+        if (ftruncate(fd, off) != 0) {
+            fatal("truncate", seq);
+        }
+    }
+    seg_ref(seq)->bytes = off;
+    free(data);
+    close(fd);
+}
+
+static int seq_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* The seqs of the files in the directory named as `fmt', a format
+ * with "%u%c", in order, their number in `cnt'. */
+static uint32_t *list_files(const char *fmt, size_t *cnt) {
+    uint32_t *seqs = NULL, *p, seq;
+    size_t n = 0, cap = 0;
+    struct dirent *e;
+    char tail;
+    DIR *d;
+
+    if (!(d = opendir(tasque_srv.binlog_dir))) {
+        fprintf(stderr, "opendir %s failed:%s\n", tasque_srv.binlog_dir,
+                strerror(errno));
+        exit(1);
+    }
+    while ((e = readdir(d))) {
+        if (sscanf(e->d_name, fmt, &seq, &tail) != 1 || seq == 0) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            if (!(p = realloc(seqs, cap * sizeof(*seqs)))) {
+                fprintf(stderr, "realloc binlog files failed\n");
+                exit(1);
+            }
+            seqs = p;
+        }
+        seqs[n++] = seq;
+    }
+    closedir(d);
+
+    if (n > 1) qsort(seqs, n, sizeof(*seqs), seq_cmp);
+    *cnt = n;
+    return seqs;
+}
+
+/* Load the latest snapshot, if any, into `jobs', remove what it makes
+ * obsolete and return its seq, 0 if there is none. */
+static uint32_t snap_init(dlink *jobs, uint64_t *cnt) {
+    char name[BINLOG_NAME_SIZE];
+    uint32_t *snaps, seq;
+    struct stat st;
+    size_t i, n;
+
+    *cnt = 0;
+    snaps = list_files(SNAP_NAME_FMT "%c", &n);
+    seq = n ? snaps[n - 1] : 0;
+    for (i = 0; i + 1 < n; ++i) {
+        file_unlink(snaps[i], 1);
+    }
+    free(snaps);
+    /* what the thread left when the server stopped */
+    unlinkat(dir_fd, "snapshot.tmp", 0);
+    unlinkat(dir_fd, "binlog.tmp", 0);
+    if (!seq) return 0;
+
+    snprintf(name, sizeof(name), SNAP_NAME_FMT, seq);
+    if (snapshot_load(dir_fd, seq, jobs, cnt) != 0 ||
+            fstatat(dir_fd, name, &st, 0) != 0) {
+        exit(1);
+    }
+    snap_bytes = st.st_size;
+    return seq;
+}
+
+/* Take tasque_srv.binlog_dir if there is one, put back the jobs of
+ * its snapshot and the files after it, and start a new file after
+ * them. */
+void binlog_init(void) {
+    uint32_t *seqs, last;
+    size_t i, n, first;
+    uint64_t restored;
+    int64_t start;
+    dlink jobs, *l;
+
+    if (!tasque_srv.binlog_dir) return;
+
+    crc_init();
+    if (mkdir(tasque_srv.binlog_dir, 0700) != 0 && errno != EEXIST) {
+        fprintf(stderr, "mkdir %s failed:%s\n", tasque_srv.binlog_dir,
+                strerror(errno));
+        exit(1);
+    }
+    dir_fd = open(tasque_srv.binlog_dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+        fprintf(stderr, "open %s failed:%s\n", tasque_srv.binlog_dir,
+                strerror(errno));
+        exit(1);
+    }
+    lock_fd = openat(dir_fd, "lock", O_RDWR | O_CREAT, 0600);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "lock %s failed:%s\n", tasque_srv.binlog_dir,
+                strerror(errno));
+        exit(1);
+    }
+
+    wbuf_cap = BINLOG_BUF_SIZE;
+    if (!(wbuf = malloc(wbuf_cap))) {
+        fprintf(stderr, "malloc binlog buffer failed\n");
+        exit(1);
+    }
+    ckpt_res = mmap(NULL, sizeof(*ckpt_res), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ckpt_res == MAP_FAILED) {
+        fprintf(stderr, "mmap checkpoint result failed\n");
+        exit(1);
+    }
+
+    start = ustime();
+    dlink_init(&jobs);
+    replaying = 1;
+    snap_seq = snap_init(&jobs, &restored);
+
+    /* the files before the snapshot are in it, file snap_seq - 1
+     * stands for it and counts its jobs */
+    seqs = list_files(BINLOG_NAME_FMT "%c", &n);
+    for (i = 0; i < n && seqs[i] < snap_seq; ++i) {
+        file_unlink(seqs[i], 0);
+    }
+    first = i;
+    if (snap_seq) {
+        oldest_seq = seg_base = snap_seq - 1;
+    } else {
+        oldest_seq = seg_base = first < n ? seqs[first] : 1;
+    }
+    cur_seq = oldest_seq - 1;
+    if (snap_seq) {
+        seg_add(oldest_seq);
+        cur_seq = oldest_seq;
+        seg_ref(oldest_seq)->refs = restored;
+        seg_ref(oldest_seq)->bytes = snap_bytes;
+    }
+    for (i = first; i < n; ++i) {
+        seg_add(seqs[i]);
+        cur_seq = seqs[i];
+        replay_file(seqs[i], &jobs);
+    }
+
+    restored = 0;
+    while ((l = dlink_first(&jobs))) {
+        dlink_delete(l);
+        conn_restore_job(dlink_entry(l, job_t, link));
+        ++restored;
+    }
+    conn_restore_done();
+    replaying = 0;
+    enabled = 1;
+    restore_usec = ustime() - start;
+    ckpt_due = ustime() + tasque_srv.checkpoint_sec * 1000000LL;
+
+    last = first < n ? seqs[n - 1] + 1 : 1;
+    seg_open(last > snap_seq ? last : snap_seq);
+    seg_gc();
+    free(seqs);
+
+    if (tasque_srv.verbose) {
+        printf("binlog %s: %" PRIu64 " jobs restored in %" PRId64
+                " ms, next id %lu\n", tasque_srv.binlog_dir, restored,
+                restore_usec / 1000,
+                (unsigned long)tasque_srv.next_job_id);
+    }
+}
+
+/* Format the binlog stats as in the `stats' command. Return the
+ * length like snprintf(). */
+int binlog_fmt_stats(char *buf, size_t n) {
+    int64_t disk = 0, garbage = 0;
+    uint32_t seq;
+    seg_t *s;
+
+    for (seq = oldest_seq; enabled && seq <= cur_seq; ++seq) {
+        s = seg_ref(seq);
+        disk += seq == cur_seq ? cur_size : s->bytes;
+        garbage += s->garbage;
+    }
+    if (garbage > disk) garbage = disk;
+
+    return snprintf(buf, n,
+            "binlog-oldest-index: %u\n"
+            "binlog-current-index: %u\n"
+            "binlog-records-migrated: %" PRIu64 "\n"
+            "binlog-records-written: %" PRIu64 "\n"
+            "binlog-max-size: %" PRId64 "\n"
+            "binlog-fsync-ms: %d\n"
+            "binlog-bytes-written: %" PRIu64 "\n"
+            "binlog-group-commits: %" PRIu64 "\n"
+            "binlog-fsyncs: %" PRIu64 "\n"
+            "binlog-snapshot-index: %u\n"
+            "binlog-snapshots: %" PRIu64 "\n"
+            "binlog-snapshot-jobs: %" PRIu64 "\n"
+            "binlog-snapshot-bytes: %" PRIu64 "\n"
+            "binlog-snapshot-read-bytes: %" PRIu64 "\n"
+            "binlog-snapshot-ms: %" PRId64 "\n"
+            "binlog-restore-ms: %" PRId64 "\n"
+            "binlog-disk-bytes: %" PRId64 "\n"
+            "binlog-garbage-bytes: %" PRId64 "\n"
+            "binlog-space-amplification: %.2f\n"
+            "binlog-compactions: %" PRIu64 "\n"
+            "binlog-compaction-read-bytes: %" PRIu64 "\n"
+            "binlog-compaction-freed-bytes: %" PRIu64 "\n"
+            "binlog-compaction-ms: %" PRId64 "\n"
+            "binlog-compaction-bytes-per-sec: %" PRIu64 "\n"
+            "binlog-checkpoints: %" PRIu64 "\n"
+            "binlog-checkpoint-in-progress: %d\n"
+            "binlog-checkpoint-ms: %" PRId64 "\n"
+            "binlog-checkpoint-fork-usec: %" PRId64 "\n"
+            "binlog-checkpoint-cow-pages: %" PRIu64 "\n",
+            enabled ? oldest_seq : 0,
+            enabled ? cur_seq : 0,
+            compact_records,
+            records_cnt,
+            (int64_t)tasque_srv.binlog_size,
+            tasque_srv.binlog_fsync_ms,
+            bytes_cnt,
+            commit_cnt,
+            fsync_cnt,
+            snap_seq,
+            snap_cnt,
+            last_fold.jobs,
+            snap_bytes,
+            last_fold.read,
+            last_fold.usec / 1000,
+            restore_usec / 1000,
+            disk,
+            garbage,
+            disk > garbage ? (double)disk / (disk - garbage) : 1.0,
+            compact_cnt,
+            compact_read,
+            compact_freed,
+            compact_usec / 1000,
+            compact_usec ?
+                (uint64_t)(compact_read * 1e6 / compact_usec) : 0,
+            ckpt_cnt,
+            bg_task == BG_CHECKPOINT || ckpt_pending,
+            ckpt_usec / 1000,
+            ckpt_fork_usec,
+            ckpt_cow_pages);
+}
@@ -0,0 +1,72 @@
+#ifndef __BINLOG_H_INCLUDED__
+#define __BINLOG_H_INCLUDED__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "job.h"
+
+/* The binlog is an append-only log of job records in
+ * tasque_srv.binlog_dir, cut into files binlog.<seq> of about
+ * tasque_srv.binlog_size bytes. A job is written in full when it is
+ * put, and its record again, without the body, whenever its state
+ * changes. Records are gathered in memory and written out together
+ * before the replies that depend on them, see binlog_flush(), then
+ * synced to disk as tasque_srv.binlog_fsync_ms says. A file goes away
+ * once it and the files before it hold no job that is still alive.
+ *
+ * Once the files closed since the last snapshot outgrow it, they are
+ * folded with it into a new one on a thread of its own, see
+ * snapshot.h, which then takes their place: a restart only reads the
+ * snapshot and the files after it. In between, the same thread
+ * compacts a file once the records in it that the deletes and updates
+ * since have made useless are half of it, see compact.h. A checkpoint
+ * writes a snapshot of the jobs in memory instead, from a child process
+ * forked off the server, when asked to or every
+ * tasque_srv.checkpoint_sec. binlog_put(), binlog_update(),
+ * binlog_delete() and binlog_flush() may be called under the lock of
+ * any partition, the rest with those of all of them, see srv.h. */
+#define BINLOG_MAGIC        "TQBL"
+#define BINLOG_VERSION      1
+
+#define BINLOG_DEFAULT_SIZE (10 * 1024 * 1024)
+#define BINLOG_DEFAULT_FSYNC_MS     50
+
+/* binlog_fsync_ms values that aren't intervals */
+#define BINLOG_FSYNC_ALWAYS 0
+#define BINLOG_FSYNC_NEVER  (-1)
+
+#define BINLOG_PUT          1   /* followed by the tube name and body */
+#define BINLOG_UPDATE       2
+#define BINLOG_DELETE       3
+
+/* at the start of every file */
+typedef struct binlog_hdr_st {
+    char        magic[4];
+    uint32_t    version;
+    uint32_t    rec_size;   /* sizeof(jobrec_t) of the writer */
+    uint32_t    seq;
+    uint64_t    next_id;    /* tasque_srv.next_job_id when opened */
+} binlog_hdr_t;
+
+typedef struct binlog_rec_st {
+    uint32_t    crc;        /* crc32 of the rest of the record */
+    uint32_t    len;        /* bytes after this header */
+    uint8_t     type;       /* BINLOG_* */
+    uint8_t     tube_len;
+    jobrec_t    rec;
+} binlog_rec_t;
+
+void binlog_init(void);
+void binlog_put(job_t *j);
+void binlog_update(job_t *j);
+void binlog_delete(job_t *j);
+uint32_t binlog_job_file(job_t *j);
+size_t binlog_rec_size(job_t *j, int type);
+void binlog_rec_encode(job_t *j, int type, char *p);
+int binlog_checkpoint(void);
+int64_t binlog_flush(void);
+int64_t binlog_cron(int64_t now);
+int binlog_fmt_stats(char *buf, size_t n);
+uint32_t binlog_crc32(uint32_t crc, const void *data, size_t len);
+
+#endif /* __BINLOG_H_INCLUDED__ */
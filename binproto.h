@@ -0,0 +1,75 @@
+#ifndef __BINPROTO_H_INCLUDED__
+#define __BINPROTO_H_INCLUDED__
+
+#include <stdint.h>
+
+/* The binary protocol, spoken by a connection whose first byte is
+ * BIN_REQ_MAGIC, see doc/protocol.txt. Every request and response is
+ * a bin_hdr_t, little-endian, followed by `len' bytes of payload: the
+ * job body of a put, the tube name of the commands taking one, the
+ * body of a job or the YAML of a stats or list reply. */
+#define BIN_REQ_MAGIC       0x80
+#define BIN_RES_MAGIC       0x81
+
+#define BIN_HDR_SIZE        32
+
+/* the longest tube name payload */
+#define BIN_NAME_MAX        200
+
+typedef struct bin_hdr_st {
+    uint8_t         magic;
+    uint8_t         op;         /* BIN_OP_*, echoed in the response */
+    uint16_t        status;     /* BIN_*, responses only */
+    uint32_t        len;        /* bytes of payload */
+    uint64_t        id;         /* job id */
+    uint32_t        pri;
+    uint32_t        delay;      /* seconds */
+    uint32_t        ttr;        /* seconds */
+    uint32_t        count;      /* timeout, kick bound, tubes watched or
+                                   jobs kicked */
+} bin_hdr_t;
+
+/* the opcodes are the numbers of the text commands */
+#define BIN_OP_PUT                  1
+#define BIN_OP_PEEKJOB              2
+#define BIN_OP_RESERVE              3
+#define BIN_OP_DELETE               4
+#define BIN_OP_RELEASE              5
+#define BIN_OP_BURY                 6
+#define BIN_OP_KICK                 7
+#define BIN_OP_STATS                8
+#define BIN_OP_JOBSTATS             9
+#define BIN_OP_PEEK_BURIED          10
+#define BIN_OP_USE                  11
+#define BIN_OP_WATCH                12
+#define BIN_OP_IGNORE               13
+#define BIN_OP_LIST_TUBES           14
+#define BIN_OP_LIST_TUBE_USED       15
+#define BIN_OP_LIST_TUBES_WATCHED   16
+#define BIN_OP_STATS_TUBE           17
+#define BIN_OP_PEEK_READY           18
+#define BIN_OP_PEEK_DELAYED         19
+#define BIN_OP_RESERVE_TIMEOUT      20
+#define BIN_OP_TOUCH                21
+#define BIN_OP_QUIT                 22
+#define BIN_OP_PAUSE_TUBE           23
+
+/* response statuses, the text replies they stand for in comments */
+#define BIN_OK                      0   /* INSERTED, RESERVED, FOUND,
+                                           DELETED, RELEASED, BURIED by
+                                           bury, TOUCHED, KICKED,
+                                           USING, WATCHING, PAUSED, OK */
+#define BIN_BURIED                  1
+#define BIN_NOT_FOUND               2
+#define BIN_TIMED_OUT               3
+#define BIN_DEADLINE_SOON           4
+#define BIN_NOT_IGNORED             5
+#define BIN_OUT_OF_MEMORY           6
+#define BIN_INTERNAL_ERROR          7
+#define BIN_DRAINING                8
+#define BIN_BAD_FORMAT              9
+#define BIN_UNKNOWN_COMMAND         10
+#define BIN_JOB_TOO_BIG             11
+#define BIN_READ_ONLY               12
+
+#endif /* __BINPROTO_H_INCLUDED__ */
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "compact.h"
+#include "binlog.h"
+#include "idtab.h"
+#include "times.h"
+
+#define COMPACT_NAME_FMT    "binlog.%u"
+#define COMPACT_TMP_NAME    "binlog.tmp"
+#define FILE_NAME_SIZE      32
+
+/* A job with records in the file compacted. */
+typedef struct cjob_st {
+    const char  *put;       /* its PUT in the file, NULL if before it */
+    const char  *last;      /* its latest record in the file */
+    uint8_t     later;      /* it has records in the files after */
+    uint8_t     deleted;    /* in the file or after it */
+} cjob_t;
+
+#define rec_at(p)   ((const binlog_rec_t *)(p))
+
+/* Map binlog.<seq> of `dir_fd' for reading. NULL returned if it can't
+ * be read, with errno ENOENT if it isn't there or is empty. */
+static char *map_file(int dir_fd, uint32_t seq, size_t *size) {
+    char name[FILE_NAME_SIZE];
+    struct stat st;
+    char *p;
+    int fd;
+
+    snprintf(name, sizeof(name), COMPACT_NAME_FMT, seq);
+    fd = openat(dir_fd, name, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size < (off_t)sizeof(binlog_hdr_t)) {
+        close(fd);
+        errno = ENOENT;
+        return NULL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    *size = st.st_size;
+    return p;
+}
+
+/* The size of the record at `off' of the `size' bytes at `p', 0 if
+ * it is cut short or doesn't match its crc. */
+static size_t rec_size(const char *p, size_t off, size_t size) {
+    const binlog_rec_t *r = rec_at(p + off);
+
+    if (size - off < sizeof(*r) || r->len > size - off - sizeof(*r) ||
+            binlog_crc32(0, p + off + sizeof(r->crc),
+                sizeof(*r) - sizeof(r->crc) + r->len) != r->crc) {
+        return 0;
+    }
+    return sizeof(*r) + r->len;
+}
+
+/* Note the jobs of the file at `p' in `ids', the latest record of
+ * each last. */
+static int scan_file(idtab_t *ids, cjob_t *jobs, size_t *cnt,
+        const char *p, size_t size) {
+    const binlog_rec_t *r;
+    size_t off, n;
+    cjob_t *j;
+
+    for (off = sizeof(binlog_hdr_t); (n = rec_size(p, off, size));
+            off += n) {
+        r = rec_at(p + off);
+        if (!(j = idtab_get(ids, r->rec.id))) {
+            j = &jobs[(*cnt)++];
+            memset(j, 0, sizeof(*j));
+            if (idtab_insert(ids, r->rec.id, j) != 0) return -1;
+        }
+        if (r->type == BINLOG_PUT && !j->put) {
+            j->put = p + off;
+        } else if (r->type == BINLOG_DELETE) {
+            j->deleted = 1;
+        }
+        j->last = p + off;
+    }
+    return 0;
+}
+
+/* Note which jobs of `ids' have records in the file at `p'. */
+static void scan_later(idtab_t *ids, const char *p, size_t size) {
+    const binlog_rec_t *r;
+    size_t off, n;
+    cjob_t *j;
+
+    for (off = sizeof(binlog_hdr_t); (n = rec_size(p, off, size));
+            off += n) {
+        r = rec_at(p + off);
+        if (r->type == BINLOG_PUT || !(j = idtab_get(ids, r->rec.id))) {
+            continue;
+        }
+        j->later = 1;
+        if (r->type == BINLOG_DELETE) j->deleted = 1;
+    }
+}
+
+/* Copy to `d' what is kept of the file at `p'. Return the bytes
+ * written. */
+static size_t rewrite(idtab_t *ids, const char *p, size_t size, char *d,
+        uint64_t *records) {
+    const binlog_rec_t *r;
+    binlog_rec_t w;
+    size_t off, n, out = sizeof(binlog_hdr_t);
+    cjob_t *j;
+
+    memcpy(d, p, sizeof(binlog_hdr_t));
+    for (off = sizeof(binlog_hdr_t); (n = rec_size(p, off, size));
+            off += n) {
+        r = rec_at(p + off);
+        j = idtab_get(ids, r->rec.id);
+
+        if (j->put) {
+            /* put here: one record with its state as the file leaves
+             * it, or nothing if it is gone */
+            if (r->type != BINLOG_PUT || j->deleted) continue;
+            memcpy(d + out, p + off, n);
+            if (j->last != p + off) {
+                memcpy(&w, d + out, sizeof(w));
+                memcpy(&w.rec, &rec_at(j->last)->rec, sizeof(w.rec));
+                w.rec.body_size = r->rec.body_size;
+                memcpy(d + out, &w, sizeof(w));
+                w.crc = binlog_crc32(0, d + out + sizeof(w.crc),
+                        n - sizeof(w.crc));
+                memcpy(d + out, &w.crc, sizeof(w.crc));
+            }
+        } else if (r->type == BINLOG_UPDATE) {
+            if (j->last != p + off || j->later) continue;
+            memcpy(d + out, p + off, n);
+        } else {
+            /* the delete of a job put before, which a replay of that
+             * file would bring back without it */
+            memcpy(d + out, p + off, n);
+        }
+        out += n;
+        ++*records;
+    }
+    return out;
+}
+
+/* Compact binlog.<seq>, given the files after it up to before `end'.
+ * Runs on its own thread: none of the files is removed while it runs,
+ * and the last one, which may still be written to, is read as far as
+ * it goes when mapped. The new file is synced unless `sync' is 0.
+ * 0 returned on success, otherwise -1. */
+int compact_file(int dir_fd, uint32_t seq, uint32_t end, int sync,
+        compact_stat_t *st) {
+    char name[FILE_NAME_SIZE];
+    int64_t start = ustime();
+    size_t size, later_size, cnt = 0, out;
+    cjob_t *jobs = NULL;
+    char *p, *q, *d = NULL;
+    idtab_t ids;
+    uint32_t s;
+    int fd = -1, ret = -1;
+    ssize_t w;
+
+    memset(st, 0, sizeof(*st));
+    memset(&ids, 0, sizeof(ids));
+    if (!(p = map_file(dir_fd, seq, &size))) {
+        fprintf(stderr, "map binlog.%u failed:%s\n", seq, strerror(errno));
+        return -1;
+    }
+    st->read = st->before = size;
+    if (idtab_init(&ids, 1024) != 0 ||
+            !(jobs = malloc((size / sizeof(binlog_rec_t) + 1) *
+                    sizeof(*jobs))) ||
+            !(d = malloc(size))) {
+        fprintf(stderr, "compact binlog.%u: out of memory\n", seq);
+        goto out;
+    }
+
+    if (scan_file(&ids, jobs, &cnt, p, size) != 0) goto out;
+    for (s = seq + 1; s < end; ++s) {
+        if (!(q = map_file(dir_fd, s, &later_size))) {
+            if (errno == ENOENT) continue;
+            fprintf(stderr, "map binlog.%u failed:%s\n", s,
+                    strerror(errno));
+            goto out;
+        }
+        scan_later(&ids, q, later_size);
+        munmap(q, later_size);
+        st->read += later_size;
+    }
+    out = rewrite(&ids, p, size, d, &st->records);
+
+    fd = openat(dir_fd, COMPACT_TMP_NAME, O_WRONLY | O_CREAT | O_TRUNC,
+            0600);
+    if (fd < 0) {
+        fprintf(stderr, "create " COMPACT_TMP_NAME " failed:%s\n",
+                strerror(errno));
+        goto out;
+    }
+    for (st->after = 0; st->after < out; st->after += w) {
+        w = write(fd, d + st->after, out - st->after);
+        if (w < 0) {
+            if (errno == EINTR) {
+                w = 0;
+                continue;
+            }
+            fprintf(stderr, "write " COMPACT_TMP_NAME " failed:%s\n",
+                    strerror(errno));
+            goto out;
+        }
+    }
+    if (sync && fsync(fd) != 0) {
+        fprintf(stderr, "fsync " COMPACT_TMP_NAME " failed:%s\n",
+                strerror(errno));
+        goto out;
+    }
+
+    snprintf(name, sizeof(name), COMPACT_NAME_FMT, seq);
+    if (renameat(dir_fd, COMPACT_TMP_NAME, dir_fd, name) != 0 ||
+            (sync && fsync(dir_fd) != 0)) {
+        fprintf(stderr, "rename %s failed:%s\n", name, strerror(errno));
+        goto out;
+    }
+    ret = 0;
+
+out:
+    if (fd >= 0) close(fd);
+    if (ret != 0) unlinkat(dir_fd, COMPACT_TMP_NAME, 0);
+    munmap(p, size);
+    idtab_destroy(&ids);
+    free(jobs);
+    free(d);
+    st->usec = ustime() - start;
+    return ret;
+}
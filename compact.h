@@ -0,0 +1,26 @@
+#ifndef __COMPACT_H_INCLUDED__
+#define __COMPACT_H_INCLUDED__
+
+#include <stdint.h>
+
+/* Compaction rewrites a closed binlog file with only what a replay
+ * still needs of it: the jobs put in it that are not deleted since,
+ * each as one record with its latest state in the file, the latest
+ * update of other jobs, and the deletes of jobs put before it. The
+ * files after it, the one being written included, tell which is
+ * which. The new file is written under a temporary name and renamed
+ * over the old one once synced, see binlog.h for when it runs. */
+
+/* what a compaction did, for the stats */
+typedef struct compact_stat_st {
+    uint64_t    read;       /* bytes of the file and those after it */
+    uint64_t    before;     /* bytes of the file */
+    uint64_t    after;
+    uint64_t    records;    /* written */
+    int64_t     usec;       /* it took */
+} compact_stat_t;
+
+int compact_file(int dir_fd, uint32_t seq, uint32_t end, int sync,
+        compact_stat_t *st);
+
+#endif /* __COMPACT_H_INCLUDED__ */
@@ -1,14 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
 #include <limits.h>
 #include <unistd.h>
-#include <ctype.h>
+#include <endian.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/uio.h>
 #include <inttypes.h>
 #include <netinet/in.h>
 #include "srv.h"
@@ -19,6 +21,10 @@
 #include "tube.h"
 #include "net.h"
 #include "job.h"
+#include "slab.h"
+#include "proto.h"
+#include "binlog.h"
+#include "replica.h"
 #include "version.h"
 
 
@@ -33,57 +39,13 @@
     "abcdefghijklmnopqrstuvwxyz"    \
     "0123456789-+/;.$_()"
 
-#define CMD_PUT                 "put "
-#define CMD_PEEKJOB             "peek "
-#define CMD_PEEK_READY          "peek-ready"
-#define CMD_PEEK_DELAYED        "peek-delayed"
-#define CMD_PEEK_BURIED         "peek-buried"
-#define CMD_RESERVE             "reserve"
-#define CMD_RESERVE_TIMEOUT     "reserve-with-timeout "
-#define CMD_DELETE              "delete "
-#define CMD_RELEASE             "release "
-#define CMD_BURY                "bury "
-#define CMD_KICK                "kick "
-#define CMD_TOUCH               "touch "
-#define CMD_STATS               "stats"
-#define CMD_JOBSTATS            "stats-job "
-#define CMD_USE                 "use "
-#define CMD_WATCH               "watch "
-#define CMD_IGNORE              "ignore "
-#define CMD_LIST_TUBES          "list-tubes"
-#define CMD_LIST_TUBE_USED      "list-tube-used"
-#define CMD_LIST_TUBES_WATCHED  "list-tubes-watched"
-#define CMD_STATS_TUBE          "stats-tube "
-#define CMD_QUIT                "quit"
-#define CMD_PAUSE_TUBE          "pause-tube"
-
-#define CONSTSTRLEN(m)              (sizeof(m) - 1)
-
-#define CMD_PEEK_READY_LEN          CONSTSTRLEN(CMD_PEEK_READY)
-#define CMD_PEEK_DELAYED_LEN        CONSTSTRLEN(CMD_PEEK_DELAYED)
-#define CMD_PEEK_BURIED_LEN         CONSTSTRLEN(CMD_PEEK_BURIED)
-#define CMD_PEEKJOB_LEN             CONSTSTRLEN(CMD_PEEKJOB)
-#define CMD_RESERVE_LEN             CONSTSTRLEN(CMD_RESERVE)
-#define CMD_RESERVE_TIMEOUT_LEN     CONSTSTRLEN(CMD_RESERVE_TIMEOUT)
-#define CMD_DELETE_LEN              CONSTSTRLEN(CMD_DELETE)
-#define CMD_RELEASE_LEN             CONSTSTRLEN(CMD_RELEASE)
-#define CMD_BURY_LEN                CONSTSTRLEN(CMD_BURY)
-#define CMD_KICK_LEN                CONSTSTRLEN(CMD_KICK)
-#define CMD_TOUCH_LEN               CONSTSTRLEN(CMD_TOUCH)
-#define CMD_STATS_LEN               CONSTSTRLEN(CMD_STATS)
-#define CMD_JOBSTATS_LEN            CONSTSTRLEN(CMD_JOBSTATS)
-#define CMD_USE_LEN                 CONSTSTRLEN(CMD_USE)
-#define CMD_WATCH_LEN               CONSTSTRLEN(CMD_WATCH)
-#define CMD_IGNORE_LEN              CONSTSTRLEN(CMD_IGNORE)
-#define CMD_LIST_TUBES_LEN          CONSTSTRLEN(CMD_LIST_TUBES)
-#define CMD_LIST_TUBE_USED_LEN      CONSTSTRLEN(CMD_LIST_TUBE_USED)
-#define CMD_LIST_TUBES_WATCHED_LEN  CONSTSTRLEN(CMD_LIST_TUBES_WATCHED)
-#define CMD_STATS_TUBE_LEN          CONSTSTRLEN(CMD_STATS_TUBE)
-#define CMD_PAUSE_TUBE_LEN          CONSTSTRLEN(CMD_PAUSE_TUBE)
-
-#define MSG_FOUND                   "FOUND"
+/* the words of the replies followed by numbers, see out_nums() */
+#define MSG_FOUND                   "FOUND "
+#define MSG_RESERVED                "RESERVED "
+#define MSG_INSERTED                "INSERTED "
+#define MSG_KICKED                  "KICKED "
+
 #define MSG_NOTFOUND                "NOT_FOUND\r\n"
-#define MSG_RESERVED                "RESERVED"
 #define MSG_DEADLINE_SOON           "DEADLINE_SOON\r\n"
 #define MSG_TIMED_OUT               "TIMED_OUT\r\n"
 #define MSG_DELETED                 "DELETED\r\n"
@@ -91,8 +53,13 @@
 #define MSG_BURIED                  "BURIED\r\n"
 #define MSG_TOUCHED                 "TOUCHED\r\n"
 #define MSG_BURIED_FMT              "BURIED %ld\r\n"
-#define MSG_INSERTED_FMT            "INSERTED %ld\r\n"
+#define MSG_INSERTED_BATCH_FMT      "INSERTED_BATCH %ld %d\r\n"
+#define MSG_RESERVED_BATCH_FMT      "RESERVED_BATCH %d\r\n"
+#define MSG_DELETED_BATCH_FMT       "DELETED_BATCH %d "
+#define MSG_TOUCHED_BATCH_FMT       "TOUCHED_BATCH %d "
+#define MSG_RELEASED_BATCH_FMT      "RELEASED_BATCH %d "
 #define MSG_NOT_IGNORED             "NOT_IGNORED\r\n"
+#define MSG_CHECKPOINTING           "CHECKPOINTING\r\n"
 
 #define MSG_NOTFOUND_LEN            CONSTSTRLEN(MSG_NOTFOUND)
 #define MSG_DELETED_LEN             CONSTSTRLEN(MSG_DELETED)
@@ -104,6 +71,7 @@
 #define MSG_OUT_OF_MEMORY           "OUT_OF_MEMORY\r\n"
 #define MSG_INTERNAL_ERROR          "INTERNAL_ERROR\r\n"
 #define MSG_DRAINING                "DRAINING\r\n"
+#define MSG_READ_ONLY               "READ_ONLY\r\n"
 
 #define MSG_BAD_FORMAT              "BAD_FORMAT\r\n"
 #define MSG_UNKNOWN_COMMAND         "UNKNOWN_COMMAND\r\n"
@@ -112,36 +80,32 @@
 
 #define STATE_WANTCOMMAND       0
 #define STATE_WANTDATA          1
-#define STATE_SENDJOB           2
-#define STATE_SENDWORD          3
 #define STATE_WAIT              4
 #define STATE_BITBUCKET         5
 
-#define OP_UNKNOWN              0
-#define OP_PUT                  1
-#define OP_PEEKJOB              2
-#define OP_RESERVE              3
-#define OP_DELETE               4
-#define OP_RELEASE              5
-#define OP_BURY                 6
-#define OP_KICK                 7
-#define OP_STATS                8
-#define OP_JOBSTATS             9
-#define OP_PEEK_BURIED          10
-#define OP_USE                  11
-#define OP_WATCH                12
-#define OP_IGNORE               13
-#define OP_LIST_TUBES           14
-#define OP_LIST_TUBE_USED       15
-#define OP_LIST_TUBES_WATCHED   16
-#define OP_STATS_TUBE           17
-#define OP_PEEK_READY           18
-#define OP_PEEK_DELAYED         19
-#define OP_RESERVE_TIMEOUT      20
-#define OP_TOUCH                21
-#define OP_QUIT                 22
-#define OP_PAUSE_TUBE           23
-#define TOTAL_OPS               24
+/* results of one conn_process() step */
+#define CONN_BLOCKED            0
+#define CONN_AGAIN              1
+
+/* work done for one connection per wakeup */
+#define CONN_BYTE_BUDGET        (64 * 1024)
+#define CONN_CMD_BUDGET         64
+
+/* stop reading commands while this much output is queued */
+#define CONN_OUT_HIGH           (256 * 1024)
+#define CONN_IOV_MAX            1024
+#define OBUF_INIT_SIZE          512
+#define OSEG_INIT_NUM           16
+
+/* the most jobs a put-batch may carry */
+#define PUT_BATCH_MAX           (1 << 20)
+
+/* the most jobs a reserve-batch hands out, a line and a body each, so
+ * that a whole batch goes out in one writev() */
+#define RESERVE_BATCH_MAX       (CONN_IOV_MAX / 2)
+
+/* the most ids a delete-, touch- or release-batch may carry */
+#define ID_BATCH_MAX            (1 << 16)
 
 #define STATS_FMT "---\n"                       \
     "current-jobs-urgent: %u\n"                 \
@@ -171,6 +135,13 @@
     "cmd-list-tube-used: %" PRIu64 "\n"         \
     "cmd-list-tubes-watched: %" PRIu64 "\n"     \
     "cmd-pause-tube: %" PRIu64 "\n"             \
+    "cmd-put-batch: %" PRIu64 "\n"              \
+    "cmd-reserve-batch: %" PRIu64 "\n"          \
+    "cmd-delete-batch: %" PRIu64 "\n"           \
+    "cmd-touch-batch: %" PRIu64 "\n"            \
+    "cmd-release-batch: %" PRIu64 "\n"          \
+    "cmd-checkpoint: %" PRIu64 "\n"             \
+    "cmd-replicate: %" PRIu64 "\n"              \
     "job-timeouts: %" PRIu64 "\n"               \
     "total-jobs: %" PRIu64 "\n"                 \
     "max-job-size: %zu\n"                       \
@@ -184,13 +155,7 @@
     "version: %s\n"                             \
     "rusage-utime: %d.%06d\n"                   \
     "rusage-stime: %d.%06d\n"                   \
-    "uptime: %u\n"                              \
-    "binlog-oldest-index: %d\n"                 \
-    "binlog-current-index: %d\n"                \
-    "binlog-records-migrated: %d\n"             \
-    "binlog-records-written: %d\n"              \
-    "binlog-max-size: %d\n"                     \
-    "\r\n"
+    "uptime: %u\n"
 
 #define STATS_TUBE_FMT "---\n"                  \
     "name: %s\n"                                \
@@ -218,7 +183,7 @@
     "delay: %" PRId64 "\n"                      \
     "ttr: %" PRId64 "\n"                        \
     "time-left: %" PRId64 "\n"                  \
-    "file: %d\n"                                \
+    "file: %u\n"                                \
     "reserves: %u\n"                            \
     "timeouts: %u\n"                            \
     "releases: %u\n"                            \
@@ -228,69 +193,20 @@
 
 /* this number is pretty arbitrary */
 #define BUCKET_BUF_SIZE     1024
-static char bucket[BUCKET_BUF_SIZE];
-
-static const char *op_names[] = {
-    "<unknown>",
-    CMD_PUT,
-    CMD_PEEKJOB,
-    CMD_RESERVE,
-    CMD_DELETE,
-    CMD_RELEASE,
-    CMD_BURY,
-    CMD_KICK,
-    CMD_STATS,
-    CMD_JOBSTATS,
-    CMD_PEEK_BURIED,
-    CMD_USE,
-    CMD_WATCH,
-    CMD_IGNORE,
-    CMD_LIST_TUBES,
-    CMD_LIST_TUBE_USED,
-    CMD_LIST_TUBES_WATCHED,
-    CMD_STATS_TUBE,
-    CMD_PEEK_READY,
-    CMD_PEEK_DELAYED,
-    CMD_RESERVE_TIMEOUT,
-    CMD_TOUCH,
-    CMD_QUIT,
-    CMD_PAUSE_TUBE,
-};
-
-static unsigned char which_cmd(conn_t *c) {
-#define TEST_CMD(s, c, o) \
-    if (strncmp((s), (c), CONSTSTRLEN(c)) == 0) return (o)
-    TEST_CMD(c->cmd, CMD_PUT, OP_PUT);
-    TEST_CMD(c->cmd, CMD_PEEKJOB, OP_PEEKJOB);
-    TEST_CMD(c->cmd, CMD_PEEK_READY, OP_PEEK_READY);
-    TEST_CMD(c->cmd, CMD_PEEK_DELAYED, OP_PEEK_DELAYED);
-    TEST_CMD(c->cmd, CMD_PEEK_BURIED, OP_PEEK_BURIED);
-    TEST_CMD(c->cmd, CMD_RESERVE_TIMEOUT, OP_RESERVE_TIMEOUT);
-    TEST_CMD(c->cmd, CMD_RESERVE, OP_RESERVE);
-    TEST_CMD(c->cmd, CMD_DELETE, OP_DELETE);
-    TEST_CMD(c->cmd, CMD_RELEASE, OP_RELEASE);
-    TEST_CMD(c->cmd, CMD_BURY, OP_BURY);
-    TEST_CMD(c->cmd, CMD_KICK, OP_KICK);
-    TEST_CMD(c->cmd, CMD_TOUCH, OP_TOUCH);
-    TEST_CMD(c->cmd, CMD_JOBSTATS, OP_JOBSTATS);
-    TEST_CMD(c->cmd, CMD_STATS_TUBE, OP_STATS_TUBE);
-    TEST_CMD(c->cmd, CMD_STATS, OP_STATS);
-    TEST_CMD(c->cmd, CMD_USE, OP_USE);
-    TEST_CMD(c->cmd, CMD_WATCH, OP_WATCH);
-    TEST_CMD(c->cmd, CMD_IGNORE, OP_IGNORE);
-    TEST_CMD(c->cmd, CMD_LIST_TUBES_WATCHED, OP_LIST_TUBES_WATCHED);
-    TEST_CMD(c->cmd, CMD_LIST_TUBE_USED, OP_LIST_TUBE_USED);
-    TEST_CMD(c->cmd, CMD_LIST_TUBES, OP_LIST_TUBES);
-    TEST_CMD(c->cmd, CMD_QUIT, OP_QUIT);
-    TEST_CMD(c->cmd, CMD_PAUSE_TUBE, OP_PAUSE_TUBE);
-    return OP_UNKNOWN;
-}
+static __thread char bucket[BUCKET_BUF_SIZE];
 
 /* --------- private function declares ------------ */
 static void reserve_job(conn_t *c, job_t *j);
-static job_t *next_eligible_job(int64_t now);
+static void reserve_batch(conn_t *c, job_t *j);
+static int remove_ready_job(job_t *j);
+static int remove_delayed_job(job_t *j);
+static int remove_buried_job(job_t *j);
 static int bury_job(job_t *j);
 static void enqueue_reserved_jobs(conn_t *c);
+static void batch_free_jobs(conn_t *c);
+static void process_queue();
+static void conn_lock(int p);
+static void conn_unlock();
 
 static void on_watch(set_t *s, void *arg, size_t pos) {
     tube_t *t = (tube_t *)arg;
@@ -304,22 +220,18 @@ static void on_ignore(set_t *s, void *arg, size_t pos) {
     tube_dref(t);
 }
 
-static void conn_reset(conn_t *c) {
-    event_regis(&tasque_srv.evt, &c->sock, EVENT_RD);
-    if (c->out_job && c->out_job->rec.state == JOB_COPY) {
-        job_free(c->out_job);
-    }
-    c->out_job = NULL;
-    c->reply_sent = 0;
-    c->state = STATE_WANTCOMMAND;
-}
-
-static int name_is_ok(char *name, size_t max) {
-    size_t len = strlen(name);
+/* Tell if the `len' bytes at `name' make a tube name of at most `max'
+ * bytes. */
+static int name_is_ok(const char *name, size_t len, size_t max) {
     return len > 0 && len <= max &&
         strspn(name, NAME_CHARS) == len && name[0] != '-';
 }
 
+/* The bytes of in_job to read from the client. A binary put leaves
+ * out the "\r\n" every job body ends with, see put_job(). */
+#define in_job_want(c) \
+    ((c)->in_job->rec.body_size - ((c)->proto == PROTO_BINARY ? 2 : 0))
+
 /* Copy up to body_size trailing bytes into the job, then the rest
  * into the cmd buffer. If c->in_job exists, this assume that
  * c->in_job->body is empty.
@@ -334,7 +246,7 @@ static void fill_extra_data(conn_t *c) {
     extra_bytes = c->cmd_read - c->cmd_len;
 
     if (c->in_job) { /* we are reading job content */
-        job_data_bytes = min(extra_bytes, c->in_job->rec.body_size);
+        job_data_bytes = min(extra_bytes, in_job_want(c));
         memcpy(c->in_job->body, c->cmd + c->cmd_len, job_data_bytes);
         c->in_job_read = job_data_bytes;
     } else if (c->in_job_read) {
@@ -353,48 +265,343 @@ static void fill_extra_data(conn_t *c) {
 
 /* -------------- Reply association functions ---------------- */
 #define reply_msg(c, m) \
-    reply((c), (m), CONSTSTRLEN(m), STATE_SENDWORD)
+    reply((c), (m), CONSTSTRLEN(m))
+
+/* Put the connection in its reactor's flush queue, the queued output
+ * is written out before the reactor sleeps again. */
+static void conn_pend(conn_t *c) {
+    reactor_t *r = c->reactor;
+    conn_t *head;
+
+    if (c->flush_pending) return;
+    c->flush_pending = 1;
+    /* the others queue under the locks of other partitions */
+    head = __atomic_load_n(&r->flushq, __ATOMIC_RELAXED);
+    do {
+        c->flush_next = head;
+    } while (!__atomic_compare_exchange_n(&r->flushq, &head, c, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    event_wake(&r->evt);
+}
 
-static void reply(conn_t *c, char *line, int len, int state) {
-    if (!c) return;
+/* Make sure `n' more bytes fit in c->obuf and two more segments can
+ * be added. Return 0 on success, -1 if out of memory. */
+static int out_reserve(conn_t *c, int n) {
+    char *nbuf;
+    outseg_t *nseg;
+    int cap;
+
+    if (c->obuf_len + n > c->obuf_cap) {
+        cap = c->obuf_cap ? c->obuf_cap : OBUF_INIT_SIZE;
+        while (cap < c->obuf_len + n) cap *= 2;
+        nbuf = realloc(c->obuf, cap);
+        if (!nbuf) return -1;
+        c->obuf = nbuf;
+        c->obuf_cap = cap;
+    }
+
+    if (c->oseg_len + 2 > c->oseg_cap) {
+        cap = c->oseg_cap ? c->oseg_cap * 2 : OSEG_INIT_NUM;
+        nseg = realloc(c->oseg, cap * sizeof(*nseg));
+        if (!nseg) return -1;
+        c->oseg = nseg;
+        c->oseg_cap = cap;
+    }
+    return 0;
+}
 
-    if (event_regis(&tasque_srv.evt, &c->sock, EVENT_WR) != 0) {
-        fprintf(stderr, "event regis failed\n");
-        conn_close(c);
+/* Append a segment, merging reply lines that are adjacent in obuf. */
+static void out_append(conn_t *c, job_t *j, int off, int len) {
+    outseg_t *last = c->oseg_len > c->oseg_head ?
+        &c->oseg[c->oseg_len - 1] : NULL;
+
+    c->out_bytes += len;
+    if (!j && last && !last->job && last->off + last->len == off) {
+        last->len += len;
         return;
     }
+    c->oseg[c->oseg_len].job = j;
+    c->oseg[c->oseg_len].off = off;
+    c->oseg[c->oseg_len].len = len;
+    ++c->oseg_len;
+}
 
-    c->reply = line;
-    c->reply_len = len;
-    c->reply_sent = 0;
-    c->state = state;
+/* Drop the output, releasing referenced jobs. */
+static void out_clear(conn_t *c) {
+    int i;
+    for (i = c->oseg_head; i < c->oseg_len; ++i) {
+        if (c->oseg[i].job) job_dref(c->oseg[i].job);
+    }
+    c->obuf_len = 0;
+    c->oseg_len = 0;
+    c->oseg_head = 0;
+    c->oseg_sent = 0;
+    c->out_bytes = 0;
+}
+
+/* The reply could not be queued, which leaves the stream of replies
+ * broken. Let the reactor close the connection. */
+static void reply_failed(conn_t *c) {
+    fprintf(stderr, "server error: " MSG_OUT_OF_MEMORY);
+    c->closing = 1;
+    conn_pend(c);
+}
+
+/* A reply ends the command being processed, or the wait for a job. */
+static void reply_done(conn_t *c) {
+    if (c->state == STATE_WAIT && !c->busy) {
+        /* input that arrived while waiting is not read yet */
+        c->stalled = 1;
+    }
+    c->state = STATE_WANTCOMMAND;
+    conn_pend(c);
+}
 
+/* Queue the `len' bytes just placed at the end of c->obuf. */
+static void out_commit_line(conn_t *c, int len) {
     if (tasque_srv.verbose >= 2) {
         printf(">%s:%d reply %.*s\n", c->remote_ip, c->remote_port,
-            len - 2, line);
+            len - 2, c->obuf + c->obuf_len);
+    }
+    out_append(c, NULL, c->obuf_len, len);
+    c->obuf_len += len;
+}
+
+/* Queue a binary response header, `h' in host order, followed by
+ * `data' as its payload unless NULL. Return 0 on success, or -1 if
+ * it failed, in which case the connection is to be closed. */
+static int out_bin(conn_t *c, bin_hdr_t *h, const char *data) {
+    bin_hdr_t le;
+    int len = BIN_HDR_SIZE + (data ? h->len : 0);
+
+    if (out_reserve(c, len) != 0) {
+        reply_failed(c);
+        return -1;
+    }
+    if (tasque_srv.verbose >= 2) {
+        printf(">%s:%d reply status %d id %" PRIu64 " len %u\n",
+                c->remote_ip, c->remote_port, h->status, h->id, h->len);
+    }
+
+    le.magic = BIN_RES_MAGIC;
+    le.op = c->bin_op;
+    le.status = htole16(h->status);
+    le.len = htole32(h->len);
+    le.id = htole64(h->id);
+    le.pri = htole32(h->pri);
+    le.delay = htole32(h->delay);
+    le.ttr = htole32(h->ttr);
+    le.count = htole32(h->count);
+    memcpy(c->obuf + c->obuf_len, &le, BIN_HDR_SIZE);
+    if (data) {
+        memcpy(c->obuf + c->obuf_len + BIN_HDR_SIZE, data, h->len);
+    }
+    out_append(c, NULL, c->obuf_len, len);
+    c->obuf_len += len;
+    return 0;
+}
+
+/* Queue a binary response with the body of `j' as its payload. */
+static int out_bin_job(conn_t *c, job_t *j) {
+    bin_hdr_t h = {};
+
+    h.status = BIN_OK;
+    h.id = j->rec.id;
+    h.pri = j->rec.pri;
+    h.ttr = j->rec.ttr / 1000000;
+    h.len = j->rec.body_size - 2;
+    if (out_bin(c, &h, NULL) != 0) return -1;
+    if (h.len) {
+        job_iref(j);
+        out_append(c, j, 0, h.len);
+    }
+    return 0;
+}
+
+static void reply_bin(conn_t *c, int status, uint64_t id, uint32_t count) {
+    bin_hdr_t h = {};
+
+    h.status = status;
+    h.id = id;
+    h.count = count;
+    if (out_bin(c, &h, NULL) == 0) {
+        reply_done(c);
+    }
+}
+
+static const struct {
+    const char      *msg;
+    int             status;
+} bin_statuses[] = {
+    { MSG_NOTFOUND,         BIN_NOT_FOUND },
+    { MSG_DEADLINE_SOON,    BIN_DEADLINE_SOON },
+    { MSG_TIMED_OUT,        BIN_TIMED_OUT },
+    { MSG_DELETED,          BIN_OK },
+    { MSG_RELEASED,         BIN_OK },
+    { MSG_BURIED,           BIN_BURIED },
+    { MSG_TOUCHED,          BIN_OK },
+    { MSG_NOT_IGNORED,      BIN_NOT_IGNORED },
+    { MSG_OUT_OF_MEMORY,    BIN_OUT_OF_MEMORY },
+    { MSG_DRAINING,         BIN_DRAINING },
+    { MSG_BAD_FORMAT,       BIN_BAD_FORMAT },
+    { MSG_UNKNOWN_COMMAND,  BIN_UNKNOWN_COMMAND },
+    { MSG_EXPECTED_CRLF,    BIN_BAD_FORMAT },
+    { MSG_JOB_TOO_BIG,      BIN_JOB_TOO_BIG },
+    { MSG_READ_ONLY,        BIN_READ_ONLY },
+};
+
+/* Answer a binary request with the status standing for the text
+ * reply `line', which the code shared by both protocols replies. */
+static void reply_bin_msg(conn_t *c, const char *line, int len) {
+    size_t i;
+
+    for (i = 0; i < sizeof(bin_statuses) / sizeof(bin_statuses[0]); ++i) {
+        if (strlen(bin_statuses[i].msg) == len &&
+                memcmp(bin_statuses[i].msg, line, len) == 0) {
+            return reply_bin(c, bin_statuses[i].status, 0, 0);
+        }
+    }
+    reply_bin(c, BIN_INTERNAL_ERROR, 0, 0);
+}
+
+static void reply(conn_t *c, char *line, int len) {
+    if (!c) return;
+
+    if (c->proto == PROTO_BINARY) {
+        return reply_bin_msg(c, line, len);
+    }
+
+    if (out_reserve(c, len) != 0) {
+        return reply_failed(c);
+    }
+    memcpy(c->obuf + c->obuf_len, line, len);
+    out_commit_line(c, len);
+    reply_done(c);
+}
+
+/* Format and queue a reply line. Return its length, or -1 if it
+ * failed, in which case an error has been replied instead. */
+static int out_vprintf(conn_t *c, const char *fmt, va_list ap) {
+    int ret;
+
+    if (out_reserve(c, LINE_BUF_SIZE) != 0) {
+        reply_failed(c);
+        return -1;
+    }
+    ret = vsnprintf(c->obuf + c->obuf_len, LINE_BUF_SIZE, fmt, ap);
+
+    /* Make sure the buffer was big enough. If not, we have a bug. */
+    if (ret >= LINE_BUF_SIZE) {
+        reply_msg(c, MSG_INTERNAL_ERROR);
+        return -1;
     }
+    out_commit_line(c, ret);
+    return ret;
 }
 
-static void reply_line(conn_t *c, int state, const char *fmt, ...) {
+static int out_printf(conn_t *c, const char *fmt, ...) {
     int ret;
     va_list ap;
     va_start(ap, fmt);
-    ret = vsnprintf(c->reply_buf, LINE_BUF_SIZE, fmt, ap);
+    ret = out_vprintf(c, fmt, ap);
     va_end(ap);
+    return ret;
+}
 
-    /* Make sure the buffer was big enough. If not, we have a bug. */
-    if (ret >= LINE_BUF_SIZE) {
-        return reply_msg(c, MSG_INTERNAL_ERROR);
+static void reply_line(conn_t *c, const char *fmt, ...) {
+    int ret;
+    va_list ap;
+    va_start(ap, fmt);
+    ret = out_vprintf(c, fmt, ap);
+    va_end(ap);
+
+    if (ret >= 0) {
+        reply_done(c);
+    }
+}
+
+/* Reply a line followed by the body of `j'. The body is not copied,
+ * the job is kept allocated until it has been sent. A binary response
+ * has the body as its payload instead of the line. */
+static void reply_body(conn_t *c, job_t *j, const char *fmt, ...) {
+    int ret;
+    va_list ap;
+
+    if (c->proto == PROTO_BINARY) {
+        if (out_bin_job(c, j) == 0) reply_done(c);
+        return;
+    }
+
+    va_start(ap, fmt);
+    ret = out_vprintf(c, fmt, ap);
+    va_end(ap);
+
+    if (ret < 0) return;
+    job_iref(j);
+    out_append(c, j, 0, j->rec.body_size);
+    reply_done(c);
+}
+
+/* Queue the line of `word', `len' bytes ending with a space, followed
+ * by the `n' numbers in `nums'. This is out_printf() without the
+ * format parsing, for the replies that go out for every job. */
+static int out_nums(conn_t *c, const char *word, int len,
+        const uint64_t *nums, int n) {
+    char *p;
+    int i;
+
+    if (out_reserve(c, LINE_BUF_SIZE) != 0) {
+        reply_failed(c);
+        return -1;
+    }
+    p = c->obuf + c->obuf_len;
+    memcpy(p, word, len);
+    for (i = 0; i < n; ++i) {
+        if (i) p[len++] = ' ';
+        len += proto_fmt_u64(p + len, nums[i]);
+    }
+    p[len++] = '\r';
+    p[len++] = '\n';
+    out_commit_line(c, len);
+    return 0;
+}
+
+#define reply_num_msg(c, m, v) \
+    reply_num((c), (m), CONSTSTRLEN(m), (v))
+
+static void reply_num(conn_t *c, const char *word, int len, uint64_t v) {
+    if (out_nums(c, word, len, &v, 1) == 0) {
+        reply_done(c);
+    }
+}
+
+#define out_job_msg(c, j, m) \
+    out_job((c), (j), (m), CONSTSTRLEN(m))
+
+/* Queue the line and the body of `j' as in a reply to a single job,
+ * see reply_body(). Return 0, or -1 if an error has been replied. */
+static int out_job(conn_t *c, job_t *j, const char *word, int len) {
+    uint64_t nums[2] = { j->rec.id, j->rec.body_size - 2 };
+
+    if (out_nums(c, word, len, nums, 2) != 0) {
+        return -1;
     }
-    return reply(c, c->reply_buf, ret, state);
+    job_iref(j);
+    out_append(c, j, 0, j->rec.body_size);
+    return 0;
 }
 
-static void reply_job(conn_t *c, job_t *j, const char *word) {
-    /* tell this connection which job to send */
-    c->out_job = j;
-    c->out_job_sent = 0;
-    return reply_line(c, STATE_SENDJOB, "%s %ld %u\r\n",
-            word, j->rec.id, j->rec.body_size - 2);
+#define reply_job_msg(c, j, m) \
+    reply_job((c), (j), (m), CONSTSTRLEN(m))
+
+static void reply_job(conn_t *c, job_t *j, const char *word, int len) {
+    if (c->proto == PROTO_BINARY) {
+        if (out_bin_job(c, j) == 0) reply_done(c);
+        return;
+    }
+    if (out_job(c, j, word, len) == 0) {
+        reply_done(c);
+    }
 }
 
 
@@ -403,7 +610,7 @@ static void reply_job(conn_t *c, job_t *j, const char *word) {
 
 /* Skip `n' bytes job content received, and reply the content
  * refered in `line' of length of 'len'. */
-static void skip_and_reply(conn_t *c, int n, char *line, int len) {
+static void skip_and_reply(conn_t *c, int64_t n, char *line, int len) {
     /* Invert the meaning of 'in_job_read' while throwing away data
      * -- it counts the bytes that remain to be thrown away. */
     c->in_job = NULL;
@@ -411,13 +618,12 @@ static void skip_and_reply(conn_t *c, int n, char *line, int len) {
     fill_extra_data(c);
 
     if (c->in_job_read == 0) {
-        return reply(c, line, len, STATE_SENDWORD);
+        return reply(c, line, len);
     }
 
     /* we enter bit-bucket mode */
     c->reply = line;
     c->reply_len = len;
-    c->reply_sent = 0;
     c->state = STATE_BITBUCKET; 
     return;
 }
@@ -438,34 +644,48 @@ static uint32_t get_delayed_job_cnt() {
 typedef int(*fmt_fn)(char *buf, size_t n, void *data);
 
 static void do_stats(conn_t *c, fmt_fn fmt, void *data) {
-    int ret, stats_len;
+    int ret, stats_len, tries = 0;
+    job_t *j;
 
     /* first, measure how big a buffer we will need */
     stats_len = fmt(NULL, 0, data) + 2;
 
-    /* fake job to hold stats data */
-    c->out_job = (job_t *)calloc(sizeof(job_t) + stats_len, 1);
-    if (!c->out_job) {
-        return reply_msg(c, MSG_OUT_OF_MEMORY);
+    for ( ; ; ) {
+        /* fake job to hold stats data */
+        j = job_alloc(stats_len);
+        if (!j) {
+            return reply_msg(c, MSG_OUT_OF_MEMORY);
+        }
+        j->rec.created_at = ustime();
+        /* Mark this job as a copy so it can be appropriately
+         * freed later on */
+        j->rec.state = JOB_COPY;
+        /* Now actually format the stats data */
+        ret = fmt(j->body, stats_len, data);
+        if (ret < stats_len) {
+            break;
+        }
+
+        /* allocating the fake job itself may have changed the
+         * allocator stats, measure again */
+        job_free(j);
+        if (ret < 0 || ++tries == 3) {
+            return reply_msg(c, MSG_INTERNAL_ERROR);
+        }
+        stats_len = ret + 2;
     }
-    c->out_job->rec.created_at = ustime();
-    c->out_job->rec.body_size = stats_len;
-    /* Mark this job as a copy so it can be appropriately
-     * freed later on */
-    c->out_job->rec.state = JOB_COPY;
-    /* Now actually format the stats data */
-    ret = fmt(c->out_job->body, stats_len, data);
     /* and set the actual body size */
-    c->out_job->rec.body_size = ret;
-    if (ret > stats_len) return reply_msg(c, MSG_INTERNAL_ERROR);
-    c->out_job_sent = 0;
-    return reply_line(c, STATE_SENDJOB, "OK %d\r\n", ret - 2);
+    j->rec.body_size = ret;
+    reply_body(c, j, "OK %d\r\n", ret - 2);
+    job_free(j);
 }
 
 static int fmt_stats(char *buf, size_t n, void *data) {
     struct rusage ru = {};
+    int len, r;
+
     getrusage(RUSAGE_SELF, &ru); /* don't care if it fails */
-    return snprintf(buf, n, STATS_FMT,
+    len = snprintf(buf, n, STATS_FMT,
             tasque_srv.global_stat.urgent_cnt,
             tasque_srv.ready_cnt,
             tasque_srv.global_stat.reserved_cnt,
@@ -493,6 +713,13 @@ static int fmt_stats(char *buf, size_t n, void *data) {
             tasque_srv.op_cnt[OP_LIST_TUBE_USED],
             tasque_srv.op_cnt[OP_LIST_TUBES_WATCHED],
             tasque_srv.op_cnt[OP_PAUSE_TUBE],
+            tasque_srv.op_cnt[OP_PUT_BATCH],
+            tasque_srv.op_cnt[OP_RESERVE_BATCH],
+            tasque_srv.op_cnt[OP_DELETE_BATCH],
+            tasque_srv.op_cnt[OP_TOUCH_BATCH],
+            tasque_srv.op_cnt[OP_RELEASE_BATCH],
+            tasque_srv.op_cnt[OP_CHECKPOINT],
+            tasque_srv.op_cnt[OP_REPLICATE],
             tasque_srv.timeout_cnt,
             tasque_srv.global_stat.total_jobs_cnt,
             (size_t)tasque_srv.job_data_size_limit,
@@ -506,18 +733,35 @@ static int fmt_stats(char *buf, size_t n, void *data) {
             TASQUE_VERSION,
             (int)ru.ru_utime.tv_sec, (int)ru.ru_utime.tv_usec,
             (int)ru.ru_stime.tv_sec, (int)ru.ru_stime.tv_usec,
-            (unsigned int)((ustime() - tasque_srv.started_at) / 1000000),
-            0,
-            0,
-            0,
-            0,
-            0);
+            (unsigned int)((ustime() - tasque_srv.started_at) / 1000000));
+    if (len < 0) return len;
+
+    /* the binlog, replication and allocator stats, then the end of
+     * the document */
+    r = binlog_fmt_stats(buf ? buf + len : NULL,
+            (size_t)len < n ? n - len : 0);
+    if (r < 0) return r;
+    len += r;
+
+    r = replica_fmt_stats(buf ? buf + len : NULL,
+            (size_t)len < n ? n - len : 0);
+    if (r < 0) return r;
+    len += r;
+
+    r = slab_fmt_stats(buf ? buf + len : NULL,
+            (size_t)len < n ? n - len : 0);
+    if (r < 0) return r;
+    len += r;
+
+    r = snprintf(buf ? buf + len : NULL,
+            (size_t)len < n ? n - len : 0, "\r\n");
+    if (r < 0) return r;
+    return len + r;
 }
 
 static int fmt_job_stats(char *buf, size_t n, void *aj) {
     int64_t t;
     int64_t time_left = 0;
-    int file = 0;
     job_t *j = (job_t *)aj;
 
     t = ustime();
@@ -534,7 +778,7 @@ static int fmt_job_stats(char *buf, size_t n, void *aj) {
             j->rec.delay / 1000000,
             j->rec.ttr / 1000000,
             time_left,
-            file,
+            binlog_job_file(j),
             j->rec.reserve_cnt,
             j->rec.timeout_cnt,
             j->rec.release_cnt,
@@ -552,7 +796,7 @@ static int fmt_stats_tube(char *buf, size_t n, void *at) {
     return snprintf(buf, n, STATS_TUBE_FMT,
             t->name,
             t->stats.urgent_cnt,
-            t->ready_jobs.len,
+            tube_ready_cnt(t),
             t->stats.reserved_cnt,
             t->delay_jobs.len,
             t->stats.buried_cnt,
@@ -569,6 +813,7 @@ static int fmt_stats_tube(char *buf, size_t n, void *at) {
 static void do_list_tubes(conn_t *c, set_t *tubes) {
     char *buf;
     tube_t *t;
+    job_t *j;
     size_t i, resp_z;
 
     /* first, measure how big a buffer we will need */
@@ -579,19 +824,19 @@ static void do_list_tubes(conn_t *c, set_t *tubes) {
     }
 
     /* fake job to hold stats data */
-    c->out_job = (job_t *)calloc(sizeof(job_t) + resp_z, 1);
-    if (!c->out_job) {
+    j = job_alloc(resp_z);
+    if (!j) {
         return reply_msg(c, MSG_OUT_OF_MEMORY);
     }
-    c->out_job->rec.created_at = ustime();
-    c->out_job->rec.body_size = resp_z;
+    j->rec.created_at = ustime();
+    j->rec.body_size = resp_z;
 
     /* Mark this job as a copy so it can be appropriately
      * freed later on */
-    c->out_job->rec.state = JOB_COPY;
+    j->rec.state = JOB_COPY;
 
     /* now actually format the response */
-    buf = c->out_job->body;
+    buf = j->body;
     buf += snprintf(buf, 5, "---\n");
     for (i = 0; i < tubes->used; ++i) {
         t = tubes->items[i];
@@ -599,14 +844,14 @@ static void do_list_tubes(conn_t *c, set_t *tubes) {
     }
     buf[0] = '\r';
     buf[1] = '\n';
-    c->out_job_sent = 0;
-    return reply_line(c, STATE_SENDJOB, "OK %d\r\n", resp_z - 2);
+    reply_body(c, j, "OK %d\r\n", resp_z - 2);
+    job_free(j);
 }
 
 #define conn_is_waiting(c)  ((c)->type & CONN_TYPE_WAITING)
 
 static int conn_has_reserved_job(conn_t *c) {
-    return dlist_length(&c->reserved_jobs) != 0;
+    return c->reserved_jobs.len != 0;
 }
 
 /* remove this connection to associated tubes' waiting set */
@@ -617,12 +862,13 @@ static void conn_remove_waiting(conn_t *c) {
     if (!conn_is_waiting(c)) return;
 
     c->type &= ~CONN_TYPE_WAITING;
-    --tasque_srv.global_stat.waiting_cnt;
+    srv_stat_dec(tasque_srv.global_stat.waiting_cnt);
 
     for (i = 0; i < c->watch.used; ++i) {
         t = (tube_t *)c->watch.items[i];
         --t->stats.waiting_cnt;
         set_remove(&t->waiting_conns, c);
+        tube_dispatch_update(t);
     }
 }
 
@@ -631,16 +877,50 @@ static void conn_enqueue_waiting(conn_t *c) {
     tube_t *t;
     size_t i;
 
-    ++tasque_srv.global_stat.waiting_cnt;
+    srv_stat_inc(tasque_srv.global_stat.waiting_cnt);
     c->type |= CONN_TYPE_WAITING;
 
     for (i = 0; i < c->watch.used; ++i) {
         t = c->watch.items[i];
         ++t->stats.waiting_cnt;
         set_append(&t->waiting_conns, c);
+        tube_dispatch_update(t);
     }
 }
 
+#define timer_conn(t) \
+    ((conn_t *)((char *)(t) - offsetof(conn_t, timer)))
+
+/* Have conn_cron() run by `at' at the latest. */
+static void cron_at(int64_t at) {
+    if (at == INT64_MAX) return;
+    event_tick_at(&tasque_srv.reactors[0].evt, at);
+}
+
+/* Arm the timer of `c' for `at', or disarm it if `at' is 0. Unless
+ * `sooner' is 0, a timer due before `at' already is left alone, and
+ * 0 returned, otherwise 1. The timers are shared by all partitions. */
+static int timer_arm(conn_t *c, int64_t at, int sooner) {
+    int armed = 0;
+
+    pthread_mutex_lock(&tasque_srv.timers_lock);
+    if (!at) {
+        wheel_del(&tasque_srv.timers, &c->timer);
+    } else if (!sooner || !wheel_armed(&c->timer) || c->timer.at > at) {
+        wheel_add(&tasque_srv.timers, &c->timer, at);
+        armed = 1;
+    }
+    pthread_mutex_unlock(&tasque_srv.timers_lock);
+    return armed;
+}
+
+/* Arm the timer of `c' for the next time it needs attention. */
+static void conn_schedule(conn_t *c) {
+    int64_t at = conn_tickat(c);
+
+    if (timer_arm(c, at, 0)) cron_at(at);
+}
+
 static void wait_for_job(conn_t *c, int timeout) {
     c->state = STATE_WAIT;
     /* add this connection to associated tubes' waiting set */
@@ -649,49 +929,22 @@ static void wait_for_job(conn_t *c, int timeout) {
     /* Set the pending timeout to the requested timeout amount */
     c->pending_timeout = timeout;
 
-    /* Only care if the connection hang up. */
-    c->ev = EVENT_HUP;
-    c->tickat = conn_tickat(c);
-
-    /* delete old tick event */
-    if (c->tickpos > -1) {
-        heap_remove(&tasque_srv.conns, c->tickpos);
-        c->tickpos = -1;
-    }
-
-    if (c->tickat) {
-        heap_insert(&tasque_srv.conns, c);
-    }
+    conn_schedule(c);
 }
 
 /* return the reserved job with the earlist deadline,
  * or NULL if there is no reserved job */
 job_t *conn_soonest_reserved_job(conn_t *c) {
-    job_t *j = NULL;
-    job_t *soonest = c->soonest_job;
-
-    if (!soonest) {
-        dlist_iter iter;
-        dlist_node *node;
-        dlist_rewind(&c->reserved_jobs, &iter);
-
-        while ((node = dlist_next(&iter))) {
-            j = (job_t *)node->value;
-            if (j->rec.deadline_at <= (soonest ? : j)->rec.deadline_at) {
-                soonest = j;
-            }
-        }
-    }
-    c->soonest_job = soonest;
-    return soonest;
+    if (!c->reserved_jobs.len) return NULL;
+    return heap_get(&c->reserved_jobs, 0);
 }
 
 static int touch_job(conn_t *c, job_t *j) {
-    if (j->reserver != c || j->rec.state != JOB_RESERVED) {
+    if (!j || j->reserver != c || j->rec.state != JOB_RESERVED) {
         return -1;
     }
     j->rec.deadline_at = ustime() + j->rec.ttr;
-    c->soonest_job = NULL;
+    delay_heap_fix(&c->reserved_jobs, j->heap_index);
     return 0;
 }
 
@@ -710,7 +963,7 @@ int64_t conn_tickat(conn_t *c) {
         should_timeout = 1;
     }
 
-    if (c->pending_timeout >= 0) {
+    if (conn_is_waiting(c) && c->pending_timeout >= 0) {
         t = min(t, (int64_t)c->pending_timeout * 1000000);
         should_timeout = 1;
     }
@@ -721,12 +974,19 @@ int64_t conn_tickat(conn_t *c) {
     return 0;
 }
 
-int conn_less(void *conn_a, void *conn_b) {
-    return ((conn_t *)conn_a)->tickat < ((conn_t *)conn_b)->tickat;
-}
 
-void conn_record(void *conn, int pos) {
-    ((conn_t *)conn)->tickpos = pos;
+/* Find the partition of the tubes `c' watches, PART_ALL if they are
+ * in more than one. A reserve takes the lock of that. */
+static void conn_set_part(conn_t *c) {
+    size_t i;
+
+    c->part = ((tube_t *)c->watch.items[0])->part;
+    for (i = 1; i < c->watch.used; ++i) {
+        if (((tube_t *)c->watch.items[i])->part != c->part) {
+            c->part = PART_ALL;
+            return;
+        }
+    }
 }
 
 conn_t *conn_create(int fd, char start_state, tube_t *use,
@@ -734,8 +994,15 @@ conn_t *conn_create(int fd, char start_state, tube_t *use,
     conn_t *c = (conn_t *)calloc(1, sizeof(*c));
     if (!c) return NULL;
 
+    if (heap_init(&c->reserved_jobs) != 0) {
+        free(c);
+        return NULL;
+    }
+
+    dlink_init(&c->batch_jobs);
     set_init(&c->watch, (set_event_fn)on_watch, (set_event_fn)on_ignore);
     if (set_append(&c->watch, watch) != 0) {
+        heap_destroy(&c->reserved_jobs);
         free(c);
         return NULL;
     }
@@ -743,12 +1010,11 @@ conn_t *conn_create(int fd, char start_state, tube_t *use,
     c->use = use;
     tube_iref(c->use);
     ++use->using_cnt;
+    conn_set_part(c);
 
     c->sock.fd = fd;
     c->state = start_state;
     c->pending_timeout = -1;
-    c->tickpos = -1;
-    dlist_init(&c->reserved_jobs);
 
     /* stats */
     ++tasque_srv.cur_conn_cnt;
@@ -759,13 +1025,13 @@ conn_t *conn_create(int fd, char start_state, tube_t *use,
 void conn_set_producer(conn_t *c) {
     if (c->type & CONN_TYPE_PRODUCER) return;
     c->type |= CONN_TYPE_PRODUCER;
-    ++tasque_srv.cur_producer_cnt;  /* stats */
+    srv_stat_inc(tasque_srv.cur_producer_cnt);  /* stats */
 }
 
 void conn_set_worker(conn_t *c) {
     if (c->type & CONN_TYPE_WORKER) return;
     c->type |= CONN_TYPE_WORKER;
-    ++tasque_srv.cur_worker_cnt;    /* stats */
+    srv_stat_inc(tasque_srv.cur_worker_cnt);    /* stats */
 }
 
 /* return true if `c' has a reserved job with less than one second
@@ -780,7 +1046,7 @@ int conn_has_ready_job(conn_t *c) {
     size_t  i;
 
     for (i = 0; i < c->watch.used; ++i) {
-        if (((tube_t*)c->watch.items[i])->ready_jobs.len) {
+        if (tube_ready_cnt((tube_t*)c->watch.items[i])) {
             return 1;
         }
     }
@@ -798,36 +1064,40 @@ void conn_free(conn_t *c) {
     }
 
     if (c->in_job) job_free(c->in_job);
-    /* was this a peek or stats command? */
-    if (c->out_job && !c->out_job->rec.id) job_free(c->out_job);
-
-    c->in_job = c->out_job = NULL;
+    c->in_job = NULL;
     c->in_job_read = 0;
+    batch_free_jobs(c);
+    free(c->batch_status);
+
+    out_clear(c);
+    free(c->obuf);
+    free(c->oseg);
 
     if (c->type & CONN_TYPE_PRODUCER) {
-        --tasque_srv.cur_producer_cnt;
+        srv_stat_dec(tasque_srv.cur_producer_cnt);
     }
     if (c->type & CONN_TYPE_WORKER) {
-        --tasque_srv.cur_worker_cnt;
+        srv_stat_dec(tasque_srv.cur_worker_cnt);
     }
     --tasque_srv.cur_conn_cnt;
     conn_remove_waiting(c);
     if (conn_has_reserved_job(c)) {
         enqueue_reserved_jobs(c);
     }
+    /* jobs a release-batch cut short has queued */
+    if (c->batch_left && c->batch_op == OP_RELEASE_BATCH) {
+        process_queue();
+    }
 
     set_clear(&c->watch);
     --c->use->using_cnt;
     tube_dref(c->use);
     c->use = NULL;
 
-    if (c->tickpos > -1) {
-        heap_remove(&tasque_srv.conns, c->tickpos);
-        c->tickpos = -1;
-    }
+    timer_arm(c, 0, 0);
 
     set_destroy(&c->watch);
-    dlist_destroy(&c->reserved_jobs);
+    heap_destroy(&c->reserved_jobs);
     --tasque_srv.cur_conn_cnt;
     --tasque_srv.tot_conn_cnt;
     free(c);
@@ -835,61 +1105,120 @@ void conn_free(conn_t *c) {
 }
 
 void conn_close(conn_t *c) {
-    event_regis(&tasque_srv.evt, &c->sock, EVENT_DEL);
+    /* handle_client() or conn_flush_all() will close it later, with
+     * the locks of all partitions */
+    if (c->busy || c->flush_pending || srv_held() != PART_ALL) {
+        c->closing = 1;
+        return;
+    }
+    event_regis(&c->reactor->evt, &c->sock, EVENT_DEL);
     conn_free(c);
 }
 
-static void process_queue() {
+/* Hand the best ready job of `t' to the connection waiting on it
+ * the longest. */
+static void dispatch_top(tube_t *t) {
     job_t *j;
     conn_t *c;
-    int64_t now = ustime();
-    while ((j = next_eligible_job(now))) {
-        heap_remove(&j->tube->ready_jobs, j->heap_index);
-        --tasque_srv.ready_cnt;
-        if (j->rec.pri < URGENT_THRESHOLD) {
-            --tasque_srv.global_stat.urgent_cnt;
-            --j->tube->stats.urgent_cnt;
-        }
 
-        c = set_take(&j->tube->waiting_conns);
-        conn_remove_waiting(c);
+    j = tube_ready_top(t, NULL);
+    remove_ready_job(j);
+
+    c = set_take(&t->waiting_conns);
+    conn_remove_waiting(c);
+    if (c->reserve_want > 1) {
+        reserve_batch(c, j);
+    } else {
         reserve_job(c, j);
     }
 }
 
+/* Hand out ready jobs while some tube has one for a waiting
+ * connection, best job first, see tube_dispatch_update(). With the
+ * lock of a single partition only its tubes are looked at, and a job
+ * for a connection that waits on those of others too is left to
+ * conn_unlock(), as the connection is theirs as well. */
+static void process_queue() {
+    int held = srv_held(), i;
+    part_t *part;
+    tube_t *t, *best;
+    heap_key_t k, best_k;
+
+    if (held >= 0) {
+        part = &tasque_srv.parts[held];
+        while (part->dispatch.len) {
+            t = heap_get(&part->dispatch, 0);
+            if (((conn_t *)t->waiting_conns.items[0])->part != held) {
+                part->redispatch = 1;
+                return;
+            }
+            dispatch_top(t);
+        }
+        return;
+    }
+
+    for (;;) {
+        best = NULL;
+        for (i = 0; i < tasque_srv.part_cnt; ++i) {
+            part = &tasque_srv.parts[i];
+            if (!part->dispatch.len) continue;
+            t = heap_get(&part->dispatch, 0);
+            tube_dispatch_key(t, &k);
+            if (!best || heap_key_less(&k, &best_k)) {
+                best = t;
+                best_k = k;
+            }
+        }
+        if (!best) break;
+        dispatch_top(best);
+    }
+    for (i = 0; i < tasque_srv.part_cnt; ++i) {
+        tasque_srv.parts[i].redispatch = 0;
+    }
+}
+
 static int remove_reserved_job(conn_t *c, job_t *j) {
-    dlist_node *dn;
-    dn = dlist_search_key(&c->reserved_jobs, j);
-    if (!dn) return -1;
-    dlist_delete_node(&c->reserved_jobs, dn);
+    if (j->rec.state != JOB_RESERVED || j->reserver != c) return -1;
+    delay_heap_remove(&c->reserved_jobs, j->heap_index);
 
-    --tasque_srv.global_stat.reserved_cnt;
+    srv_stat_dec(tasque_srv.global_stat.reserved_cnt);
     --j->tube->stats.reserved_cnt;
     j->reserver = NULL;
-    c->soonest_job = NULL;
     return 0;
 }
 
-static int enqueue_job(job_t *j, int64_t delay) {
+/* Put `j' in the ready or delay queue of its tube, without handing
+ * it out yet, see process_queue(). */
+static int queue_job(job_t *j, int64_t delay) {
     int ret;
     j->reserver = NULL;
 
     if (delay) {
         j->rec.deadline_at = ustime() + delay;
-        ret = heap_insert(&j->tube->delay_jobs, j);
+        cron_at(j->rec.deadline_at);
+        ret = delay_heap_insert(&j->tube->delay_jobs, j);
         if (ret < 0) return -1;
         j->rec.state = JOB_DELAYED;
+        tube_delay_update(j->tube);
     } else {
-        ret = heap_insert(&j->tube->ready_jobs, j);
+        ret = tube_ready_insert(j->tube, j);
         if (ret < 0) return -1;
         j->rec.state = JOB_READY;
-        ++tasque_srv.ready_cnt;
+        srv_stat_inc(tasque_srv.ready_cnt);
         if (j->rec.pri < URGENT_THRESHOLD) {
-            ++tasque_srv.global_stat.urgent_cnt;
+            srv_stat_inc(tasque_srv.global_stat.urgent_cnt);
             ++j->tube->stats.urgent_cnt;
         }
+        tube_dispatch_update(j->tube);
     }
+    binlog_update(j);
+    return 0;
+}
 
+static int enqueue_job(job_t *j, int64_t delay) {
+    if (queue_job(j, delay) != 0) {
+        return -1;
+    }
     process_queue();
     return 0;
 }
@@ -898,16 +1227,13 @@ static void enqueue_reserved_jobs(conn_t *c) {
     int ret;
     job_t *j;
     while (conn_has_reserved_job(c)) {
-        dlist_node *head = dlist_first(&c->reserved_jobs);
-        j = dlist_node_value(head);
-        dlist_delete_node(&c->reserved_jobs, head);
+        j = delay_heap_remove(&c->reserved_jobs, c->reserved_jobs.len - 1);
         ret = enqueue_job(j, 0);
         if (ret != 0) {
             bury_job(j);
         }
-        --tasque_srv.global_stat.reserved_cnt;
+        srv_stat_dec(tasque_srv.global_stat.reserved_cnt);
         --j->tube->stats.reserved_cnt;
-        c->soonest_job = NULL;
     }
 }
 
@@ -935,95 +1261,93 @@ static void conn_timeout(conn_t *c) {
     while ((j = conn_soonest_reserved_job(c))) {
         if (j->rec.deadline_at > now) break;
 
-        /* This job is in the middle of being written out. If we
-         * return it to the ready queue, someone might free it
-         * before we finish writing it out to the socket. So we'll
-         * copy it here and free the copy when it's done sending,
-         * in conn_reset(). */
-        if (j == c->out_job) {
-            c->out_job = job_copy(c->out_job);
-        }
-        ++tasque_srv.timeout_cnt;   /* stats */
+        srv_stat_inc(tasque_srv.timeout_cnt);   /* stats */
         ++j->rec.timeout_cnt;
         remove_reserved_job(c, j);
         ret = enqueue_job(j, 0);
         if (ret != 0) {
             bury_job(j);
         }
-
-        c->tickat = conn_tickat(c);
-        if (c->tickpos > -1) {
-            heap_remove(&tasque_srv.conns, c->tickpos);
-            c->tickpos = -1;
-        }
-        if (c->tickat) {
-            heap_insert(&tasque_srv.conns, c);
-        }
     }
 
     if (should_timeout) {
         conn_remove_waiting(c);
-        return reply_msg(c, MSG_DEADLINE_SOON);
+        reply_msg(c, MSG_DEADLINE_SOON);
     } else if (conn_is_waiting(c) && c->pending_timeout >= 0) {
         conn_remove_waiting(c);
         c->pending_timeout = -1;
-        return reply_msg(c, MSG_TIMED_OUT);
+        reply_msg(c, MSG_TIMED_OUT);
     }
+    conn_schedule(c);
 }
 
 static job_t *soonest_delay_job() {
-    int i;
+    job_t *j, *soonest = NULL;
     tube_t *t;
-    job_t *j = NULL, *nj;
+    int i;
 
-    for (i = 0; i < tasque_srv.tubes.used; ++i) {
-        t = tasque_srv.tubes.items[i];
-        if (t->delay_jobs.len == 0) {
-            continue;
-        }
-        nj = t->delay_jobs.data[0];
-        if (!j || nj->rec.deadline_at < j->rec.deadline_at) {
-            j = nj;
+    for (i = 0; i < tasque_srv.part_cnt; ++i) {
+        if (!tasque_srv.parts[i].delays.len) continue;
+        t = heap_get(&tasque_srv.parts[i].delays, 0);
+        j = heap_get(&t->delay_jobs, 0);
+        if (!soonest || j->rec.deadline_at < soonest->rec.deadline_at) {
+            soonest = j;
         }
     }
-    return j;
+    return soonest;
 }
 
-/* cron function every 10 ms */
+/* Run what has come due: delayed jobs, paused tubes and connection
+ * timers. Then ask to run again when the next of them is due. */
 void conn_cron(void *tickarg, int ev) {
-    int64_t now = ustime();
+    int64_t now = ustime(), next;
+    wheel_timer_t *w;
     job_t *j;
     int ret;
-    int i;
     tube_t *t;
 
+    srv_lock();
+    tube_gc();
     while ((j = soonest_delay_job())) {
         if (j->rec.deadline_at > now) break;
-        heap_remove(&j->tube->delay_jobs, j->heap_index);
+        remove_delayed_job(j);
         ret = enqueue_job(j, 0);
         if (ret < 0) {
             bury_job(j);
         }
     }
 
-    for (i = 0; i < tasque_srv.tubes.used; ++i) {
-        t = tasque_srv.tubes.items[i];
-        if (t->pause && t->deadline_at <= now) {
-            t->pause = 0;
-            process_queue();
-        }
+    while (tasque_srv.paused.len) {
+        t = heap_get(&tasque_srv.paused, 0);
+        if (t->deadline_at > now) break;
+        tube_unpause(t);
+        process_queue();
     }
 
     /* process tick event of some connections */
-    while (tasque_srv.conns.len) {
-        conn_t *c = tasque_srv.conns.data[0];
-        if (c->tickat > now) {
-            break;
-        }
-        heap_remove(&tasque_srv.conns, 0);
-        c->tickpos = -1;
-        conn_timeout(c);
+    while ((w = wheel_expire(&tasque_srv.timers, now))) {
+        conn_timeout(timer_conn(w));
+    }
+
+    next = wheel_next(&tasque_srv.timers);
+    if ((j = soonest_delay_job())) {
+        next = min(next, j->rec.deadline_at);
+    }
+    if (tasque_srv.paused.len) {
+        t = heap_get(&tasque_srv.paused, 0);
+        next = min(next, t->deadline_at);
     }
+    next = min(next, binlog_cron(now));
+    cron_at(next);
+    srv_unlock();
+}
+
+/* NUL-terminate the line in c->cmd, the numbers in it end there.
+ * -1 returned if the line has a NUL of its own, which would cut it
+ * short, otherwise 0. */
+static int cmd_terminate(conn_t *c) {
+    c->cmd[c->cmd_len - 2] = '\0';
+    return memchr(c->cmd, '\0', c->cmd_len - 2) ? -1 : 0;
 }
 
 /* Always returns at least 2 if a match is found. Return 0 if no match. */
@@ -1052,13 +1376,9 @@ static int scan_eol(const char *s, int size) {
  * If a failure occured, `pri' and `end' are not modified. */
 static int read_pri(uint32_t *pri, const char *buf, char **end) {
     char *tend;
-    uint32_t tpri;
+    uint64_t tpri;
 
-    while (buf[0] == ' ') ++buf;
-    if (!isdigit(buf[0])) return -1;
-    tpri = strtoul(buf, &tend, 10);
-    if (tend == buf) return -1;
-    if (errno && errno != ERANGE) return -1;
+    if (proto_read_num(buf, UINT32_MAX, &tpri, &tend) != 0) return -1;
     if (!end && tend[0] != '\0') return -1;
 
     if (pri) *pri = tpri;
@@ -1087,6 +1407,61 @@ static int read_ttr(int64_t *ttr, const char *buf, char **end) {
     return read_delay(ttr, buf, end);
 }
 
+/* Read the `<pri> <delay> <ttr> <bytes>' of a put from `buf'. `end'
+ * is left after the last character consumed, the caller checks what
+ * follows. Return 0 on success, or nonzero on failure. */
+static int read_job_line(const char *buf, uint32_t *pri, int64_t *delay,
+        int64_t *ttr, uint32_t *body_size, char **end) {
+    char *delay_buf, *ttr_buf, *size_buf;
+
+    if (read_pri(pri, buf, &delay_buf) < 0) return -1;
+    if (read_delay(delay, delay_buf, &ttr_buf) < 0) return -1;
+    if (read_ttr(ttr, ttr_buf, &size_buf) < 0) return -1;
+    return read_pri(body_size, size_buf, end);
+}
+
+/* Read a job id from the given buffer, see read_pri(). */
+static int read_id(uint64_t *id, const char *buf, char **end) {
+    char *tend;
+
+    if (proto_read_num(buf, UINT64_MAX, id, &tend) != 0) return -1;
+    if (!end && tend[0] != '\0') return -1;
+    if (end) *end = tend;
+    return 0;
+}
+
+/* Read a count of at least 1 and at most `max' from the given buffer,
+ * see read_pri(). */
+static int read_count(long *count, long max, const char *buf, char **end) {
+    uint64_t n;
+    char *tend;
+
+    if (proto_read_num(buf, max, &n, &tend) != 0 || n < 1) return -1;
+    if (!end && tend[0] != '\0') return -1;
+    *count = n;
+    if (end) *end = tend;
+    return 0;
+}
+
+/* Read the timeout of a reserve in seconds from the given buffer, a
+ * negative one meaning none, see read_pri(). */
+static int read_timeout(int *timeout, const char *buf, char **end) {
+    int neg = 0;
+    uint64_t n;
+    char *tend;
+
+    while (buf[0] == ' ') ++buf;
+    if (buf[0] == '-') {
+        neg = 1;
+        ++buf;
+    }
+    if (proto_read_num(buf, INT_MAX, &n, &tend) != 0) return -1;
+    if (!end && tend[0] != '\0') return -1;
+    *timeout = neg ? -(int)n : (int)n;
+    if (end) *end = tend;
+    return 0;
+}
+
 /* Read a tube name from the given buffer moving the buffer to
  * the name start */
 static int read_tube_name(char **tubename, char *buf, char **end) {
@@ -1100,62 +1475,497 @@ static int read_tube_name(char **tubename, char *buf, char **end) {
     return 0;
 }
 
-static void reserve_job(conn_t *c, job_t *j) {
+/* Make `j', just taken off the ready queue, reserved by `c'. Return
+ * 0 on success. Otherwise the job has been given back and -1 is
+ * returned. */
+static int take_job(conn_t *c, job_t *j) {
     j->rec.deadline_at = ustime() + j->rec.ttr;
-    ++tasque_srv.global_stat.reserved_cnt;
+    if (delay_heap_insert(&c->reserved_jobs, j) != 0) {
+        /* give the job back to somebody else */
+        if (enqueue_job(j, 0) != 0) {
+            bury_job(j);
+        }
+        return -1;
+    }
+    srv_stat_inc(tasque_srv.global_stat.reserved_cnt);
     ++j->tube->stats.reserved_cnt;
     ++j->rec.reserve_cnt;
     j->rec.state = JOB_RESERVED;
-
-    assert(dlist_add_node_head(&c->reserved_jobs, j) != NULL);
     j->reserver = c;
-    if (c->soonest_job && 
-            j->rec.deadline_at < c->soonest_job->rec.deadline_at) {
-        c->soonest_job = j;
+    binlog_update(j);
+
+    /* the TTR is enforced whether or not the client waits again */
+    if (timer_arm(c, j->rec.deadline_at, 1)) {
+        cron_at(j->rec.deadline_at);
     }
+    return 0;
+}
 
-    return reply_job(c, j, MSG_RESERVED);
+static void reserve_job(conn_t *c, job_t *j) {
+    if (take_job(c, j) != 0) {
+        return reply_msg(c, MSG_OUT_OF_MEMORY);
+    }
+    reply_job_msg(c, j, MSG_RESERVED);
 }
 
-static job_t *next_eligible_job(int64_t now) {
+/* The best ready job of the unpaused tubes `c' watches, or NULL. */
+static job_t *next_ready_job(conn_t *c) {
+    job_t *j, *best = NULL;
+    heap_key_t k, best_k;
     tube_t *t;
     size_t i;
-    job_t *j = NULL, *candidate;
-
-    for (i = 0; i < tasque_srv.tubes.used; ++i) {
-        t = tasque_srv.tubes.items[i];
-        if (t->pause) {
-            if (t->deadline_at > now) continue;
-            t->pause = 0;
-        }
 
-        if (t->waiting_conns.used && t->ready_jobs.len) {
-            candidate = t->ready_jobs.data[0];
-            if (!j || job_pri_less(candidate, j)) {
-                j = candidate;
-            }
+    for (i = 0; i < c->watch.used; ++i) {
+        t = c->watch.items[i];
+        if (t->pause || !(j = tube_ready_top(t, &k))) continue;
+        if (!best || heap_key_less(&k, &best_k)) {
+            best = j;
+            best_k = k;
         }
     }
-    return j;
+    return best;
 }
 
-static int bury_job(job_t *j) {
-    if (!dlist_add_node_tail(&j->tube->buried_jobs, j)) {
-        return -1;
+/* Reserve `j' and as many more of the ready jobs `c' watches as its
+ * reserve-batch asked for, best first, and reply all of them at
+ * once: a RESERVED_BATCH line, then each job as if reserved alone. */
+static void reserve_batch(conn_t *c, job_t *j) {
+    job_t *jobs[RESERVE_BATCH_MAX];
+    int i, n = 0;
+
+    for ( ; ; ) {
+        if (take_job(c, j) != 0) break;
+        jobs[n++] = j;
+        if (n == c->reserve_want || !(j = next_ready_job(c))) break;
+        remove_ready_job(j);
+    }
+
+    if (!n) {
+        return reply_msg(c, MSG_OUT_OF_MEMORY);
     }
+    if (out_printf(c, MSG_RESERVED_BATCH_FMT, n) < 0) return;
+    for (i = 0; i < n; ++i) {
+        if (out_job_msg(c, jobs[i], MSG_RESERVED) != 0) return;
+    }
+    reply_done(c);
+}
 
-    ++tasque_srv.global_stat.buried_cnt;
+static int bury_job(job_t *j) {
+    dlink_add_tail(&j->tube->buried_jobs, &j->link);
+    srv_stat_inc(tasque_srv.global_stat.buried_cnt);
     ++j->tube->stats.buried_cnt;
     j->rec.state = JOB_BURIED;
     j->reserver = NULL;
     ++j->rec.bury_cnt;
+    binlog_update(j);
     return 0;
 }
 
+/* Delete job `id' for `c', see "delete" in the protocol. Return 0 on
+ * success, -1 if there is no such job it may delete. */
+static int delete_job(conn_t *c, uintptr_t id) {
+    job_t *j = job_find(id);
+    int ret;
+
+    if (!j) return -1;
+    if ((ret = remove_reserved_job(c, j)) != 0) {
+        if ((ret = remove_ready_job(j)) != 0) {
+            if ((ret = remove_delayed_job(j)) != 0) {
+                ret = remove_buried_job(j);
+            }
+        }
+    }
+    if (ret != 0) return -1;
+
+    ++j->tube->stats.total_delete_cnt;
+    j->rec.state = JOB_INVALID;
+    binlog_delete(j);
+    job_free(j);
+    return 0;
+}
+
+/* Put job `id' reserved by `c' back with a new priority and delay.
+ * It is only queued, see process_queue(). Return 0 on success, 1 if
+ * it had to be buried instead, -1 if `c' has no such job. */
+static int release_job(conn_t *c, uintptr_t id, uint32_t pri,
+        int64_t delay) {
+    job_t *j = job_find(id);
+
+    if (!j || remove_reserved_job(c, j) != 0) return -1;
+
+    j->rec.pri = pri;
+    j->rec.delay = delay;
+    ++j->rec.release_cnt;
+    if (queue_job(j, delay) != 0) {
+        bury_job(j);
+        return 1;
+    }
+    return 0;
+}
+
+/* Put back `j' as read from the binlog, see binlog_init(). A job
+ * that was reserved is ready again, and so is a delayed one whose
+ * time has passed. The heaps are only filled here, and put in order
+ * all at once by conn_restore_done() after the last job. */
+void conn_restore_job(job_t *j) {
+    int ret;
+
+    j->reserver = NULL;
+    if (j->rec.state == JOB_BURIED) {
+        dlink_add_tail(&j->tube->buried_jobs, &j->link);
+        srv_stat_inc(tasque_srv.global_stat.buried_cnt);
+        ++j->tube->stats.buried_cnt;
+        return;
+    }
+
+    if (j->rec.state == JOB_DELAYED && j->rec.deadline_at > ustime()) {
+        ret = delay_heap_push(&j->tube->delay_jobs, j);
+    } else {
+        j->rec.state = JOB_READY;
+        ret = tube_ready_push(j->tube, j);
+        if (ret == 0) {
+            srv_stat_inc(tasque_srv.ready_cnt);
+            if (j->rec.pri < URGENT_THRESHOLD) {
+                srv_stat_inc(tasque_srv.global_stat.urgent_cnt);
+                ++j->tube->stats.urgent_cnt;
+            }
+        }
+    }
+    if (ret != 0) {
+        bury_job(j);
+    }
+}
+
+/* Order the heaps filled by conn_restore_job(). */
+void conn_restore_done(void) {
+    tube_t *t;
+    size_t i;
+
+    for (i = 0; i < tasque_srv.tubes.used; ++i) {
+        t = tasque_srv.tubes.items[i];
+        ready_heap_heapify(&t->ready_jobs);
+        delay_heap_heapify(&t->delay_jobs);
+        tube_dispatch_update(t);
+        tube_delay_update(t);
+    }
+    /* the cron takes it from there, the delayed jobs restored and the
+     * timers of the binlog */
+    cron_at(ustime());
+}
+
+/* --------------- replication --------------------------------
+ * A follower takes the jobs of its leader as the leader logs them,
+ * see replica.h. Each is put where its state says, a reserved one
+ * nowhere: it stays reserved until the leader tells otherwise. */
+
+static void place_job(job_t *j) {
+    j->reserver = NULL;
+    switch (j->rec.state) {
+    case JOB_RESERVED:
+        srv_stat_inc(tasque_srv.global_stat.reserved_cnt);
+        ++j->tube->stats.reserved_cnt;
+        return;
+    case JOB_BURIED:
+        dlink_add_tail(&j->tube->buried_jobs, &j->link);
+        srv_stat_inc(tasque_srv.global_stat.buried_cnt);
+        ++j->tube->stats.buried_cnt;
+        return;
+    case JOB_DELAYED:
+        if (delay_heap_insert(&j->tube->delay_jobs, j) != 0) break;
+        tube_delay_update(j->tube);
+        cron_at(j->rec.deadline_at);
+        return;
+    }
+
+    j->rec.state = JOB_READY;
+    if (tube_ready_insert(j->tube, j) != 0) {
+        bury_job(j);
+        return;
+    }
+    srv_stat_inc(tasque_srv.ready_cnt);
+    if (j->rec.pri < URGENT_THRESHOLD) {
+        srv_stat_inc(tasque_srv.global_stat.urgent_cnt);
+        ++j->tube->stats.urgent_cnt;
+    }
+    tube_dispatch_update(j->tube);
+}
+
+static void unplace_job(job_t *j) {
+    if (j->rec.state == JOB_RESERVED) {
+        srv_stat_dec(tasque_srv.global_stat.reserved_cnt);
+        --j->tube->stats.reserved_cnt;
+    } else if (remove_ready_job(j) != 0 && remove_delayed_job(j) != 0) {
+        remove_buried_job(j);
+    }
+}
+
+/* A job put on the leader. */
+void conn_replica_put(job_t *j) {
+    place_job(j);
+    binlog_put(j);
+    srv_stat_inc(tasque_srv.global_stat.total_jobs_cnt);
+    ++j->tube->stats.total_jobs_cnt;
+}
+
+/* The new state `rec' of `j' on the leader. */
+void conn_replica_update(job_t *j, const jobrec_t *rec) {
+    uint32_t body_size = j->rec.body_size;
+
+    unplace_job(j);
+    j->rec = *rec;
+    j->rec.body_size = body_size;
+    place_job(j);
+    binlog_update(j);
+}
+
+/* A job deleted on the leader. */
+void conn_replica_delete(job_t *j) {
+    unplace_job(j);
+    ++j->tube->stats.total_delete_cnt;
+    j->rec.state = JOB_INVALID;
+    binlog_delete(j);
+    job_free(j);
+}
+
+/* Drop all jobs, before the jobs of the leader are taken anew. */
+void conn_replica_reset(void) {
+    job_t **jobs, *j;
+    size_t pos = 0, n = 0, i;
+
+    jobs = malloc((idtab_count(&tasque_srv.all_jobs) + 1) * sizeof(*jobs));
+    if (!jobs) {
+        fprintf(stderr, "malloc failed dropping jobs to resync\n");
+        exit(1);
+    }
+    while ((j = idtab_next(&tasque_srv.all_jobs, &pos))) {
+        jobs[n++] = j;
+    }
+    for (i = 0; i < n; ++i) {
+        conn_replica_delete(jobs[i]);
+    }
+    free(jobs);
+}
+
+/* Write out what the changes of a follower logged, and have the cron
+ * see to its delayed jobs. */
+void conn_replica_flush(void) {
+    cron_at(binlog_flush());
+}
+
+/* --------------- delete-, touch- and release-batch ----------
+ * These are followed by <count> lines, each with what follows the
+ * name of the single job command: an id, and for release-batch a
+ * priority and a delay. Each line is done as it arrives, and leaves
+ * a letter in batch_status: the first letter of the reply of the
+ * single command (D, T, R, B or N), or F for a malformed line. Once
+ * the last one is in, released jobs are handed out and one line
+ * answers for all of them, see id_batch_commit(). */
+
+static void id_batch_commit(conn_t *c) {
+    const char *fmt;
+    char ok_letter;
+    int i, n = c->batch_cnt, ok = 0, len;
+
+    if (tasque_srv.leader_host) {
+        free(c->batch_status);
+        c->batch_status = NULL;
+        return reply_msg(c, MSG_READ_ONLY);
+    }
+    if (c->batch_op == OP_DELETE_BATCH) {
+        fmt = MSG_DELETED_BATCH_FMT;
+    } else if (c->batch_op == OP_TOUCH_BATCH) {
+        fmt = MSG_TOUCHED_BATCH_FMT;
+    } else {
+        fmt = MSG_RELEASED_BATCH_FMT;
+        process_queue();
+    }
+    ok_letter = fmt[0];
+    for (i = 0; i < n; ++i) {
+        if (c->batch_status[i] == ok_letter) ++ok;
+    }
+
+    /* <WORD>_BATCH <done> <letters>\r\n */
+    if (out_reserve(c, LINE_BUF_SIZE + n) != 0) {
+        free(c->batch_status);
+        c->batch_status = NULL;
+        return reply_failed(c);
+    }
+    len = sprintf(c->obuf + c->obuf_len, fmt, ok);
+    memcpy(c->obuf + c->obuf_len + len, c->batch_status, n);
+    len += n;
+    memcpy(c->obuf + c->obuf_len + len, "\r\n", 2);
+    len += 2;
+    free(c->batch_status);
+    c->batch_status = NULL;
+
+    out_commit_line(c, len);
+    reply_done(c);
+}
+
+static void do_id_line(conn_t *c) {
+    char *end_buf, *delay_buf, st;
+    uint64_t id;
+    uint32_t pri;
+    int64_t delay;
+
+    if (cmd_terminate(c) != 0) {
+        st = 'F';
+    } else if (tasque_srv.leader_host) {
+        /* read only, see id_batch_commit() */
+        st = 'N';
+    } else if (read_id(&id, c->cmd, &end_buf) != 0) {
+        st = 'F';
+    } else if (c->batch_op == OP_DELETE_BATCH) {
+        st = end_buf[0] ? 'F' : delete_job(c, id) == 0 ? 'D' : 'N';
+    } else if (c->batch_op == OP_TOUCH_BATCH) {
+        st = end_buf[0] ? 'F' : touch_job(c, job_find(id)) == 0 ? 'T' : 'N';
+    } else if (read_pri(&pri, end_buf, &delay_buf) != 0 ||
+            read_delay(&delay, delay_buf, NULL) != 0) {
+        st = 'F';
+    } else {
+        switch (release_job(c, id, pri, delay)) {
+        case 0:  st = 'R'; break;
+        case 1:  st = 'B'; break;
+        default: st = 'N'; break;
+        }
+    }
+
+    c->batch_status[c->batch_cnt - c->batch_left] = st;
+    if (--c->batch_left == 0) {
+        id_batch_commit(c);
+    }
+}
+
+/* --------------- put-batch ----------------------------------
+ * put-batch <count>\r\n is followed by <count> jobs, each framed as
+ * the line of a put without the "put " and its body. The jobs are
+ * collected as they arrive. Once the last one is in, they get
+ * consecutive ids and are queued together, and a single line
+ * answers for all of them. Errors that leave the framing intact fail
+ * the whole batch when it ends, a malformed job line fails it at
+ * once. */
+
+static void batch_free_jobs(conn_t *c) {
+    dlink *l;
+
+    while ((l = dlink_first(&c->batch_jobs))) {
+        dlink_delete(l);
+        job_free(dlink_entry(l, job_t, link));
+    }
+}
+
+/* Give up on the batch, the rest of it is read as commands. What an
+ * id batch has done so far stays done. */
+static void batch_abort(conn_t *c, char *msg) {
+    batch_free_jobs(c);
+    free(c->batch_status);
+    c->batch_status = NULL;
+    c->batch_left = 0;
+    c->batch_err = NULL;
+    if (c->batch_op == OP_RELEASE_BATCH) {
+        process_queue();
+    }
+    reply(c, msg, strlen(msg));
+}
+
+static void batch_commit(conn_t *c) {
+    char *err = c->batch_err;
+    uintptr_t first = 0;
+    int n = 0;
+    dlink *l;
+    job_t *j;
+
+    c->batch_err = NULL;
+    if (!err && tasque_srv.drain_mode) {
+        err = MSG_DRAINING;
+    }
+    if (!err && tasque_srv.leader_host) {
+        err = MSG_READ_ONLY;
+    }
+
+    /* The ids are handed out in one go, so they are consecutive. */
+    for (l = c->batch_jobs.next; !err && l != &c->batch_jobs; l = l->next) {
+        j = dlink_entry(l, job_t, link);
+        if (job_add(j, 0) != 0) {
+            err = MSG_OUT_OF_MEMORY;
+        }
+        if (!first) first = j->rec.id;
+        ++n;
+    }
+
+    if (err) {
+        batch_free_jobs(c);
+        return reply(c, err, strlen(err));
+    }
+
+    while ((l = dlink_first(&c->batch_jobs))) {
+        dlink_delete(l);
+        j = dlink_entry(l, job_t, link);
+        if (queue_job(j, j->rec.delay) != 0) {
+            bury_job(j);
+        }
+        binlog_put(j);
+        srv_stat_inc(tasque_srv.global_stat.total_jobs_cnt);
+        ++j->tube->stats.total_jobs_cnt;
+    }
+    process_queue();
+
+    if (tasque_srv.verbose >= 2) {
+        printf("<%s:%d jobs %ld-%ld\n", c->remote_ip, c->remote_port,
+                (long)first, (long)first + n - 1);
+    }
+    reply_line(c, MSG_INSERTED_BATCH_FMT, (long)first, n);
+}
+
+/* A job of the batch has been read or skipped. */
+static void batch_next(conn_t *c) {
+    c->state = STATE_WANTCOMMAND;
+    if (--c->batch_left == 0) {
+        batch_commit(c);
+    }
+}
+
+static void batch_fail(conn_t *c, char *msg) {
+    if (!c->batch_err) {
+        c->batch_err = msg;
+    }
+}
+
+/* Skip the body of a job of the batch that can't be taken. */
+static void batch_skip(conn_t *c, int64_t n) {
+    c->in_job = NULL;
+    c->in_job_read = n;
+    fill_extra_data(c);
+
+    if (c->in_job_read == 0) {
+        return batch_next(c);
+    }
+    c->state = STATE_BITBUCKET;
+}
+
+static void batch_add_job(conn_t *c) {
+    job_t *j = c->in_job;
+
+    c->in_job = NULL;
+    c->in_job_read = 0;
+
+    if (memcmp(j->body + j->rec.body_size - 2, "\r\n", 2)) {
+        job_free(j);
+        batch_fail(c, MSG_EXPECTED_CRLF);
+    } else {
+        dlink_add_tail(&c->batch_jobs, &j->link);
+    }
+    batch_next(c);
+}
+
 static void enqueue_incoming_job(conn_t *c) {
     int ret;
     job_t *j = c->in_job;
 
+    if (c->batch_left) {
+        return batch_add_job(c);
+    }
+
     c->in_job = NULL; /* the connection no longer owns this job */
     c->in_job_read = 0;
 
@@ -1165,61 +1975,67 @@ static void enqueue_incoming_job(conn_t *c) {
         return reply_msg(c, MSG_EXPECTED_CRLF);
     }
 
-    if (tasque_srv.verbose >= 2) {
-        printf("<%s:%d job %ld\n", 
-                c->remote_ip, c->remote_port, (long)j->rec.id);
-    }
-
     if (tasque_srv.drain_mode) {
         job_free(j);
         return reply_msg(c, MSG_DRAINING);
     }
+    if (tasque_srv.leader_host) {
+        job_free(j);
+        return reply_msg(c, MSG_READ_ONLY);
+    }
+    if (job_add(j, 0) != 0) {
+        job_free(j);
+        return reply_msg(c, MSG_OUT_OF_MEMORY);
+    }
 
-    /* we have a complete job, so let's stick it in the pqueue */
-    ret = enqueue_job(j, j->rec.delay);
+    if (tasque_srv.verbose >= 2) {
+        printf("<%s:%d job %ld\n", 
+                c->remote_ip, c->remote_port, (long)j->rec.id);
+    }
+
+    /* we have a complete job, so let's stick it in the pqueue, and
+     * log it before it may be handed out */
+    ret = queue_job(j, j->rec.delay);
     if (ret < 0) {
         job_free(j);
         return reply_msg(c, MSG_INTERNAL_ERROR);
     }
+    binlog_put(j);
+    process_queue();
 
-    ++tasque_srv.global_stat.total_jobs_cnt;
+    srv_stat_inc(tasque_srv.global_stat.total_jobs_cnt);
     ++j->tube->stats.total_jobs_cnt;
 
-    return reply_line(c, STATE_SENDWORD, MSG_INSERTED_FMT,j->rec.id);
+    if (c->proto == PROTO_BINARY) {
+        return reply_bin(c, BIN_OK, j->rec.id, 0);
+    }
+    return reply_num_msg(c, MSG_INSERTED, j->rec.id);
 }
 
-static job_t *remove_buried_job(tube_t *t) {
-    dlist_node *head = dlist_first(&t->buried_jobs);
-    if (!head) return NULL;
-    job_t *j = dlist_node_value(head);
-    if (!j || j->rec.state != JOB_BURIED) return NULL;
-    dlist_delete_node(&t->buried_jobs, head);
-    if (j) {
-        --tasque_srv.global_stat.buried_cnt;
-        --j->tube->stats.buried_cnt;
-    }
-    return j;
+static int remove_buried_job(job_t *j) {
+    if (!j || j->rec.state != JOB_BURIED) return -1;
+    dlink_delete(&j->link);
+    srv_stat_dec(tasque_srv.global_stat.buried_cnt);
+    --j->tube->stats.buried_cnt;
+    return 0;
 }
 
 static int remove_ready_job(job_t *j) {
     if (!j || j->rec.state != JOB_READY) return -1;
-    heap_remove(&j->tube->ready_jobs, j->heap_index);
-    --tasque_srv.ready_cnt;
+    tube_ready_remove(j);
+    srv_stat_dec(tasque_srv.ready_cnt);
     if (j->rec.pri < URGENT_THRESHOLD) {
-        --tasque_srv.global_stat.urgent_cnt;
+        srv_stat_dec(tasque_srv.global_stat.urgent_cnt);
         --j->tube->stats.urgent_cnt;
     }
+    tube_dispatch_update(j->tube);
     return 0;
 }
 
 static int remove_delayed_job(job_t *j) {
-    if (!j || j->rec.state != JOB_READY) return -1;
-    heap_remove(&j->tube->ready_jobs, j->heap_index);
-    --tasque_srv.ready_cnt;
-    if (j->rec.pri < URGENT_THRESHOLD) {
-        --tasque_srv.global_stat.urgent_cnt;
-        --j->tube->stats.urgent_cnt;
-    }
+    if (!j || j->rec.state != JOB_DELAYED) return -1;
+    delay_heap_remove(&j->tube->delay_jobs, j->heap_index);
+    tube_delay_update(j->tube);
     return 0;
 }
 
@@ -1228,7 +2044,8 @@ static uint32_t kick_delayed_job(tube_t *t) {
     job_t *j;
 
     if (t->delay_jobs.len == 0) return -1;
-    j = heap_remove(&t->delay_jobs, 0);
+    j = heap_get(&t->delay_jobs, 0);
+    remove_delayed_job(j);
     ++j->rec.kick_cnt;
     ret = enqueue_job(j, 0);
     if (ret == 0) {
@@ -1246,9 +2063,9 @@ static uint32_t kick_buried_job(tube_t *t) {
     int ret;
     job_t *j;
 
-    if (!tube_has_buried_job(t)) return 0;
-    j = remove_buried_job(t);
-    if (!j) {
+    if (!tube_has_buried_job(t)) return -1;
+    j = dlink_entry(t->buried_jobs.next, job_t, link);
+    if (remove_buried_job(j) != 0) {
         return -1;
     }
     ++j->rec.kick_cnt;
@@ -1279,165 +2096,312 @@ static uint32_t kick_jobs(tube_t *t, uint32_t n) {
     }
 }
 
+/* Handle the line of a job in a put-batch, as OP_PUT does. */
+static void do_batch_line(conn_t *c) {
+    uint32_t pri, body_size;
+    int64_t delay, ttr;
+    char *end_buf;
+
+    if (cmd_terminate(c) != 0) {
+        return batch_abort(c, MSG_BAD_FORMAT);
+    }
+    if (read_job_line(c->cmd, &pri, &delay, &ttr, &body_size,
+                &end_buf) != 0) {
+        return batch_abort(c, MSG_BAD_FORMAT);
+    }
+
+    if (body_size > tasque_srv.job_data_size_limit) {
+        batch_fail(c, MSG_JOB_TOO_BIG);
+        return batch_skip(c, (int64_t)body_size + 2);
+    }
+
+    if (end_buf[0] != '\0') return batch_abort(c, MSG_BAD_FORMAT);
+
+    if (ttr < 1000000) { /* 1 second */
+        ttr = 1000000;
+    }
+
+    c->in_job = job_new(pri, delay, ttr, body_size + 2, c->use);
+    if (!c->in_job) {
+        batch_fail(c, MSG_OUT_OF_MEMORY);
+        return batch_skip(c, (int64_t)body_size + 2);
+    }
+    fill_extra_data(c);
+
+    /* it's possible we already have a complete job */
+    if (c->in_job_read == c->in_job->rec.body_size) {
+        return enqueue_incoming_job(c);
+    }
+    c->state = STATE_WANTDATA;
+}
+
+static int use_tube(conn_t *c, const char *name) {
+    tube_t *t = tube_find_or_create(name);
+
+    if (!t) return -1;
+    tube_iref(t);
+    --c->use->using_cnt;
+    tube_dref(c->use);
+    c->use = t;
+    ++c->use->using_cnt;
+    return 0;
+}
+
+static int watch_tube(conn_t *c, const char *name) {
+    tube_t *t = tube_find_or_create(name);
+
+    if (!t) return -1;
+    if (!set_contains(&c->watch, t)) {
+        /* ref count changed by on_watch() or on_ignore(). */
+        if (set_append(&c->watch, t) < 0) {
+            return -1;
+        }
+        conn_set_part(c);
+    }
+    return 0;
+}
+
+/* -1 returned if `name' is the last tube `c' watches */
+static int ignore_tube(conn_t *c, const char *name) {
+    tube_t *t = NULL;
+    size_t i;
+
+    for (i = 0; i < c->watch.used; ++i) {
+        t = c->watch.items[i];
+        if (strncmp(t->name, name, MAX_TUBE_NAME_LEN) == 0) break;
+        t = NULL;
+    }
+
+    if (t && c->watch.used < 2) return -1;
+    if (t) {
+        set_remove(&c->watch, t); /* maybe free t if refcount=0 */
+        conn_set_part(c);
+    }
+    return 0;
+}
+
+/* NULL returned on success, otherwise the error to reply. */
+static char *pause_tube(const char *name, int64_t delay) {
+    tube_t *t = tube_find(name);
+
+    if (!t) return MSG_NOTFOUND;
+
+    /* always pause for a positive amount of time, to make sure
+     * the waiting clients wake up when the deadline arrives. */
+    if (delay == 0) {
+        delay = 1;
+    }
+    if (tube_pause(t, delay) < 0) {
+        return MSG_OUT_OF_MEMORY;
+    }
+    cron_at(t->deadline_at);
+    ++t->stats.pause_cnt;
+    return NULL;
+}
+
+static int bury_reserved_job(conn_t *c, uintptr_t id, uint32_t pri) {
+    job_t *j = job_find(id);
+
+    if (!j || remove_reserved_job(c, j) != 0) return -1;
+    j->rec.pri = pri;
+    return bury_job(j);
+}
+
+/* Start reading the body of a put, `body_size' bytes not counting
+ * the "\r\n" after it. The binary protocol doesn't send those two,
+ * they are put in place right away. */
+static void put_job(conn_t *c, uint32_t pri, int64_t delay, int64_t ttr,
+        uint32_t body_size) {
+    int64_t wire_size = (int64_t)body_size +
+        (c->proto == PROTO_BINARY ? 0 : 2);
+
+    conn_set_producer(c);
+    if (ttr < 1000000) { /* 1 second */
+        ttr = 1000000;
+    }
+
+    /* the id is only given once the body is in, see
+     * enqueue_incoming_job(), so the job can't be found while the
+     * body is read outside the lock */
+    c->in_job = job_new(pri, delay, ttr, body_size + 2, c->use);
+    if (!c->in_job) {
+        /* throw away the job body and respond with OUT_OF_MEMORY */
+        fprintf(stderr, "server error: " MSG_OUT_OF_MEMORY);
+        skip_and_reply_msg(c, wire_size, MSG_OUT_OF_MEMORY);
+        return;
+    }
+    if (c->proto == PROTO_BINARY) {
+        memcpy(c->in_job->body + body_size, "\r\n", 2);
+    }
+    fill_extra_data(c);
+
+    /* it's possible we already have a complete job */
+    if (c->in_job_read == in_job_want(c)) {
+        return enqueue_incoming_job(c);
+    }
+    /* otherwise we have incomplete data, so just keep waiting */
+    c->state = STATE_WANTDATA;
+}
+
+/* Whether `op' changes jobs, which a follower doesn't take from its
+ * clients, see replica.h. The puts and the id batches are only turned
+ * down once what follows them is read. */
+static int op_is_write(int op) {
+    switch (op) {
+    case OP_RESERVE:
+    case OP_RESERVE_TIMEOUT:
+    case OP_RESERVE_BATCH:
+    case OP_DELETE:
+    case OP_RELEASE:
+    case OP_BURY:
+    case OP_KICK:
+    case OP_TOUCH:
+        return 1;
+    }
+    return 0;
+}
+
 static void do_cmd(conn_t *c) {
     unsigned char type;
     int ret, timeout = -1;
     uint32_t pri, body_size;
-    char *size_buf, *delay_buf, *ttr_buf, *pri_buf, *end_buf, *name;
+    char *delay_buf, *pri_buf, *end_buf, *name, *err;
     int64_t delay, ttr;
     job_t *j = NULL;
     long count;
     uint32_t i;
-    uintptr_t id;
+    uint64_t id;
     tube_t *t = NULL;
 
-    /* NUL-terminate this string so we can use strtol and friends */
-    c->cmd[c->cmd_len - 2] = '\0';
-
     /* check for possible maliciousness */
-    if (strlen(c->cmd) != c->cmd_len - 2) {
+    if (cmd_terminate(c) != 0) {
         return reply_msg(c, MSG_BAD_FORMAT);
     }
 
-    type = which_cmd(c);
+    type = proto_which_cmd(c->cmd, c->cmd_len - 2);
     if (tasque_srv.verbose >= 2) {
         printf("<%s:%d command %s\n", c->remote_ip, c->remote_port,
                 op_names[type]);
     }
 
+    /* a follower has its jobs from the leader alone, a put is turned
+     * down once its body is in */
+    if (tasque_srv.leader_host && op_is_write(type)) {
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+        return reply_msg(c, MSG_READ_ONLY);
+    }
+
     switch (type) {
     case OP_PUT:
-        ret = read_pri(&pri, c->cmd + 4, &delay_buf);
-        if (ret < 0) return reply_msg(c, MSG_BAD_FORMAT);
-
-        ret = read_delay(&delay, delay_buf, &ttr_buf);
+        ret = read_job_line(c->cmd + 4, &pri, &delay, &ttr, &body_size,
+                &end_buf);
         if (ret < 0) return reply_msg(c, MSG_BAD_FORMAT);
-        
-        ret = read_ttr(&ttr, ttr_buf, &size_buf);
-        if (ret < 0) return reply_msg(c, MSG_BAD_FORMAT);
-
-        body_size = strtoul(size_buf, &end_buf, 10);
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
 
-        ++tasque_srv.op_cnt[type];
+        srv_stat_inc(tasque_srv.op_cnt[type]);
 
         if (body_size > tasque_srv.job_data_size_limit) {
             /* throw away the job body and respond with JOB_TOO_BIG */
-            skip_and_reply_msg(c, body_size + 2, MSG_JOB_TOO_BIG);
+            skip_and_reply_msg(c, (int64_t)body_size + 2, MSG_JOB_TOO_BIG);
             return;
         }
 
         /* don't allow trailing garbage */
         if (end_buf[0] != '\0') return reply_msg(c, MSG_BAD_FORMAT);
 
-        conn_set_producer(c);
-        if (ttr < 1000000) { /* 1 second */
-            ttr = 1000000;
-        }
-
-        c->in_job = job_create(pri, delay, ttr, body_size + 2, c->use, 0);
-        if (!c->in_job) {
-            /* throw away the job body and respond with OUT_OF_MEMORY */
-            fprintf(stderr, "server error: " MSG_OUT_OF_MEMORY);
-            skip_and_reply_msg(c, body_size + 2, MSG_OUT_OF_MEMORY);
-            return;
+        put_job(c, pri, delay, ttr, body_size);
+        break;
+    case OP_PUT_BATCH:
+        if (read_count(&count, PUT_BATCH_MAX,
+                    c->cmd + CMD_PUT_BATCH_LEN, NULL) != 0) {
+            return reply_msg(c, MSG_BAD_FORMAT);
         }
-        fill_extra_data(c);
+        srv_stat_inc(tasque_srv.op_cnt[type]);
 
-        /* it's possible we already have a complete job */
-        if (c->in_job_read == c->in_job->rec.body_size) {
-            return enqueue_incoming_job(c);
-        }
-        /* otherwise we have incomplete data, so just keep waiting */
-        c->state = STATE_WANTDATA;
+        /* no reply until the jobs are in, see batch_commit() */
+        conn_set_producer(c);
+        c->batch_op = type;
+        c->batch_left = count;
+        c->batch_err = NULL;
         break;
     case OP_PEEK_READY:
         /* don't allow trailing garbage */
         if (c->cmd_len != CMD_PEEK_READY_LEN + 2) {
             return reply_msg(c, MSG_BAD_FORMAT);
         }
-        ++tasque_srv.op_cnt[type];
-        if (!c->use->ready_jobs.len) {
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+        if (!tube_ready_cnt(c->use)) {
             return reply_msg(c, MSG_NOTFOUND);
         }
 
-        j = job_copy(c->use->ready_jobs.data[0]);
-
-        if (!j) {
-            return reply_msg(c, MSG_OUT_OF_MEMORY);
-        }
-
-        reply_job(c, j, MSG_FOUND);
+        reply_job_msg(c, tube_ready_top(c->use, NULL), MSG_FOUND);
         break;
     case OP_PEEK_DELAYED:
         /* don't allow trailing garbage */
         if (c->cmd_len != CMD_PEEK_DELAYED_LEN + 2) {
             return reply_msg(c, MSG_BAD_FORMAT);
         }
-        ++tasque_srv.op_cnt[type];
+        srv_stat_inc(tasque_srv.op_cnt[type]);
         if (!c->use->delay_jobs.len) {
             return reply_msg(c, MSG_NOTFOUND);
         }
 
-        j = job_copy(c->use->delay_jobs.data[0]);
-        if (!j) {
-            return reply_msg(c, MSG_OUT_OF_MEMORY);
-        }
-        reply_job(c, j, MSG_FOUND);
+        reply_job_msg(c, heap_get(&c->use->delay_jobs, 0), MSG_FOUND);
         break;
     case OP_PEEK_BURIED:
         /* don't allow trailing garbage */
         if (c->cmd_len != CMD_PEEK_BURIED_LEN + 2) {
             return reply_msg(c, MSG_BAD_FORMAT);
         }
-        ++tasque_srv.op_cnt[type];
+        srv_stat_inc(tasque_srv.op_cnt[type]);
 
         if (!tube_has_buried_job(c->use)) {
             return reply_msg(c, MSG_NOTFOUND);
         } else {
-            dlist_node *head = dlist_first(&c->reserved_jobs);
-            j = job_copy(dlist_node_value(head));
-            if (!j) {
-                return reply_msg(c, MSG_OUT_OF_MEMORY);
-            }
-            reply_job(c, j, MSG_FOUND);
+            j = dlink_entry(c->use->buried_jobs.next, job_t, link);
+            reply_job_msg(c, j, MSG_FOUND);
         }
         break;
     case OP_PEEKJOB:
-        id = strtoul(c->cmd + CMD_PEEKJOB_LEN, &end_buf, 10);
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
-        ++tasque_srv.op_cnt[type];
+        if (read_id(&id, c->cmd + CMD_PEEKJOB_LEN, &end_buf) != 0) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
 
-        /* So, peek is annoying, because some other connection might
-         * free the job while we are still trying to write it out.
-         * So we copy it and then free the copy when it's done sending. */
+        /* Some other connection might free the job while we are
+         * still writing it out, the reply holds a reference. */
         j = job_find(id);
         if (!j) {
             return reply_msg(c, MSG_NOTFOUND);
         }
-
-        j = job_copy(j);
-
-        if (!j) {
-            return reply_msg(c, MSG_OUT_OF_MEMORY);
-        }
-
-        reply_job(c, j, MSG_FOUND);
+        reply_job_msg(c, j, MSG_FOUND);
         break;
-    case OP_RESERVE_TIMEOUT:
-        timeout = strtol(c->cmd + CMD_RESERVE_TIMEOUT_LEN, &end_buf, 10);
-        if (errno) {
+    case OP_RESERVE_BATCH:
+        if (read_count(&count, RESERVE_BATCH_MAX,
+                    c->cmd + CMD_RESERVE_BATCH_LEN, &end_buf) != 0) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        if (end_buf[0] != '\0' &&
+                read_timeout(&timeout, end_buf, NULL) != 0) {
             return reply_msg(c, MSG_BAD_FORMAT);
         }
         /* fall through */
+    case OP_RESERVE_TIMEOUT:
+        if (type == OP_RESERVE_TIMEOUT) {
+            if (read_timeout(&timeout, c->cmd + CMD_RESERVE_TIMEOUT_LEN,
+                        &end_buf) != 0) {
+                return reply_msg(c, MSG_BAD_FORMAT);
+            }
+        }
+        /* fall through */
     case OP_RESERVE:
         /* don't allow trailing garbage */
         if (type == OP_RESERVE && c->cmd_len != CMD_RESERVE_LEN + 2) {
             return reply_msg(c, MSG_BAD_FORMAT);
         }
 
-        ++tasque_srv.op_cnt[type];
+        srv_stat_inc(tasque_srv.op_cnt[type]);
         conn_set_worker(c);
+        c->reserve_want = type == OP_RESERVE_BATCH ? count : 1;
 
         if (conn_deadline_soon(c) && !conn_has_ready_job(c)) {
             return reply_msg(c, MSG_DEADLINE_SOON);
@@ -1448,380 +2412,861 @@ static void do_cmd(conn_t *c) {
         process_queue();
         break;
     case OP_DELETE:
-        id = strtoul(c->cmd + CMD_DELETE_LEN, &end_buf, 10);
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
-        ++tasque_srv.op_cnt[type];
+        if (read_id(&id, c->cmd + CMD_DELETE_LEN, &end_buf) != 0) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+
+        if (delete_job(c, id) != 0) {
+            return reply_msg(c, MSG_NOTFOUND);
+        }
+        reply_msg(c, MSG_DELETED);
+        break;
+    case OP_RELEASE:
+        ret = read_id(&id, c->cmd + CMD_RELEASE_LEN, &pri_buf);
+        if (ret) return reply_msg(c, MSG_BAD_FORMAT);
+
+        ret = read_pri(&pri, pri_buf, &delay_buf);
+        if (ret) return reply_msg(c, MSG_BAD_FORMAT);
+
+        ret = read_delay(&delay, delay_buf, NULL);
+        if (ret != 0) return reply_msg(c, MSG_BAD_FORMAT);
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+
+        ret = release_job(c, id, pri, delay);
+        if (ret < 0) {
+            return reply_msg(c, MSG_NOTFOUND);
+        }
+        process_queue();
+        if (ret > 0) {
+            return reply_msg(c, MSG_BURIED);
+        }
+        reply_msg(c, MSG_RELEASED);
+        break;
+    case OP_DELETE_BATCH:
+    case OP_TOUCH_BATCH:
+    case OP_RELEASE_BATCH:
+        if (read_count(&count, ID_BATCH_MAX,
+                    c->cmd + strlen(op_names[type]), NULL) != 0) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        c->batch_status = malloc(count);
+        if (!c->batch_status) {
+            return reply_msg(c, MSG_OUT_OF_MEMORY);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
 
+        /* no reply until the ids are in, see id_batch_commit() */
+        c->batch_op = type;
+        c->batch_cnt = count;
+        c->batch_left = count;
+        break;
+    case OP_BURY:
+        ret = read_id(&id, c->cmd + CMD_BURY_LEN, &pri_buf);
+        if (ret) return reply_msg(c, MSG_BAD_FORMAT);
+
+        ret = read_pri(&pri, pri_buf, NULL);
+        if (ret != 0) return reply_msg(c, MSG_BAD_FORMAT);
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+        if (bury_reserved_job(c, id, pri) != 0) {
+            return reply_msg(c, MSG_NOTFOUND);
+        }
+        reply_msg(c, MSG_BURIED);
+        break;
+    case OP_KICK:
+        if (read_pri(&i, c->cmd + CMD_KICK_LEN, &end_buf) != 0) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+
+        i = kick_jobs(c->use, i);
+        reply_num_msg(c, MSG_KICKED, i);
+        break;
+    case OP_TOUCH:
+        if (read_id(&id, c->cmd + CMD_TOUCH_LEN, &end_buf) != 0) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+        if (touch_job(c, job_find(id)) < 0) {
+            return reply_msg(c, MSG_NOTFOUND);
+        }
+        reply_msg(c, MSG_TOUCHED);
+        break;
+    case OP_STATS:
+        /* don't allow trailing garbage */
+        if (c->cmd_len != CMD_STATS_LEN + 2) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+        do_stats(c, fmt_stats, NULL);
+        break;
+    case OP_JOBSTATS:
+        if (read_id(&id, c->cmd + CMD_JOBSTATS_LEN, &end_buf) != 0) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
         j = job_find(id);
-        if (!j) {
+        if (!j) return reply_msg(c, MSG_NOTFOUND);
+        if (!j->tube) return reply_msg(c, MSG_INTERNAL_ERROR);
+        do_stats(c, fmt_job_stats, (void *)j);
+        break;
+    case OP_STATS_TUBE:
+        name = c->cmd + CMD_STATS_TUBE_LEN;
+        if (!name_is_ok(name, c->cmd_len - 2 - CMD_STATS_TUBE_LEN,
+                    MAX_TUBE_NAME_LEN - 1)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+        t = tube_find(name);
+        if (!t) return reply_msg(c, MSG_NOTFOUND);
+        do_stats(c, fmt_stats_tube, (void *)t);
+        break;
+    case OP_LIST_TUBES:
+        /* don't allow trailing garbage */
+        if (c->cmd_len != CMD_LIST_TUBES_LEN + 2) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+        do_list_tubes(c, &tasque_srv.tubes);
+        break;
+    case OP_LIST_TUBE_USED:
+        /* don't allow trailing garbage */
+        if (c->cmd_len != CMD_LIST_TUBE_USED_LEN + 2) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+        reply_line(c, "USING %s\r\n", c->use->name);
+        break;
+    case OP_LIST_TUBES_WATCHED:
+        /* don't allow trailing garbage */
+        if (c->cmd_len != CMD_LIST_TUBES_WATCHED_LEN + 2) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+        do_list_tubes(c, &c->watch);
+        break;
+    case OP_USE:
+        name = c->cmd + CMD_USE_LEN;
+        if (!name_is_ok(name, c->cmd_len - 2 - CMD_USE_LEN,
+                    MAX_TUBE_NAME_LEN - 1)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+        if (use_tube(c, name) != 0) {
+            return reply_msg(c, MSG_OUT_OF_MEMORY);
+        }
+        reply_line(c, "USING %s\r\n", c->use->name);
+        break;
+    case OP_WATCH:
+        name = c->cmd + CMD_WATCH_LEN;
+        if (!name_is_ok(name, c->cmd_len - 2 - CMD_WATCH_LEN,
+                    MAX_TUBE_NAME_LEN - 1)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+        if (watch_tube(c, name) != 0) {
+            return reply_msg(c, MSG_OUT_OF_MEMORY);
+        }
+        reply_line(c, "WATCHING %d\r\n", c->watch.used);
+        break;
+    case OP_IGNORE:
+        name = c->cmd + CMD_IGNORE_LEN;
+        if (!name_is_ok(name, c->cmd_len - 2 - CMD_IGNORE_LEN,
+                    MAX_TUBE_NAME_LEN - 1)) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+        if (ignore_tube(c, name) != 0) {
+            return reply_msg(c, MSG_NOT_IGNORED);
+        }
+        reply_line(c, "WATCHING %d\r\n", c->watch.used);
+        break;
+    case OP_QUIT:
+        conn_close(c);
+        break;
+    case OP_PAUSE_TUBE:
+        ret = read_tube_name(&name, c->cmd + CMD_PAUSE_TUBE_LEN, 
+                &delay_buf);
+        if (ret < 0) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+        ret = read_delay(&delay, delay_buf, NULL);
+        if (ret < 0) return reply_msg(c, MSG_BAD_FORMAT);
+        *delay_buf = '\0';
+        if ((err = pause_tube(name, delay))) {
+            return reply(c, err, strlen(err));
+        }
+        reply_line(c, "PAUSED\r\n");
+        break;
+    case OP_CHECKPOINT:
+        /* don't allow trailing garbage */
+        if (c->cmd_len != CMD_CHECKPOINT_LEN + 2) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+        if (binlog_checkpoint() != 0) return reply_msg(c, MSG_NOTFOUND);
+        reply_msg(c, MSG_CHECKPOINTING);
+        break;
+    case OP_REPLICATE:
+        /* don't allow trailing garbage */
+        if (c->cmd_len != CMD_REPLICATE_LEN + 2) {
+            return reply_msg(c, MSG_BAD_FORMAT);
+        }
+        srv_stat_inc(tasque_srv.op_cnt[type]);
+
+        /* the follower gets what is logged up to now with the jobs,
+         * and what is logged from now on as the log */
+        cron_at(binlog_flush());
+        if (replica_attach(c->sock.fd, c->remote_ip, c->remote_port)) {
             return reply_msg(c, MSG_NOTFOUND);
         }
+        conn_close(c);
+        break;
+    default:
+        return reply_msg(c, MSG_UNKNOWN_COMMAND);
+    }
+}
 
-        if ((ret = remove_reserved_job(c, j)) != 0) {
-            if ((ret = remove_ready_job(j)) != 0) {
-                if ((remove_buried_job(j->tube)) == NULL) {
-                    ret = remove_delayed_job(j);
-                } else {
-                    ret = 0;
-                }
-            }
+/* Return the length of the binary frame at the start of c->cmd, or 0
+ * if it isn't complete yet. Only a tube name is read along with the
+ * header, any other payload is read or skipped by do_bin_cmd(). */
+static int scan_bin(conn_t *c) {
+    uint32_t len;
+    int op;
+
+    if (c->cmd_read < BIN_HDR_SIZE) return 0;
+
+    op = (unsigned char)c->cmd[1];
+    memcpy(&len, c->cmd + 4, sizeof(len));
+    len = le32toh(len);
+    if (len > BIN_NAME_MAX || (op != OP_USE && op != OP_WATCH &&
+                op != OP_IGNORE && op != OP_STATS_TUBE &&
+                op != OP_PAUSE_TUBE)) {
+        return BIN_HDR_SIZE;
+    }
+    if (c->cmd_read < BIN_HDR_SIZE + len) return 0;
+    return BIN_HDR_SIZE + len;
+}
+
+/* Return the length of the command at the start of c->cmd, or 0 if
+ * it isn't complete yet. The first byte a connection sends tells
+ * the protocol it speaks. */
+static int scan_cmd(conn_t *c) {
+    if (c->proto == PROTO_UNKNOWN) {
+        c->proto = (unsigned char)c->cmd[0] == BIN_REQ_MAGIC ?
+            PROTO_BINARY : PROTO_TEXT;
+    }
+    if (c->proto == PROTO_BINARY) {
+        return scan_bin(c);
+    }
+    return scan_eol(c->cmd, c->cmd_read);
+}
+
+/* Handle the binary request in c->cmd, see binproto.h. It maps onto
+ * the same operations as do_cmd(), the replies of which are turned
+ * into statuses by reply(). */
+static void do_bin_cmd(conn_t *c) {
+    bin_hdr_t h;
+    char name[MAX_TUBE_NAME_LEN];
+    int name_len = c->cmd_len - BIN_HDR_SIZE;
+    bin_hdr_t r = {};
+    job_t *j;
+    tube_t *t;
+    char *err;
+    int ret;
+
+    memcpy(&h, c->cmd, BIN_HDR_SIZE);
+    h.len = le32toh(h.len);
+    h.id = le64toh(h.id);
+    h.pri = le32toh(h.pri);
+    h.delay = le32toh(h.delay);
+    h.ttr = le32toh(h.ttr);
+    h.count = le32toh(h.count);
+    c->bin_op = h.op;
+
+    if (h.magic != BIN_REQ_MAGIC) {
+        /* the framing is lost */
+        return conn_close(c);
+    }
+    if (tasque_srv.verbose >= 2) {
+        printf("<%s:%d binary command %s\n", c->remote_ip, c->remote_port,
+                op_names[h.op < TOTAL_OPS ? h.op : OP_UNKNOWN]);
+    }
+
+    /* a payload the request doesn't take */
+    if (h.op != OP_PUT && h.len != name_len) {
+        if (h.op == OP_UNKNOWN || h.op > BIN_OP_PAUSE_TUBE) {
+            return skip_and_reply_msg(c, h.len, MSG_UNKNOWN_COMMAND);
         }
+        return skip_and_reply_msg(c, h.len, MSG_BAD_FORMAT);
+    }
 
-        if (ret != 0) {
+    if (tasque_srv.leader_host && (h.op == OP_PUT || op_is_write(h.op))) {
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
+        return skip_and_reply_msg(c, h.op == OP_PUT ? h.len : 0,
+                MSG_READ_ONLY);
+    }
+
+    memcpy(name, c->cmd + BIN_HDR_SIZE, name_len);
+    name[name_len] = '\0';
+    if (name_len && !name_is_ok(name, name_len, BIN_NAME_MAX)) {
+        return reply_msg(c, MSG_BAD_FORMAT);
+    }
+
+    switch (h.op) {
+    case OP_PUT:
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
+        if (h.len > tasque_srv.job_data_size_limit) {
+            return skip_and_reply_msg(c, h.len, MSG_JOB_TOO_BIG);
+        }
+        put_job(c, h.pri, (int64_t)h.delay * 1000000,
+                (int64_t)h.ttr * 1000000, h.len);
+        break;
+    case OP_RESERVE:
+    case OP_RESERVE_TIMEOUT:
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
+        conn_set_worker(c);
+        c->reserve_want = 1;
+
+        if (conn_deadline_soon(c) && !conn_has_ready_job(c)) {
+            return reply_msg(c, MSG_DEADLINE_SOON);
+        }
+        wait_for_job(c, h.op == OP_RESERVE ? -1 : (int)h.count);
+        process_queue();
+        break;
+    case OP_DELETE:
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
+        if (delete_job(c, h.id) != 0) {
             return reply_msg(c, MSG_NOTFOUND);
         }
-        ++j->tube->stats.total_delete_cnt;
-        j->rec.state = JOB_INVALID;
-        job_free(j);
-        reply_msg(c, MSG_DELETED);
+        reply_bin(c, BIN_OK, h.id, 0);
         break;
     case OP_RELEASE:
-        id = strtoul(c->cmd + CMD_RELEASE_LEN, &pri_buf, 10);
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
-
-        ret = read_pri(&pri, pri_buf, &delay_buf);
-        if (ret) return reply_msg(c, MSG_BAD_FORMAT);
-
-        ret = read_delay(&delay, delay_buf, NULL);
-        if (ret != 0) return reply_msg(c, MSG_BAD_FORMAT);
-        ++tasque_srv.op_cnt[type];
-
-        j = job_find(id);
-        if (!j) return reply_msg(c, MSG_NOTFOUND);
-        ret = remove_reserved_job(c, j);
-        if (ret != 0) {
-            return reply_msg(c, MSG_NOTFOUND);
-        }
-
-        j->rec.pri = pri;
-        j->rec.delay = delay;
-        ++j->rec.release_cnt;
-        ret = enqueue_job(j, delay);
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
+        ret = release_job(c, h.id, h.pri, (int64_t)h.delay * 1000000);
         if (ret < 0) {
-            bury_job(j);
-            return reply_msg(c, MSG_BURIED);
+            return reply_msg(c, MSG_NOTFOUND);
         }
-        reply_msg(c, MSG_RELEASED);
+        process_queue();
+        reply_bin(c, ret > 0 ? BIN_BURIED : BIN_OK, h.id, 0);
         break;
     case OP_BURY:
-        id = strtoul(c->cmd + CMD_BURY_LEN, &pri_buf, 10);
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
-
-        ret = read_pri(&pri, pri_buf, NULL);
-        if (ret != 0) return reply_msg(c, MSG_BAD_FORMAT);
-        ++tasque_srv.op_cnt[type];
-        j = job_find(id);
-        if (!j) {
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
+        if (bury_reserved_job(c, h.id, h.pri) != 0) {
             return reply_msg(c, MSG_NOTFOUND);
         }
-
-        ret = remove_reserved_job(c, j);
-        if (ret != 0) {
+        reply_bin(c, BIN_OK, h.id, 0);
+        break;
+    case OP_TOUCH:
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
+        if (touch_job(c, job_find(h.id)) < 0) {
             return reply_msg(c, MSG_NOTFOUND);
         }
-        j->rec.pri = pri;
-        ret = bury_job(j);
-        if (ret != 0) return reply_msg(c, MSG_INTERNAL_ERROR);
-        reply_msg(c, MSG_BURIED);
+        reply_bin(c, BIN_OK, h.id, 0);
         break;
     case OP_KICK:
-        count = strtoul(c->cmd + CMD_KICK_LEN, &end_buf, 10);
-        if (end_buf == c->cmd + CMD_KICK_LEN) {
-            return reply_msg(c, MSG_BAD_FORMAT);
-        }
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
-        ++tasque_srv.op_cnt[type];
-
-        i = kick_jobs(c->use, count);
-        reply_line(c, STATE_SENDWORD, "KICKED %u\r\n", i);
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
+        reply_bin(c, BIN_OK, 0, kick_jobs(c->use, h.count));
         break;
-    case OP_TOUCH:
-        id = strtoul(c->cmd + CMD_TOUCH_LEN, &end_buf, 10);
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
-        ++tasque_srv.op_cnt[type];
-        j = job_find(id);
-        if (!j) return reply_msg(c, MSG_NOTFOUND);
-        ret = touch_job(c, j);
-        if (ret < 0) {
+    case OP_PEEKJOB:
+    case OP_PEEK_READY:
+    case OP_PEEK_DELAYED:
+    case OP_PEEK_BURIED:
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
+        if (h.op == OP_PEEKJOB) {
+            j = job_find(h.id);
+        } else if (h.op == OP_PEEK_READY) {
+            j = tube_ready_top(c->use, NULL);
+        } else if (h.op == OP_PEEK_DELAYED) {
+            j = c->use->delay_jobs.len ?
+                heap_get(&c->use->delay_jobs, 0) : NULL;
+        } else {
+            j = tube_has_buried_job(c->use) ?
+                dlink_entry(c->use->buried_jobs.next, job_t, link) : NULL;
+        }
+        if (!j) {
             return reply_msg(c, MSG_NOTFOUND);
         }
-        reply_msg(c, MSG_TOUCHED);
+        reply_job_msg(c, j, MSG_FOUND);
         break;
     case OP_STATS:
-        /* don't allow trailing garbage */
-        if (c->cmd_len != CMD_STATS_LEN + 2) {
-            return reply_msg(c, MSG_BAD_FORMAT);
-        }
-        ++tasque_srv.op_cnt[type];
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
         do_stats(c, fmt_stats, NULL);
         break;
     case OP_JOBSTATS:
-        id = strtoul(c->cmd + CMD_JOBSTATS_LEN, &end_buf, 10);
-        if (errno) return reply_msg(c, MSG_BAD_FORMAT);
-        ++tasque_srv.op_cnt[type];
-        j = job_find(id);
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
+        j = job_find(h.id);
         if (!j) return reply_msg(c, MSG_NOTFOUND);
-        if (!j->tube) return reply_msg(c, MSG_INTERNAL_ERROR);
         do_stats(c, fmt_job_stats, (void *)j);
         break;
-    case OP_STATS_TUBE:
-        name = c->cmd + CMD_STATS_TUBE_LEN;
-        if (!name_is_ok(name, MAX_TUBE_NAME_LEN - 1)) {
-            return reply_msg(c, MSG_BAD_FORMAT);
-        }
-        ++tasque_srv.op_cnt[type];
-        t = tube_find(name);
-        if (!t) return reply_msg(c, MSG_NOTFOUND);
-        do_stats(c, fmt_stats_tube, (void *)t);
-        break;
     case OP_LIST_TUBES:
-        /* don't allow trailing garbage */
-        if (c->cmd_len != CMD_LIST_TUBES_LEN + 2) {
-            return reply_msg(c, MSG_BAD_FORMAT);
-        }
-        ++tasque_srv.op_cnt[type];
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
         do_list_tubes(c, &tasque_srv.tubes);
         break;
-    case OP_LIST_TUBE_USED:
-        /* don't allow trailing garbage */
-        if (c->cmd_len != CMD_LIST_TUBE_USED_LEN + 2) {
-            return reply_msg(c, MSG_BAD_FORMAT);
-        }
-        ++tasque_srv.op_cnt[type];
-        reply_line(c, STATE_SENDWORD, "USING %s\r\n", c->use->name);
-        break;
     case OP_LIST_TUBES_WATCHED:
-        /* don't allow trailing garbage */
-        if (c->cmd_len != CMD_LIST_TUBES_WATCHED_LEN + 2) {
-            return reply_msg(c, MSG_BAD_FORMAT);
-        }
-        ++tasque_srv.op_cnt[type];
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
         do_list_tubes(c, &c->watch);
         break;
     case OP_USE:
-        name = c->cmd + CMD_USE_LEN;
-        if (!name_is_ok(name, MAX_TUBE_NAME_LEN - 1)) {
-            return reply_msg(c, MSG_BAD_FORMAT);
+        if (!name_len) return reply_msg(c, MSG_BAD_FORMAT);
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
+        if (use_tube(c, name) != 0) {
+            return reply_msg(c, MSG_OUT_OF_MEMORY);
         }
-        ++tasque_srv.op_cnt[type];
-        t = tube_find_or_create(name);
-        if (!t) return reply_msg(c, MSG_OUT_OF_MEMORY);
-        tube_iref(t);
-        --c->use->using_cnt;
-        tube_dref(c->use);
-        c->use = t;
-        ++c->use->using_cnt;
-        reply_line(c, STATE_SENDWORD, "USING %s\r\n", c->use->name);
+        /* fall through */
+    case OP_LIST_TUBE_USED:
+        if (h.op == OP_LIST_TUBE_USED) srv_stat_inc(tasque_srv.op_cnt[h.op]);
+        r.status = BIN_OK;
+        r.len = strlen(c->use->name);
+        if (out_bin(c, &r, c->use->name) == 0) reply_done(c);
         break;
     case OP_WATCH:
-        name = c->cmd + CMD_WATCH_LEN;
-        if (!name_is_ok(name, MAX_TUBE_NAME_LEN - 1)) {
-            return reply_msg(c, MSG_BAD_FORMAT);
-        }
-        ++tasque_srv.op_cnt[type];
-        t = tube_find_or_create(name);
-        if (!t) return reply_msg(c, MSG_OUT_OF_MEMORY);
-        if (!set_contains(&c->watch, t)) {
-            /* ref count changed by on_watch() or on_ignore(). */
-            if (set_append(&c->watch, t) < 0) {
-                return reply_msg(c, MSG_OUT_OF_MEMORY);
-            }
+        if (!name_len) return reply_msg(c, MSG_BAD_FORMAT);
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
+        if (watch_tube(c, name) != 0) {
+            return reply_msg(c, MSG_OUT_OF_MEMORY);
         }
-        reply_line(c, STATE_SENDWORD, "WATCHING %d\r\n", c->watch.used);
+        reply_bin(c, BIN_OK, 0, c->watch.used);
         break;
     case OP_IGNORE:
-        name = c->cmd + CMD_IGNORE_LEN;
-        if (!name_is_ok(name, MAX_TUBE_NAME_LEN - 1)) {
-            return reply_msg(c, MSG_BAD_FORMAT);
-        }
-        ++tasque_srv.op_cnt[type];
-        t = NULL;
-        for (i = 0; i < c->watch.used; ++i) {
-            t = c->watch.items[i];
-            if (strncmp(t->name, name, MAX_TUBE_NAME_LEN) == 0) break;
-            t = NULL;
+        if (!name_len) return reply_msg(c, MSG_BAD_FORMAT);
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
+        if (ignore_tube(c, name) != 0) {
+            return reply_msg(c, MSG_NOT_IGNORED);
         }
-
-        if (t && c->watch.used < 2) return reply_msg(c, MSG_NOT_IGNORED);
-        if (t) set_remove(&c->watch, t); /* maybe free t if refcount=0 */
-        reply_line(c, STATE_SENDWORD, "WATCHING %d\r\n", c->watch.used);
+        reply_bin(c, BIN_OK, 0, c->watch.used);
         break;
-    case OP_QUIT:
-        conn_close(c);
-        break;
-    case OP_PAUSE_TUBE:
-        ret = read_tube_name(&name, c->cmd + CMD_PAUSE_TUBE_LEN, 
-                &delay_buf);
-        if (ret < 0) {
-            return reply_msg(c, MSG_BAD_FORMAT);
-        }
-        ++tasque_srv.op_cnt[type];
-        ret = read_delay(&delay, delay_buf, NULL);
-        if (ret < 0) return reply_msg(c, MSG_BAD_FORMAT);
-        *delay_buf = '\0';
+    case OP_STATS_TUBE:
+        if (!name_len) return reply_msg(c, MSG_BAD_FORMAT);
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
         t = tube_find(name);
         if (!t) return reply_msg(c, MSG_NOTFOUND);
-
-        /* always pause for a positive amount of time, to make sure
-         * the waiting clients wake up when the deadline arrives. */
-        if (delay == 0) {
-            delay = 1;
+        do_stats(c, fmt_stats_tube, (void *)t);
+        break;
+    case OP_PAUSE_TUBE:
+        if (!name_len) return reply_msg(c, MSG_BAD_FORMAT);
+        srv_stat_inc(tasque_srv.op_cnt[h.op]);
+        if ((err = pause_tube(name, (int64_t)h.delay * 1000000))) {
+            return reply(c, err, strlen(err));
         }
-        t->deadline_at = ustime() + delay;
-        t->pause = delay;
-        ++t->stats.pause_cnt;
-
-        reply_line(c, STATE_SENDWORD, "PAUSED\r\n");
+        reply_bin(c, BIN_OK, 0, 0);
+        break;
+    case OP_QUIT:
+        conn_close(c);
         break;
     default:
         return reply_msg(c, MSG_UNKNOWN_COMMAND);
     }
 }
 
-static void handle_client(void *arg, int ev) {
-    int r, to_read;
-    job_t *j;
-    conn_t *c = (conn_t *)arg;
-    struct iovec iov[2];
+/* Hold the lock of partition `p' alone, or those of all of them for
+ * PART_ALL, see srv.h. */
+static void conn_lock(int p) {
+    int held = srv_held();
 
-    if (ev == EVENT_HUP) {
-        conn_close(c);
+    if (held == p) return;
+    if (held != PART_NONE) conn_unlock();
+    srv_lock_part(p);
+}
+
+/* Let go of the lock held. A job left for a connection that waits on
+ * other partitions too, see process_queue(), is handed out with the
+ * locks of all of them first. */
+static void conn_unlock() {
+    int held = srv_held();
+
+    if (held == PART_NONE) return;
+    if (held == PART_ALL || !tasque_srv.parts[held].redispatch) {
+        srv_unlock();
         return;
     }
+    srv_unlock();
+    srv_lock();
+    process_queue();
+    srv_unlock();
+}
+
+/* The partition the command in c->cmd works in: the one of the tube
+ * used for a put, of those watched for a reserve, and of the job for
+ * a delete, release, bury or touch. Anything else, a batch, or a job
+ * that isn't there takes the locks of all partitions. */
+static int cmd_part(conn_t *c) {
+    int op;
+    uint64_t id = 0;
+    bin_hdr_t h;
+    char *end;
+
+    if (c->batch_left) return PART_ALL;
+    if (c->proto == PROTO_BINARY) {
+        memcpy(&h, c->cmd, BIN_HDR_SIZE);
+        op = h.op;
+        id = le64toh(h.id);
+    } else {
+        op = proto_which_cmd(c->cmd, c->cmd_len - 2);
+    }
+
+    switch (op) {
+    case OP_PUT:
+        return c->use->part;
+    case OP_RESERVE:
+    case OP_RESERVE_TIMEOUT:
+        return c->part;
+    case OP_DELETE:
+    case OP_RELEASE:
+    case OP_BURY:
+    case OP_TOUCH:
+        /* the line ends in "\r\n", which ends the number */
+        if (c->proto == PROTO_TEXT &&
+                proto_read_num(c->cmd + strlen(op_names[op]), UINT64_MAX,
+                    &id, &end) != 0) {
+            return PART_ALL;
+        }
+        return job_part(id);
+    }
+    return PART_ALL;
+}
+
+/* read() from the client without a lock. Only the thread of the
+ * connection touches its input, and nobody else its output or state
+ * unless it waits for a job, when it doesn't read. */
+static int conn_read(conn_t *c, char *buf, int n) {
+    int held = srv_held(), r, err;
+
+    conn_unlock();
+    r = read(c->sock.fd, buf, n);
+    err = errno;
+    conn_lock(held);
+    errno = err;
+    return r;
+}
+
+/* Run one step of the connection state machine. `bytes' and `cmds'
+ * accumulate the input read and the commands handled, so that the
+ * caller can bound the work done for a single wakeup. Replies are
+ * only queued here, see conn_flush().
+ *
+ * Return CONN_AGAIN if some progress was made and the caller may go
+ * on, or CONN_BLOCKED if the socket would block, too much output is
+ * queued, the connection is waiting for a job, or it has been
+ * closed. */
+static int conn_process(conn_t *c, int *bytes, int *cmds) {
+    int r, to_read;
+    job_t *j;
 
     /* Hehe..., everyone love status machine. */
     switch (c->state) {
     case STATE_WANTCOMMAND:
-        r = read(c->sock.fd, c->cmd + c->cmd_read, 
-                LINE_BUF_SIZE - c->cmd_read);
-        if (r < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                    errno == EINTR) {
-                /* just continue */
-                return;
+        /* let the client read its replies first */
+        if (c->out_bytes >= CONN_OUT_HIGH) {
+            c->stalled = 1;
+            return CONN_BLOCKED;
+        }
+
+        /* a pipelined command may already be in the buffer */
+        if (c->cmd_read) {
+            c->cmd_len = scan_cmd(c);
+        }
+
+        if (!c->cmd_len) {
+            r = conn_read(c, c->cmd + c->cmd_read,
+                    (c->proto == PROTO_BINARY ? CMD_BUF_SIZE :
+                     LINE_BUF_SIZE) - c->cmd_read);
+            if (r < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                        errno == EINTR) {
+                    /* just continue */
+                    return CONN_BLOCKED;
+                }
+                conn_close(c);
+                return CONN_BLOCKED;
+            } else if (r == 0) {
+                conn_close(c);   /* client close connection */
+                return CONN_BLOCKED;
             }
-            conn_close(c);
-            return;
-        } else if (r == 0) {
-            return conn_close(c);   /* client close connection */
-        }
 
-        c->cmd_read += r; /* we got some bytes */
-        c->cmd_len = scan_eol(c->cmd, c->cmd_read);
+            *bytes += r;
+            c->cmd_read += r; /* we got some bytes */
+            c->cmd_len = scan_cmd(c);
+        }
 
         /* when c->cmd_len > 0, we have a complete command */
         if (c->cmd_len) {
-            do_cmd(c);
+            conn_lock(cmd_part(c));
+            /* the jobs of a batch count as one command, the input
+             * budget still applies */
+            if (c->batch_left && c->batch_op == OP_PUT_BATCH) {
+                do_batch_line(c);
+            } else if (c->batch_left) {
+                do_id_line(c);
+            } else if (c->proto == PROTO_BINARY) {
+                ++*cmds;
+                do_bin_cmd(c);
+            } else {
+                ++*cmds;
+                do_cmd(c);
+            }
             fill_extra_data(c);
-            return;
+            return CONN_AGAIN;
         }
-        /* command line too long */
-        if (c->cmd_read == LINE_BUF_SIZE) {
+        /* command line too long, a binary frame always fits */
+        if (c->proto == PROTO_TEXT && c->cmd_read == LINE_BUF_SIZE) {
             c->cmd_read = 0;    /* discard the input so far */
-            return reply_msg(c, MSG_BAD_FORMAT);
+            if (c->batch_left) {
+                batch_abort(c, MSG_BAD_FORMAT);
+            } else {
+                reply_msg(c, MSG_BAD_FORMAT);
+            }
         }
 
         /* otherwise we have an incomplete line, so just keep waiting */
-        break;
+        return CONN_AGAIN;
     case STATE_WANTDATA:
         j = c->in_job;
-        r = read(c->sock.fd, j->body + c->in_job_read, 
-                j->rec.body_size - c->in_job_read);
+        r = conn_read(c, j->body + c->in_job_read,
+                in_job_want(c) - c->in_job_read);
         if (r == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK ||
                     errno == EINTR) {
                 /* just continue */
-                return;
+                return CONN_BLOCKED;
             }
-            return conn_close(c);
+            conn_close(c);
+            return CONN_BLOCKED;
         } else if (r == 0) { /* client hang up the connection */
-            return conn_close(c);
+            conn_close(c);
+            return CONN_BLOCKED;
         }
+        *bytes += r;
         c->in_job_read += r; /* we got some bytes */
 
-        if (c->in_job_read == j->rec.body_size) {
+        if (c->in_job_read == in_job_want(c)) {
             /* we've got a complete job content */
-            return enqueue_incoming_job(c);
+            conn_lock(c->batch_left ? PART_ALL : j->tube->part);
+            enqueue_incoming_job(c);
         }
         
         /* continue waiting for imcomplete job data */
-        break;
+        return CONN_AGAIN;
     case STATE_BITBUCKET:
         /* Invert the meaning of 'in_job_read' while throwing
          * away data -- it counts the bytes that remain to 
          * be thrown away. */
         to_read = min(c->in_job_read, BUCKET_BUF_SIZE);
-        r = read(c->sock.fd, bucket, to_read);
+        r = conn_read(c, bucket, to_read);
         if (r < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK ||
                     errno == EINTR) {
                 /* just continue */
-                return;
+                return CONN_BLOCKED;
             }
+            conn_close(c);
+            return CONN_BLOCKED;
         } else if (r == 0) {
-            return conn_close(c); /* client hung up the connection */
+            conn_close(c); /* client hung up the connection */
+            return CONN_BLOCKED;
         }
+        *bytes += r;
         c->in_job_read -= r; /* we got some bytes */
 
         if (c->in_job_read == 0) {
-            return reply(c, c->reply, c->reply_len, STATE_SENDWORD);
-        }
-        break;
-    case STATE_SENDWORD:
-        r = write(c->sock.fd, c->reply + c->reply_sent, 
-                c->reply_len - c->reply_sent);
-        if (r < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                    errno == EINTR) {
-                /* just continue */
-                return;
+            if (c->batch_left) {
+                conn_lock(PART_ALL);
+                batch_next(c);
+            } else {
+                reply(c, c->reply, c->reply_len);
             }
-        } else if (r == 0) { /* the client hang up the connection */
-            conn_close(c);
-            return;
-        }
-        c->reply_sent += r; /* we sent some bytes */
-
-        if (c->reply_sent == c->reply_len) {
-            return conn_reset(c);
         }
-        /* otherwise we sent an incomplete reply, so just continue */
+        return CONN_AGAIN;
+    case STATE_WAIT:
+        /* do nothing */
         break;
-    case STATE_SENDJOB:
-        j = c->out_job;
-        iov[0].iov_base = (void *)(c->reply + c->reply_sent);
-        iov[0].iov_len = c->reply_len - c->reply_sent;
-        iov[1].iov_base = j->body + c->out_job_sent;
-        iov[1].iov_len = j->rec.body_size - c->out_job_sent;
-
-        r = writev(c->sock.fd, iov, 2);
-        if (r < 0) {
-           if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                    errno == EINTR) {
-                /* just continue */
-                return;
-           }
-        } else if (r == 0) {
-            return conn_close(c);
-        }
+    }
+    return CONN_BLOCKED;
+}
+
+/* Process as much input as is available, within the budget. Without
+ * it, pipelining clients would be served one command per wakeup. */
+static void conn_serve(conn_t *c) {
+    int r, bytes = 0, cmds = 0;
+
+    c->busy = 1;
+    do {
+        r = conn_process(c, &bytes, &cmds);
+    } while (r == CONN_AGAIN && !c->closing &&
+            bytes < CONN_BYTE_BUDGET && cmds < CONN_CMD_BUDGET);
+    c->busy = 0;
+
+    if (r == CONN_AGAIN && !c->closing) {
+        /* budget exhausted, come back in the next round */
+        c->stalled = 1;
+        conn_pend(c);
+    }
+}
+
+/* Register the event the connection is waiting for: writability if
+ * output is blocked, only hang-ups while waiting for a job, so that
+ * pipelined input doesn't wake us up in vain, and input otherwise. */
+static void conn_update_event(conn_t *c) {
+    int ev;
+
+    if (c->out_bytes) {
+        ev = EVENT_WR;
+    } else if (c->state == STATE_WAIT) {
+        ev = EVENT_HUP;
+    } else {
+        ev = EVENT_RD;
+    }
 
-        /* update the sent values */
-        c->reply_sent += r;
-        if (c->reply_sent >= c->reply_len) {
-            c->out_job_sent += c->reply_sent - c->reply_len;
-            c->reply_sent = c->reply_len;
+    if (ev == c->ev) return;
+    if (event_regis(&c->reactor->evt, &c->sock, ev) != 0) {
+        fprintf(stderr, "event regis failed\n");
+        c->closing = 1;
+        return;
+    }
+    c->ev = ev;
+}
+
+/* Close `c' if it is to be and nothing is left to write, otherwise
+ * wait for the next event unless queued for flushing. */
+static void conn_settle(conn_t *c) {
+    if (!c->closing && !c->flush_pending) {
+        conn_update_event(c);
+    }
+    if (c->closing && !c->flush_pending) {
+        conn_lock(PART_ALL);
+        conn_close(c);
+    }
+}
+
+/* Write out the queued output with a single writev(), without a lock
+ * unless the connection waits for a job: then a job may be handed to
+ * it, and its reply added, at any time.
+ * Return 0 if all of it was written, CONN_AGAIN if the iovec limit
+ * left some behind, or CONN_BLOCKED if the socket would block or
+ * failed, in which case the connection is marked for closing. */
+static int conn_write(conn_t *c) {
+    struct iovec iov[CONN_IOV_MAX];
+    outseg_t *seg;
+    int i, n, r, left, err, total = 0;
+    int unlocked = c->state != STATE_WAIT, held = srv_held();
+
+    for (i = c->oseg_head, n = 0; i < c->oseg_len && n < CONN_IOV_MAX;
+            ++i, ++n) {
+        seg = &c->oseg[i];
+        iov[n].iov_base = (seg->job ? seg->job->body : c->obuf) + seg->off;
+        iov[n].iov_len = seg->len;
+        total += seg->len;
+    }
+    iov[0].iov_base = (char *)iov[0].iov_base + c->oseg_sent;
+    iov[0].iov_len -= c->oseg_sent;
+    total -= c->oseg_sent;
+
+    if (unlocked) conn_unlock();
+    r = writev(c->sock.fd, iov, n);
+    err = errno;
+    if (unlocked) conn_lock(held);
+    errno = err;
+    if (r < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return CONN_BLOCKED;
+        }
+        c->closing = 1;
+        return CONN_BLOCKED;
+    } else if (r == 0) {
+        c->closing = 1;
+        return CONN_BLOCKED;
+    }
+
+    c->out_bytes -= r;
+    total -= r;
+    while (r > 0) {
+        seg = &c->oseg[c->oseg_head];
+        left = seg->len - c->oseg_sent;
+        if (r < left) {
+            c->oseg_sent += r;
+            break;
         }
+        r -= left;
+        if (seg->job) job_dref(seg->job);
+        ++c->oseg_head;
+        c->oseg_sent = 0;
+    }
+
+    if (c->oseg_head == c->oseg_len) {
+        out_clear(c);
+        return 0;
+    }
+    return total ? CONN_BLOCKED : CONN_AGAIN;
+}
 
-        /* are we done? */
-        if (c->out_job_sent == j->rec.body_size) {
-            return conn_reset(c);
+/* Write out the output of a connection in the flush queue, then go
+ * on with the input that was left when it stalled. */
+static void conn_flush(conn_t *c) {
+    int r = 0;
+
+    if (!c->closing && c->out_bytes) {
+        /* what the replies tell of is logged first */
+        cron_at(binlog_flush());
+        r = conn_write(c);
+        if (r == CONN_AGAIN) {
+            conn_pend(c);   /* more than one writev() worth */
         }
-        /* otherwise we sent incomplete data, so just keep waiting */
-        break;
-    case STATE_WAIT:
-        /* do nothing */
-        break;
     }
+
+    if (!c->closing && !c->out_bytes && c->stalled &&
+            c->state != STATE_WAIT) {
+        c->stalled = 0;
+        conn_serve(c);
+    }
+    conn_settle(c);
+}
+
+/* Called by each reactor before it sleeps. Connections queued while
+ * flushing are handled in the next round, which doesn't sleep. Each
+ * is flushed with the lock of its partition, which those that queue
+ * it while it waits for a job hold. */
+void conn_flush_all(void *arg, int ev) {
+    reactor_t *r = (reactor_t *)arg;
+    conn_t *c, *next;
+
+    /* others wake us up after queueing */
+    if (!__atomic_load_n(&r->flushq, __ATOMIC_ACQUIRE)) return;
+
+    c = __atomic_exchange_n(&r->flushq, NULL, __ATOMIC_ACQUIRE);
+    for (; c; c = next) {
+        conn_lock(c->part);
+        next = c->flush_next;
+        c->flush_next = NULL;
+        c->flush_pending = 0;
+        conn_flush(c);
+    }
+    conn_unlock();
+}
+
+static void handle_client(void *arg, int ev) {
+    conn_t *c = (conn_t *)arg;
+
+    if (ev == EVENT_HUP) {
+        srv_lock();
+        conn_close(c);
+        srv_unlock();
+        return;
+    }
+
+    conn_lock(c->part);
+
+    /* blocked output may go on now */
+    if (c->out_bytes) {
+        conn_pend(c);
+    }
+
+    /* a level-triggered EVENT_WR only means the output is blocked */
+    if (c->sock.edge || ev != EVENT_WR) {
+        conn_serve(c);
+    }
+    conn_settle(c);
+    conn_unlock();
 }
 
 void conn_accept(void *arg, int ev) {
@@ -1831,18 +3276,14 @@ void conn_accept(void *arg, int ev) {
     conn_t *c;
     int ret;
 
-    evtent_t *sock = (evtent_t *)arg;
-    if ((cli_fd = tcp_accept(sock->fd, remote_ip, &remote_port)) < 0) {
+    reactor_t *r = (reactor_t *)arg;
+    if ((cli_fd = tcp_accept(r->sock.fd, remote_ip, &remote_port)) < 0) {
         if (errno != EAGAIN && errno != EWOULDBLOCK) {
             fprintf(stderr, "accept failed:%s\n", strerror(errno));
         }
         return;
     }
 
-    if (tasque_srv.verbose) {
-        printf("accept connection %s:%d\n", remote_ip, remote_port);
-    }
-
     if (net_nonblock(cli_fd) < 0) {
         fprintf(stderr, "net_nonblock failed:%s\n", strerror(errno));
         close(cli_fd);
@@ -1852,6 +3293,17 @@ void conn_accept(void *arg, int ev) {
         return;
     }
 
+    /* Replies are gathered into one writev() per loop iteration
+     * already. Nagle would only hold back the one after it, until
+     * the client acks, when a pipeline needs more than one round. */
+    net_nodelay(cli_fd);
+
+    srv_lock();
+    if (tasque_srv.verbose) {
+        printf("accept connection %s:%d on reactor %d\n",
+                remote_ip, remote_port, r->id);
+    }
+
     c = conn_create(cli_fd, STATE_WANTCOMMAND, 
             tasque_srv.default_tube, tasque_srv.default_tube);
     if (!c) {
@@ -1860,6 +3312,7 @@ void conn_accept(void *arg, int ev) {
         if (tasque_srv.verbose) {
             printf("close connection %s:%d\n", remote_ip, remote_port);
         }
+        srv_unlock();
         return;
     }
 
@@ -1870,14 +3323,125 @@ void conn_accept(void *arg, int ev) {
     c->sock.f = (handle_fn)handle_client;
     c->sock.fd = cli_fd;
     c->sock.added = 0;
+    c->sock.edge = tasque_srv.edge_triggered &&
+        r->evt.backend == EVENT_BACKEND_EPOLL;
+    c->reactor = r;
 
-    ret = event_regis(&tasque_srv.evt, &c->sock, EVENT_RD);
+    ret = event_regis(&r->evt, &c->sock, EVENT_RD);
     if (ret < 0) {
         fprintf(stderr, "event_regis failed\n");
         conn_free(c);
-        if (tasque_srv.verbose) {
-            printf("close connection %s:%d\n", remote_ip, remote_port);
+    } else {
+        c->ev = EVENT_RD;
+    }
+    srv_unlock();
+}
+
+#ifdef CONN_TEST_MAIN
+#include <assert.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+/* A server of its own on the loopback, sent frames and put lines that
+ * announce more bytes than an int counts. They are thrown away while
+ * the server goes on serving. Lines with a NUL in them are turned
+ * down. Link with the objects but main.o. */
+
+static void *test_serve(void *arg) {
+    srv_serve();
+    return NULL;
+}
+
+static int test_connect(int port) {
+    struct sockaddr_in sa;
+    int fd, i;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i = 0; i < 100; ++i) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        assert(fd >= 0);
+        if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+            return fd;
         }
-        return;
+        close(fd);
+        usleep(10000);
     }
+    assert(!"connect");
+    return -1;
+}
+
+static void test_send(int fd, const void *p, size_t n) {
+    assert(write(fd, p, n) == (ssize_t)n);
+}
+
+int main(int argc, char **argv) {
+    static const char *lines[] = {
+        "put 0 0 10 4294967295\r\nhello",
+        "put-batch 1\r\n0 0 10 4294967295\r\nhello",
+    };
+    static const char nul_lines[][32] = {
+        "peek 1\0garbage\r\n",
+        "delete-batch 1\r\n1\0garbage\r\n",
+    };
+    static const int nul_lens[] = { 16, 27 };
+    static const char *nul_replies[] = {
+        "BAD_FORMAT\r\n",
+        "DELETED_BATCH 0 F\r\n",
+    };
+    int port = 20000 + getpid() % 10000, fds[4], fd, i, n;
+    pthread_t thread;
+    char buf[32];
+    bin_hdr_t h;
+
+    srv_init();
+    tasque_srv.port = port;
+    free(tasque_srv.host);
+    tasque_srv.host = strdup("127.0.0.1");
+    assert(pthread_create(&thread, NULL, test_serve, NULL) == 0);
+
+    /* a binary put too big to take, and an op there is none of */
+    memset(&h, 0, sizeof(h));
+    h.magic = BIN_REQ_MAGIC;
+    h.op = BIN_OP_PUT;
+    h.len = htole32(0x80000005);
+    fds[0] = test_connect(port);
+    test_send(fds[0], &h, BIN_HDR_SIZE);
+    test_send(fds[0], "hello", 5);
+
+    h.op = 200;
+    h.len = htole32(0xffffffff);
+    fds[1] = test_connect(port);
+    test_send(fds[1], &h, BIN_HDR_SIZE);
+    test_send(fds[1], "hello", 5);
+
+    for (i = 0; i < 2; ++i) {
+        fds[2 + i] = test_connect(port);
+        test_send(fds[2 + i], lines[i], strlen(lines[i]));
+    }
+    usleep(100000);
+
+    /* nothing is answered before all of it is read */
+    for (i = 0; i < 4; ++i) {
+        assert(recv(fds[i], buf, sizeof(buf), MSG_DONTWAIT) < 0 &&
+                errno == EAGAIN);
+    }
+    fd = test_connect(port);
+    test_send(fd, "stats\r\n", 7);
+    assert(read(fd, buf, 3) == 3 && memcmp(buf, "OK ", 3) == 0);
+
+    /* a NUL in a line doesn't cut it short, it is a bad line */
+    for (i = 0; i < 2; ++i) {
+        fd = test_connect(port);
+        test_send(fd, nul_lines[i], nul_lens[i]);
+        n = strlen(nul_replies[i]);
+        assert(recv(fd, buf, n, MSG_WAITALL) == n &&
+                memcmp(buf, nul_replies[i], n) == 0);
+    }
+
+    printf("conn test ok\n");
+    exit(0);
 }
+#endif /* CONN_TEST_MAIN */
@@ -5,9 +5,15 @@
 #include "event.h"
 #include "tube.h"
 #include "job.h"
+#include "wheel.h"
+#include "binproto.h"
+#include "proto.h"
 
 #define LINE_BUF_SIZE   208 
 
+/* a command line, or a binary header with a tube name */
+#define CMD_BUF_SIZE    (BIN_HDR_SIZE + BIN_NAME_MAX + 1)
+
 #define DEFAULT_JOB_DATA_SIZE_LIMIT     ((1 << 16) - 1)
 
 /* CONN_TYPE_* are bit masks */
@@ -15,49 +21,87 @@
 #define CONN_TYPE_WORKER    0x2
 #define CONN_TYPE_WAITING   0x4
 
-#define TOTAL_OPS               24
+/* the protocol a connection speaks, told by its first byte */
+#define PROTO_UNKNOWN       0
+#define PROTO_TEXT          1
+#define PROTO_BINARY        2
 
 typedef struct conn_st conn_t;
+struct reactor_st;
+
+/* A piece of queued output: either reply lines in conn_t.obuf or the
+ * body of a job, which is referenced instead of copied. */
+typedef struct outseg_st {
+    job_t       *job;           /* NULL for reply lines */
+    int         off;
+    int         len;
+} outseg_t;
 
 struct conn_st {
     evtent_t    sock;
+    struct reactor_st *reactor; /* the reactor owning this connection */
     char        remote_ip[INET_ADDRSTRLEN];
     int         remote_port;
     char        state;
     char        type;
+    char        proto;          /* PROTO_* */
+    unsigned char bin_op;       /* the binary request being answered */
+    char        busy;           /* inside its own handle_client() */
+    char        closing;        /* conn_close() deferred until not busy */
+    char        stalled;        /* input left unprocessed, resume later */
+    char        flush_pending;  /* linked in the reactor's flush queue */
+    conn_t      *flush_next;
     conn_t      *next;          /* XXX */
     tube_t      *use;
-    int64_t     tickat;         /* time at which to do more work */
-    int         tickpos;        /* position in srv->conns */
-    job_t       *soonest_job;    /* memorization of the soonest job */
-    int         ev;             /* event type: EVENT_RD|WR|HUP */
+    int         part;           /* of the tubes watched, see srv.h */
+    wheel_timer_t timer;        /* when to do more work, in srv->timers */
+    int         ev;             /* registered event: EVENT_RD|WR|HUP */
     int         pending_timeout;    /* seconds */
+    int         reserve_want;   /* jobs the waiting reserve takes */
 
-    char        cmd[LINE_BUF_SIZE]; /* the string is NOT NUL-terminated */
+    char        cmd[CMD_BUF_SIZE];  /* the string is NOT NUL-terminated */
     int         cmd_len;
     int         cmd_read;
 
-    char        *reply;
+    char        *reply;         /* reply deferred by bit-bucket mode */
     int         reply_len;
-    int         reply_sent;
-    char        reply_buf[LINE_BUF_SIZE]; /* the string is NUL-terminated */
+
+    /* Replies wait here until the reactor writes them out, with one
+     * writev() per event loop iteration. */
+    char        *obuf;
+    int         obuf_len;
+    int         obuf_cap;
+    outseg_t    *oseg;
+    int         oseg_len;
+    int         oseg_cap;
+    int         oseg_head;      /* first segment not completely sent */
+    int         oseg_sent;      /* bytes of oseg[oseg_head] sent */
+    int         out_bytes;      /* bytes queued and not sent yet */
 
     /* How many bytes of in_job->body have been read so far. If in_job is
      * NULL while in_job_read is nonzero, we are in bit bucket mode and
      * in_job_read's meaning in inverted -- then it counts the bytes that
-     * remain to be thrown away. */
-    int         in_job_read;
+     * remain to be thrown away, as many as a frame or a put line may
+     * announce. */
+    int64_t     in_job_read;
     job_t       *in_job;    /* a job to be read from the client */
-    job_t       *out_job;
-    int         out_job_sent;
+
+    /* A batch being read. The jobs of a put-batch are only queued,
+     * and given ids, once all of them have arrived. */
+    unsigned char batch_op;     /* the command of the batch */
+    int         batch_left;     /* lines still to be read */
+    char        *batch_err;     /* the first error, the batch fails */
+    dlink       batch_jobs;     /* jobs read so far, of job_t.link */
+    int         batch_cnt;      /* ids in a delete-, touch- or release-
+                                   batch */
+    char        *batch_status;  /* and a status letter for each */
     set_t       watch;
-    dlist       reserved_jobs;
+    heap_t      reserved_jobs;  /* a delay_heap, by deadline_at */
 };
 
-int conn_less(void *conn_a, void *conn_b);
-void conn_record(void *conn, int pos);
 void conn_cron(void *tickarg, int ev);
 void conn_accept(void *sock, int ev);
+void conn_flush_all(void *reactor, int ev);
 void conn_close(conn_t *c);
 void conn_set_producer(conn_t *c);
 void conn_set_worker(conn_t *c);
@@ -65,5 +109,12 @@ job_t *conn_soonest_reserved_job(conn_t *c);
 int conn_deadline_soon(conn_t *c);
 int conn_ready(conn_t *c);
 int64_t conn_tickat(conn_t *c);
+void conn_restore_job(job_t *j);
+void conn_restore_done(void);
+void conn_replica_put(job_t *j);
+void conn_replica_update(job_t *j, const jobrec_t *rec);
+void conn_replica_delete(job_t *j);
+void conn_replica_reset(void);
+void conn_replica_flush(void);
 
 #endif /*  __CONN_H_INCLUDED__ */
@@ -0,0 +1,145 @@
+#ifndef __DHEAP_H_INCLUDED__
+#define __DHEAP_H_INCLUDED__
+
+#include "heap.h"
+
+/* A d-ary heap over the same heap_t, specialized for one element
+ * type at compile time. DHEAP_DEFINE(name, type, KEY, RECORD) defines
+ * name_insert(), name_remove() and name_fix(), which work like their
+ * heap_* counterparts but with KEY(x, key) and RECORD(x, pos) expanded
+ * inline instead of called through h->key and h->record. With four
+ * children a node the heap is half as deep as a binary one, so a sift
+ * moves, and records the position of, half as many elements. The
+ * children of a node are next to each other in the array.
+ *
+ * heap_init(), heap_destroy(), heap_get() and h->len apply as usual,
+ * but a heap filled through name_insert() must only be changed through
+ * the name_* functions.
+ *
+ * To fill a heap with many elements at once, name_push() them in any
+ * order and then call name_heapify(), which orders them in O(n) rather
+ * than the O(n log n) of as many inserts. The heap must not be used
+ * otherwise in between. */
+#define DHEAP_ARITY     4
+
+#define DHEAP_DECLARE(name, type)                                           \
+    int name##_insert(heap_t *h, type *x);                                  \
+    type *name##_remove(heap_t *h, int k);                                  \
+    void name##_fix(heap_t *h, int k);                                      \
+    int name##_push(heap_t *h, type *x);                                    \
+    void name##_heapify(heap_t *h)
+
+#define DHEAP_DEFINE(name, type, KEY, RECORD)                               \
+static void name##_up(heap_t *h, int k, heap_item_t *item) {                \
+    int p;                                                                  \
+                                                                            \
+    while (k > 0) {                                                         \
+        p = (k - 1) / DHEAP_ARITY;                                          \
+        if (!heap_key_less(&item->key, &h->items[p].key)) {                 \
+            break;                                                          \
+        }                                                                   \
+        h->items[k] = h->items[p];                                          \
+        RECORD((type *)h->items[k].data, k);                                \
+        k = p;                                                              \
+    }                                                                       \
+    h->items[k] = *item;                                                    \
+    RECORD((type *)item->data, k);                                          \
+}                                                                           \
+                                                                            \
+static void name##_down(heap_t *h, int k, heap_item_t *item) {              \
+    int c, s, end;                                                          \
+                                                                            \
+    for ( ; ; ) {                                                           \
+        c = k * DHEAP_ARITY + 1;                                            \
+        if (c >= h->len) {                                                  \
+            break;                                                          \
+        }                                                                   \
+                                                                            \
+        /* the smallest child */                                            \
+        end = c + DHEAP_ARITY < h->len ? c + DHEAP_ARITY : h->len;          \
+        for (s = c++; c < end; ++c) {                                       \
+            if (heap_key_less(&h->items[c].key, &h->items[s].key)) {       \
+                s = c;                                                      \
+            }                                                               \
+        }                                                                   \
+                                                                            \
+        if (!heap_key_less(&h->items[s].key, &item->key)) {                 \
+            break;                                                          \
+        }                                                                   \
+        h->items[k] = h->items[s];                                          \
+        RECORD((type *)h->items[k].data, k);                                \
+        k = s;                                                              \
+    }                                                                       \
+    h->items[k] = *item;                                                    \
+    RECORD((type *)item->data, k);                                          \
+}                                                                           \
+                                                                            \
+static void name##_sift(heap_t *h, int k) {                                 \
+    heap_item_t item = h->items[k];                                         \
+                                                                            \
+    if (k > 0 && heap_key_less(&item.key,                                   \
+                &h->items[(k - 1) / DHEAP_ARITY].key)) {                    \
+        name##_up(h, k, &item);                                             \
+    } else {                                                                \
+        name##_down(h, k, &item);                                           \
+    }                                                                       \
+}                                                                           \
+                                                                            \
+int name##_insert(heap_t *h, type *x) {                                     \
+    heap_item_t item;                                                       \
+                                                                            \
+    if (h->len >= h->cap && heap_grow(h) != 0) {                            \
+        return -1;                                                          \
+    }                                                                       \
+    item.data = x;                                                          \
+    KEY(x, &item.key);                                                      \
+    name##_up(h, h->len++, &item);                                          \
+    return 0;                                                               \
+}                                                                           \
+                                                                            \
+type *name##_remove(heap_t *h, int k) {                                     \
+    type *x;                                                                \
+                                                                            \
+    if (k < 0 || k >= h->len) {                                             \
+        return NULL;                                                        \
+    }                                                                       \
+    x = (type *)h->items[k].data;                                           \
+    if (k < --h->len) {                                                     \
+        h->items[k] = h->items[h->len];                                     \
+        name##_sift(h, k);                                                  \
+    }                                                                       \
+    RECORD(x, -1);                                                          \
+    return x;                                                               \
+}                                                                           \
+                                                                            \
+void name##_fix(heap_t *h, int k) {                                         \
+    if (k < 0 || k >= h->len) {                                             \
+        return;                                                             \
+    }                                                                       \
+    KEY((type *)h->items[k].data, &h->items[k].key);                        \
+    name##_sift(h, k);                                                      \
+}                                                                           \
+                                                                            \
+int name##_push(heap_t *h, type *x) {                                       \
+    if (h->len >= h->cap && heap_grow(h) != 0) {                            \
+        return -1;                                                          \
+    }                                                                       \
+    h->items[h->len].data = x;                                              \
+    KEY(x, &h->items[h->len].key);                                          \
+    RECORD(x, h->len);                                                      \
+    ++h->len;                                                               \
+    return 0;                                                               \
+}                                                                           \
+                                                                            \
+void name##_heapify(heap_t *h) {                                            \
+    heap_item_t item;                                                       \
+    int k;                                                                  \
+                                                                            \
+    /* sift down every parent, the last one first */                        \
+    for (k = h->len > 1 ? (h->len - 2) / DHEAP_ARITY : -1; k >= 0; --k) { \
+        item = h->items[k];                                                 \
+        name##_down(h, k, &item);                                           \
+    }                                                                       \
+}
+
+#endif /* __DHEAP_H_INCLUDED__ */
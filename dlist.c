@@ -298,3 +298,31 @@ dlist_node *dlist_index(dlist *dl, int index) {
     }
     return node;
 }
+
+void dlink_init(dlink *h) {
+    h->prev = h;
+    h->next = h;
+}
+
+/* Link `l' at the front of list `h'. */
+void dlink_add_head(dlink *h, dlink *l) {
+    l->prev = h;
+    l->next = h->next;
+    h->next->prev = l;
+    h->next = l;
+}
+
+/* Link `l' at the back of list `h'. */
+void dlink_add_tail(dlink *h, dlink *l) {
+    l->next = h;
+    l->prev = h->prev;
+    h->prev->next = l;
+    h->prev = l;
+}
+
+/* Unlink `l' from whatever list it is on. */
+void dlink_delete(dlink *l) {
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+    dlink_init(l);
+}
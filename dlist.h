@@ -1,6 +1,8 @@
 #ifndef __DLIST_H_INCLUDED__
 #define __DLIST_H_INCLUDED__
 
+#include <stddef.h>
+
 typedef struct dlist_node {
     struct dlist_node *prev;
     struct dlist_node *next;
@@ -57,6 +59,24 @@ dlist_node *dlist_index(dlist *dl, int index);
 void dlist_rewind(dlist *dl, dlist_iter *iter);
 void dlist_rewind_tail(dlist *dl, dlist_iter *iter);
 
+/* An intrusive circular list: the links are embedded in the listed
+ * struct, so linking and unlinking never allocate. A list is a head
+ * linked to itself when empty, an unlinked member is too. */
+typedef struct dlink {
+    struct dlink *prev;
+    struct dlink *next;
+} dlink;
+
+#define dlink_empty(h)      ((h)->next == (h))
+#define dlink_first(h)      (dlink_empty(h) ? NULL : (h)->next)
+#define dlink_entry(l, type, member) \
+    ((type *)((char *)(l) - offsetof(type, member)))
+
+void dlink_init(dlink *h);
+void dlink_add_head(dlink *h, dlink *l);
+void dlink_add_tail(dlink *h, dlink *l);
+void dlink_delete(dlink *l);
+
 /* Directions for iterators */
 #define DLIST_START_HEAD    0
 #define DLIST_START_TAIL    1
@@ -1,17 +1,54 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include "times.h"
+#include "uring.h"
 #include "event.h"
 
 #ifndef EPOLLRDHUP
 #define EPOLLRDHUP  0x2000
 #endif /* EPOLLRDHUP */
 
+#ifndef POLLRDHUP
+#define POLLRDHUP   0x2000
+#endif /* POLLRDHUP */
+
+#define URING_ENTRIES       1024
+#define URING_CANCEL_DATA   UINT64_MAX
+
+/* The io_uring backend keeps readiness semantics: every registered fd
+ * has a one-shot IORING_OP_POLL_ADD in flight, which is re-armed after
+ * its handler ran. Polls are tagged with the fd and a generation that
+ * is bumped whenever the fd is deregistered or its poll replaced, so
+ * completions of stale polls are recognized and dropped. */
+typedef struct event_uring_st {
+    uring_t         ring;
+    int             cap;
+    evtent_t        **ents;     /* indexed by fd */
+    uint32_t        *gens;
+    unsigned char   *polling;   /* a poll is in flight for the fd */
+} event_uring_t;
+
+static int default_backend = EVENT_BACKEND_EPOLL;
+
+/* the event loop run by this thread */
+static __thread event_t *running;
+
+#ifdef __NR_epoll_pwait2
+/* set when the kernel lacks epoll_pwait2() */
+static int no_pwait2 = 0;
+#endif /* __NR_epoll_pwait2 */
+
+/* epoll and poll event bits have the same values */
 static void handle(evtent_t *ent, int evset) {
     int c = 0;
 
@@ -25,6 +62,11 @@ static void handle(evtent_t *ent, int evset) {
     ent->f(ent->x, c);
 }
 
+/* Select the backend used by event loops initialized from now on. */
+void event_set_backend(int backend) {
+    default_backend = backend;
+}
+
 /* interval in unit of minisecond(ms) */
 event_t *event_create(handle_fn tick, void *tickval, int interval) {
     event_t *evt = (event_t*)calloc(1, sizeof(*evt));
@@ -35,24 +77,233 @@ event_t *event_create(handle_fn tick, void *tickval, int interval) {
     return evt;
 }
 
+static int uring_create(event_t *evt) {
+    event_uring_t *u = (event_uring_t *)calloc(1, sizeof(*u));
+    if (!u) return -1;
+    if (uring_init(&u->ring, URING_ENTRIES) != 0) {
+        free(u);
+        return -1;
+    }
+    evt->uring = u;
+    return 0;
+}
+
+static void wake_handler(void *arg, int event) {
+    evtent_t *ent = (evtent_t *)arg;
+    uint64_t n;
+
+    while (read(ent->fd, &n, sizeof(n)) > 0) { /* nothing */ }
+}
+
 int event_init(event_t *evt, handle_fn tick, void *tickval, int interval) {
     evt->stop = 0;
     evt->tick = tick;
     evt->tickval = tickval;
     evt->interval = interval;
+    evt->tick_at = INT64_MAX;
+    evt->last_tick = ustime();
     evt->fd_count = 0;
-    evt->epoll_fd = epoll_create(1);
-    if (evt->epoll_fd == -1) {
+    evt->epoll_fd = -1;
+    evt->uring = NULL;
+    evt->backend = EVENT_BACKEND_EPOLL;
+    evt->prepare = NULL;
+    evt->prepareval = NULL;
+    evt->nowait = 0;
+    evt->wake.fd = -1;
+
+    if (default_backend == EVENT_BACKEND_URING) {
+        if (uring_create(evt) == 0) {
+            evt->backend = EVENT_BACKEND_URING;
+        } else {
+            fprintf(stderr, "io_uring unavailable:%s, "
+                    "falling back to epoll\n", strerror(errno));
+        }
+    }
+
+    if (evt->backend == EVENT_BACKEND_EPOLL) {
+        evt->epoll_fd = epoll_create(1);
+        if (evt->epoll_fd == -1) {
+            return -1;
+        }
+    }
+
+    evt->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    evt->wake.added = 0;
+    evt->wake.edge = 0;
+    evt->wake.f = wake_handler;
+    evt->wake.x = &evt->wake;
+    if (evt->wake.fd < 0 || event_regis(evt, &evt->wake, EVENT_RD) != 0) {
+        event_destroy(evt);
         return -1;
     }
     return 0;
 }
 
+/* `prepare' is called with EVENT_PREPARE every time before the loop
+ * waits for events. */
+void event_set_prepare(event_t *evt, handle_fn prepare, void *arg) {
+    evt->prepare = prepare;
+    evt->prepareval = arg;
+}
+
+/* Make the loop go around once more without sleeping. Safe to call
+ * from any thread; other threads interrupt the wait via the eventfd. */
+void event_wake(event_t *evt) {
+    uint64_t one = 1;
+
+    if (evt == running) {
+        evt->nowait = 1;
+        return;
+    }
+    if (write(evt->wake.fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "write eventfd failed:%s\n", strerror(errno));
+    }
+}
+
+/* Have the tick handler run at `at' or before. Safe to call from any
+ * thread, the loop is woken up if it sleeps for longer. */
+void event_tick_at(event_t *evt, int64_t at) {
+    int64_t cur = __atomic_load_n(&evt->tick_at, __ATOMIC_ACQUIRE);
+
+    while (at < cur) {
+        if (__atomic_compare_exchange_n(&evt->tick_at, &cur, at, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if (evt != running) {
+                event_wake(evt);
+            }
+            return;
+        }
+    }
+}
+
+/* when the tick handler is due next */
+static int64_t event_next_tick(event_t *evt) {
+    int64_t at;
+
+    if (!evt->tick) return INT64_MAX;
+    at = __atomic_load_n(&evt->tick_at, __ATOMIC_ACQUIRE);
+    if (evt->interval > 0 && evt->last_tick + evt->interval * 1000LL < at) {
+        at = evt->last_tick + evt->interval * 1000LL;
+    }
+    return at;
+}
+
+static int uring_reserve(event_uring_t *u, int fd) {
+    int ncap;
+    evtent_t **nents;
+    uint32_t *ngens;
+    unsigned char *npolling;
+
+    if (fd < u->cap) return 0;
+
+    ncap = u->cap ? u->cap : 64;
+    while (ncap <= fd) ncap *= 2;
+
+    nents = realloc(u->ents, ncap * sizeof(*nents));
+    if (!nents) return -1;
+    u->ents = nents;
+    ngens = realloc(u->gens, ncap * sizeof(*ngens));
+    if (!ngens) return -1;
+    u->gens = ngens;
+    npolling = realloc(u->polling, ncap * sizeof(*npolling));
+    if (!npolling) return -1;
+    u->polling = npolling;
+
+    memset(u->ents + u->cap, 0, (ncap - u->cap) * sizeof(*nents));
+    memset(u->gens + u->cap, 0, (ncap - u->cap) * sizeof(*ngens));
+    memset(u->polling + u->cap, 0, (ncap - u->cap) * sizeof(*npolling));
+    u->cap = ncap;
+    return 0;
+}
+
+static uint64_t uring_data(event_uring_t *u, int fd) {
+    return ((uint64_t)u->gens[fd] << 32) | (uint32_t)fd;
+}
+
+/* Cancel the poll in flight for `fd', if any. */
+static int uring_cancel(event_uring_t *u, int fd) {
+    struct io_uring_sqe *sqe;
+
+    if (!u->polling[fd]) return 0;
+    sqe = uring_get_sqe(&u->ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = uring_data(u, fd);
+    sqe->user_data = URING_CANCEL_DATA;
+    u->polling[fd] = 0;
+    ++u->gens[fd];
+    return 0;
+}
+
+/* Queue a poll for `mask' on `fd', replacing the one in flight. It is
+ * submitted by the next io_uring_enter() of the loop. */
+static int uring_poll(event_uring_t *u, int fd, int mask) {
+    struct io_uring_sqe *sqe;
+
+    if (uring_cancel(u, fd) != 0) return -1;
+    sqe = uring_get_sqe(&u->ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = mask;
+    sqe->user_data = uring_data(u, fd);
+    u->polling[fd] = 1;
+    return 0;
+}
+
+static int uring_regis(event_t *evt, evtent_t *ent, int rwd) {
+    event_uring_t *u = evt->uring;
+    int mask;
+
+    if (!ent->added && rwd == EVENT_DEL) {
+        return -1;
+    } else if (rwd == EVENT_DEL) {
+        ent->added = 0;
+        --evt->fd_count;
+        uring_cancel(u, ent->fd);
+        u->ents[ent->fd] = NULL;
+        ++u->gens[ent->fd];
+        return 0;
+    } else if (!ent->added) {
+        if (uring_reserve(u, ent->fd) != 0) {
+            return -1;
+        }
+        ent->added = 1;
+        ++evt->fd_count;
+        u->ents[ent->fd] = ent;
+        u->polling[ent->fd] = 0;
+    }
+
+    mask = POLLRDHUP | POLLPRI;
+    if (rwd == EVENT_RD) {
+        mask |= POLLIN;
+    } else if (rwd == EVENT_WR) {
+        mask |= POLLOUT;
+    }
+    if (u->polling[ent->fd] && ent->mask == mask) {
+        return 0;
+    }
+    ent->mask = mask;
+    return uring_poll(u, ent->fd, mask);
+}
+
+/* Registering EVENT_HUP watches for nothing but the peer hanging up.
+ * An edge-triggered entry is registered once for both directions, so
+ * switching between EVENT_RD and EVENT_WR costs no system call. */
 int event_regis(event_t *evt, evtent_t *ent, int rwd) {
     int op;
     struct epoll_event ev = {};
     assert(evt && ent);
 
+    if (evt->backend == EVENT_BACKEND_URING) {
+        return uring_regis(evt, ent, rwd);
+    }
+
+    if (ent->edge && ent->added && rwd != EVENT_DEL) {
+        return 0;
+    }
+
     if (!ent->added && rwd == EVENT_DEL) {
         return -1;
     } else if (!ent->added && rwd != EVENT_DEL) {
@@ -74,42 +325,148 @@ int event_regis(event_t *evt, evtent_t *ent, int rwd) {
         ev.events = EPOLLOUT;
         break;
     }
+    if (ent->edge && rwd != EVENT_DEL) {
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    }
     ev.events |= EPOLLRDHUP | EPOLLPRI;
     ev.data.ptr = ent;
 
     return epoll_ctl(evt->epoll_fd, op, ent->fd, &ev);
 }
 
-void event_loop(event_t *evt) {
+/* `timeout' in microseconds, negative to wait forever */
+static int epoll_poll(event_t *evt, int64_t timeout) {
     int i, r;
-    long long e, t = ustime();
     struct epoll_event evs[512];
+#ifdef __NR_epoll_pwait2
+    struct timespec ts;
+
+    if (!no_pwait2) {
+        ts.tv_sec = timeout / 1000000;
+        ts.tv_nsec = (timeout % 1000000) * 1000;
+        r = syscall(__NR_epoll_pwait2, evt->epoll_fd, evs, 512,
+                timeout < 0 ? NULL : &ts, NULL, 0);
+        if (r < 0 && errno == ENOSYS) {
+            no_pwait2 = 1;
+        } else {
+            goto done;
+        }
+    }
+#endif /* __NR_epoll_pwait2 */
+
+    /* round up, waking up early would just go around the loop */
+    r = epoll_wait(evt->epoll_fd, evs, 512,
+            timeout < 0 ? -1 : (int)((timeout + 999) / 1000));
+#ifdef __NR_epoll_pwait2
+done:
+#endif /* __NR_epoll_pwait2 */
+    if (r < 0 && errno != EINTR) {
+        fprintf(stderr, "epoll_wait failed:%s\n", strerror(errno));
+        exit(1);
+    }
+
+    for (i = 0; i < r; ++i) {
+        handle(evs[i].data.ptr, evs[i].events);
+    }
+    return r;
+}
+
+/* Submitting the polls queued since the last round and waiting for
+ * completions is one io_uring_enter(). */
+static int uring_poll_events(event_t *evt, int64_t timeout) {
+    event_uring_t *u = evt->uring;
+    struct io_uring_cqe *cqe;
+    evtent_t *ent;
+    uint64_t data;
+    uint32_t gen;
+    int fd, res, r, n = 0;
+
+    r = uring_enter(&u->ring, 1, timeout);
+    if (r < 0) {
+        fprintf(stderr, "io_uring_enter failed:%s\n", strerror(errno));
+        exit(1);
+    }
+
+    while ((cqe = uring_peek_cqe(&u->ring))) {
+        data = cqe->user_data;
+        res = cqe->res;
+        uring_cqe_seen(&u->ring);
+
+        if (data == URING_CANCEL_DATA) continue;
+        fd = (int)(uint32_t)data;
+        gen = (uint32_t)(data >> 32);
+        if (fd >= u->cap || !u->ents[fd] || u->gens[fd] != gen) {
+            continue;   /* stale poll */
+        }
+
+        ent = u->ents[fd];
+        u->polling[fd] = 0;
+        ++n;
+        handle(ent, res < 0 ? EPOLLHUP : res);
+
+        /* level-triggered: poll again unless the handler deregistered
+         * the fd or already queued a new poll for it */
+        if (u->ents[fd] == ent && u->gens[fd] == gen && !u->polling[fd]) {
+            uring_poll(u, fd, ent->mask);
+        }
+    }
+    return n;
+}
+
+void event_loop(event_t *evt) {
+    int64_t now, at, timeout;
 
+    running = evt;
+    evt->last_tick = ustime();
     while (!evt->stop) {
-        r = epoll_wait(evt->epoll_fd, evs, 512, evt->interval);
+        evt->nowait = 0;
+        if (evt->prepare) {
+            evt->prepare(evt->prepareval, EVENT_PREPARE);
+        }
 
-        if (r < 0 && errno != EINTR) {
-            fprintf(stderr, "epoll_wait failed:%s\n", strerror(errno));
-            exit(1);
+        /* sleep until the tick is due */
+        at = event_next_tick(evt);
+        now = ustime();
+        if (evt->nowait || evt->stop || at <= now) {
+            timeout = 0;
+        } else if (at == INT64_MAX) {
+            timeout = -1;
+        } else {
+            timeout = at - now;
         }
 
-        e = ustime();
-        if ((e - t) / 1000 >= evt->interval) {
-            evt->tick(evt->tickval, EVENT_TICK);
-            t = e;
+        if (evt->backend == EVENT_BACKEND_URING) {
+            uring_poll_events(evt, timeout);
+        } else {
+            epoll_poll(evt, timeout);
         }
 
-        for (i = 0; i < r; ++i) {
-            handle(evs[i].data.ptr, evs[i].events);
+        now = ustime();
+        if (now >= event_next_tick(evt)) {
+            __atomic_store_n(&evt->tick_at, INT64_MAX, __ATOMIC_RELEASE);
+            evt->last_tick = now;
+            evt->tick(evt->tickval, EVENT_TICK);
         }
     }
 }
 
 void event_destroy(event_t *evt) {
+    if (evt->wake.fd >= 0) {
+        close(evt->wake.fd);
+        evt->wake.fd = -1;
+    }
     if (evt->epoll_fd >= 0) {
         close(evt->epoll_fd);
         evt->epoll_fd = -1;
     }
+    if (evt->uring) {
+        uring_destroy(&evt->uring->ring);
+        free(evt->uring->ents);
+        free(evt->uring->gens);
+        free(evt->uring->polling);
+        free(evt->uring);
+        evt->uring = NULL;
+    }
     evt->stop = 0;
     evt->tick = NULL;
     evt->tickval = NULL;
@@ -124,6 +481,7 @@ void event_free(event_t *evt) {
 
 void event_stop(event_t *evt) {
     evt->stop = 1;
+    event_wake(evt);
 }
 
 evtent_t *event_entry_create(handle_fn handler, void *arg, int fd) {
@@ -132,6 +490,8 @@ evtent_t *event_entry_create(handle_fn handler, void *arg, int fd) {
     ent->f = handler;
     ent->x = arg;
     ent->added = 0;
+    ent->edge = 0;
+    ent->mask = 0;
     return ent;
 }
 
@@ -180,7 +540,7 @@ int main(int argc, char **argv) {
     event_t *evt = event_create(tick, NULL, 1000);  /* 1000 ms */
     assert(evt);
 
-    if ((count = create_socket("localhost", 5986, sockfds, 
+    if ((count = create_socket("localhost", 5986, 0, sockfds, 
             1, &maxfd)) == 0) {
         fprintf(stderr, "create_socket failed\n");
         exit(1);
@@ -197,3 +557,144 @@ int main(int argc, char **argv) {
 
 }
 #endif /* EVENT_TEST_MAIN */
+
+/* gcc -O2 -DEVENT_BENCH_MAIN event.c uring.c times.c -o event_bench
+ * ./event_bench [epoll|uring] [conns] [active] [messages]
+ *
+ * A forked client opens `conns' connections and keeps one byte in
+ * flight on `active' of them, the rest stay idle. The server side
+ * handles each byte like conn.c does: read it, switch to EVENT_WR,
+ * write the reply and switch back to EVENT_RD. */
+#ifdef EVENT_BENCH_MAIN
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static event_t *bench_evt;
+static long long bench_msgs;
+static long long bench_total;
+
+static void bench_handle(void *arg, int event) {
+    evtent_t *ent = (evtent_t *)arg;
+    char c;
+
+    switch (event) {
+    case EVENT_RD:
+        if (read(ent->fd, &c, 1) == 1) {
+            event_regis(bench_evt, ent, EVENT_WR);
+        }
+        break;
+    case EVENT_WR:
+        if (write(ent->fd, "x", 1) == 1) {
+            event_regis(bench_evt, ent, EVENT_RD);
+            if (++bench_msgs == bench_total) {
+                event_stop(bench_evt);
+            }
+        }
+        break;
+    case EVENT_HUP:
+        event_regis(bench_evt, ent, EVENT_DEL);
+        break;
+    }
+}
+
+static void bench_client(struct sockaddr_in *addr, int conns, int active) {
+    struct epoll_event ev, evs[512];
+    int i, n, fd, ep, one = 1;
+    char c;
+
+    ep = epoll_create(1);
+    for (i = 0; i < conns; ++i) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)addr,
+                    sizeof(*addr)) != 0) {
+            perror("connect");
+            exit(1);
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+        if (i < active) {
+            write(fd, "x", 1);
+        }
+    }
+
+    for (;;) {
+        n = epoll_wait(ep, evs, 512, -1);
+        for (i = 0; i < n; ++i) {
+            fd = evs[i].data.fd;
+            if (read(fd, &c, 1) != 1) {
+                exit(0);
+            }
+            write(fd, "x", 1);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int conns = argc > 2 ? atoi(argv[2]) : 10000;
+    int active = argc > 3 ? atoi(argv[3]) : 1000;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    evtent_t *ents;
+    long long start, elapsed;
+    int i, fd, lfd, one = 1;
+    pid_t pid;
+
+    bench_total = argc > 4 ? atoll(argv[4]) : 1000000;
+    if (argc > 1 && !strcmp(argv[1], "uring")) {
+        event_set_backend(EVENT_BACKEND_URING);
+    }
+    bench_evt = event_create(NULL, NULL, 1000);
+    assert(bench_evt);
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(lfd, 4096) != 0 ||
+            getsockname(lfd, (struct sockaddr *)&addr, &len) != 0) {
+        perror("listen");
+        exit(1);
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        close(lfd);
+        bench_client(&addr, conns, active);
+    }
+
+    ents = calloc(conns, sizeof(*ents));
+    for (i = 0; i < conns; ++i) {
+        fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            perror("accept");
+            exit(1);
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        ents[i].fd = fd;
+        ents[i].f = bench_handle;
+        ents[i].x = &ents[i];
+        assert(event_regis(bench_evt, &ents[i], EVENT_RD) == 0);
+    }
+
+    start = ustime();
+    event_loop(bench_evt);
+    elapsed = ustime() - start;
+
+    printf("%s: %d conns, %d active, %lld messages in %lld ms, "
+            "%.0f msg/s\n", bench_evt->backend == EVENT_BACKEND_URING ?
+            "io_uring" : "epoll", conns, active, bench_msgs,
+            elapsed / 1000, bench_msgs * 1e6 / elapsed);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    event_free(bench_evt);
+    exit(0);
+}
+#endif /* EVENT_BENCH_MAIN */
@@ -6,6 +6,10 @@
 #define EVENT_WR        2
 #define EVENT_TICK      3
 #define EVENT_HUP       4
+#define EVENT_PREPARE   5
+
+#define EVENT_BACKEND_EPOLL     0
+#define EVENT_BACKEND_URING     1
 
 typedef void (*handle_fn)(void *arg, int event);
 
@@ -14,20 +18,38 @@ typedef struct event_entry_st {
     handle_fn   f;
     void        *x;
     int         added;
+    int         edge;       /* edge-triggered, watch both directions */
+    int         mask;       /* events polled by the io_uring backend */
 } evtent_t;
 
+struct event_uring_st;
+
+/* The tick handler runs when the time asked with event_tick_at() has
+ * come, and at least every `interval' ms unless it is 0. */
 typedef struct event_st {
+    int         backend;
     int         epoll_fd;
+    struct event_uring_st *uring;
     int         fd_count;
     handle_fn   tick;
     void        *tickval;
     int         interval;
+    int64_t     tick_at;    /* see ustime() */
+    int64_t     last_tick;
     int         stop;
+    handle_fn   prepare;    /* run before the loop goes to sleep */
+    void        *prepareval;
+    int         nowait;     /* don't sleep in the next round */
+    evtent_t    wake;       /* eventfd to wake the loop from others */
 } event_t;
 
+void event_set_backend(int backend);
 event_t *event_create(handle_fn tick, void *tickval, int interval);
 int event_init(event_t *evt, handle_fn tick, void *tickval, int interval);
 int event_regis(event_t *evt, evtent_t *ent, int rwd);
+void event_set_prepare(event_t *evt, handle_fn prepare, void *arg);
+void event_wake(event_t *evt);
+void event_tick_at(event_t *evt, int64_t at);
 void event_loop(event_t *evt);
 void event_destroy(event_t *evt);
 void event_free(event_t *evt);
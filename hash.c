@@ -30,6 +30,10 @@ unsigned long hash_func_str(const void *key) {
     return h;
 }
 
+int hash_keycmp_str(const void *key1, const void *key2) {
+    return strcmp((const char *)key1, (const char *)key2) == 0;
+}
+
 unsigned long hash_func_int(const void *key) {
     return (unsigned long)key;
 }
@@ -92,6 +92,9 @@ unsigned long hash_func_int(const void *key);
 /* string hash function */
 unsigned long hash_func_str(const void *key);
 
+/* string key comparison, true if equal */
+int hash_keycmp_str(const void *key1, const void *key2);
+
 /* destroy a hash table */
 void hash_destroy(hash_t *ht);
 
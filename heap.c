@@ -5,58 +5,74 @@
 
 #define HEAP_INIT_SIZE      16
 
-static void heap_set(heap_t *h, int k, void *data) {
-    h->data[k] = data;
+static void heap_set(heap_t *h, int k, heap_item_t *item) {
+    h->items[k] = *item;
     if (h->record) {
-        h->record(data, k);
+        h->record(item->data, k);
     }
 }
 
-static void heap_swap(heap_t *h, int a, int b) {
-    void *tmp;
-    tmp = h->data[a];
-    heap_set(h, a, h->data[b]);
-    heap_set(h, b, tmp);
-}
-
-static int heap_less(heap_t *h, int a, int b) {
-    if (h->less) {
-        return h->less(h->data[a], h->data[b]);
+static void heap_key(heap_t *h, heap_item_t *item) {
+    if (h->key) {
+        h->key(item->data, &item->key);
     } else {
-        return (h->data[a] < h->data[b]) ? 1 : 0;
+        item->key.hi = (uintptr_t)item->data;
+        item->key.lo = 0;
     }
 }
 
+/* The element at `k' is taken out and the ones in its way are moved
+ * into the hole, then it is put where the hole ends up. Only the
+ * keys in the array are compared. */
 static void heap_siftdown(heap_t *h, int k) {
-    for ( ; ; ) {
-        int p = (k - 1) / 2; /* parent */
+    heap_item_t item = h->items[k];
+    int p;
 
-        if (k == 0 || heap_less(h, p, k)) {
-            return;
+    while (k > 0) {
+        p = (k - 1) / 2; /* parent */
+        if (!heap_key_less(&item.key, &h->items[p].key)) {
+            break;
         }
-        heap_swap(h, k, p);
+        heap_set(h, k, &h->items[p]);
         k = p;
     }
+    heap_set(h, k, &item);
 }
 
 static void heap_siftup(heap_t *h, int k) {
+    heap_item_t item = h->items[k];
+    int l, s;
+
     for ( ; ; ) {
-        int l, r, s;
         l = k * 2 + 1; /* left child */
-        r = k * 2 + 2; /* right child */
-
-        /* find the smallest of the three */
-        s = k;
-        if (l < h->len && heap_less(h, l, s)) s = l;
-        if (r < h->len && heap_less(h, r, s)) s = r;
+        if (l >= h->len) {
+            break;
+        }
 
-        if (s == k) {
-            return; /* statisfies the heap property */
+        /* the smaller child */
+        s = l;
+        if (l + 1 < h->len && heap_key_less(&h->items[l + 1].key,
+                    &h->items[l].key)) {
+            s = l + 1;
         }
 
-        heap_swap(h, k, s);
+        if (!heap_key_less(&h->items[s].key, &item.key)) {
+            break; /* statisfies the heap property */
+        }
+        heap_set(h, k, &h->items[s]);
         k = s;
     }
+    heap_set(h, k, &item);
+}
+
+/* Move the element at `k' up or down to where it belongs. */
+static void heap_sift(heap_t *h, int k) {
+    if (k > 0 && heap_key_less(&h->items[k].key,
+                &h->items[(k - 1) / 2].key)) {
+        heap_siftdown(h, k);
+    } else {
+        heap_siftup(h, k);
+    }
 }
 
 heap_t *heap_create() {
@@ -72,33 +88,41 @@ heap_t *heap_create() {
 int heap_init(heap_t *h) {
     h->cap = HEAP_INIT_SIZE;
     h->len = 0;
-    h->data = (void **)calloc(h->cap, sizeof(void *));
-    if (!h->data) return -1;
-    h->less = NULL;
+    h->items = (heap_item_t *)calloc(h->cap, sizeof(heap_item_t));
+    if (!h->items) return -1;
+    h->key = NULL;
     h->record = NULL;
     return 0;
 }
 
+/* Make room for at least one more element.
+ * 0 returned on success, otherwise -1. */
+int heap_grow(heap_t *h) {
+    heap_item_t *nitems;
+    int ncap = (h->len + 1) * 2; /* callocate twice what we need */
+
+    nitems = realloc(h->items, sizeof(heap_item_t) * ncap);
+    if (!nitems) {
+        return -1;
+    }
+    h->items = nitems;
+    h->cap = ncap;
+    return 0;
+}
+
 /* heap_insert insert `data' into heap `h' according
- * to h->less.
+ * to h->key.
  * 0 returned on success, otherwise -1. */
 int heap_insert(heap_t *h, void *data) {
     int k;
 
-    if (h->len >= h->cap) {
-        void **ndata;
-        int ncap = (h->len + 1) * 2; /* callocate twice what we need */
-
-        ndata = realloc(h->data, sizeof(void*) * ncap);
-        if (!ndata) {
-            return -1;
-        }
-        h->data = ndata;
-        h->cap = ncap;
+    if (h->len >= h->cap && heap_grow(h) != 0) {
+        return -1;
     }
     k = h->len;
     ++h->len;
-    heap_set(h, k, data);
+    h->items[k].data = data;
+    heap_key(h, &h->items[k]);
     heap_siftdown(h, k);
     return 0;
 }
@@ -110,25 +134,36 @@ void *heap_remove(heap_t *h, int k) {
         return NULL;
     }
 
-    data = h->data[k];
+    data = h->items[k].data;
     --h->len;
-    heap_set(h, k, h->data[h->len]);
-    heap_siftdown(h, k);
-    heap_siftup(h, k);
+    if (k < h->len) {
+        h->items[k] = h->items[h->len];
+        heap_sift(h, k);
+    }
     if (h->record) {
         h->record(data, -1);
     }
     return data;
 }
 
+/* heap_fix restores the heap order after the key of the
+ * element at `k' has changed. */
+void heap_fix(heap_t *h, int k) {
+    if (k < 0 || k >= h->len) {
+        return;
+    }
+    heap_key(h, &h->items[k]);
+    heap_sift(h, k);
+}
+
 void heap_destroy(heap_t *h) {
-    if (h->data) {
-        free(h->data);
-        h->data = NULL;
+    if (h->items) {
+        free(h->items);
+        h->items = NULL;
     }
     h->cap = 0;
     h->len = 0;
-    h->less = NULL;
+    h->key = NULL;
     h->record = NULL;
 }
 
@@ -141,32 +176,175 @@ void heap_free(heap_t *h) {
 #ifdef HEAP_TEST_MAIN
 #include <assert.h>
 #include <stdio.h>
+#include <time.h>
+#include "dheap.h"
 
 #define TEST_NUMBER     100000
 
-int less(void *a, void *b) {
-    return (uintptr_t)a < (uintptr_t)b ? 1 : 0;
-}
+typedef struct test_elem_st {
+    int         pos;
+    uint64_t    value;
+} test_elem_t;
+
+#define TEST_KEY(e, key)    ((key)->hi = (e)->value, (key)->lo = 0)
+#define TEST_RECORD(e, k)   ((e)->pos = (k))
+DHEAP_DEFINE(test_heap, test_elem_t, TEST_KEY, TEST_RECORD)
 
 int main(int argc, char **argv) {
+    static test_elem_t elems[TEST_NUMBER];
     int i;
+    uintptr_t last = 0, value;
+    test_elem_t *e;
     heap_t *h = heap_create();
-    h->less = less;
     srand(time(NULL));
     for (i = 0; i < TEST_NUMBER; ++i) {
         assert(heap_insert(h, (void *)(long)(rand() % TEST_NUMBER)) == 0);
     }
 
-    printf("Original\n==========================================\n");
-    for (i = 0; i < h->len; ++i) {
-        printf("%ld\n", (long)h->data[i]);
+    /* take some out of the middle */
+    for (i = 0; i < TEST_NUMBER / 10; ++i) {
+        heap_remove(h, rand() % h->len);
     }
 
     printf("Sorted\n==========================================\n");
     while (h->len != 0) {
-        void *value = heap_remove(h, 0);
+        value = (uintptr_t)heap_remove(h, 0);
+        assert(value >= last);
+        last = value;
         printf("%ld\n", (long)value);
     }
+
+    /* the same through a specialized 4-ary heap, changing some keys */
+    for (i = 0; i < TEST_NUMBER; ++i) {
+        elems[i].value = rand() % TEST_NUMBER;
+        assert(test_heap_insert(h, &elems[i]) == 0);
+    }
+    for (i = 0; i < TEST_NUMBER / 10; ++i) {
+        e = &elems[rand() % TEST_NUMBER];
+        if (e->pos < 0) continue;
+        if (i % 2) {
+            assert(test_heap_remove(h, e->pos) == e);
+            assert(e->pos == -1);
+        } else {
+            e->value = rand() % TEST_NUMBER;
+            test_heap_fix(h, e->pos);
+        }
+    }
+    last = 0;
+    while (h->len != 0) {
+        e = test_heap_remove(h, 0);
+        assert(e->value >= last);
+        last = e->value;
+    }
     heap_free(h);
+    return 0;
 }
 #endif /* HEAP_TEST_MAIN */
+
+/* gcc -O2 -DHEAP_BENCH_MAIN heap.c times.c -o heap_bench
+ * ./heap_bench [jobs] */
+#ifdef HEAP_BENCH_MAIN
+#include <stdio.h>
+#include "times.h"
+#include "dheap.h"
+
+/* about the size of a job with a small body, allocated in a random
+ * order like jobs that came and went */
+typedef struct bench_job_st {
+    int         heap_index;
+    uint32_t    pri;
+    uint64_t    id;
+    char        rest[176];
+} bench_job_t;
+
+static void bench_key(void *arg, heap_key_t *key) {
+    key->hi = ((bench_job_t *)arg)->pri;
+    key->lo = ((bench_job_t *)arg)->id;
+}
+
+static void bench_record(void *arg, int pos) {
+    ((bench_job_t *)arg)->heap_index = pos;
+}
+
+#define BENCH_KEY(j, key)       bench_key(j, key)
+#define BENCH_RECORD(j, pos)    ((j)->heap_index = (pos))
+DHEAP_DEFINE(bench_heap, bench_job_t, BENCH_KEY, BENCH_RECORD)
+
+#define bench_insert(d, h, j) \
+    ((d) ? bench_heap_insert(h, j) : heap_insert(h, j))
+#define bench_remove(d, h, k) \
+    ((d) ? bench_heap_remove(h, k) : (bench_job_t *)heap_remove(h, k))
+
+static void bench(int d, bench_job_t **order, int n) {
+    bench_job_t *j;
+    heap_t h;
+    int64_t start;
+    int i;
+
+    if (heap_init(&h) != 0) {
+        exit(1);
+    }
+    h.key = bench_key;
+    h.record = bench_record;
+
+    start = ustime();
+    for (i = 0; i < n; ++i) {
+        bench_insert(d, &h, order[i]);
+    }
+    printf("%s insert: %.1f ns/op\n", d ? "4-ary" : "binary",
+            (ustime() - start) * 1000.0 / n);
+
+    /* a steady state: take the best, put one back */
+    start = ustime();
+    for (i = 0; i < n; ++i) {
+        j = bench_remove(d, &h, 0);
+        j->pri = rand() % 1024;
+        bench_insert(d, &h, j);
+    }
+    printf("%s remove+insert: %.1f ns/op\n", d ? "4-ary" : "binary",
+            (ustime() - start) * 1000.0 / n);
+
+    start = ustime();
+    while (h.len) {
+        bench_remove(d, &h, 0);
+    }
+    printf("%s remove: %.1f ns/op\n", d ? "4-ary" : "binary",
+            (ustime() - start) * 1000.0 / n);
+    heap_destroy(&h);
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 10000000, i, k, d;
+    bench_job_t *jobs, **order, *tmp;
+
+    jobs = calloc(n, sizeof(*jobs));
+    order = malloc(n * sizeof(*order));
+    if (!jobs || !order) {
+        return 1;
+    }
+
+    srand(1);
+    for (i = 0; i < n; ++i) {
+        order[i] = &jobs[i];
+    }
+    for (i = n - 1; i > 0; --i) {
+        k = rand() % (i + 1);
+        tmp = order[i];
+        order[i] = order[k];
+        order[k] = tmp;
+    }
+
+    for (d = 0; d < 2; ++d) {
+        srand(2);
+        for (i = 0; i < n; ++i) {
+            order[i]->id = i + 1;
+            order[i]->pri = rand() % 1024;
+        }
+        bench(d, order, n);
+    }
+
+    free(order);
+    free(jobs);
+    return 0;
+}
+#endif /* HEAP_BENCH_MAIN */
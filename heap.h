@@ -1,21 +1,42 @@
 #ifndef __HEAP_H_INCLUDED__
 #define __HEAP_H_INCLUDED__
 
-typedef int (*cmp_fn)(void *, void *);
+#include <stdint.h>
+
+/* The sort key of an element, compared `hi' first. It is kept in the
+ * heap array next to the element, so sifting compares keys without
+ * going to the elements themselves. */
+typedef struct heap_key_st {
+    uint64_t    hi;
+    uint64_t    lo;
+} heap_key_t;
+
+typedef struct heap_item_st {
+    heap_key_t  key;
+    void        *data;
+} heap_item_t;
+
+typedef void (*key_fn)(void *, heap_key_t *);
 typedef void (*record_fn)(void *, int);
 
 typedef struct heap_st {
     int         cap;
     int         len;
-    void        **data;
-    cmp_fn      less;
+    heap_item_t *items;
+    key_fn      key;        /* the key of an element, its address if NULL */
     record_fn   record;
 } heap_t;
 
+#define heap_get(h, k)  ((h)->items[k].data)
+#define heap_key_less(a, b) \
+    ((a)->hi < (b)->hi || ((a)->hi == (b)->hi && (a)->lo < (b)->lo))
+
 heap_t *heap_create(void);
 int heap_init(heap_t *h);
+int heap_grow(heap_t *h);
 int heap_insert(heap_t *h, void *data);
 void *heap_remove(heap_t *h, int k);
+void heap_fix(heap_t *h, int k);
 void heap_destroy(heap_t *h);
 void heap_free(heap_t *h);
 
@@ -0,0 +1,346 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include "idtab.h"
+
+#define IDTAB_MIN_SLOTS     16
+#define IDTAB_MOVE_STEP     64      /* old slots moved per update */
+#define IDTAB_RELEASE_MIN   65536   /* bytes of moved slots to release */
+
+/* grow beyond a load factor of 4/5 */
+#define array_full(a)       (((a)->count + 1) * 5 > ((a)->mask + 1) * 4)
+
+/* Ids are handed out in sequence, so the live ones mostly form a
+ * window. Folding the bits above the mask onto the low ones keeps
+ * neighbouring ids in neighbouring slots, which is cache friendly,
+ * while ids a whole array size apart still land apart. */
+#define array_home(a, id) \
+    ((size_t)((id) ^ ((id) >> (a)->bits) ^ ((id) >> 2 * (a)->bits)) & \
+     (a)->mask)
+#define array_dist(a, id, pos)  (((pos) - array_home(a, id)) & (a)->mask)
+
+static size_t page_size;
+
+#define page_up(p) \
+    ((char *)(((uintptr_t)(p) + page_size - 1) & ~(page_size - 1)))
+#define page_down(p)    ((char *)((uintptr_t)(p) & ~(page_size - 1)))
+
+/* The arrays are mapped rather than malloc()ed, so that the pages of
+ * an old array can be given back while it is being emptied. */
+static int array_init(idtab_array_t *a, size_t cap) {
+    size_t n = IDTAB_MIN_SLOTS;
+    int bits = 4;
+    void *p;
+
+    while (n < cap) {
+        n <<= 1;
+        ++bits;
+    }
+
+    p = mmap(NULL, n * sizeof(idtab_slot_t), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    a->slots = (idtab_slot_t *)p;
+    a->mask = n - 1;
+    a->bits = bits;
+    a->count = 0;
+    return 0;
+}
+
+static void array_destroy(idtab_array_t *a) {
+    if (a->slots) {
+        munmap(a->slots, (a->mask + 1) * sizeof(idtab_slot_t));
+    }
+    memset(a, 0, sizeof(*a));
+}
+
+/* Place `id', which must not be in `a' yet. A newcomer that is
+ * farther from its home slot than the occupant takes the slot and
+ * the occupant moves on. */
+static void array_put(idtab_array_t *a, uint64_t id, void *val) {
+    size_t pos = array_home(a, id), d = 0, od;
+    idtab_slot_t *s, tmp;
+
+    for ( ; ; ) {
+        s = &a->slots[pos];
+        if (!s->val) {
+            s->id = id;
+            s->val = val;
+            ++a->count;
+            return;
+        }
+
+        od = array_dist(a, s->id, pos);
+        if (od < d) {
+            tmp = *s;
+            s->id = id;
+            s->val = val;
+            id = tmp.id;
+            val = tmp.val;
+            d = od;
+        }
+        pos = (pos + 1) & a->mask;
+        ++d;
+    }
+}
+
+/* Look for `id' from slot `pos', `d' slots away from its home.
+ * Return its slot, or -1 once it can not be farther on. */
+static ssize_t array_find(idtab_array_t *a, uint64_t id,
+        size_t pos, size_t d) {
+    idtab_slot_t *s;
+
+    for ( ; ; ) {
+        s = &a->slots[pos];
+        if (!s->val || array_dist(a, s->id, pos) < d) {
+            return -1;
+        }
+        if (s->id == id) {
+            return pos;
+        }
+        pos = (pos + 1) & a->mask;
+        ++d;
+    }
+}
+
+/* Empty slot `pos' and shift the rest of its run back by one. */
+static void array_delete(idtab_array_t *a, size_t pos) {
+    size_t next;
+    idtab_slot_t *s;
+
+    for ( ; ; ) {
+        next = (pos + 1) & a->mask;
+        s = &a->slots[next];
+        if (!s->val || array_dist(a, s->id, next) == 0) {
+            break;
+        }
+        a->slots[pos] = *s;
+        pos = next;
+    }
+    a->slots[pos].id = 0;
+    a->slots[pos].val = NULL;
+    --a->count;
+}
+
+/* Find `id' in the old array. Moving began right after an empty slot
+ * and left the slots it went over empty, so an entry whose home has
+ * been moved over can only be found from where moving stands now. */
+static ssize_t old_find(idtab_t *t, uint64_t id) {
+    idtab_array_t *a = &t->old;
+    size_t home = array_home(a, id), pos = home;
+
+    if (((home - t->start) & a->mask) < t->moved) {
+        pos = (t->start + t->moved) & a->mask;
+    }
+    return array_find(a, id, pos, (pos - home) & a->mask);
+}
+
+/* Give the pages of old slots that have been moved back to the
+ * kernel, a batch at a time, so that unmapping the old array in the
+ * end costs next to nothing. The moved slots read as empty anyway. */
+static void old_release(idtab_t *t) {
+    idtab_array_t *a = &t->old;
+    size_t from = (t->start + t->released) & a->mask;
+    size_t n = t->moved - t->released;
+    char *lo, *hi;
+
+    /* up to the end of the array, the rest goes next time */
+    if (from + n > a->mask + 1) {
+        n = a->mask + 1 - from;
+    }
+
+    lo = page_up(&a->slots[from]);
+    hi = page_down(&a->slots[from + n]);
+    if (hi - lo < IDTAB_RELEASE_MIN) {
+        return;
+    }
+    madvise(lo, hi - lo, MADV_DONTNEED);
+    t->released += (idtab_slot_t *)hi - &a->slots[from];
+}
+
+/* Move up to `n' slots of the old array into the current one. */
+static void idtab_move(idtab_t *t, size_t n) {
+    idtab_array_t *a = &t->old;
+    idtab_slot_t *s;
+
+    while (n-- && a->count) {
+        s = &a->slots[(t->start + t->moved) & a->mask];
+        if (s->val) {
+            array_put(&t->cur, s->id, s->val);
+            s->val = NULL;
+            --a->count;
+        }
+        ++t->moved;
+    }
+
+    if (!a->count) {
+        array_destroy(a);
+    } else {
+        old_release(t);
+    }
+}
+
+/* Start moving everything into an array twice as big. */
+static int idtab_grow(idtab_t *t) {
+    idtab_array_t bigger;
+
+    /* finish the previous round first, it is far along anyway */
+    if (t->old.slots) {
+        idtab_move(t, SIZE_MAX);
+    }
+
+    if (array_init(&bigger, (t->cur.mask + 1) * 2) != 0) {
+        return -1;
+    }
+    t->old = t->cur;
+    t->cur = bigger;
+
+    /* there is always an empty slot, see array_full() */
+    for (t->start = 0; t->old.slots[t->start].val; ++t->start) {
+        /* nothing */
+    }
+    t->moved = 0;
+    t->released = 0;
+    return 0;
+}
+
+int idtab_init(idtab_t *t, size_t cap) {
+    if (!page_size) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+    memset(t, 0, sizeof(*t));
+    return array_init(&t->cur, cap);
+}
+
+void idtab_destroy(idtab_t *t) {
+    array_destroy(&t->cur);
+    array_destroy(&t->old);
+}
+
+/* Map `id' to `val', which must not be NULL. The id must not be in
+ * the table yet. 0 returned on success, otherwise -1. */
+int idtab_insert(idtab_t *t, uint64_t id, void *val) {
+    if (t->old.slots) {
+        idtab_move(t, IDTAB_MOVE_STEP);
+    }
+
+    if (array_full(&t->cur) && idtab_grow(t) != 0) {
+        /* keep going in the current array while it has room */
+        if (t->cur.count + 1 > t->cur.mask) {
+            return -1;
+        }
+    }
+    array_put(&t->cur, id, val);
+    return 0;
+}
+
+void *idtab_get(idtab_t *t, uint64_t id) {
+    ssize_t pos;
+
+    pos = array_find(&t->cur, id, array_home(&t->cur, id), 0);
+    if (pos >= 0) {
+        return t->cur.slots[pos].val;
+    }
+
+    if (t->old.slots && (pos = old_find(t, id)) >= 0) {
+        return t->old.slots[pos].val;
+    }
+    return NULL;
+}
+
+/* 0 returned on success, -1 if `id' is not in the table. */
+int idtab_remove(idtab_t *t, uint64_t id) {
+    ssize_t pos;
+
+    pos = array_find(&t->cur, id, array_home(&t->cur, id), 0);
+    if (pos >= 0) {
+        array_delete(&t->cur, pos);
+    } else if (t->old.slots && (pos = old_find(t, id)) >= 0) {
+        array_delete(&t->old, pos);
+    } else {
+        return -1;
+    }
+
+    if (t->old.slots) {
+        idtab_move(t, IDTAB_MOVE_STEP);
+    }
+    return 0;
+}
+
+/* The value of the next entry from `*pos' on, which is 0 to begin
+ * with, and NULL after the last one. The table must not change in
+ * between. */
+void *idtab_next(idtab_t *t, size_t *pos) {
+    size_t n = t->cur.slots ? t->cur.mask + 1 : 0;
+    idtab_slot_t *s;
+
+    for ( ; *pos < n; ++*pos) {
+        s = &t->cur.slots[*pos];
+        if (s->val) {
+            ++*pos;
+            return s->val;
+        }
+    }
+    for ( ; t->old.slots && *pos - n <= t->old.mask; ++*pos) {
+        s = &t->old.slots[*pos - n];
+        if (s->val) {
+            ++*pos;
+            return s->val;
+        }
+    }
+    return NULL;
+}
+
+/* gcc idtab.c times.c -DIDTAB_TEST_MAIN */
+#ifdef IDTAB_TEST_MAIN
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include "times.h"
+
+#define TEST_NUMBER     10000000
+
+int main(int argc, char **argv) {
+    idtab_t t;
+    uint64_t i, lo = 1, hi = 1, id;
+    int64_t start, took, worst = 0;
+
+    assert(idtab_init(&t, 0) == 0);
+    srand(time(NULL));
+
+    /* a sliding window of live ids, like jobs coming and going,
+     * with some random deletes in the middle */
+    for (i = 0; i < TEST_NUMBER; ++i) {
+        start = ustime();
+        assert(idtab_insert(&t, hi, (void *)(uintptr_t)hi) == 0);
+        ++hi;
+        if (rand() % 3 == 0) {
+            while (lo < hi && !idtab_get(&t, lo)) ++lo;
+            if (lo < hi) assert(idtab_remove(&t, lo++) == 0);
+        }
+        if (hi > lo && rand() % 5 == 0) {
+            id = lo + rand() % (hi - lo);
+            if (idtab_get(&t, id)) {
+                assert(idtab_remove(&t, id) == 0);
+            }
+            assert(idtab_get(&t, id) == NULL);
+            assert(idtab_remove(&t, id) == -1);
+        }
+        took = ustime() - start;
+        if (took > worst) worst = took;
+    }
+
+    for (id = 1; id < hi; ++id) {
+        void *v = idtab_get(&t, id);
+        assert(v == NULL || v == (void *)(uintptr_t)id);
+        if (v) assert(idtab_remove(&t, id) == 0);
+    }
+    assert(idtab_count(&t) == 0);
+    printf("%d inserts, slowest update %ld us\n", TEST_NUMBER, (long)worst);
+    idtab_destroy(&t);
+    return 0;
+}
+#endif /* IDTAB_TEST_MAIN */
@@ -0,0 +1,40 @@
+#ifndef __IDTAB_H_INCLUDED__
+#define __IDTAB_H_INCLUDED__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* An open-addressing table from integer ids to pointers, Robin Hood
+ * probing over a power-of-two array. When it has to grow, the entries
+ * are moved into the bigger array a few slots per update instead of
+ * all at once, so no single insert pays for the whole rehash. */
+typedef struct idtab_slot_st {
+    uint64_t        id;
+    void            *val;       /* NULL if the slot is empty */
+} idtab_slot_t;
+
+typedef struct idtab_array_st {
+    idtab_slot_t    *slots;
+    size_t          mask;       /* number of slots - 1 */
+    int             bits;       /* log2(number of slots) */
+    size_t          count;
+} idtab_array_t;
+
+typedef struct idtab_st {
+    idtab_array_t   cur;        /* where new ids go */
+    idtab_array_t   old;        /* being moved into cur, if slots */
+    size_t          start;      /* the empty slot of old moving began at */
+    size_t          moved;      /* slots of old moved so far */
+    size_t          released;   /* of which pages were given back */
+} idtab_t;
+
+int idtab_init(idtab_t *t, size_t cap);
+void idtab_destroy(idtab_t *t);
+int idtab_insert(idtab_t *t, uint64_t id, void *val);
+void *idtab_get(idtab_t *t, uint64_t id);
+int idtab_remove(idtab_t *t, uint64_t id);
+void *idtab_next(idtab_t *t, size_t *pos);
+
+#define idtab_count(t)  ((t)->cur.count + (t)->old.count)
+
+#endif /* __IDTAB_H_INCLUDED__ */
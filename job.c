@@ -1,81 +1,165 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "srv.h"
 #include "job.h"
 #include "tube.h"
 #include "times.h"
+#include "slab.h"
+#include "dheap.h"
 
-job_t *job_create(int pri, int64_t delay, int64_t ttr,
-        int body_size, tube_t *tube, uintptr_t job_id) {
-    job_t *j = (job_t *)calloc(1, sizeof(*j) + body_size);
+/* guards tasque_srv.all_jobs and next_job_id, as jobs are added and
+ * removed under the locks of different partitions */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Allocate a job with room for `body_size' bytes of body. Everything
+ * but the body is zeroed, and the caller holds the only reference. */
+job_t *job_alloc(int body_size) {
+    size_t size = sizeof(job_t) + body_size;
+    int cls = slab_class(size);
+    job_t *j;
+
+    j = (job_t *)slab_alloc(cls, size);
+    if (!j) return NULL;
+    memset(j, 0, sizeof(*j));
+    dlink_init(&j->link);
+    j->slab_cls = cls;
+    j->refs = 1;
+    return j;
+}
+
+/* Make a job of `tube'. It has no id and can't be found until it is
+ * given to job_add(). */
+job_t *job_new(int pri, int64_t delay, int64_t ttr,
+        int body_size, tube_t *tube) {
+    job_t *j = job_alloc(body_size);
     if (!j) return NULL;
     j->rec.created_at = ustime();
     j->rec.body_size = body_size;
-    if (job_id) {
-        j->rec.id = job_id;
-        if (job_id >= tasque_srv.next_job_id) {
-            tasque_srv.next_job_id = job_id + 1;
-        }
-    } else {
-        j->rec.id = tasque_srv.next_job_id++;
-    }
     j->rec.pri = pri;
     j->rec.delay = delay;
     j->rec.ttr = ttr;
+    j->tube = tube;
+    tube_iref(j->tube);
+    return j;
+}
+
+/* Give `j' the id `job_id', or the next one if it is 0, and make it
+ * known by it. 0 returned on success, otherwise -1. */
+int job_add(job_t *j, uintptr_t job_id) {
+    uintptr_t next;
+
+    pthread_mutex_lock(&lock);
+    next = tasque_srv.next_job_id;
+    if (!job_id) {
+        job_id = next++;
+    } else if (job_id >= next) {
+        next = job_id + 1;
+    }
+
+    if (idtab_insert(&tasque_srv.all_jobs, job_id, j) != 0) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    j->rec.id = job_id;
+    __atomic_store_n(&tasque_srv.next_job_id, next, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
 
-    if (hash_insert(&tasque_srv.all_jobs, (void *)j->rec.id, j) != 0) {
-        free(j);
+job_t *job_create(int pri, int64_t delay, int64_t ttr,
+        int body_size, tube_t *tube, uintptr_t job_id) {
+    job_t *j = job_new(pri, delay, ttr, body_size, tube);
+    if (!j) return NULL;
+    if (job_add(j, job_id) != 0) {
+        job_dref(j);
         return NULL;
     }
-    j->tube = tube;
-    tube_iref(j->tube);
     return j;
 }
 
+/* Forget the job. The memory is released once the replies that
+ * still refer to its body have been sent. */
 void job_free(job_t *j) {
     if (j->rec.state != JOB_COPY) {
-        hash_delete(&tasque_srv.all_jobs, (void *)(j->rec.id));
+        pthread_mutex_lock(&lock);
+        idtab_remove(&tasque_srv.all_jobs, j->rec.id);
+        pthread_mutex_unlock(&lock);
     }
-    free(j);
+    job_dref(j);
 }
 
-/* lookup a job by job id */
-job_t *job_find(uintptr_t job_id) {
-    return (job_t *)hash_get_val(&tasque_srv.all_jobs, (void *)job_id);
+/* A reply may hold the last reference to a job after it was deleted
+ * under the lock of its partition, and be sent under another one. */
+void job_iref(job_t *j) {
+    __atomic_add_fetch(&j->refs, 1, __ATOMIC_RELAXED);
 }
 
-/* the void* parameters are really job pointers */
-void job_set_heap_pos(void *arg, int pos) {
-    ((job_t *)arg)->heap_index = pos;
+void job_dref(job_t *j) {
+    if (__atomic_sub_fetch(&j->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    if (j->tube) tube_dref(j->tube);
+    slab_free(j->slab_cls, j);
 }
 
-int job_pri_less(void *ax, void *bx) {
-    job_t *a = (job_t *)ax; 
-    job_t *b = (job_t *)bx;
-    if (a->rec.pri < b->rec.pri) return 1;
-    if (a->rec.pri > b->rec.pri) return 0;
-    return a->rec.id < b->rec.id;
+/* Lookup a job by job id. With the lock of a single partition, the
+ * jobs of the others are not to be touched and aren't found. */
+job_t *job_find(uintptr_t job_id) {
+    int p = srv_held();
+    job_t *j;
+
+    pthread_mutex_lock(&lock);
+    j = (job_t *)idtab_get(&tasque_srv.all_jobs, job_id);
+    if (j && p >= 0 && j->tube->part != p) j = NULL;
+    pthread_mutex_unlock(&lock);
+    return j;
 }
 
-int job_delay_less(void *ax, void *bx) {
-    job_t *a = (job_t *)ax; 
-    job_t *b = (job_t *)bx;
-    if (a->rec.deadline_at < b->rec.deadline_at) return 1;
-    if (a->rec.deadline_at > b->rec.deadline_at) return 0;
-    return a->rec.id < b->rec.id;
+/* The partition of the job `job_id', PART_ALL if there is none. */
+int job_part(uintptr_t job_id) {
+    job_t *j;
+    int p;
+
+    pthread_mutex_lock(&lock);
+    j = (job_t *)idtab_get(&tasque_srv.all_jobs, job_id);
+    p = j ? j->tube->part : PART_ALL;
+    pthread_mutex_unlock(&lock);
+    return p;
 }
 
+/* ready jobs go by priority, then by id */
+#define JOB_PRI_KEY(j, key) do {                                    \
+        (key)->hi = (j)->rec.pri;                                   \
+        (key)->lo = (j)->rec.id;                                    \
+    } while (0)
+
+/* delayed and reserved jobs go by deadline, then by id */
+#define JOB_DELAY_KEY(j, key) do {                                  \
+        (key)->hi = (uint64_t)(j)->rec.deadline_at;                 \
+        (key)->lo = (j)->rec.id;                                    \
+    } while (0)
+
+#define JOB_RECORD(j, pos)  ((j)->heap_index = (pos))
+
+DHEAP_DEFINE(ready_heap, job_t, JOB_PRI_KEY, JOB_RECORD)
+DHEAP_DEFINE(delay_heap, job_t, JOB_DELAY_KEY, JOB_RECORD)
+
 job_t *job_copy(job_t *j) {
-    job_t *aj = (job_t *)malloc(sizeof(*aj) + j->rec.body_size);
+    job_t *aj = job_alloc(j->rec.body_size);
+    uint8_t cls;
+
     if (!aj) {
         return NULL;
     }
+    cls = aj->slab_cls;
     memcpy(aj, j, sizeof(job_t) + j->rec.body_size);
+    aj->slab_cls = cls;
     aj->tube = NULL;
     aj->tube = j->tube;
+    dlink_init(&aj->link);
     tube_iref(aj->tube);
     aj->rec.state = JOB_COPY;
+    aj->refs = 1;
     return aj;
 }
 
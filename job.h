@@ -2,7 +2,9 @@
 #define __JOB_H_INCLUDED__
 
 #include <stdint.h>
+#include "dlist.h"
 #include "tube.h"
+#include "dheap.h"
 
 #define JOB_INVALID         0
 #define JOB_READY           1
@@ -12,37 +14,54 @@
 #define JOB_COPY            5
 
 typedef struct job_st job_t;
+/* The fields scheduling looks at come first, and with the job header
+ * before them they share the first cache line of a job, see
+ * slab_init(). The counters are only read by stats-job. */
 typedef struct job_record_st {
     uintptr_t   id;
+    int64_t     deadline_at;
     uint32_t    pri;
+    int32_t     body_size;
+    uint8_t     state;
     int64_t     delay;
     int64_t     ttr;
-    int32_t     body_size;
     int64_t     created_at;
-    int64_t     deadline_at;
     uint32_t    reserve_cnt;
     uint32_t    timeout_cnt;
     uint32_t    release_cnt;
     uint32_t    bury_cnt;
     uint32_t    kick_cnt;
-    uint8_t     state;
 } jobrec_t;
 
 struct job_st {
-    jobrec_t    rec;
-    tube_t      *tube;
     size_t      heap_index; /* where is this job in its current heap */
+    tube_t      *tube;
     void        *reserver;
+    uint32_t    refs;       /* the server and unsent replies */
+    uint8_t     slab_cls;   /* allocated from, see slab_class() */
+    jobrec_t    rec;
+    dlink       link;       /* on the tube's buried list or a fifo */
+    uint32_t    binlog_seq; /* binlog file it was put in, 0 if none */
+    uint32_t    binlog_upd; /* and of its latest update, 0 if none */
     char        body[];
 };
 
+job_t *job_alloc(int body_size);
+job_t *job_new(int pri, int64_t delay, int64_t ttr,
+        int body_size, tube_t *tube);
+int job_add(job_t *j, uintptr_t job_id);
 job_t *job_create(int pir, int64_t delay, int64_t ttr,
         int body_size, tube_t *tube, uintptr_t job_id);
 void job_free(job_t *j);
+void job_iref(job_t *j);
+void job_dref(job_t *j);
 job_t *job_find(uintptr_t job_id);
-void job_set_heap_pos(void *arg, int pos);
-int job_pri_less(void *ax, void *bx);
-int job_delay_less(void *ax, void *bx);
+int job_part(uintptr_t job_id);
+
+/* the heaps of a tube's ready and delayed jobs, and of a connection's
+ * reserved jobs, see dheap.h */
+DHEAP_DECLARE(ready_heap, job_t);
+DHEAP_DECLARE(delay_heap, job_t);
 job_t *job_copy(job_t *j);
 const char *job_state(job_t *j);
 
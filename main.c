@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <ctype.h>
 #include "srv.h"
+#include "binlog.h"
 #include "version.h"
 
 #define LLONG_MAX  9223372036854775807LL
@@ -101,7 +102,7 @@ static void option_parse(int argc, char **argv) {
     char *end;
     int c;
     int err;
-    while ((c = getopt(argc, argv, "p:l:z:u:hvV")) != -1) {
+    while ((c = getopt(argc, argv, "p:l:z:u:t:b:B:f:Fs:c:R:ehvV")) != -1) {
         switch (c) {
         case 'p':
             tasque_srv.port = strtol(optarg, &end, 10);
@@ -123,6 +124,71 @@ static void option_parse(int argc, char **argv) {
         case 'u':
             tasque_srv.user = strdup(optarg);
             break;
+        case 't':
+            tasque_srv.reactor_cnt = strtol(optarg, &end, 10);
+            if (end == optarg || (*end != ' ' && *end != '\0') ||
+                    tasque_srv.reactor_cnt < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'b':
+            if (!strcmp(optarg, "epoll")) {
+                event_set_backend(EVENT_BACKEND_EPOLL);
+            } else if (!strcmp(optarg, "uring")) {
+                event_set_backend(EVENT_BACKEND_URING);
+            } else {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'B':
+            tasque_srv.binlog_dir = strdup(optarg);
+            break;
+        case 'f':
+            tasque_srv.binlog_fsync_ms = strtol(optarg, &end, 10);
+            if (end == optarg || (*end != ' ' && *end != '\0') ||
+                    tasque_srv.binlog_fsync_ms < 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'F':
+            tasque_srv.binlog_fsync_ms = BINLOG_FSYNC_NEVER;
+            break;
+        case 's':
+            tasque_srv.binlog_size = memtoll(optarg, &err);
+            if (err || tasque_srv.binlog_size <= 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'c':
+            tasque_srv.checkpoint_sec = strtol(optarg, &end, 10);
+            if (end == optarg || (*end != ' ' && *end != '\0') ||
+                    tasque_srv.checkpoint_sec < 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'R':
+            end = strrchr(optarg, ':');
+            if (!end || end == optarg) {
+                usage();
+                exit(1);
+            }
+            tasque_srv.leader_host = strndup(optarg, end - optarg);
+            optarg = end + 1;
+            tasque_srv.leader_port = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' ||
+                    tasque_srv.leader_port <= 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'e':
+            tasque_srv.edge_triggered = 1;
+            break;
         case 'V':
             ++tasque_srv.verbose;
             break;
@@ -144,6 +210,11 @@ static void option_parse(int argc, char **argv) {
         usage();
         exit(1);
     }
+
+    if (tasque_srv.checkpoint_sec && !tasque_srv.binlog_dir) {
+        fprintf(stderr, "checkpoints need a binlog, see -B\n");
+        exit(1);
+    }
 }
 
 int main(int argc, char **argv) {
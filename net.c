@@ -7,11 +7,16 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include "net.h"
 
-int create_socket(const char *ifname, int port, 
+/* Create listening sockets on `ifname':`port'. If `reuseport' is set,
+ * SO_REUSEPORT is enabled so that several sockets (one per event loop)
+ * can be bound to the same address and the kernel spreads incoming
+ * connections among them. */
+int create_socket(const char *ifname, int port, int reuseport,
         int sockfds[], size_t sz, int *pmaxfd) {
     struct addrinfo hints, *res, *res0;
     int error;
@@ -49,6 +54,15 @@ int create_socket(const char *ifname, int port,
             continue;
         }
 
+#ifdef SO_REUSEPORT
+        if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+            &on, sizeof(on))) {
+            perror("setsockopt");
+            close(sockfd);
+            continue;
+        }
+#endif /* SO_REUSEPORT */
+
         if (bind(sockfd, res->ai_addr, res->ai_addrlen)) {
             perror("bind");
             close(sockfd);
@@ -128,6 +142,12 @@ int net_nonblock(int fd) {
     return 0;
 }
 
+int net_nodelay(int fd) {
+    int one = 1;
+
+    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
 #ifdef NET_TEST_MAIN
 #include <sys/select.h>
 #include <errno.h>
@@ -143,7 +163,7 @@ int main(int argc, char *argv[]) {
     struct timeval timeout;
     int ready;
 
-    if ((count = create_socket("localhost", 5986, sockfds, 
+    if ((count = create_socket("localhost", 5986, 0, sockfds, 
             10, &maxfd)) == 0) {
         fprintf(stderr, "create_socket failed\n");
         exit(1);
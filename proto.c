@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proto.h"
+
+const char *op_names[TOTAL_OPS] = {
+    "<unknown>",
+    CMD_PUT,
+    CMD_PEEKJOB,
+    CMD_RESERVE,
+    CMD_DELETE,
+    CMD_RELEASE,
+    CMD_BURY,
+    CMD_KICK,
+    CMD_STATS,
+    CMD_JOBSTATS,
+    CMD_PEEK_BURIED,
+    CMD_USE,
+    CMD_WATCH,
+    CMD_IGNORE,
+    CMD_LIST_TUBES,
+    CMD_LIST_TUBE_USED,
+    CMD_LIST_TUBES_WATCHED,
+    CMD_STATS_TUBE,
+    CMD_PEEK_READY,
+    CMD_PEEK_DELAYED,
+    CMD_RESERVE_TIMEOUT,
+    CMD_TOUCH,
+    CMD_QUIT,
+    CMD_PAUSE_TUBE,
+    CMD_PUT_BATCH,
+    CMD_RESERVE_BATCH,
+    CMD_DELETE_BATCH,
+    CMD_TOUCH_BATCH,
+    CMD_RELEASE_BATCH,
+    CMD_CHECKPOINT,
+    CMD_REPLICATE,
+};
+
+/* the longest command name, "reserve-with-timeout" */
+#define CMD_NAME_MAX    20
+#define SAME_LEN_MAX    5
+
+/* The commands by the length of their name. Those of a length differ
+ * in their first or third byte, so a line is compared in full with
+ * one command at most. */
+static const unsigned char cmds_by_len[CMD_NAME_MAX + 1][SAME_LEN_MAX] = {
+    [3]  = { OP_PUT, OP_USE },
+    [4]  = { OP_PEEKJOB, OP_BURY, OP_KICK, OP_QUIT },
+    [5]  = { OP_TOUCH, OP_STATS, OP_WATCH },
+    [6]  = { OP_DELETE, OP_IGNORE },
+    [7]  = { OP_RESERVE, OP_RELEASE },
+    [9]  = { OP_JOBSTATS, OP_PUT_BATCH, OP_REPLICATE },
+    [10] = { OP_PEEK_READY, OP_LIST_TUBES, OP_STATS_TUBE, OP_PAUSE_TUBE,
+             OP_CHECKPOINT },
+    [11] = { OP_PEEK_BURIED, OP_TOUCH_BATCH },
+    [12] = { OP_PEEK_DELAYED, OP_DELETE_BATCH },
+    [13] = { OP_RESERVE_BATCH, OP_RELEASE_BATCH },
+    [14] = { OP_LIST_TUBE_USED },
+    [18] = { OP_LIST_TUBES_WATCHED },
+    [20] = { OP_RESERVE_TIMEOUT },
+};
+
+/* Return the OP_* of the command `line' of `len' bytes, without its
+ * "\r\n", or OP_UNKNOWN. A command taking arguments has to be
+ * followed by a space, what comes after is left to the caller. */
+int proto_which_cmd(const char *line, size_t len) {
+    const unsigned char *ops;
+    const char *name;
+    size_t n;
+    int i;
+
+    for (n = 0; n < len && n <= CMD_NAME_MAX && line[n] != ' '; ++n) {
+        /* nothing */
+    }
+    if (n > CMD_NAME_MAX) return OP_UNKNOWN;
+
+    ops = cmds_by_len[n];
+    for (i = 0; i < SAME_LEN_MAX && ops[i]; ++i) {
+        name = op_names[ops[i]];
+        if (name[0] != line[0] || name[2] != line[2]) continue;
+        if (memcmp(name, line, n) != 0) break;
+        if (name[n] == ' ' && n == len) break;
+        return ops[i];
+    }
+    return OP_UNKNOWN;
+}
+
+/* Read the decimal number at `buf', after any spaces, into `num' and
+ * set `end' past its last digit. The number has to be no more than
+ * `max'. Return 0 on success, or -1 on failure, leaving `num' and
+ * `end' alone. Unlike strtoul(), no sign is taken, and neither the
+ * locale nor errno is looked at. */
+int proto_read_num(const char *buf, uint64_t max, uint64_t *num,
+        char **end) {
+    uint64_t v = 0;
+    unsigned d;
+
+    while (*buf == ' ') ++buf;
+    if ((unsigned)(*buf - '0') > 9) return -1;
+
+    do {
+        d = *buf++ - '0';
+        if (v > (max - d) / 10) return -1;
+        v = v * 10 + d;
+    } while ((unsigned)(*buf - '0') <= 9);
+
+    *num = v;
+    if (end) *end = (char *)buf;
+    return 0;
+}
+
+static const char digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const uint64_t powers_of_10[PROTO_U64_DIGITS] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL,
+};
+
+/* Write `v' in decimal at `buf', unterminated, and return the number
+ * of digits, PROTO_U64_DIGITS at most. Two digits are done per
+ * division. */
+int proto_fmt_u64(char *buf, uint64_t v) {
+    int n = 1, i;
+    char *p;
+
+    while (n < PROTO_U64_DIGITS && v >= powers_of_10[n]) ++n;
+
+    p = buf + n;
+    while (v >= 100) {
+        i = (v % 100) * 2;
+        v /= 100;
+        *--p = digit_pairs[i + 1];
+        *--p = digit_pairs[i];
+    }
+    if (v >= 10) {
+        *--p = digit_pairs[v * 2 + 1];
+        *--p = digit_pairs[v * 2];
+    } else {
+        *--p = '0' + v;
+    }
+    return n;
+}
+
+/* gcc proto.c -DPROTO_TEST_MAIN */
+#ifdef PROTO_TEST_MAIN
+#include <assert.h>
+#include <inttypes.h>
+
+static int which(const char *line) {
+    return proto_which_cmd(line, strlen(line));
+}
+
+int main(int argc, char **argv) {
+    char buf[64], *end;
+    uint64_t v, tests[] = { 0, 9, 10, 99, 100, 12345, 4294967295ULL,
+        4294967296ULL, 10000000000000000000ULL, UINT64_MAX };
+    size_t i;
+    int op;
+
+    for (op = 1; op < TOTAL_OPS; ++op) {
+        strcpy(buf, op_names[op]);
+        strcat(buf, buf[strlen(buf) - 1] == ' ' ? "1" : "");
+        assert(which(buf) == op);
+    }
+    assert(which("") == OP_UNKNOWN);
+    assert(which("delete") == OP_UNKNOWN);
+    assert(which("deletex 1") == OP_UNKNOWN);
+    assert(which("reserves") == OP_UNKNOWN);
+    assert(which("reserve ") == OP_RESERVE);
+    assert(which("stats x") == OP_STATS);
+    assert(which("put  1") == OP_PUT);
+    assert(which("reserve-with-timeouts 1") == OP_UNKNOWN);
+    assert(proto_which_cmd("reserve-batch 3", 7) == OP_RESERVE);
+
+    assert(proto_read_num("  42 x", 100, &v, &end) == 0);
+    assert(v == 42 && strcmp(end, " x") == 0);
+    assert(proto_read_num("100", 100, &v, NULL) == 0 && v == 100);
+    assert(proto_read_num("101", 100, &v, NULL) == -1);
+    assert(proto_read_num("4294967295", UINT32_MAX, &v, NULL) == 0);
+    assert(proto_read_num("4294967296", UINT32_MAX, &v, NULL) == -1);
+    assert(proto_read_num("18446744073709551615", UINT64_MAX, &v,
+                NULL) == 0 && v == UINT64_MAX);
+    assert(proto_read_num("18446744073709551616", UINT64_MAX, &v,
+                NULL) == -1);
+    assert(proto_read_num("-1", UINT64_MAX, &v, NULL) == -1);
+    assert(proto_read_num("+1", UINT64_MAX, &v, NULL) == -1);
+    assert(proto_read_num("", UINT64_MAX, &v, NULL) == -1);
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+        buf[proto_fmt_u64(buf, tests[i])] = '\0';
+        assert(strtoull(buf, NULL, 10) == tests[i]);
+        assert(strlen(buf) == (size_t)snprintf(NULL, 0, "%" PRIu64,
+                    tests[i]));
+    }
+    for (v = 0; v < 1000000; v += 7) {
+        buf[proto_fmt_u64(buf, v * 1000003)] = '\0';
+        assert(strtoull(buf, NULL, 10) == v * 1000003);
+    }
+    printf("OK\n");
+    return 0;
+}
+#endif /* PROTO_TEST_MAIN */
+
+/* gcc -O2 -DPROTO_BENCH_MAIN proto.c times.c -o proto_bench
+ * ./proto_bench [rounds]
+ *
+ * The parsing and the reply of the commands a worker and a producer
+ * send for each job, done the way conn.c did before this file, with
+ * a strncmp() chain, strtoul() and snprintf(), and the way it does
+ * now. */
+#ifdef PROTO_BENCH_MAIN
+#include <errno.h>
+#include <inttypes.h>
+#include "times.h"
+
+static const char *lines[] = {
+    "put 1024 0 60 100",
+    "reserve",
+    "delete 1234567",
+    "reserve-with-timeout 5",
+    "release 1234567 1024 0",
+    "touch 1234567",
+    "bury 1234567 2048",
+    "stats-job 1234567",
+};
+#define LINE_CNT    (sizeof(lines) / sizeof(lines[0]))
+
+static int old_which_cmd(const char *cmd) {
+#define TEST_CMD(s, c, o) \
+    if (strncmp((s), (c), CONSTSTRLEN(c)) == 0) return (o)
+    TEST_CMD(cmd, CMD_PUT, OP_PUT);
+    TEST_CMD(cmd, CMD_PUT_BATCH, OP_PUT_BATCH);
+    TEST_CMD(cmd, CMD_PEEKJOB, OP_PEEKJOB);
+    TEST_CMD(cmd, CMD_PEEK_READY, OP_PEEK_READY);
+    TEST_CMD(cmd, CMD_PEEK_DELAYED, OP_PEEK_DELAYED);
+    TEST_CMD(cmd, CMD_PEEK_BURIED, OP_PEEK_BURIED);
+    TEST_CMD(cmd, CMD_RESERVE_TIMEOUT, OP_RESERVE_TIMEOUT);
+    TEST_CMD(cmd, CMD_RESERVE_BATCH, OP_RESERVE_BATCH);
+    TEST_CMD(cmd, CMD_RESERVE, OP_RESERVE);
+    TEST_CMD(cmd, CMD_DELETE, OP_DELETE);
+    TEST_CMD(cmd, CMD_DELETE_BATCH, OP_DELETE_BATCH);
+    TEST_CMD(cmd, CMD_RELEASE, OP_RELEASE);
+    TEST_CMD(cmd, CMD_RELEASE_BATCH, OP_RELEASE_BATCH);
+    TEST_CMD(cmd, CMD_BURY, OP_BURY);
+    TEST_CMD(cmd, CMD_KICK, OP_KICK);
+    TEST_CMD(cmd, CMD_TOUCH, OP_TOUCH);
+    TEST_CMD(cmd, CMD_TOUCH_BATCH, OP_TOUCH_BATCH);
+    TEST_CMD(cmd, CMD_JOBSTATS, OP_JOBSTATS);
+    TEST_CMD(cmd, CMD_STATS_TUBE, OP_STATS_TUBE);
+    TEST_CMD(cmd, CMD_STATS, OP_STATS);
+    TEST_CMD(cmd, CMD_USE, OP_USE);
+    TEST_CMD(cmd, CMD_WATCH, OP_WATCH);
+    TEST_CMD(cmd, CMD_IGNORE, OP_IGNORE);
+    TEST_CMD(cmd, CMD_LIST_TUBES_WATCHED, OP_LIST_TUBES_WATCHED);
+    TEST_CMD(cmd, CMD_LIST_TUBE_USED, OP_LIST_TUBE_USED);
+    TEST_CMD(cmd, CMD_LIST_TUBES, OP_LIST_TUBES);
+    TEST_CMD(cmd, CMD_QUIT, OP_QUIT);
+    TEST_CMD(cmd, CMD_PAUSE_TUBE, OP_PAUSE_TUBE);
+#undef TEST_CMD
+    return OP_UNKNOWN;
+}
+
+/* Parse `line' and format a reply to it, the old way or the new way.
+ * Return something depending on all of it. */
+static uint64_t one(int new_way, const char *line, size_t len, char *out) {
+    uint64_t a = 0, b = 0;
+    char *end = (char *)line;
+    int op, n;
+
+    if (new_way) {
+        op = proto_which_cmd(line, len);
+        end = (char *)line + strlen(op_names[op]);
+        while (proto_read_num(end, UINT64_MAX, &b, &end) == 0) a += b;
+        memcpy(out, "RESERVED ", 9);
+        n = 9 + proto_fmt_u64(out + 9, a);
+        out[n++] = ' ';
+        n += proto_fmt_u64(out + n, op);
+        out[n++] = '\r';
+        out[n++] = '\n';
+    } else {
+        if (strlen(line) != len) return 0;
+        errno = 0;
+        op = old_which_cmd(line);
+        end = (char *)line + strlen(op_names[op]);
+        while (*end) {
+            b = strtoul(end, &end, 10);
+            if (errno) return 0;
+            a += b;
+        }
+        n = snprintf(out, 64, "%s %" PRIu64 " %u\r\n", "RESERVED", a,
+                (unsigned)op);
+    }
+    return op + a + n + out[n - 3];
+}
+
+int main(int argc, char **argv) {
+    long rounds = argc > 1 ? atol(argv[1]) : 2000000, r;
+    size_t lens[LINE_CNT], i;
+    uint64_t check[2] = { 0, 0 };
+    char out[64];
+    int64_t start;
+    int w;
+
+    for (i = 0; i < LINE_CNT; ++i) {
+        lens[i] = strlen(lines[i]);
+    }
+
+    for (w = 0; w < 2; ++w) {
+        start = ustime();
+        for (r = 0; r < rounds; ++r) {
+            for (i = 0; i < LINE_CNT; ++i) {
+                check[w] += one(w, lines[i], lens[i], out);
+            }
+        }
+        printf("%s: %.1f ns/command\n", w ? "proto_*" : "libc",
+                (ustime() - start) * 1000.0 / (rounds * LINE_CNT));
+    }
+    return check[0] != check[1];
+}
+#endif /* PROTO_BENCH_MAIN */
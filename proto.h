@@ -0,0 +1,111 @@
+#ifndef __PROTO_H_INCLUDED__
+#define __PROTO_H_INCLUDED__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The words of the text protocol, see doc/protocol.txt. A command
+ * taking arguments is spelt with the space that follows its name. */
+#define CMD_PUT                 "put "
+#define CMD_PEEKJOB             "peek "
+#define CMD_PEEK_READY          "peek-ready"
+#define CMD_PEEK_DELAYED        "peek-delayed"
+#define CMD_PEEK_BURIED         "peek-buried"
+#define CMD_RESERVE             "reserve"
+#define CMD_RESERVE_TIMEOUT     "reserve-with-timeout "
+#define CMD_DELETE              "delete "
+#define CMD_RELEASE             "release "
+#define CMD_BURY                "bury "
+#define CMD_KICK                "kick "
+#define CMD_TOUCH               "touch "
+#define CMD_STATS               "stats"
+#define CMD_JOBSTATS            "stats-job "
+#define CMD_USE                 "use "
+#define CMD_WATCH               "watch "
+#define CMD_IGNORE              "ignore "
+#define CMD_LIST_TUBES          "list-tubes"
+#define CMD_LIST_TUBE_USED      "list-tube-used"
+#define CMD_LIST_TUBES_WATCHED  "list-tubes-watched"
+#define CMD_STATS_TUBE          "stats-tube "
+#define CMD_QUIT                "quit"
+#define CMD_PAUSE_TUBE          "pause-tube"
+#define CMD_PUT_BATCH           "put-batch "
+#define CMD_RESERVE_BATCH       "reserve-batch "
+#define CMD_DELETE_BATCH        "delete-batch "
+#define CMD_TOUCH_BATCH         "touch-batch "
+#define CMD_RELEASE_BATCH       "release-batch "
+#define CMD_CHECKPOINT          "checkpoint"
+#define CMD_REPLICATE           "replicate"
+
+#define CONSTSTRLEN(m)              (sizeof(m) - 1)
+
+#define CMD_PEEK_READY_LEN          CONSTSTRLEN(CMD_PEEK_READY)
+#define CMD_PEEK_DELAYED_LEN        CONSTSTRLEN(CMD_PEEK_DELAYED)
+#define CMD_PEEK_BURIED_LEN         CONSTSTRLEN(CMD_PEEK_BURIED)
+#define CMD_PEEKJOB_LEN             CONSTSTRLEN(CMD_PEEKJOB)
+#define CMD_RESERVE_LEN             CONSTSTRLEN(CMD_RESERVE)
+#define CMD_RESERVE_TIMEOUT_LEN     CONSTSTRLEN(CMD_RESERVE_TIMEOUT)
+#define CMD_DELETE_LEN              CONSTSTRLEN(CMD_DELETE)
+#define CMD_RELEASE_LEN             CONSTSTRLEN(CMD_RELEASE)
+#define CMD_BURY_LEN                CONSTSTRLEN(CMD_BURY)
+#define CMD_KICK_LEN                CONSTSTRLEN(CMD_KICK)
+#define CMD_TOUCH_LEN               CONSTSTRLEN(CMD_TOUCH)
+#define CMD_STATS_LEN               CONSTSTRLEN(CMD_STATS)
+#define CMD_JOBSTATS_LEN            CONSTSTRLEN(CMD_JOBSTATS)
+#define CMD_USE_LEN                 CONSTSTRLEN(CMD_USE)
+#define CMD_WATCH_LEN               CONSTSTRLEN(CMD_WATCH)
+#define CMD_IGNORE_LEN              CONSTSTRLEN(CMD_IGNORE)
+#define CMD_LIST_TUBES_LEN          CONSTSTRLEN(CMD_LIST_TUBES)
+#define CMD_LIST_TUBE_USED_LEN      CONSTSTRLEN(CMD_LIST_TUBE_USED)
+#define CMD_LIST_TUBES_WATCHED_LEN  CONSTSTRLEN(CMD_LIST_TUBES_WATCHED)
+#define CMD_STATS_TUBE_LEN          CONSTSTRLEN(CMD_STATS_TUBE)
+#define CMD_PAUSE_TUBE_LEN          CONSTSTRLEN(CMD_PAUSE_TUBE)
+#define CMD_PUT_BATCH_LEN           CONSTSTRLEN(CMD_PUT_BATCH)
+#define CMD_RESERVE_BATCH_LEN       CONSTSTRLEN(CMD_RESERVE_BATCH)
+#define CMD_CHECKPOINT_LEN          CONSTSTRLEN(CMD_CHECKPOINT)
+#define CMD_REPLICATE_LEN           CONSTSTRLEN(CMD_REPLICATE)
+
+#define OP_UNKNOWN              0
+#define OP_PUT                  1
+#define OP_PEEKJOB              2
+#define OP_RESERVE              3
+#define OP_DELETE               4
+#define OP_RELEASE              5
+#define OP_BURY                 6
+#define OP_KICK                 7
+#define OP_STATS                8
+#define OP_JOBSTATS             9
+#define OP_PEEK_BURIED          10
+#define OP_USE                  11
+#define OP_WATCH                12
+#define OP_IGNORE               13
+#define OP_LIST_TUBES           14
+#define OP_LIST_TUBE_USED       15
+#define OP_LIST_TUBES_WATCHED   16
+#define OP_STATS_TUBE           17
+#define OP_PEEK_READY           18
+#define OP_PEEK_DELAYED         19
+#define OP_RESERVE_TIMEOUT      20
+#define OP_TOUCH                21
+#define OP_QUIT                 22
+#define OP_PAUSE_TUBE           23
+#define OP_PUT_BATCH            24
+#define OP_RESERVE_BATCH        25
+#define OP_DELETE_BATCH         26
+#define OP_TOUCH_BATCH          27
+#define OP_RELEASE_BATCH        28
+#define OP_CHECKPOINT           29
+#define OP_REPLICATE            30
+#define TOTAL_OPS               31
+
+/* the longest number proto_fmt_u64() writes */
+#define PROTO_U64_DIGITS        20
+
+extern const char *op_names[TOTAL_OPS];
+
+int proto_which_cmd(const char *line, size_t len);
+int proto_read_num(const char *buf, uint64_t max, uint64_t *num,
+        char **end);
+int proto_fmt_u64(char *buf, uint64_t v);
+
+#endif /* __PROTO_H_INCLUDED__ */
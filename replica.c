@@ -0,0 +1,698 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "replica.h"
+#include "binlog.h"
+#include "conn.h"
+#include "srv.h"
+#include "job.h"
+#include "tube.h"
+#include "idtab.h"
+#include "times.h"
+
+#define REPL_FRAME_MAX      (1024 * 1024)       /* of log per frame */
+#define REPL_BUF_MAX        (64 * 1024 * 1024)  /* kept for a follower */
+#define REPL_BUF_MIN        (64 * 1024)
+#define REPL_PING_USEC      100000
+#define REPL_ACK_USEC       10000   /* between acks of the log */
+#define REPL_RETRY_SEC      1       /* between connects to the leader */
+#define REPL_MARKS          1024
+#define REPL_MARK_USEC      1000    /* the log given within is one mark */
+#define REPL_NAME_SIZE      (INET_ADDRSTRLEN + 8)
+
+/* A follower of this server, given the log by replica_feed() and
+ * served by a thread of its own, see send_main(). */
+typedef struct follower_st {
+    struct follower_st *next;
+    char        name[REPL_NAME_SIZE];
+    int         fd;
+    pid_t       pid;        /* of the child sending the jobs */
+    char        *buf;       /* log not sent yet */
+    size_t      len;
+    size_t      cap;
+    int         dropped;    /* it fell REPL_BUF_MAX behind */
+    uint64_t    given;      /* log bytes given it so far */
+    uint64_t    acked;      /* and applied, by its last ack */
+    /* from the oldest not acked, when the log up to an offset began
+     * to be given, to tell how late the follower is */
+    struct {
+        uint64_t    off;
+        int64_t     at;
+    } marks[REPL_MARKS];
+    size_t      mark_first;
+    size_t      mark_cnt;
+} follower_t;
+
+/* guards the followers, taken after the locks of the server and the
+ * binlog if held with them */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fed = PTHREAD_COND_INITIALIZER;
+static follower_t *followers;
+
+/* the follower side, under the server lock */
+static int connected;
+static int synced;          /* all jobs of the leader are in */
+static uint64_t syncs;
+static uint64_t applied;    /* log bytes applied since the sync */
+static uint64_t lag_bytes;  /* by the last ping */
+static int64_t lag_usec;
+
+static int write_all(int fd, const char *p, size_t n) {
+    ssize_t w;
+
+    while (n) {
+        w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+static int read_all(int fd, char *p, size_t n) {
+    ssize_t r;
+
+    while (n) {
+        r = read(fd, p, n);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) continue;
+            if (r == 0) errno = ECONNRESET;
+            return -1;
+        }
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+/* Send a frame with `n' bytes at `p' after it, in one write where it
+ * can be. */
+static int send_frame(int fd, uint32_t type, const char *p, size_t n,
+        uint64_t a, uint64_t b) {
+    repl_frame_t f = { type, n, a, b };
+    struct iovec iov[2] = { { &f, sizeof(f) }, { (char *)p, n } };
+    int i = 0;
+    ssize_t w;
+
+    while (i < 2) {
+        w = writev(fd, iov + i, 2 - i);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        for (; i < 2 && (size_t)w >= iov[i].iov_len; ++i) {
+            w -= iov[i].iov_len;
+        }
+        if (i < 2) {
+            iov[i].iov_base = (char *)iov[i].iov_base + w;
+            iov[i].iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+/* ---------------- the leader -------------------------------- */
+
+/* Send the jobs as they are, from the child forked by
+ * replica_attach(), which then exits. */
+static void send_jobs(int fd) {
+    size_t pos = 0, len = 0, cap = REPL_FRAME_MAX, n;
+    char *buf = malloc(cap), *p;
+    job_t *j;
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (!buf || send_frame(fd, REPL_HELLO, NULL, 0, sizeof(jobrec_t),
+                BINLOG_VERSION) != 0) {
+        _exit(1);
+    }
+    while ((j = idtab_next(&tasque_srv.all_jobs, &pos))) {
+        /* not logged, and neither will the rest of it be */
+        if (!j->binlog_seq) continue;
+
+        n = binlog_rec_size(j, BINLOG_PUT);
+        if (len + n > cap) {
+            if (len && send_frame(fd, REPL_JOBS, buf, len, 0, 0) != 0) {
+                _exit(1);
+            }
+            len = 0;
+            if (n > cap) {
+                if (!(p = realloc(buf, n))) _exit(1);
+                buf = p;
+                cap = n;
+            }
+        }
+        binlog_rec_encode(j, BINLOG_PUT, buf + len);
+        len += n;
+    }
+    if ((len && send_frame(fd, REPL_JOBS, buf, len, 0, 0) != 0) ||
+            send_frame(fd, REPL_SYNCED, NULL, 0, tasque_srv.next_job_id,
+                0) != 0) {
+        _exit(1);
+    }
+    _exit(0);
+}
+
+/* How long the oldest log `f' has not acked was given it, at `now'. */
+static int64_t follower_lag(follower_t *f, int64_t now) {
+    if (f->acked >= f->given || !f->mark_cnt) return 0;
+    return now - f->marks[f->mark_first].at;
+}
+
+/* Stop giving `f' the log, its thread sees to the rest. */
+static void follower_drop(follower_t *f) {
+    f->dropped = 1;
+    free(f->buf);
+    f->buf = NULL;
+    f->len = f->cap = 0;
+    shutdown(f->fd, SHUT_RDWR);
+}
+
+static void follower_unlink(follower_t *f) {
+    follower_t **pp;
+
+    pthread_mutex_lock(&lock);
+    for (pp = &followers; *pp != f; pp = &(*pp)->next);
+    *pp = f->next;
+    pthread_mutex_unlock(&lock);
+}
+
+static void follower_ack(follower_t *f, uint64_t off) {
+    pthread_mutex_lock(&lock);
+    if (off > f->given) off = f->given;
+    f->acked = off;
+    while (f->mark_cnt && f->marks[f->mark_first].off <= off) {
+        f->mark_first = (f->mark_first + 1) % REPL_MARKS;
+        --f->mark_cnt;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* Serve follower `f': wait for the child sending the jobs, then send
+ * the log as it is given, a ping every REPL_PING_USEC, and take the
+ * acks it sends back. */
+static void *send_main(void *arg) {
+    follower_t *f = arg;
+    char ack[sizeof(repl_frame_t)], *out = NULL, *p;
+    size_t out_len, out_cap = 0, ack_len = 0, off, n;
+    int64_t now, ping_due = 0, lag;
+    uint64_t given;
+    struct timespec ts;
+    repl_frame_t a;
+    const char *err = NULL;
+    int status = 0;
+    ssize_t r;
+
+    while (waitpid(f->pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            status = -1;
+            break;
+        }
+    }
+    if (status != 0) {
+        err = "sending the jobs failed";
+        goto out;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (!f->len && !f->dropped && (now = ustime()) < ping_due) {
+            ts.tv_sec = ping_due / 1000000;
+            ts.tv_nsec = ping_due % 1000000 * 1000;
+            pthread_cond_timedwait(&fed, &lock, &ts);
+        }
+        if (f->dropped) {
+            pthread_mutex_unlock(&lock);
+            err = "it fell too far behind";
+            break;
+        }
+        /* take the log, leaving the buffer sent last for more */
+        p = f->buf;
+        n = f->cap;
+        out_len = f->len;
+        f->buf = out;
+        f->cap = out_cap;
+        f->len = 0;
+        out = p;
+        out_cap = n;
+        pthread_mutex_unlock(&lock);
+
+        for (off = 0; off < out_len; off += n) {
+            n = out_len - off < REPL_FRAME_MAX ? out_len - off :
+                REPL_FRAME_MAX;
+            if (send_frame(f->fd, REPL_LOG, out + off, n, 0, 0) != 0) {
+                err = strerror(errno);
+                goto out;
+            }
+        }
+
+        now = ustime();
+        if (now >= ping_due) {
+            pthread_mutex_lock(&lock);
+            given = f->given;
+            lag = follower_lag(f, now);
+            pthread_mutex_unlock(&lock);
+            if (send_frame(f->fd, REPL_PING, NULL, 0, given, lag) != 0) {
+                err = strerror(errno);
+                goto out;
+            }
+            ping_due = now + REPL_PING_USEC;
+        }
+
+        while ((r = recv(f->fd, ack + ack_len, sizeof(ack) - ack_len,
+                        MSG_DONTWAIT)) > 0) {
+            ack_len += r;
+            if (ack_len < sizeof(ack)) continue;
+            ack_len = 0;
+            memcpy(&a, ack, sizeof(a));
+            if (a.type != REPL_ACK || a.len) {
+                err = "it sent a bad frame";
+                goto out;
+            }
+            follower_ack(f, a.a);
+        }
+        if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                    errno != EINTR)) {
+            err = r == 0 ? "it closed the connection" : strerror(errno);
+            break;
+        }
+    }
+
+out:
+    if (tasque_srv.verbose || f->dropped) {
+        fprintf(stderr, "follower %s is gone: %s\n", f->name, err);
+    }
+    follower_unlink(f);
+    close(f->fd);
+    free(f->buf);
+    free(out);
+    free(f);
+    return NULL;
+}
+
+/* Have the client on socket `fd', from `ip' and `port', follow this
+ * server, see "replicate" in the protocol. Its connection is closed
+ * by the caller once this succeeds. Called with what is logged so far
+ * written, under the server lock. -1 returned if there is no binlog
+ * or the follower can't be taken on, otherwise 0. */
+int replica_attach(int fd, const char *ip, int port) {
+    pthread_t thread;
+    follower_t *f;
+    int one = 1;
+
+    if (!tasque_srv.binlog_dir) return -1;
+    if (!(f = calloc(1, sizeof(*f)))) return -1;
+    snprintf(f->name, sizeof(f->name), "%s:%d", ip, port);
+    if ((f->fd = dup(fd)) < 0) {
+        free(f);
+        return -1;
+    }
+    /* its own threads and processes write it as they go */
+    fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(f->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    f->pid = fork();
+    if (f->pid < 0) {
+        fprintf(stderr, "fork for follower %s failed:%s\n", f->name,
+                strerror(errno));
+        close(f->fd);
+        free(f);
+        return -1;
+    }
+    if (f->pid == 0) {
+        srv_close_fds(&f->fd, 1);
+        send_jobs(f->fd);
+    }
+
+    pthread_mutex_lock(&lock);
+    f->next = followers;
+    followers = f;
+    pthread_mutex_unlock(&lock);
+
+    if (pthread_create(&thread, NULL, send_main, f) != 0) {
+        fprintf(stderr, "start follower thread failed\n");
+        follower_unlink(f);
+        kill(f->pid, SIGKILL);
+        waitpid(f->pid, NULL, 0);
+        close(f->fd);
+        free(f);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    if (tasque_srv.verbose) {
+        printf("follower %s attached\n", f->name);
+    }
+    return 0;
+}
+
+/* Give the followers the `n' bytes of log at `p', as written to the
+ * binlog. Called with the lock of the binlog held. */
+void replica_feed(const char *p, size_t n) {
+    follower_t *f;
+    int64_t now;
+    size_t cap, last;
+    char *b;
+
+    pthread_mutex_lock(&lock);
+    if (!followers) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    now = ustime();
+    for (f = followers; f; f = f->next) {
+        if (f->dropped) continue;
+        if (f->len + n > REPL_BUF_MAX) {
+            follower_drop(f);
+            continue;
+        }
+        if (f->len + n > f->cap) {
+            cap = f->cap ? f->cap * 2 : REPL_BUF_MIN;
+            while (cap < f->len + n) cap *= 2;
+            if (!(b = realloc(f->buf, cap))) {
+                follower_drop(f);
+                continue;
+            }
+            f->buf = b;
+            f->cap = cap;
+        }
+        memcpy(f->buf + f->len, p, n);
+        f->len += n;
+        f->given += n;
+
+        last = (f->mark_first + f->mark_cnt - 1) % REPL_MARKS;
+        if (f->mark_cnt && (f->mark_cnt == REPL_MARKS ||
+                    now - f->marks[last].at < REPL_MARK_USEC)) {
+            f->marks[last].off = f->given;
+        } else {
+            last = (f->mark_first + f->mark_cnt++) % REPL_MARKS;
+            f->marks[last].off = f->given;
+            f->marks[last].at = now;
+        }
+    }
+    pthread_cond_broadcast(&fed);
+    pthread_mutex_unlock(&lock);
+}
+
+/* ---------------- the follower ------------------------------ */
+
+/* Connect to the leader and ask for its jobs. Return the socket, or
+ * -1 with errno set. */
+static int dial(void) {
+    struct addrinfo hints, *res, *ai;
+    char port[16];
+    int fd = -1, one = 1, ret;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", tasque_srv.leader_port);
+    ret = getaddrinfo(tasque_srv.leader_host, port, &hints, &res);
+    if (ret != 0) {
+        errno = ret == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) return -1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (write_all(fd, CMD_REPLICATE "\r\n", CMD_REPLICATE_LEN + 2) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Apply record `r', with the tube name and body at `p', as
+ * replay_rec() of the binlog does. */
+static void apply_rec(const binlog_rec_t *r, const char *p) {
+    char name[MAX_TUBE_NAME_LEN];
+    job_t *j = job_find(r->rec.id);
+    tube_t *t;
+
+    if (r->rec.id >= tasque_srv.next_job_id) {
+        tasque_srv.next_job_id = r->rec.id + 1;
+    }
+    switch (r->type) {
+    case BINLOG_PUT:
+        if (j || r->tube_len >= MAX_TUBE_NAME_LEN ||
+                r->len != r->tube_len + (uint32_t)r->rec.body_size) {
+            return;
+        }
+        memcpy(name, p, r->tube_len);
+        name[r->tube_len] = '\0';
+        t = tube_find_or_create(name);
+        j = t ? job_create(r->rec.pri, r->rec.delay, r->rec.ttr,
+                r->rec.body_size, t, r->rec.id) : NULL;
+        if (!j) {
+            fprintf(stderr, "out of memory taking jobs from the leader\n");
+            exit(1);
+        }
+        j->rec = r->rec;
+        memcpy(j->body, p + r->tube_len, r->rec.body_size);
+        conn_replica_put(j);
+        break;
+    case BINLOG_UPDATE:
+        if (j) conn_replica_update(j, &r->rec);
+        break;
+    case BINLOG_DELETE:
+        if (j) conn_replica_delete(j);
+        break;
+    }
+}
+
+/* Apply the whole records of the `len' bytes at `p'. Return the bytes
+ * they take, or -1 if one is damaged. */
+static ssize_t apply(const char *p, size_t len) {
+    binlog_rec_t r;
+    size_t off = 0;
+
+    while (len - off >= sizeof(r)) {
+        memcpy(&r, p + off, sizeof(r));
+        if (r.len > len - off - sizeof(r)) break;
+        if (binlog_crc32(0, p + off + sizeof(r.crc),
+                    sizeof(r) - sizeof(r.crc) + r.len) != r.crc) {
+            return -1;
+        }
+        apply_rec(&r, p + off + sizeof(r));
+        off += sizeof(r) + r.len;
+    }
+    return off;
+}
+
+/* Follow the leader on socket `fd' until the connection is lost.
+ * Return why it was. */
+static const char *follow(int fd) {
+    char *buf = NULL, *p;   /* records not applied yet */
+    size_t len = 0, cap = 0;
+    int64_t now, acked_at = 0;
+    const char *err = NULL;
+    repl_frame_t f;
+    ssize_t n;
+
+    for (;;) {
+        if (read_all(fd, (char *)&f, sizeof(f)) != 0) {
+            err = strerror(errno);
+            break;
+        }
+        if (f.len && f.type != REPL_JOBS && f.type != REPL_LOG) {
+            err = "a bad frame";
+            break;
+        }
+        if (len + f.len > cap) {
+            if (!(p = realloc(buf, len + f.len))) {
+                err = "out of memory";
+                break;
+            }
+            buf = p;
+            cap = len + f.len;
+        }
+        if (read_all(fd, buf + len, f.len) != 0) {
+            err = strerror(errno);
+            break;
+        }
+        len += f.len;
+
+        switch (f.type) {
+        case REPL_HELLO:
+            if (f.a != sizeof(jobrec_t) || f.b != BINLOG_VERSION) {
+                err = "a leader of another version";
+                goto out;
+            }
+            srv_lock();
+            conn_replica_reset();
+            conn_replica_flush();
+            connected = 1;
+            synced = 0;
+            ++syncs;
+            applied = lag_bytes = 0;
+            lag_usec = 0;
+            srv_unlock();
+            len = 0;
+            break;
+        case REPL_JOBS:
+        case REPL_LOG:
+            srv_lock();
+            n = apply(buf, len);
+            if (n > 0 && f.type == REPL_LOG) applied += n;
+            conn_replica_flush();
+            srv_unlock();
+            if (n < 0) {
+                err = "a damaged record";
+                goto out;
+            }
+            memmove(buf, buf + n, len - n);
+            len -= n;
+
+            now = ustime();
+            if (f.type == REPL_LOG && now - acked_at >= REPL_ACK_USEC) {
+                if (send_frame(fd, REPL_ACK, NULL, 0, applied, 0) != 0) {
+                    err = strerror(errno);
+                    goto out;
+                }
+                acked_at = now;
+            }
+            break;
+        case REPL_SYNCED:
+            srv_lock();
+            if (f.a > tasque_srv.next_job_id) {
+                tasque_srv.next_job_id = f.a;
+            }
+            synced = 1;
+            srv_unlock();
+            if (tasque_srv.verbose) {
+                printf("synced with leader %s:%d\n",
+                        tasque_srv.leader_host, tasque_srv.leader_port);
+            }
+            break;
+        case REPL_PING:
+            srv_lock();
+            lag_bytes = f.a > applied + len ? f.a - applied - len : 0;
+            lag_usec = f.b;
+            srv_unlock();
+            if (send_frame(fd, REPL_ACK, NULL, 0, applied, 0) != 0) {
+                err = strerror(errno);
+                goto out;
+            }
+            acked_at = ustime();
+            break;
+        default:
+            err = "a bad frame";
+            goto out;
+        }
+    }
+
+out:
+    free(buf);
+    return err;
+}
+
+static void *follow_main(void *arg) {
+    const char *err;
+    int fd, loud = 1;
+
+    (void)arg;
+    for (;;) {
+        fd = dial();
+        if (fd < 0) {
+            if (loud) {
+                fprintf(stderr, "connect to leader %s:%d failed:%s\n",
+                        tasque_srv.leader_host, tasque_srv.leader_port,
+                        strerror(errno));
+            }
+            loud = 0;
+        } else {
+            err = follow(fd);
+            close(fd);
+            srv_lock();
+            connected = synced = 0;
+            srv_unlock();
+            fprintf(stderr, "lost leader %s:%d: %s\n",
+                    tasque_srv.leader_host, tasque_srv.leader_port, err);
+            loud = 1;
+        }
+        sleep(REPL_RETRY_SEC);
+    }
+    return NULL;
+}
+
+/* Start following the leader given by -R, on a thread of its own. */
+void replica_follow(void) {
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, follow_main, NULL) != 0) {
+        fprintf(stderr, "start replication thread failed\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/* Format the replication stats as in the `stats' command, under the
+ * server lock. Return the length like snprintf(). The lag is that of
+ * the log, in bytes the leader has yet to send by the last ping on a
+ * follower and yet to be acked on a leader, and in how long the
+ * oldest of it not acked has been given, by the last ping on a
+ * follower. A leader tells the most of its followers. */
+int replica_fmt_stats(char *buf, size_t n) {
+    uint64_t given = 0, behind = 0;
+    int64_t now = ustime(), late = 0;
+    follower_t *f;
+    int cnt = 0;
+
+    if (tasque_srv.leader_host) {
+        return snprintf(buf, n,
+                "replication-role: follower\n"
+                "replication-leader: %s:%d\n"
+                "replication-connected: %d\n"
+                "replication-synced: %d\n"
+                "replication-syncs: %" PRIu64 "\n"
+                "replication-offset: %" PRIu64 "\n"
+                "replication-lag-bytes: %" PRIu64 "\n"
+                "replication-lag-ms: %" PRId64 "\n",
+                tasque_srv.leader_host, tasque_srv.leader_port,
+                connected, synced, syncs, applied, lag_bytes,
+                lag_usec / 1000);
+    }
+
+    pthread_mutex_lock(&lock);
+    for (f = followers; f; f = f->next) {
+        if (f->dropped) continue;
+        ++cnt;
+        if (f->given > given) given = f->given;
+        if (f->given - f->acked > behind) behind = f->given - f->acked;
+        if (follower_lag(f, now) > late) late = follower_lag(f, now);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return snprintf(buf, n,
+            "replication-role: leader\n"
+            "replication-followers: %d\n"
+            "replication-offset: %" PRIu64 "\n"
+            "replication-lag-bytes: %" PRIu64 "\n"
+            "replication-lag-ms: %" PRId64 "\n",
+            cnt, given, behind, late / 1000);
+}
@@ -0,0 +1,40 @@
+#ifndef __REPLICA_H_INCLUDED__
+#define __REPLICA_H_INCLUDED__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Replication ships the binlog of a leader to followers as it is
+ * written. A follower, started with -R, connects to its leader and
+ * sends "replicate". The leader forks, and the child sends the jobs
+ * as they are then, as PUT records, while what the leader logs from
+ * then on is kept for the follower and sent once the child is done.
+ * The follower applies all of it to jobs of its own, logged in its
+ * own binlog if it has one, and turns down what would change them.
+ * Each follower has a thread on either side for the socket, which
+ * takes the server lock to apply records or to be given them.
+ *
+ * All that is sent is in frames, the records in those of the jobs
+ * and of the log as they are in a binlog file, in the byte order of
+ * the leader. */
+#define REPL_HELLO      1   /* a: sizeof(jobrec_t), b: BINLOG_VERSION */
+#define REPL_JOBS       2   /* records of the jobs as forked */
+#define REPL_SYNCED     3   /* a: the next job id, all jobs are sent */
+#define REPL_LOG        4   /* records of the log since */
+#define REPL_PING       5   /* a: log bytes given the follower, b: its
+                               lag in usec, see replica_fmt_stats() */
+#define REPL_ACK        6   /* to the leader, a: log bytes applied */
+
+typedef struct repl_frame_st {
+    uint32_t    type;       /* REPL_* */
+    uint32_t    len;        /* bytes that follow */
+    uint64_t    a;
+    uint64_t    b;
+} repl_frame_t;
+
+int replica_attach(int fd, const char *ip, int port);
+void replica_feed(const char *p, size_t n);
+void replica_follow(void);
+int replica_fmt_stats(char *buf, size_t n);
+
+#endif /* __REPLICA_H_INCLUDED__ */
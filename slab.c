@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "slab.h"
+
+struct slab_st {
+    slab_t      *prev;
+    slab_t      *next;      /* in the partial list of its class */
+    void        *free;      /* chunks given back */
+    uint32_t    used;       /* chunks handed out */
+    uint32_t    carved;     /* chunks ever handed out, the rest is
+                               untouched memory */
+};
+
+/* chunks start after the header, on a cache line */
+#define SLAB_HDR_SIZE   ((sizeof(slab_t) + 63) & ~(size_t)63)
+
+#define slab_of(p) \
+    ((slab_t *)((uintptr_t)(p) & ~((uintptr_t)SLAB_SIZE - 1)))
+#define slab_chunk(s, c, i) \
+    ((char *)(s) + SLAB_HDR_SIZE + (size_t)(i) * (c)->size)
+
+static slab_class_t classes[SLAB_MAX_CLASSES];
+static int class_cnt;           /* classes[1 .. class_cnt] are used */
+static uint64_t large_cnt;      /* malloc()ed chunks */
+static uint64_t released_cnt;   /* slabs unmapped */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Chunk sizes grow by a quarter from SLAB_MIN_CHUNK, in whole cache
+ * lines, up to SLAB_MAX_CHUNK. Every chunk then starts on a cache
+ * line, and so does the head of the job in it. */
+void slab_init(void) {
+    size_t size = SLAB_MIN_CHUNK;
+    slab_class_t *c;
+
+    memset(classes, 0, sizeof(classes));
+    class_cnt = 0;
+    while (class_cnt + 1 < SLAB_MAX_CLASSES) {
+        c = &classes[++class_cnt];
+        c->size = size < SLAB_MAX_CHUNK ? size : SLAB_MAX_CHUNK;
+        c->per_slab = (SLAB_SIZE - SLAB_HDR_SIZE) / c->size;
+        if (c->size == SLAB_MAX_CHUNK) break;
+        size = ((size + size / 4) + 63) & ~(size_t)63;
+    }
+}
+
+/* Return the class to allocate `size' bytes from. */
+int slab_class(size_t size) {
+    int lo = 1, hi = class_cnt, mid;
+
+    if (size > classes[class_cnt].size) {
+        return SLAB_LARGE;
+    }
+
+    /* the first class big enough */
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (classes[mid].size < size) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void list_push(slab_t **head, slab_t *s) {
+    s->prev = NULL;
+    s->next = *head;
+    if (*head) (*head)->prev = s;
+    *head = s;
+}
+
+static void list_unlink(slab_t **head, slab_t *s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        *head = s->next;
+    }
+    if (s->next) s->next->prev = s->prev;
+    s->prev = s->next = NULL;
+}
+
+/* Map a slab aligned to its size: map twice as much and trim. */
+static slab_t *slab_map(void) {
+    char *p, *a;
+    size_t head;
+
+    p = mmap(NULL, SLAB_SIZE * 2, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+
+    a = (char *)(((uintptr_t)p + SLAB_SIZE - 1) &
+            ~((uintptr_t)SLAB_SIZE - 1));
+    head = a - p;
+    if (head) munmap(p, head);
+    munmap(a + SLAB_SIZE, SLAB_SIZE - head);
+    return (slab_t *)a;
+}
+
+static slab_t *slab_new(slab_class_t *c) {
+    slab_t *s = c->spare;
+
+    if (s) {
+        c->spare = NULL;
+    } else {
+        s = slab_map();
+        if (!s) return NULL;
+        ++c->slabs;
+    }
+
+    memset(s, 0, sizeof(*s));
+    return s;
+}
+
+/* An empty slab is kept as the spare of its class, so that a class
+ * going back and forth between zero and a few chunks doesn't map and
+ * unmap all the time. Other empty slabs go back to the system. */
+static void slab_empty(slab_class_t *c, slab_t *s) {
+    list_unlink(&c->partial, s);
+    if (!c->spare) {
+        c->spare = s;
+        return;
+    }
+    munmap(s, SLAB_SIZE);
+    --c->slabs;
+    ++released_cnt;
+}
+
+static void *alloc_chunk(int cls, size_t size) {
+    slab_class_t *c;
+    slab_t *s;
+    void *p;
+
+    if (cls == SLAB_LARGE) {
+        p = malloc(size);
+        if (p) ++large_cnt;
+        return p;
+    }
+
+    c = &classes[cls];
+    if (!(s = c->partial)) {
+        if (!(s = slab_new(c))) {
+            return NULL;
+        }
+        list_push(&c->partial, s);
+    }
+
+    if (s->free) {
+        p = s->free;
+        s->free = *(void **)p;
+    } else {
+        p = slab_chunk(s, c, s->carved++);
+    }
+
+    if (++s->used == c->per_slab) {
+        list_unlink(&c->partial, s);
+    }
+    ++c->used;
+    return p;
+}
+
+static void free_chunk(int cls, void *p) {
+    slab_class_t *c;
+    slab_t *s;
+
+    if (cls == SLAB_LARGE) {
+        free(p);
+        --large_cnt;
+        return;
+    }
+
+    c = &classes[cls];
+    s = slab_of(p);
+    *(void **)p = s->free;
+    s->free = p;
+    if (s->used-- == c->per_slab) {
+        list_push(&c->partial, s);
+    }
+    --c->used;
+
+    if (!s->used) {
+        slab_empty(c, s);
+    }
+}
+
+/* Allocate `size' bytes from class `cls', see slab_class().
+ * NULL returned on failure. */
+void *slab_alloc(int cls, size_t size) {
+    void *p;
+
+    pthread_mutex_lock(&lock);
+    p = alloc_chunk(cls, size);
+    pthread_mutex_unlock(&lock);
+    return p;
+}
+
+/* Give back `p', allocated from class `cls'. */
+void slab_free(int cls, void *p) {
+    pthread_mutex_lock(&lock);
+    free_chunk(cls, p);
+    pthread_mutex_unlock(&lock);
+}
+
+static int fmt_stats(char *buf, size_t n) {
+    slab_class_t *c;
+    uint64_t mapped = 0, used = 0;
+    int i, r, len = 0;
+
+#define SLAB_APPEND(...) do {                                   \
+        r = snprintf(buf ? buf + len : NULL,                    \
+                (size_t)len < n ? n - len : 0, __VA_ARGS__);    \
+        if (r < 0) return r;                                    \
+        len += r;                                               \
+    } while (0)
+
+    for (i = 1; i <= class_cnt; ++i) {
+        c = &classes[i];
+        mapped += (uint64_t)c->slabs * SLAB_SIZE;
+        used += c->used * c->size;
+    }
+
+    SLAB_APPEND("slab-bytes-mapped: %" PRIu64 "\n", mapped);
+    SLAB_APPEND("slab-bytes-used: %" PRIu64 "\n", used);
+    SLAB_APPEND("slab-released: %" PRIu64 "\n", released_cnt);
+    SLAB_APPEND("slab-large-chunks: %" PRIu64 "\n", large_cnt);
+
+    for (i = 1; i <= class_cnt; ++i) {
+        c = &classes[i];
+        if (!c->slabs) continue;
+        SLAB_APPEND("slab-%zu-slabs: %u\n", c->size, c->slabs);
+        SLAB_APPEND("slab-%zu-chunks-used: %" PRIu64 "\n",
+                c->size, c->used);
+    }
+#undef SLAB_APPEND
+    return len;
+}
+
+/* Format the allocator stats as in the `stats' command, one pair of
+ * lines per class that has slabs. Return the length like snprintf(). */
+int slab_fmt_stats(char *buf, size_t n) {
+    int r;
+
+    pthread_mutex_lock(&lock);
+    r = fmt_stats(buf, n);
+    pthread_mutex_unlock(&lock);
+    return r;
+}
+
+/* gcc slab.c -DSLAB_TEST_MAIN */
+#ifdef SLAB_TEST_MAIN
+#include <assert.h>
+#include <time.h>
+
+#define TEST_NUMBER     1000000
+
+int main(int argc, char **argv) {
+    static void *ptrs[TEST_NUMBER];
+    static size_t sizes[TEST_NUMBER];
+    char buf[4096];
+    size_t i, k;
+    int cls;
+
+    slab_init();
+    srand(time(NULL));
+
+    assert(slab_class(1) == 1);
+    assert(slab_class(SLAB_MIN_CHUNK) == 1);
+    assert(slab_class(SLAB_MIN_CHUNK + 1) == 2);
+    assert(slab_class(SLAB_MAX_CHUNK) != SLAB_LARGE);
+    assert(slab_class(SLAB_MAX_CHUNK + 1) == SLAB_LARGE);
+
+    for (i = 0; i < TEST_NUMBER; ++i) {
+        sizes[i] = 100 + rand() % (i % 100 ? 2000 : 200000);
+        cls = slab_class(sizes[i]);
+        assert(cls == SLAB_LARGE || classes[cls].size >= sizes[i]);
+        ptrs[i] = slab_alloc(cls, sizes[i]);
+        assert(ptrs[i]);
+        memset(ptrs[i], (int)i, sizes[i]);
+
+        /* free a random earlier one now and then */
+        if (rand() % 2) {
+            k = rand() % (i + 1);
+            if (ptrs[k]) {
+                assert(*(unsigned char *)ptrs[k] == (unsigned char)k);
+                slab_free(slab_class(sizes[k]), ptrs[k]);
+                ptrs[k] = NULL;
+            }
+        }
+    }
+
+    slab_fmt_stats(buf, sizeof(buf));
+    printf("%s", buf);
+
+    for (i = 0; i < TEST_NUMBER; ++i) {
+        if (!ptrs[i]) continue;
+        assert(((unsigned char *)ptrs[i])[sizes[i] - 1] == (unsigned char)i);
+        slab_free(slab_class(sizes[i]), ptrs[i]);
+    }
+
+    /* only the spares are left */
+    for (i = 1; i <= class_cnt; ++i) {
+        assert(classes[i].used == 0);
+        assert(classes[i].slabs <= 1);
+    }
+    slab_fmt_stats(buf, sizeof(buf));
+    printf("after freeing everything:\n%s", buf);
+    return 0;
+}
+#endif /* SLAB_TEST_MAIN */
@@ -0,0 +1,37 @@
+#ifndef __SLAB_H_INCLUDED__
+#define __SLAB_H_INCLUDED__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A size-class slab allocator for jobs. Slabs are SLAB_SIZE aligned
+ * mappings cut into chunks of one class, so a chunk finds its slab
+ * by masking its address. Slabs that run empty are unmapped, except
+ * for one spare per class. It has a lock of its own, as jobs come
+ * and go under the locks of different partitions, see srv.h. */
+#define SLAB_SIZE           (1 << 20)
+#define SLAB_MIN_CHUNK      128
+#define SLAB_MAX_CHUNK      (SLAB_SIZE / 8)
+#define SLAB_MAX_CLASSES    48
+
+/* the class of sizes beyond SLAB_MAX_CHUNK, served by malloc() */
+#define SLAB_LARGE          0
+
+typedef struct slab_st slab_t;
+
+typedef struct slab_class_st {
+    size_t          size;       /* chunk size */
+    uint32_t        per_slab;   /* chunks in a slab */
+    slab_t          *partial;   /* slabs with free chunks */
+    slab_t          *spare;     /* an empty slab kept for reuse */
+    uint32_t        slabs;      /* slabs mapped, the spare included */
+    uint64_t        used;       /* chunks handed out */
+} slab_class_t;
+
+void slab_init(void);
+int slab_class(size_t size);
+void *slab_alloc(int cls, size_t size);
+void slab_free(int cls, void *p);
+int slab_fmt_stats(char *buf, size_t n);
+
+#endif /* __SLAB_H_INCLUDED__ */
@@ -0,0 +1,850 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "snapshot.h"
+#include "binlog.h"
+#include "srv.h"
+#include "job.h"
+#include "tube.h"
+#include "hash.h"
+#include "idtab.h"
+#include "times.h"
+
+#define SNAP_NAME_FMT       "snapshot.%u"
+#define SNAP_TMP_NAME       "snapshot.tmp"
+#define FILE_NAME_SIZE      32
+
+/* fold jobs are handed out from chunks of this many */
+#define FOLD_CHUNK          65536
+
+/* A job of a fold: where its body and its latest record are, in the
+ * files mapped. A free one is on the free list by `next'. */
+typedef struct fold_job_st {
+    uint64_t    id;
+    union {
+        const char *put;    /* its full record */
+        struct fold_job_st *next;
+    };
+    const char  *last;      /* its latest record */
+    uint32_t    tube;       /* in fold_t.tubes */
+} fold_job_t;
+
+typedef struct fold_tube_st {
+    char        name[SNAP_NAME_SIZE];
+    uint64_t    cnt[SNAP_GROUPS];
+    uint64_t    bytes[SNAP_GROUPS];
+    uint64_t    off[SNAP_GROUPS];   /* where its next job goes */
+} fold_tube_t;
+
+typedef struct fold_map_st {
+    char        *data;
+    size_t      size;
+} fold_map_t;
+
+/* Everything a fold works with. Nothing of it is shared with the event
+ * loop, which goes on while a fold runs. */
+typedef struct fold_st {
+    idtab_t     ids;        /* id -> fold_job_t */
+    fold_job_t  **chunks;
+    size_t      chunk_cnt;
+    size_t      chunk_used; /* jobs handed out from the last chunk */
+    fold_job_t  *free;
+    fold_tube_t **tubes;
+    size_t      tube_cnt;
+    size_t      tube_cap;
+    hash_t      names;      /* tube name -> index + 1 in tubes */
+    fold_map_t  *maps;
+    size_t      map_cnt;
+    uint64_t    next_id;
+    snap_stat_t *st;
+} fold_t;
+
+#define rec_at(p)   ((const binlog_rec_t *)(p))
+
+/* Map file `name' of `dir_fd' for reading. NULL returned if it can't
+ * be read, with errno ENOENT if it isn't there or is empty. */
+static char *map_file(int dir_fd, const char *name, size_t *size) {
+    struct stat st;
+    char *p;
+    int fd;
+
+    fd = openat(dir_fd, name, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        errno = ENOENT;
+        return NULL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    *size = st.st_size;
+    return p;
+}
+
+/* Check the header of the snapshot mapped at `p', of `size' bytes. */
+static int hdr_ok(const char *p, size_t size, uint32_t seq) {
+    const snap_hdr_t *h = (const snap_hdr_t *)p;
+
+    return size >= sizeof(*h) &&
+        !memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) &&
+        h->version == SNAP_VERSION &&
+        h->rec_size == sizeof(jobrec_t) && h->seq == seq &&
+        h->size == size &&
+        binlog_crc32(0, h, offsetof(snap_hdr_t, crc)) == h->crc;
+}
+
+/* The job record at `p', `left' bytes before the end of the section,
+ * if it is whole and matches its crc. Return its padded size, 0 if
+ * it is bad. */
+static size_t entry_size(const char *p, size_t left) {
+    const binlog_rec_t *r = rec_at(p);
+    size_t n;
+
+    if (left < sizeof(*r)) return 0;
+    n = sizeof(*r) + r->len;
+    if (r->len > left - sizeof(*r) || r->type != BINLOG_PUT ||
+            r->tube_len || r->len != (uint32_t)r->rec.body_size ||
+            binlog_crc32(0, p + sizeof(r->crc), n - sizeof(r->crc)) !=
+            r->crc) {
+        return 0;
+    }
+    return SNAP_PAD(n) <= left ? SNAP_PAD(n) : 0;
+}
+
+static int fold_map(fold_t *f, char *data, size_t size) {
+    fold_map_t *m;
+
+    m = realloc(f->maps, (f->map_cnt + 1) * sizeof(*m));
+    if (!m) return -1;
+    f->maps = m;
+    f->maps[f->map_cnt].data = data;
+    f->maps[f->map_cnt].size = size;
+    ++f->map_cnt;
+    f->st->read += size;
+    return 0;
+}
+
+/* The index of the tube named by the `len' bytes at `name'. */
+static int fold_tube(fold_t *f, const char *name, size_t len,
+        uint32_t *idx) {
+    char key[SNAP_NAME_SIZE];
+    fold_tube_t *t, **ts;
+    void *v;
+
+    if (len >= MAX_TUBE_NAME_LEN) return -1;
+    memcpy(key, name, len);
+    key[len] = '\0';
+    if ((v = hash_get_val(&f->names, key))) {
+        *idx = (uintptr_t)v - 1;
+        return 0;
+    }
+
+    if (f->tube_cnt == f->tube_cap) {
+        f->tube_cap = f->tube_cap ? f->tube_cap * 2 : 16;
+        ts = realloc(f->tubes, f->tube_cap * sizeof(*ts));
+        if (!ts) return -1;
+        f->tubes = ts;
+    }
+    if (!(t = calloc(1, sizeof(*t)))) return -1;
+    f->tubes[f->tube_cnt] = t;
+    memcpy(t->name, key, len + 1);
+    if (hash_insert(&f->names, t->name,
+                (void *)(uintptr_t)(f->tube_cnt + 1)) != 0) {
+        free(t);
+        return -1;
+    }
+    *idx = f->tube_cnt++;
+    return 0;
+}
+
+/* Start keeping job `id', put at `put' in tube `tube'. */
+static int fold_put(fold_t *f, uint64_t id, const char *put,
+        uint32_t tube) {
+    fold_job_t *j, **c;
+
+    if (idtab_get(&f->ids, id)) return 0;
+
+    if ((j = f->free)) {
+        f->free = j->next;
+    } else {
+        if (!f->chunk_cnt || f->chunk_used == FOLD_CHUNK) {
+            c = realloc(f->chunks, (f->chunk_cnt + 1) * sizeof(*c));
+            if (!c) return -1;
+            f->chunks = c;
+            if (!(c[f->chunk_cnt] = malloc(FOLD_CHUNK * sizeof(*j)))) {
+                return -1;
+            }
+            ++f->chunk_cnt;
+            f->chunk_used = 0;
+        }
+        j = &f->chunks[f->chunk_cnt - 1][f->chunk_used++];
+    }
+
+    j->id = id;
+    j->put = j->last = put;
+    j->tube = tube;
+    if (idtab_insert(&f->ids, id, j) != 0) return -1;
+    if (id >= f->next_id) f->next_id = id + 1;
+    return 0;
+}
+
+static void fold_del(fold_t *f, fold_job_t *j) {
+    idtab_remove(&f->ids, j->id);
+    j->id = 0;
+    j->next = f->free;
+    f->free = j;
+}
+
+/* Take in the jobs of snapshot.<seq>. */
+static int fold_snapshot(fold_t *f, int dir_fd, uint32_t seq) {
+    char name[FILE_NAME_SIZE];
+    const snap_hdr_t *h;
+    const snap_tube_t *t;
+    uint64_t i, k;
+    size_t size, off, n, end;
+    uint32_t tube;
+    char *p;
+
+    snprintf(name, sizeof(name), SNAP_NAME_FMT, seq);
+    if (!(p = map_file(dir_fd, name, &size))) {
+        fprintf(stderr, "map %s failed:%s\n", name, strerror(errno));
+        return -1;
+    }
+    if (fold_map(f, p, size) != 0) {
+        munmap(p, size);
+        return -1;
+    }
+    if (!hdr_ok(p, size, seq)) {
+        fprintf(stderr, "%s is not a snapshot of this version\n", name);
+        return -1;
+    }
+
+    h = (const snap_hdr_t *)p;
+    if (h->next_id > f->next_id) f->next_id = h->next_id;
+    off = sizeof(*h);
+    for (i = 0; i < h->tube_cnt; ++i) {
+        t = (const snap_tube_t *)(p + off);
+        if (size - off < sizeof(*t) ||
+                binlog_crc32(0, t, offsetof(snap_tube_t, crc)) != t->crc ||
+                t->bytes > size - off - sizeof(*t) ||
+                fold_tube(f, t->name, strnlen(t->name, MAX_TUBE_NAME_LEN),
+                    &tube) != 0) {
+            goto bad;
+        }
+        off += sizeof(*t);
+        end = off + t->bytes;
+        for (k = 0; k < t->cnt[0] + t->cnt[1] + t->cnt[2]; ++k) {
+            if (!(n = entry_size(p + off, end - off))) goto bad;
+            if (fold_put(f, rec_at(p + off)->rec.id, p + off, tube) != 0) {
+                return -1;
+            }
+            off += n;
+        }
+    }
+    return 0;
+
+bad:
+    fprintf(stderr, "%s: bad section at %zu\n", name, off);
+    return -1;
+}
+
+/* Take in the records of binlog.<seq>, as binlog_init() would. */
+static int fold_binlog(fold_t *f, int dir_fd, uint32_t seq) {
+    char name[FILE_NAME_SIZE];
+    binlog_hdr_t h;
+    binlog_rec_t r;
+    fold_job_t *j;
+    size_t size, off;
+    uint32_t tube;
+    char *p;
+
+    snprintf(name, sizeof(name), "binlog.%u", seq);
+    if (!(p = map_file(dir_fd, name, &size))) {
+        /* removed once nothing in it was alive */
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (fold_map(f, p, size) != 0) {
+        munmap(p, size);
+        return -1;
+    }
+    if (size < sizeof(h)) return 0;
+
+    memcpy(&h, p, sizeof(h));
+    if (memcmp(h.magic, BINLOG_MAGIC, sizeof(h.magic)) ||
+            h.version != BINLOG_VERSION ||
+            h.rec_size != sizeof(jobrec_t) || h.seq != seq) {
+        fprintf(stderr, "%s is not a binlog of this version\n", name);
+        return -1;
+    }
+    if (h.next_id > f->next_id) f->next_id = h.next_id;
+
+    for (off = sizeof(h); size - off >= sizeof(r);
+            off += sizeof(r) + r.len) {
+        memcpy(&r, p + off, sizeof(r));
+        if (r.len > size - off - sizeof(r) ||
+                binlog_crc32(0, p + off + sizeof(r.crc),
+                    sizeof(r) - sizeof(r.crc) + r.len) != r.crc) {
+            break;
+        }
+        if (r.rec.id >= f->next_id) f->next_id = r.rec.id + 1;
+
+        j = idtab_get(&f->ids, r.rec.id);
+        switch (r.type) {
+        case BINLOG_PUT:
+            if (r.len != r.tube_len + (uint32_t)r.rec.body_size) break;
+            if (fold_tube(f, p + off + sizeof(r), r.tube_len, &tube) != 0 ||
+                    fold_put(f, r.rec.id, p + off, tube) != 0) {
+                return -1;
+            }
+            break;
+        case BINLOG_UPDATE:
+            if (j) j->last = p + off;
+            break;
+        case BINLOG_DELETE:
+            if (j) fold_del(f, j);
+            break;
+        }
+    }
+    return 0;
+}
+
+static int job_group(const jobrec_t *rec) {
+    if (rec->state == JOB_BURIED) return SNAP_BURIED;
+    if (rec->state == JOB_DELAYED) return SNAP_DELAYED;
+    return SNAP_READY;
+}
+
+/* Where the jobs of each tube and group go in a snapshot, whose size
+ * is returned. */
+static uint64_t fold_layout(fold_t *f, uint64_t *tube_cnt) {
+    const binlog_rec_t *put;
+    fold_tube_t *t;
+    fold_job_t *j;
+    jobrec_t rec;
+    uint64_t off = sizeof(snap_hdr_t), n;
+    size_t c, i, used;
+    int g;
+
+    for (c = 0; c < f->chunk_cnt; ++c) {
+        used = c == f->chunk_cnt - 1 ? f->chunk_used : FOLD_CHUNK;
+        for (i = 0; i < used; ++i) {
+            j = &f->chunks[c][i];
+            if (!j->id) continue;
+            put = rec_at(j->put);
+            memcpy(&rec, &rec_at(j->last)->rec, sizeof(rec));
+            g = job_group(&rec);
+            t = f->tubes[j->tube];
+            ++t->cnt[g];
+            t->bytes[g] += SNAP_PAD(sizeof(*put) + put->rec.body_size);
+            ++f->st->jobs;
+        }
+    }
+
+    *tube_cnt = 0;
+    for (i = 0; i < f->tube_cnt; ++i) {
+        t = f->tubes[i];
+        n = t->cnt[0] + t->cnt[1] + t->cnt[2];
+        if (!n) continue;
+        ++*tube_cnt;
+        off += sizeof(snap_tube_t);
+        for (g = 0; g < SNAP_GROUPS; ++g) {
+            t->off[g] = off;
+            off += t->bytes[g];
+        }
+    }
+    return off;
+}
+
+/* Write the jobs of the fold into the snapshot mapped at `p'. */
+static void fold_write(fold_t *f, char *p, uint64_t size, uint32_t seq,
+        uint64_t tube_cnt) {
+    snap_hdr_t *h = (snap_hdr_t *)p;
+    snap_tube_t *st;
+    const binlog_rec_t *put;
+    binlog_rec_t r;
+    fold_tube_t *t;
+    fold_job_t *j;
+    size_t c, i, used;
+    uint64_t n;
+    char *d;
+    int g;
+
+    memcpy(h->magic, SNAP_MAGIC, sizeof(h->magic));
+    h->version = SNAP_VERSION;
+    h->rec_size = sizeof(jobrec_t);
+    h->seq = seq;
+    h->next_id = f->next_id;
+    h->tube_cnt = tube_cnt;
+    h->job_cnt = f->st->jobs;
+    h->size = size;
+    h->crc = binlog_crc32(0, h, offsetof(snap_hdr_t, crc));
+
+    for (i = 0; i < f->tube_cnt; ++i) {
+        t = f->tubes[i];
+        n = t->cnt[0] + t->cnt[1] + t->cnt[2];
+        if (!n) continue;
+        st = (snap_tube_t *)(p + t->off[0] - sizeof(*st));
+        memcpy(st->cnt, t->cnt, sizeof(st->cnt));
+        st->bytes = t->bytes[0] + t->bytes[1] + t->bytes[2];
+        memcpy(st->name, t->name, sizeof(st->name));
+        st->crc = binlog_crc32(0, st, offsetof(snap_tube_t, crc));
+    }
+
+    for (c = 0; c < f->chunk_cnt; ++c) {
+        used = c == f->chunk_cnt - 1 ? f->chunk_used : FOLD_CHUNK;
+        for (i = 0; i < used; ++i) {
+            j = &f->chunks[c][i];
+            if (!j->id) continue;
+            put = rec_at(j->put);
+            memset(&r, 0, sizeof(r));
+            memcpy(&r.rec, &rec_at(j->last)->rec, sizeof(r.rec));
+            r.rec.body_size = put->rec.body_size;
+            if (r.rec.state == JOB_RESERVED) {
+                r.rec.state = JOB_READY;
+            }
+            r.type = BINLOG_PUT;
+            r.len = r.rec.body_size;
+
+            g = job_group(&r.rec);
+            t = f->tubes[j->tube];
+            d = p + t->off[g];
+            t->off[g] += SNAP_PAD(sizeof(r) + r.len);
+
+            memcpy(d, &r, sizeof(r));
+            memcpy(d + sizeof(r), j->put + sizeof(r) + put->tube_len, r.len);
+            r.crc = binlog_crc32(0, d + sizeof(r.crc),
+                    sizeof(r) - sizeof(r.crc) + r.len);
+            memcpy(d, &r.crc, sizeof(r.crc));
+        }
+    }
+}
+
+static void fold_destroy(fold_t *f) {
+    size_t i;
+
+    for (i = 0; i < f->map_cnt; ++i) {
+        munmap(f->maps[i].data, f->maps[i].size);
+    }
+    for (i = 0; i < f->chunk_cnt; ++i) {
+        free(f->chunks[i]);
+    }
+    for (i = 0; i < f->tube_cnt; ++i) {
+        free(f->tubes[i]);
+    }
+    free(f->maps);
+    free(f->chunks);
+    free(f->tubes);
+    hash_destroy(&f->names);
+    idtab_destroy(&f->ids);
+}
+
+/* Write snapshot.<seq> from snapshot.<snap>, unless `snap' is 0, and
+ * the binlog files from `from' to before `seq'. It is written under a
+ * temporary name, synced and then renamed, so a snapshot that is there
+ * is whole. Runs on its own thread: it only reads files the event loop
+ * is done writing. 0 returned on success, otherwise -1. */
+int snapshot_fold(int dir_fd, uint32_t snap, uint32_t from, uint32_t seq,
+        snap_stat_t *st) {
+    char name[FILE_NAME_SIZE];
+    int64_t start = ustime();
+    uint64_t size, tube_cnt;
+    fold_t f;
+    char *p;
+    int fd = -1, ret = -1;
+    uint32_t s;
+
+    memset(st, 0, sizeof(*st));
+    memset(&f, 0, sizeof(f));
+    f.st = st;
+    if (idtab_init(&f.ids, 1024) != 0 ||
+            hash_init(&f.names, 16) != 0) {
+        fprintf(stderr, "fold init failed\n");
+        return -1;
+    }
+    HASH_SET_HASHFN(&f.names, hash_func_str);
+    HASH_SET_KEYCMP(&f.names, hash_keycmp_str);
+
+    if (snap && fold_snapshot(&f, dir_fd, snap) != 0) goto out;
+    for (s = from; s < seq; ++s) {
+        if (fold_binlog(&f, dir_fd, s) != 0) goto out;
+    }
+
+    size = fold_layout(&f, &tube_cnt);
+    fd = openat(dir_fd, SNAP_TMP_NAME, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        fprintf(stderr, "create " SNAP_TMP_NAME " failed:%s\n",
+                strerror(errno));
+        goto out;
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "map " SNAP_TMP_NAME " failed:%s\n",
+                strerror(errno));
+        goto out;
+    }
+    fold_write(&f, p, size, seq, tube_cnt);
+    if (msync(p, size, MS_SYNC) != 0 || munmap(p, size) != 0 ||
+            fsync(fd) != 0) {
+        fprintf(stderr, "sync " SNAP_TMP_NAME " failed:%s\n",
+                strerror(errno));
+        goto out;
+    }
+
+    snprintf(name, sizeof(name), SNAP_NAME_FMT, seq);
+    if (renameat(dir_fd, SNAP_TMP_NAME, dir_fd, name) != 0 ||
+            fsync(dir_fd) != 0) {
+        fprintf(stderr, "rename %s failed:%s\n", name, strerror(errno));
+        goto out;
+    }
+    st->bytes = size;
+    ret = 0;
+
+out:
+    if (fd >= 0) close(fd);
+    if (ret != 0) unlinkat(dir_fd, SNAP_TMP_NAME, 0);
+    fold_destroy(&f);
+    st->usec = ustime() - start;
+    return ret;
+}
+
+/* A snapshot written out as it is made, by a checkpoint. */
+typedef struct snap_out_st {
+    int         fd;
+    char        *buf;
+    size_t      len;
+    uint64_t    off;        /* of the end of buf in the file */
+    job_t       **reserved; /* the reserved jobs, by tube */
+    size_t      reserved_cnt;
+    snap_stat_t *st;
+} snap_out_t;
+
+/* a checkpoint writes this much at a time */
+#define OUT_BUF_SIZE        (1024 * 1024)
+
+static int write_all(int fd, const char *p, size_t n) {
+    ssize_t w;
+
+    while (n) {
+        w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+static int out_flush(snap_out_t *o) {
+    if (write_all(o->fd, o->buf, o->len) != 0) return -1;
+    o->len = 0;
+    return 0;
+}
+
+/* Add `n' bytes to the file. What is added in one go is either all
+ * in the buffer or all written, see out_patch(). */
+static int out_add(snap_out_t *o, const void *p, size_t n) {
+    if (o->len + n > OUT_BUF_SIZE && out_flush(o) != 0) return -1;
+    o->off += n;
+    if (n > OUT_BUF_SIZE) return write_all(o->fd, p, n);
+    memcpy(o->buf + o->len, p, n);
+    o->len += n;
+    return 0;
+}
+
+/* Overwrite the `n' bytes added at `at' with those at `p'. */
+static int out_patch(snap_out_t *o, uint64_t at, const void *p, size_t n) {
+    uint64_t start = o->off - o->len;
+
+    if (at >= start) {
+        memcpy(o->buf + (at - start), p, n);
+        return 0;
+    }
+    return pwrite(o->fd, p, n, at) == (ssize_t)n ? 0 : -1;
+}
+
+/* Add `j' to section `st' as a job of group `g'. */
+static int out_job(snap_out_t *o, snap_tube_t *st, int g, job_t *j) {
+    static const char pad[SNAP_ALIGN];
+    binlog_rec_t r;
+    size_t n;
+
+    memset(&r, 0, sizeof(r));
+    r.rec = j->rec;
+    if (r.rec.state == JOB_RESERVED) {
+        r.rec.state = JOB_READY;
+    }
+    r.type = BINLOG_PUT;
+    r.len = r.rec.body_size;
+    r.crc = binlog_crc32(binlog_crc32(0, (char *)&r + sizeof(r.crc),
+                sizeof(r) - sizeof(r.crc)), j->body, r.len);
+
+    n = sizeof(r) + r.len;
+    if (out_add(o, &r, sizeof(r)) != 0 ||
+            out_add(o, j->body, r.len) != 0 ||
+            out_add(o, pad, SNAP_PAD(n) - n) != 0) {
+        return -1;
+    }
+    ++st->cnt[g];
+    st->bytes += SNAP_PAD(n);
+    ++o->st->jobs;
+    return 0;
+}
+
+static int tube_cmp(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)(*(job_t * const *)a)->tube;
+    uintptr_t y = (uintptr_t)(*(job_t * const *)b)->tube;
+    return x < y ? -1 : x > y;
+}
+
+/* Gather the reserved jobs, which only their connections list, by
+ * their tube. */
+static int out_reserved(snap_out_t *o) {
+    size_t pos = 0, cap = 0;
+    job_t *j, **p;
+
+    while ((j = idtab_next(&tasque_srv.all_jobs, &pos))) {
+        if (j->rec.state != JOB_RESERVED || !j->binlog_seq) continue;
+        if (o->reserved_cnt == cap) {
+            cap = cap ? cap * 2 : 1024;
+            p = realloc(o->reserved, cap * sizeof(*p));
+            if (!p) return -1;
+            o->reserved = p;
+        }
+        o->reserved[o->reserved_cnt++] = j;
+    }
+    qsort(o->reserved, o->reserved_cnt, sizeof(*o->reserved), tube_cmp);
+    return 0;
+}
+
+/* The first of the reserved jobs of `t', their number in `cnt'. */
+static job_t **reserved_of(snap_out_t *o, tube_t *t, size_t *cnt) {
+    size_t lo = 0, hi = o->reserved_cnt, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if ((uintptr_t)o->reserved[mid]->tube < (uintptr_t)t) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (hi = lo; hi < o->reserved_cnt && o->reserved[hi]->tube == t;
+            ++hi) {
+        /* nothing */
+    }
+    *cnt = hi - lo;
+    return o->reserved + lo;
+}
+
+/* Add the section of tube `t', if it has jobs that are logged. */
+static int out_tube(snap_out_t *o, tube_t *t, uint64_t *tube_cnt) {
+    snap_tube_t st;
+    uint64_t at = o->off;
+    job_t *j, **res;
+    dlink *l;
+    size_t i, n;
+    int k;
+
+    res = reserved_of(o, t, &n);
+    if (!tube_ready_cnt(t) && !t->delay_jobs.len &&
+            dlink_empty(&t->buried_jobs) && !n) {
+        return 0;
+    }
+
+    memset(&st, 0, sizeof(st));
+    memcpy(st.name, t->name, sizeof(t->name));
+    if (out_add(o, &st, sizeof(st)) != 0) return -1;
+
+    for (i = 0; i < (size_t)t->ready_jobs.len; ++i) {
+        j = heap_get(&t->ready_jobs, i);
+        if (j->binlog_seq && out_job(o, &st, SNAP_READY, j) != 0) {
+            return -1;
+        }
+    }
+    for (k = 0; k < t->fifo_cnt; ++k) {
+        for (l = t->fifos[k].jobs.next; l != &t->fifos[k].jobs;
+                l = l->next) {
+            j = dlink_entry(l, job_t, link);
+            if (j->binlog_seq && out_job(o, &st, SNAP_READY, j) != 0) {
+                return -1;
+            }
+        }
+    }
+    for (i = 0; i < n; ++i) {
+        if (out_job(o, &st, SNAP_READY, res[i]) != 0) return -1;
+    }
+    for (i = 0; i < (size_t)t->delay_jobs.len; ++i) {
+        j = heap_get(&t->delay_jobs, i);
+        if (j->binlog_seq && out_job(o, &st, SNAP_DELAYED, j) != 0) {
+            return -1;
+        }
+    }
+    for (l = t->buried_jobs.next; l != &t->buried_jobs; l = l->next) {
+        j = dlink_entry(l, job_t, link);
+        if (j->binlog_seq && out_job(o, &st, SNAP_BURIED, j) != 0) {
+            return -1;
+        }
+    }
+
+    st.crc = binlog_crc32(0, &st, offsetof(snap_tube_t, crc));
+    ++*tube_cnt;
+    return out_patch(o, at, &st, sizeof(st));
+}
+
+/* Write snapshot.<seq> of the jobs in memory, which must be all that
+ * the binlog files before `seq' hold. Runs in a child forked off the
+ * server, see binlog_checkpoint(), which has the server as it was when
+ * forked to itself: nothing changes underneath, and nothing but this
+ * runs. malloc() is fine there, the C library sees to its locks on
+ * fork(). As snapshot_fold(), 0 returned on success, otherwise -1. */
+int snapshot_write(int dir_fd, uint32_t seq, snap_stat_t *st) {
+    char name[FILE_NAME_SIZE];
+    int64_t start = ustime();
+    snap_out_t o;
+    snap_hdr_t h;
+    uint64_t tube_cnt = 0;
+    size_t i;
+    int ret = -1;
+
+    memset(st, 0, sizeof(*st));
+    memset(&o, 0, sizeof(o));
+    o.st = st;
+    o.fd = openat(dir_fd, SNAP_TMP_NAME, O_WRONLY | O_CREAT | O_TRUNC,
+            0600);
+    if (o.fd < 0) {
+        fprintf(stderr, "create " SNAP_TMP_NAME " failed:%s\n",
+                strerror(errno));
+        return -1;
+    }
+    if (!(o.buf = malloc(OUT_BUF_SIZE)) || out_reserved(&o) != 0) {
+        fprintf(stderr, "checkpoint: out of memory\n");
+        goto out;
+    }
+
+    memset(&h, 0, sizeof(h));
+    if (out_add(&o, &h, sizeof(h)) != 0) goto bad;
+    for (i = 0; i < tasque_srv.tubes.used; ++i) {
+        if (out_tube(&o, tasque_srv.tubes.items[i], &tube_cnt) != 0) {
+            goto bad;
+        }
+    }
+
+    memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+    h.version = SNAP_VERSION;
+    h.rec_size = sizeof(jobrec_t);
+    h.seq = seq;
+    h.next_id = tasque_srv.next_job_id;
+    h.tube_cnt = tube_cnt;
+    h.job_cnt = st->jobs;
+    h.size = o.off;
+    h.crc = binlog_crc32(0, &h, offsetof(snap_hdr_t, crc));
+    if (out_patch(&o, 0, &h, sizeof(h)) != 0 || out_flush(&o) != 0 ||
+            fsync(o.fd) != 0) {
+        goto bad;
+    }
+
+    snprintf(name, sizeof(name), SNAP_NAME_FMT, seq);
+    if (renameat(dir_fd, SNAP_TMP_NAME, dir_fd, name) != 0 ||
+            fsync(dir_fd) != 0) {
+        fprintf(stderr, "rename %s failed:%s\n", name, strerror(errno));
+        goto out;
+    }
+    st->bytes = o.off;
+    ret = 0;
+    goto out;
+
+bad:
+    fprintf(stderr, "write " SNAP_TMP_NAME " failed:%s\n",
+            strerror(errno));
+out:
+    close(o.fd);
+    if (ret != 0) unlinkat(dir_fd, SNAP_TMP_NAME, 0);
+    free(o.buf);
+    free(o.reserved);
+    st->usec = ustime() - start;
+    return ret;
+}
+
+/* Make jobs of what snapshot.<seq> holds and add them to `jobs', their
+ * number in `cnt'. They are in no queue yet, see conn_restore_job().
+ * The jobs have seq - 1 as their binlog file, the one the snapshot
+ * stands for. -1 returned if the snapshot is bad. */
+int snapshot_load(int dir_fd, uint32_t seq, dlink *jobs, uint64_t *cnt) {
+    char name[FILE_NAME_SIZE];
+    const snap_hdr_t *h;
+    const snap_tube_t *st;
+    const binlog_rec_t *r;
+    uint64_t i, k;
+    size_t size, off = 0, n, end;
+    job_t *j;
+    tube_t *t;
+    char *p;
+    int ret = -1;
+
+    *cnt = 0;
+    snprintf(name, sizeof(name), SNAP_NAME_FMT, seq);
+    if (!(p = map_file(dir_fd, name, &size))) {
+        fprintf(stderr, "map %s failed:%s\n", name, strerror(errno));
+        return -1;
+    }
+    if (!hdr_ok(p, size, seq)) {
+        fprintf(stderr, "%s is not a snapshot of this version\n", name);
+        goto out;
+    }
+
+    h = (const snap_hdr_t *)p;
+    if (h->next_id > tasque_srv.next_job_id) {
+        tasque_srv.next_job_id = h->next_id;
+    }
+    off = sizeof(*h);
+    for (i = 0; i < h->tube_cnt; ++i) {
+        st = (const snap_tube_t *)(p + off);
+        if (size - off < sizeof(*st) ||
+                binlog_crc32(0, st, offsetof(snap_tube_t, crc)) !=
+                st->crc || st->bytes > size - off - sizeof(*st) ||
+                !memchr(st->name, '\0', MAX_TUBE_NAME_LEN) ||
+                !(t = tube_find_or_create(st->name))) {
+            goto out;
+        }
+        off += sizeof(*st);
+        end = off + st->bytes;
+        for (k = 0; k < st->cnt[0] + st->cnt[1] + st->cnt[2]; ++k) {
+            if (!(n = entry_size(p + off, end - off))) goto out;
+            r = rec_at(p + off);
+            j = job_create(r->rec.pri, r->rec.delay, r->rec.ttr,
+                    r->rec.body_size, t, r->rec.id);
+            if (!j) goto out;
+            j->rec = r->rec;
+            memcpy(j->body, p + off + sizeof(*r), r->rec.body_size);
+            j->binlog_seq = seq - 1;
+            dlink_add_tail(jobs, &j->link);
+            ++*cnt;
+            off += n;
+        }
+    }
+    ret = 0;
+
+out:
+    if (ret != 0) {
+        fprintf(stderr, "%s: bad section or out of memory at %zu\n",
+                name, off);
+    }
+    munmap(p, size);
+    return ret;
+}
@@ -0,0 +1,68 @@
+#ifndef __SNAPSHOT_H_INCLUDED__
+#define __SNAPSHOT_H_INCLUDED__
+
+#include <stdint.h>
+#include "dlist.h"
+#include "tube.h"
+#include "binlog.h"
+
+/* A snapshot is the jobs alive before binlog file `seq', kept as
+ * snapshot.<seq> next to the log, so that a restart reads it and the
+ * files from `seq' on instead of the whole log. It is laid out to be
+ * mapped and loaded in one pass: a snap_hdr_t, then per tube a
+ * snap_tube_t followed by the tube's ready, delayed and buried jobs,
+ * each group in turn. A job is a binlog_rec_t of type BINLOG_PUT with
+ * no tube name, then its body, padded to SNAP_ALIGN. Reserved jobs
+ * are kept as ready. Snapshots are written by folding the previous
+ * one and the log after it, off the event loop, or by a checkpoint
+ * from the jobs in memory, in a child process, see binlog.h. */
+#define SNAP_MAGIC          "TQSN"
+#define SNAP_VERSION        1
+
+#define SNAP_ALIGN          8
+#define SNAP_PAD(n) \
+    (((n) + SNAP_ALIGN - 1) & ~(uint64_t)(SNAP_ALIGN - 1))
+
+#define SNAP_NAME_SIZE      SNAP_PAD(MAX_TUBE_NAME_LEN)
+
+/* the groups of jobs in a tube section */
+#define SNAP_READY          0
+#define SNAP_DELAYED        1
+#define SNAP_BURIED         2
+#define SNAP_GROUPS         3
+
+typedef struct snap_hdr_st {
+    char        magic[4];
+    uint32_t    version;
+    uint32_t    rec_size;   /* sizeof(jobrec_t) of the writer */
+    uint32_t    seq;
+    uint64_t    next_id;    /* tasque_srv.next_job_id to go on from */
+    uint64_t    tube_cnt;
+    uint64_t    job_cnt;
+    uint64_t    size;       /* of the whole file */
+    uint32_t    pad;
+    uint32_t    crc;        /* of the header before it */
+} snap_hdr_t;
+
+typedef struct snap_tube_st {
+    uint64_t    cnt[SNAP_GROUPS];
+    uint64_t    bytes;      /* of the jobs that follow */
+    char        name[SNAP_NAME_SIZE];
+    uint32_t    pad;
+    uint32_t    crc;        /* of the section header before it */
+} snap_tube_t;
+
+/* what a fold did, for the stats */
+typedef struct snap_stat_st {
+    uint64_t    jobs;
+    uint64_t    bytes;      /* of the snapshot */
+    uint64_t    read;       /* bytes of snapshot and log read */
+    int64_t     usec;       /* it took */
+} snap_stat_t;
+
+int snapshot_fold(int dir_fd, uint32_t snap, uint32_t from, uint32_t seq,
+        snap_stat_t *st);
+int snapshot_write(int dir_fd, uint32_t seq, snap_stat_t *st);
+int snapshot_load(int dir_fd, uint32_t seq, dlink *jobs, uint64_t *cnt);
+
+#endif /* __SNAPSHOT_H_INCLUDED__ */
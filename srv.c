@@ -4,12 +4,17 @@
 #include <errno.h>
 #include <unistd.h>
 #include <pwd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include "srv.h"
 #include "conn.h"
 #include "tube.h"
 #include "times.h"
 #include "net.h"
+#include "slab.h"
+#include "binlog.h"
+#include "replica.h"
 
 #define DEFAULT_PORT        8774
 #define INIT_TUBE_NUM       8
@@ -50,78 +55,270 @@ static void srv_su(const char *user) {
 }
 
 void srv_init() {
-    tube_t *t = NULL;
     tasque_srv.port = DEFAULT_PORT;
+    tasque_srv.reactor_cnt = 1;
     tasque_srv.host = strdup("0.0.0.0");
     tasque_srv.user = NULL;
     tasque_srv.next_job_id = 1;
     tasque_srv.job_data_size_limit = DEFAULT_JOB_DATA_SIZE_LIMIT;
     tasque_srv.started_at = ustime();
+    tasque_srv.binlog_fsync_ms = BINLOG_DEFAULT_FSYNC_MS;
+    tasque_srv.binlog_size = BINLOG_DEFAULT_SIZE;
+    pthread_mutex_init(&tasque_srv.timers_lock, NULL);
 
     set_init(&tasque_srv.tubes, NULL, NULL);
-
-    t = tube_make_and_insert("default");
-    if (!t) {
-        fprintf(stderr, "create default tube failed\n");
+    if (hash_init(&tasque_srv.tube_names, INIT_TUBE_NUM) != 0) {
+        fprintf(stderr, "hash_init failed\n");
         exit(1);
     }
-    tasque_srv.default_tube = t;
-    tube_iref(t);
+    HASH_SET_HASHFN(&tasque_srv.tube_names, hash_func_str);
+    HASH_SET_KEYCMP(&tasque_srv.tube_names, hash_keycmp_str);
 
-    if (heap_init(&tasque_srv.conns) != 0) {
+    if (heap_init(&tasque_srv.paused) != 0) {
         fprintf(stderr, "heap_init failed\n");
         exit(1);
     }
-    tasque_srv.conns.less = conn_less;
-    tasque_srv.conns.record = conn_record;
+    tasque_srv.paused.key = tube_pause_key;
+    tasque_srv.paused.record = tube_set_pause_pos;
 
-    if (hash_init(&tasque_srv.all_jobs, INIT_JOB_NUM) != 0) {
-        fprintf(stderr, "hash_init failed\n");
+    wheel_init(&tasque_srv.timers, ustime());
+    slab_init();
+
+    if (idtab_init(&tasque_srv.all_jobs, INIT_JOB_NUM) != 0) {
+        fprintf(stderr, "idtab_init failed\n");
         exit(1);
     }
-    HASH_SET_HASHFN(&tasque_srv.all_jobs, hash_func_int);
 }
 
-void srv_serve() {
+/* A few partitions for each reactor, so that the busy tubes of the
+ * reactors seldom share one. The tubes are made once they are there,
+ * as a tube is in the partition of its name, see tube_create(). */
+static void srv_parts_init() {
+    part_t *p;
+    tube_t *t;
+    int i;
+
+    tasque_srv.part_cnt = tasque_srv.reactor_cnt > 1 ?
+        tasque_srv.reactor_cnt * PARTS_PER_REACTOR : 1;
+    tasque_srv.parts = (part_t *)calloc(tasque_srv.part_cnt,
+            sizeof(part_t));
+    if (!tasque_srv.parts) {
+        fprintf(stderr, "calloc parts failed\n");
+        exit(1);
+    }
+
+    for (i = 0; i < tasque_srv.part_cnt; ++i) {
+        p = &tasque_srv.parts[i];
+        pthread_mutex_init(&p->lock, NULL);
+        if (heap_init(&p->dispatch) != 0 || heap_init(&p->delays) != 0) {
+            fprintf(stderr, "heap_init failed\n");
+            exit(1);
+        }
+        p->dispatch.key = tube_dispatch_key;
+        p->dispatch.record = tube_set_dispatch_pos;
+        p->delays.key = tube_delay_key;
+        p->delays.record = tube_set_delay_pos;
+    }
+
+    t = tube_make_and_insert("default");
+    if (!t) {
+        fprintf(stderr, "create default tube failed\n");
+        exit(1);
+    }
+    tasque_srv.default_tube = t;
+    tube_iref(t);
+}
+
+static void *srv_reactor_main(void *arg) {
+    reactor_t *r = (reactor_t *)arg;
+    event_loop(&r->evt);
+    return NULL;
+}
+
+static void srv_reactor_init(reactor_t *r, int id) {
     int count;
     int sockfds[1];
     int maxfd;
     int ret;
 
-    if (tasque_srv.user) srv_su(tasque_srv.user);
+    r->id = id;
 
-    /* 10 ms */
-    if (event_init(&tasque_srv.evt, conn_cron, &tasque_srv, 10) != 0) {
+    /* Only the first reactor drives the cron, whenever it is due */
+    if (event_init(&r->evt, id == 0 ? conn_cron : NULL,
+                &tasque_srv, 0) != 0) {
         fprintf(stderr, "event_init failed\n");
         exit(1);
     }
+    /* replies are written out before the loop sleeps */
+    r->flushq = NULL;
+    event_set_prepare(&r->evt, conn_flush_all, r);
 
     if ((count = create_socket(tasque_srv.host, tasque_srv.port, 
-                sockfds, 1, &maxfd)) == 0) {
+                tasque_srv.reactor_cnt > 1, sockfds, 1, &maxfd)) <= 0) {
         fprintf(stderr, "create_socket failed\n");
         exit(1);
     }
 
-    tasque_srv.sock.x = &tasque_srv.sock;
-    tasque_srv.sock.f = (handle_fn)conn_accept;
-    tasque_srv.sock.fd = sockfds[0];
-    tasque_srv.sock.added = 0;
+    r->sock.x = r;
+    r->sock.f = (handle_fn)conn_accept;
+    r->sock.fd = sockfds[0];
+    r->sock.added = 0;
 
-    ret = event_regis(&tasque_srv.evt, &tasque_srv.sock, EVENT_RD);
+    ret = event_regis(&r->evt, &r->sock, EVENT_RD);
     if (ret < 0) {
         fprintf(stderr, "event_regis failed:%s\n", strerror(errno));
         exit(1);
     }
+}
 
-    event_loop(&tasque_srv.evt);
+void srv_serve() {
+    int i;
+    int ret;
+
+    if (tasque_srv.user) srv_su(tasque_srv.user);
+    srv_parts_init();
+
+    tasque_srv.reactors = (reactor_t *)calloc(tasque_srv.reactor_cnt,
+            sizeof(reactor_t));
+    if (!tasque_srv.reactors) {
+        fprintf(stderr, "calloc reactors failed\n");
+        exit(1);
+    }
+
+    for (i = 0; i < tasque_srv.reactor_cnt; ++i) {
+        srv_reactor_init(&tasque_srv.reactors[i], i);
+    }
+
+    /* the jobs logged are back before anybody can ask for them */
+    binlog_init();
+    if (tasque_srv.leader_host) replica_follow();
+
+    /* reactor 0 runs on the main thread */
+    for (i = 1; i < tasque_srv.reactor_cnt; ++i) {
+        ret = pthread_create(&tasque_srv.reactors[i].thread, NULL,
+                srv_reactor_main, &tasque_srv.reactors[i]);
+        if (ret != 0) {
+            fprintf(stderr, "pthread_create failed:%s\n", strerror(ret));
+            exit(1);
+        }
+    }
+
+    event_loop(&tasque_srv.reactors[0].evt);
 }
 
 void srv_destroy() {
     if (tasque_srv.host) free(tasque_srv.host);
     if (tasque_srv.user) free(tasque_srv.user);
+    if (tasque_srv.binlog_dir) free(tasque_srv.binlog_dir);
+    if (tasque_srv.leader_host) free(tasque_srv.leader_host);
 
-    event_destroy(&tasque_srv.evt);
-    heap_destroy(&tasque_srv.conns);
+    if (tasque_srv.reactors) {
+        int i;
+        for (i = 0; i < tasque_srv.reactor_cnt; ++i) {
+            event_destroy(&tasque_srv.reactors[i].evt);
+        }
+        free(tasque_srv.reactors);
+        tasque_srv.reactors = NULL;
+    }
     set_destroy(&tasque_srv.tubes);
-    hash_destroy(&tasque_srv.all_jobs);
+    hash_destroy(&tasque_srv.tube_names);
+    heap_destroy(&tasque_srv.paused);
+    if (tasque_srv.parts) {
+        int i;
+        for (i = 0; i < tasque_srv.part_cnt; ++i) {
+            heap_destroy(&tasque_srv.parts[i].dispatch);
+            heap_destroy(&tasque_srv.parts[i].delays);
+            pthread_mutex_destroy(&tasque_srv.parts[i].lock);
+        }
+        free(tasque_srv.parts);
+        tasque_srv.parts = NULL;
+    }
+    idtab_destroy(&tasque_srv.all_jobs);
+    pthread_mutex_destroy(&tasque_srv.timers_lock);
+}
+
+/* the partition this thread holds the lock of, see srv_held() */
+static __thread int held = PART_NONE;
+
+/* All reactors share the tubes and jobs, so every handler runs with
+ * a lock held: that of the partition it works in, or those of all of
+ * them. They are always taken in order, so that a thread taking all
+ * doesn't deadlock with another, and a thread never holds the lock
+ * of one partition while it takes another. */
+void srv_lock_part(int p) {
+    int i;
+
+    if (p != PART_ALL) {
+        pthread_mutex_lock(&tasque_srv.parts[p].lock);
+    } else {
+        for (i = 0; i < tasque_srv.part_cnt; ++i) {
+            pthread_mutex_lock(&tasque_srv.parts[i].lock);
+        }
+    }
+    held = p;
+}
+
+void srv_lock() {
+    srv_lock_part(PART_ALL);
+}
+
+void srv_unlock() {
+    int i;
+
+    if (held != PART_ALL) {
+        pthread_mutex_unlock(&tasque_srv.parts[held].lock);
+    } else {
+        for (i = tasque_srv.part_cnt - 1; i >= 0; --i) {
+            pthread_mutex_unlock(&tasque_srv.parts[i].lock);
+        }
+    }
+    held = PART_NONE;
+}
+
+/* The partition whose lock is held, PART_ALL for all of them, or
+ * PART_NONE. */
+int srv_held() {
+    return held;
+}
+
+int srv_tube_part(const char *name) {
+    return (int)(hash_func_str(name) % tasque_srv.part_cnt);
+}
+
+/* Close every fd but stdin, stdout, stderr and the `n' in `keep', in
+ * a child forked off the server. The sockets and event loops are the
+ * server's: a client it closes would get no FIN while the child still
+ * held its socket. The fds are listed from /proc, with no allocation,
+ * as another thread may have had the heap locked at the fork. */
+void srv_close_fds(const int keep[], int n) {
+    struct {
+        uint64_t ino;
+        int64_t off;
+        unsigned short reclen;
+        unsigned char type;
+        char name[];
+    } *d;
+    char buf[4096];
+    long fd, max, len, off;
+    int dfd, i;
+
+    dfd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY);
+    if (dfd < 0) {
+        max = sysconf(_SC_OPEN_MAX);
+        for (fd = 3; fd < max; ++fd) {
+            for (i = 0; i < n && keep[i] != fd; ++i);
+            if (i == n) close(fd);
+        }
+        return;
+    }
+    while ((len = syscall(SYS_getdents64, dfd, buf, sizeof(buf))) > 0) {
+        for (off = 0; off < len; off += d->reclen) {
+            d = (void *)(buf + off);
+            fd = strtol(d->name, NULL, 10);
+            if (fd < 3 || fd == dfd) continue;
+            for (i = 0; i < n && keep[i] != fd; ++i);
+            if (i == n) close(fd);
+        }
+    }
+    close(dfd);
 }
@@ -2,23 +2,65 @@
 #define __SRV_H_INCLUDED__
 
 #include <stdint.h>
+#include <pthread.h>
 #include "tube.h"
 #include "conn.h"
 #include "heap.h"
+#include "wheel.h"
 #include "event.h"
 #include "hash.h"
+#include "idtab.h"
 #include "set.h"
 
+/* Each reactor owns an event loop and a SO_REUSEPORT listening socket.
+ * Connections stay on the reactor that accepted them. */
+typedef struct reactor_st {
+    int         id;
+    pthread_t   thread;
+    evtent_t    sock;
+    event_t     evt;
+    conn_t      *flushq;    /* connections with output to write */
+} reactor_t;
+
+/* The tubes are split into partitions by the hash of their names,
+ * each with a lock of its own. It guards the tubes of the partition
+ * and their jobs, so commands on the tubes of different partitions
+ * run at the same time, see conn.c. Taking the locks of all of them,
+ * srv_lock(), guards everything. */
+typedef struct part_st {
+    pthread_mutex_t lock;
+    heap_t      dispatch;   /* tubes with jobs for waiting conns */
+    heap_t      delays;     /* tubes by their soonest delayed job */
+    int         redispatch; /* a job here is for a conn waiting on
+                               other partitions too */
+} part_t;
+
+#define PART_ALL            (-1)    /* all partitions, see srv_lock() */
+#define PART_NONE           (-2)    /* no lock held */
+#define PARTS_PER_REACTOR   4
+
+/* for the counters below that change under the lock of a single
+ * partition */
+#define srv_stat_inc(x)     __atomic_add_fetch(&(x), 1, __ATOMIC_RELAXED)
+#define srv_stat_dec(x)     __atomic_sub_fetch(&(x), 1, __ATOMIC_RELAXED)
+
 typedef struct server_st {
     int         port;
     char        *host;
     char        *user;
-    evtent_t    sock;
-    event_t     evt;
-    heap_t      conns;
+    int         reactor_cnt;
+    reactor_t   *reactors;
+    int         part_cnt;
+    part_t      *parts;     /* guard everything below */
+    pthread_mutex_t timers_lock;    /* the timers too, see timer_arm() */
+    wheel_t     timers;     /* connection timers */
+    int         tube_gc;    /* a tube ran out of refs, see tube_dref() */
     set_t       tubes;
+    hash_t      tube_names; /* name -> tube */
+    heap_t      paused;     /* paused tubes by deadline */
     tube_t      *default_tube;
     int         verbose;
+    int         edge_triggered;
     int         drain_mode;
     int64_t     started_at;
 
@@ -34,7 +76,14 @@ typedef struct server_st {
     stats_t     global_stat;
     uint64_t    op_cnt[TOTAL_OPS];
     uint64_t    timeout_cnt;
-    hash_t      all_jobs;
+    idtab_t     all_jobs;   /* id -> job */
+
+    char        *binlog_dir;    /* NULL if jobs aren't logged */
+    int         binlog_fsync_ms;    /* or BINLOG_FSYNC_* */
+    int64_t     binlog_size;    /* of a file, see binlog.h */
+    int         checkpoint_sec; /* between checkpoints, 0 for none */
+    char        *leader_host;   /* followed, see replica.h, or NULL */
+    int         leader_port;
 } server_t;
 
 extern server_t tasque_srv;
@@ -42,5 +91,11 @@ extern server_t tasque_srv;
 void srv_init();
 void srv_serve();
 void srv_destroy();
+void srv_lock();
+void srv_lock_part(int p);
+void srv_unlock();
+int srv_held();
+int srv_tube_part(const char *name);
+void srv_close_fds(const int keep[], int n);
 
 #endif /* __SRV_H_INCLUDED__ */
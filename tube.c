@@ -8,6 +8,7 @@
 #include "heap.h"
 #include "set.h"
 #include "job.h"
+#include "times.h"
 
 tube_t *tube_create(const char *name) {
     tube_t *t = (tube_t *)calloc(sizeof(*t), 1);
@@ -21,61 +22,83 @@ tube_t *tube_create(const char *name) {
         free(t);
         return NULL;
     }
-    t->ready_jobs.less = job_pri_less;
-    t->ready_jobs.record = job_set_heap_pos;
 
     if (heap_init(&t->delay_jobs) != 0) {
         free(t);
         return NULL;
     }
-    t->delay_jobs.less = job_delay_less;
-    t->delay_jobs.record = job_set_heap_pos;
-    dlist_init(&t->buried_jobs);
+    dlink_init(&t->buried_jobs);
     set_init(&t->waiting_conns, NULL, NULL);
+    t->dispatch_index = -1;
+    t->pause_index = -1;
+    t->delay_index = -1;
+    t->part = srv_tube_part(t->name);
     return t;
 }
 
 void tube_free(tube_t *t) {
+    part_t *p = &tasque_srv.parts[t->part];
+
+    if (t->dispatch_index >= 0) {
+        heap_remove(&p->dispatch, t->dispatch_index);
+    }
+    if (t->pause_index >= 0) {
+        heap_remove(&tasque_srv.paused, t->pause_index);
+    }
+    if (t->delay_index >= 0) {
+        heap_remove(&p->delays, t->delay_index);
+    }
     heap_destroy(&t->ready_jobs);
     heap_destroy(&t->delay_jobs);
-    dlist_destroy(&t->buried_jobs);
     set_destroy(&t->waiting_conns);
     free(t);
 }
 
+/* The last job of a tube may go away under the lock of another
+ * partition, after a reply that had it was sent. A tube is only
+ * removed with all the locks then, so the cron is asked to do it,
+ * see tube_gc(). */
 void tube_dref(tube_t *t) {
     assert(t);
-    if (t->refs < 1) {
+    if (__atomic_load_n(&t->refs, __ATOMIC_RELAXED) < 1) {
         fprintf(stderr, "refs is zero for tube: %s\n", t->name);
         return;
     }
 
-    --t->refs;
-    if (t->refs < 1) {
+    if (__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    if (srv_held() < 0) {
         tube_free_and_remove(t);
+        return;
     }
+    __atomic_store_n(&tasque_srv.tube_gc, 1, __ATOMIC_RELEASE);
+    event_tick_at(&tasque_srv.reactors[0].evt, ustime());
 }
 
 void tube_iref(tube_t *t) {
     assert(t);
-    ++t->refs;
+    __atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
 }
 
-tube_t *tube_find(const char *name) {
+/* Remove the tubes nobody refers to any more, with all the locks. */
+void tube_gc() {
     tube_t *t;
     size_t i;
 
-    for (i = 0; i < tasque_srv.tubes.used; ++i) {
-        t = tasque_srv.tubes.items[i];
-        if (strncmp(t->name, name, MAX_TUBE_NAME_LEN) == 0) {
-            return t;
-        }
+    if (!__atomic_exchange_n(&tasque_srv.tube_gc, 0, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    for (i = tasque_srv.tubes.used; i > 0; --i) {
+        t = tasque_srv.tubes.items[i - 1];
+        if (!t->refs) tube_free_and_remove(t);
     }
-    return NULL;
+}
+
+tube_t *tube_find(const char *name) {
+    return (tube_t *)hash_get_val(&tasque_srv.tube_names, name);
 }
 
 int tube_has_buried_job(tube_t *t) {
-    return dlist_length(&t->buried_jobs) != 0;
+    return !dlink_empty(&t->buried_jobs);
 }
 
 tube_t *tube_make_and_insert(const char *name) {
@@ -87,10 +110,17 @@ tube_t *tube_make_and_insert(const char *name) {
         tube_free(t);
         return NULL;
     }
+    ret = hash_insert(&tasque_srv.tube_names, t->name, t);
+    if (ret != 0) {
+        set_remove(&tasque_srv.tubes, t);
+        tube_free(t);
+        return NULL;
+    }
     return t;
 }
 
 void tube_free_and_remove(tube_t *t) {
+    hash_delete(&tasque_srv.tube_names, t->name);
     set_remove(&tasque_srv.tubes, t);
     tube_free(t);
 }
@@ -98,3 +128,250 @@ void tube_free_and_remove(tube_t *t) {
 tube_t *tube_find_or_create(const char *name) {
     return tube_find(name) ? : tube_make_and_insert(name);
 }
+
+/* Ready jobs that share a priority mostly become ready in the order
+ * of their ids, newly put ones above all. Those go to the tail of a
+ * FIFO for their priority rather than into `ready_jobs', so that
+ * queueing and taking them is O(1). The fifos are kept sorted by
+ * priority and `fifo_map' tells which have jobs, so the best of them
+ * is at the head of the first one in the map. Jobs that come out of
+ * order, like released ones, or that find no fifo for their priority,
+ * go to the heap. The best ready job of the tube is the better of the
+ * heap top and that fifo head, so the order is still by (pri, id). */
+
+/* the first fifo with a priority not below `pri' */
+static int fifo_find(tube_t *t, uint32_t pri) {
+    int lo = 0, hi = t->fifo_cnt, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (t->fifos[mid].pri < pri) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Move fifos[from] to fifos[to]. The first and last job of the list
+ * point back to its head, so they have to follow. */
+static void fifo_move(tube_t *t, int to, int from) {
+    fifo_t *f = &t->fifos[to];
+
+    f->pri = t->fifos[from].pri;
+    if (dlink_empty(&t->fifos[from].jobs)) {
+        dlink_init(&f->jobs);
+        return;
+    }
+    f->jobs = t->fifos[from].jobs;
+    f->jobs.next->prev = &f->jobs;
+    f->jobs.prev->next = &f->jobs;
+}
+
+/* Return the fifo for `pri', making one if there is none yet. A fifo
+ * without jobs gives its place up when all are taken. -1 returned if
+ * they all have jobs. */
+static int fifo_get(tube_t *t, uint32_t pri) {
+    int i = fifo_find(t, pri), k, e;
+    uint32_t low;
+
+    if (i < t->fifo_cnt && t->fifos[i].pri == pri) {
+        return i;
+    }
+
+    if (t->fifo_cnt == TUBE_FIFO_NUM) {
+        if (!~t->fifo_map) {
+            return -1;
+        }
+        e = __builtin_ctz(~t->fifo_map);
+        for (k = e; k < t->fifo_cnt - 1; ++k) {
+            fifo_move(t, k, k + 1);
+        }
+        low = (1u << e) - 1;
+        t->fifo_map = (t->fifo_map & low) | ((t->fifo_map >> 1) & ~low);
+        --t->fifo_cnt;
+        i = fifo_find(t, pri);
+    }
+
+    for (k = t->fifo_cnt; k > i; --k) {
+        fifo_move(t, k, k - 1);
+    }
+    low = (1u << i) - 1;
+    t->fifo_map = (t->fifo_map & low) | ((t->fifo_map & ~low) << 1);
+    ++t->fifo_cnt;
+    t->fifos[i].pri = pri;
+    dlink_init(&t->fifos[i].jobs);
+    return i;
+}
+
+/* Add `j' to the fifo of its pri if it goes last there.
+ * 0 returned if it did, otherwise -1. */
+static int fifo_add(tube_t *t, job_t *j) {
+    int i = fifo_get(t, j->rec.pri);
+    fifo_t *f;
+
+    if (i < 0) return -1;
+    f = &t->fifos[i];
+    if (dlink_empty(&f->jobs) ||
+            dlink_entry(f->jobs.prev, job_t, link)->rec.id < j->rec.id) {
+        dlink_add_tail(&f->jobs, &j->link);
+        t->fifo_map |= 1u << i;
+        ++t->fifo_jobs;
+        return 0;
+    }
+    return -1;
+}
+
+/* Make `j' a ready job of `t'.
+ * 0 returned on success, otherwise -1. */
+int tube_ready_insert(tube_t *t, job_t *j) {
+    if (fifo_add(t, j) == 0) return 0;
+    return ready_heap_insert(&t->ready_jobs, j);
+}
+
+/* As tube_ready_insert(), but a job that goes in the heap is only
+ * pushed, the heap is put in order by ready_heap_heapify() once all
+ * are in. */
+int tube_ready_push(tube_t *t, job_t *j) {
+    if (fifo_add(t, j) == 0) return 0;
+    return ready_heap_push(&t->ready_jobs, j);
+}
+
+void tube_ready_remove(job_t *j) {
+    tube_t *t = j->tube;
+    int i;
+
+    if (dlink_empty(&j->link)) {
+        ready_heap_remove(&t->ready_jobs, j->heap_index);
+        return;
+    }
+
+    i = fifo_find(t, j->rec.pri);
+    dlink_delete(&j->link);
+    --t->fifo_jobs;
+    if (dlink_empty(&t->fifos[i].jobs)) {
+        t->fifo_map &= ~(1u << i);
+    }
+}
+
+/* Return the best ready job of `t' and its key if `key' isn't NULL,
+ * or NULL if there is no ready job. */
+job_t *tube_ready_top(tube_t *t, heap_key_t *key) {
+    job_t *j = NULL, *fj;
+    heap_key_t k, fk;
+    fifo_t *f;
+
+    if (t->ready_jobs.len) {
+        j = heap_get(&t->ready_jobs, 0);
+        k = t->ready_jobs.items[0].key;
+    }
+
+    if (t->fifo_map) {
+        f = &t->fifos[__builtin_ctz(t->fifo_map)];
+        fj = dlink_entry(f->jobs.next, job_t, link);
+        fk.hi = f->pri;
+        fk.lo = fj->rec.id;
+        if (!j || heap_key_less(&fk, &k)) {
+            j = fj;
+            k = fk;
+        }
+    }
+
+    if (j && key) {
+        *key = k;
+    }
+    return j;
+}
+
+/* the void* parameters are really tube pointers */
+void tube_dispatch_key(void *arg, heap_key_t *key) {
+    tube_ready_top((tube_t *)arg, key);
+}
+
+void tube_set_dispatch_pos(void *arg, int pos) {
+    ((tube_t *)arg)->dispatch_index = pos;
+}
+
+void tube_pause_key(void *arg, heap_key_t *key) {
+    key->hi = (uint64_t)((tube_t *)arg)->deadline_at;
+    key->lo = 0;
+}
+
+void tube_set_pause_pos(void *arg, int pos) {
+    ((tube_t *)arg)->pause_index = pos;
+}
+
+void tube_delay_key(void *arg, heap_key_t *key) {
+    *key = ((tube_t *)arg)->delay_jobs.items[0].key;
+}
+
+void tube_set_delay_pos(void *arg, int pos) {
+    ((tube_t *)arg)->delay_index = pos;
+}
+
+/* A tube can hand out a job when it is not paused, has a ready job
+ * and somebody waits for one. Such tubes are kept in a heap ordered
+ * by their best ready job, so the next job to dispatch in a partition
+ * is always at the top of its `dispatch'. This must be called
+ * whenever any of those conditions or the best ready job may have
+ * changed. */
+void tube_dispatch_update(tube_t *t) {
+    heap_t *h = &tasque_srv.parts[t->part].dispatch;
+
+    if (t->pause || !t->waiting_conns.used || !tube_ready_cnt(t)) {
+        if (t->dispatch_index >= 0) {
+            heap_remove(h, t->dispatch_index);
+        }
+        return;
+    }
+
+    if (t->dispatch_index >= 0) {
+        heap_fix(h, t->dispatch_index);
+    } else {
+        heap_insert(h, t);
+    }
+}
+
+/* Tubes with delayed jobs are kept in a heap ordered by their
+ * soonest one, so the next delayed job to come due in any tube of a
+ * partition is at the top of its `delays'. Call this whenever the
+ * top of `delay_jobs' may have changed. */
+void tube_delay_update(tube_t *t) {
+    heap_t *h = &tasque_srv.parts[t->part].delays;
+
+    if (!t->delay_jobs.len) {
+        if (t->delay_index >= 0) {
+            heap_remove(h, t->delay_index);
+        }
+        return;
+    }
+
+    if (t->delay_index >= 0) {
+        heap_fix(h, t->delay_index);
+    } else {
+        heap_insert(h, t);
+    }
+}
+
+/* Hold back the ready jobs of `t' for `delay' microseconds.
+ * 0 returned on success, otherwise -1. */
+int tube_pause(tube_t *t, int64_t delay) {
+    t->deadline_at = ustime() + delay;
+    if (t->pause_index >= 0) {
+        heap_fix(&tasque_srv.paused, t->pause_index);
+    } else if (heap_insert(&tasque_srv.paused, t) != 0) {
+        return -1;
+    }
+    t->pause = delay;
+    tube_dispatch_update(t);
+    return 0;
+}
+
+void tube_unpause(tube_t *t) {
+    if (t->pause_index >= 0) {
+        heap_remove(&tasque_srv.paused, t->pause_index);
+    }
+    t->pause = 0;
+    tube_dispatch_update(t);
+}
@@ -11,6 +11,11 @@
 
 #define TUBE_ASSIGN(a, b)   (tube_dref(a), (a) = (b), tube_iref(a))
 
+/* priorities a tube keeps FIFOs of ready jobs for, at most */
+#define TUBE_FIFO_NUM       32
+
+struct job_st;
+
 typedef struct stats_st {
     uint32_t        urgent_cnt;
     uint32_t        waiting_cnt;
@@ -21,29 +26,59 @@ typedef struct stats_st {
     uint64_t        total_jobs_cnt;
 } stats_t;
 
+typedef struct fifo_st {
+    uint32_t        pri;
+    dlink           jobs;             /* of job_t.link, by id */
+} fifo_t;
+
 typedef struct tube_st {
     uint32_t        refs;
     char            name[MAX_TUBE_NAME_LEN];
-    heap_t          ready_jobs;
-    heap_t          delay_jobs;
-    dlist           buried_jobs;
+    heap_t          ready_jobs;       /* a ready_heap, see job.h */
+    fifo_t          fifos[TUBE_FIFO_NUM]; /* more ready jobs, by pri */
+    int             fifo_cnt;         /* fifos given a pri */
+    uint32_t        fifo_map;         /* bit i set if fifos[i] has jobs */
+    uint32_t        fifo_jobs;        /* ready jobs in the fifos */
+    heap_t          delay_jobs;       /* a delay_heap */
+    dlink           buried_jobs;      /* of job_t.link */
     set_t           waiting_conns;    /* set of conns */
     uint32_t        using_cnt;
     uint32_t        watching_cnt;
     int64_t         pause;
     int64_t         deadline_at;
+    int             part;           /* see srv_tube_part() */
+    int             dispatch_index; /* in the dispatch of the part, or -1 */
+    int             pause_index;    /* in tasque_srv.paused, or -1 */
+    int             delay_index;    /* in the delays of the part, or -1 */
     stats_t         stats;
 } tube_t;
 
 
+#define tube_ready_cnt(t)   ((t)->ready_jobs.len + (t)->fifo_jobs)
+
 tube_t *tube_create(const char *name);
 void tube_free(tube_t *t);
 void tube_dref(tube_t *t);
 void tube_iref(tube_t *t);
+void tube_gc();
 tube_t *tube_find(const char *name);
 int tube_has_buried_job(tube_t *t);
 tube_t *tube_make_and_insert(const char *name);
 void tube_free_and_remove(tube_t *t);
 tube_t *tube_find_or_create(const char *name);
+int tube_ready_insert(tube_t *t, struct job_st *j);
+int tube_ready_push(tube_t *t, struct job_st *j);
+void tube_ready_remove(struct job_st *j);
+struct job_st *tube_ready_top(tube_t *t, heap_key_t *key);
+void tube_dispatch_key(void *arg, heap_key_t *key);
+void tube_set_dispatch_pos(void *arg, int pos);
+void tube_pause_key(void *arg, heap_key_t *key);
+void tube_set_pause_pos(void *arg, int pos);
+void tube_delay_key(void *arg, heap_key_t *key);
+void tube_set_delay_pos(void *arg, int pos);
+void tube_dispatch_update(tube_t *t);
+void tube_delay_update(tube_t *t);
+int tube_pause(tube_t *t, int64_t delay);
+void tube_unpause(tube_t *t);
 
 #endif /* __TUBE_H_INCLUDED__ */
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+#define uring_load_acquire(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define uring_store_release(p, v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+        unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+            flags, arg, argsz);
+}
+
+/* Set up a ring with at least `entries' submission slots.
+ * 0 returned on success, otherwise -1 with errno set. */
+int uring_init(uring_t *r, unsigned entries) {
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    /* we rely on timeouts passed to io_uring_enter() */
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        close(r->fd);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_sz = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        goto fail;
+    }
+
+    r->cq_ring = mmap(NULL, r->cq_ring_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) {
+        r->cq_ring = NULL;
+        goto fail;
+    }
+
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    sq = (char *)r->sq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+
+    cq = (char *)r->cq_ring;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    uring_destroy(r);
+    return -1;
+}
+
+void uring_destroy(uring_t *r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_sz);
+    if (r->cq_ring) munmap(r->cq_ring, r->cq_ring_sz);
+    if (r->sq_ring && r->sq_ring != MAP_FAILED) {
+        munmap(r->sq_ring, r->sq_ring_sz);
+    }
+    if (r->fd >= 0) close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+/* Publish the prepared sqes to the kernel, return how many. */
+static unsigned uring_flush(uring_t *r) {
+    unsigned tail = *r->sq_tail;
+    unsigned n = r->sqe_tail - r->sqe_head;
+    unsigned i;
+
+    for (i = 0; i < n; ++i) {
+        r->sq_array[tail & *r->sq_mask] = r->sqe_head & *r->sq_mask;
+        ++tail;
+        ++r->sqe_head;
+    }
+    uring_store_release(r->sq_tail, tail);
+    return tail - uring_load_acquire(r->sq_head);
+}
+
+/* Return a zeroed sqe, submitting what is queued if the ring is full.
+ * NULL returned if no slot could be freed. */
+struct io_uring_sqe *uring_get_sqe(uring_t *r) {
+    struct io_uring_sqe *sqe;
+
+    if (r->sqe_tail - uring_load_acquire(r->sq_head) >= r->sq_entries) {
+        if (uring_enter(r, 0, 0) < 0 ||
+                r->sqe_tail - uring_load_acquire(r->sq_head) >=
+                r->sq_entries) {
+            return NULL;
+        }
+    }
+
+    sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++r->sqe_tail;
+    return sqe;
+}
+
+/* Submit every queued sqe and wait for at least `wait_nr' completions
+ * or `timeout' microseconds, whichever comes first. A negative timeout
+ * waits forever. Only one system call is made. */
+int uring_enter(uring_t *r, unsigned wait_nr, int64_t timeout) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned submit, flags = 0;
+    int ret;
+
+    submit = uring_flush(r);
+    if (wait_nr) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    if (wait_nr && timeout >= 0) {
+        ts.tv_sec = timeout / 1000000;
+        ts.tv_nsec = (timeout % 1000000) * 1000;
+        arg.ts = (unsigned long long)(uintptr_t)&ts;
+    }
+    flags |= IORING_ENTER_EXT_ARG;
+
+    ret = sys_io_uring_enter(r->fd, submit, wait_nr, flags,
+            &arg, sizeof(arg));
+    if (ret < 0 && (errno == ETIME || errno == EINTR)) {
+        return 0;
+    }
+    return ret;
+}
+
+/* Return the next completion or NULL if there is none. */
+struct io_uring_cqe *uring_peek_cqe(uring_t *r) {
+    unsigned head = *r->cq_head;
+    if (head == uring_load_acquire(r->cq_tail)) {
+        return NULL;
+    }
+    return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *r) {
+    uring_store_release(r->cq_head, *r->cq_head + 1);
+}
@@ -0,0 +1,39 @@
+#ifndef __URING_H_INCLUDED__
+#define __URING_H_INCLUDED__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/* A minimal io_uring wrapper on top of the raw system calls. */
+typedef struct uring_st {
+    int                 fd;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    unsigned            sq_entries;
+    unsigned            sqe_head;   /* sqes handed to the kernel */
+    unsigned            sqe_tail;   /* sqes prepared by us */
+    struct io_uring_sqe *sqes;
+
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void                *sq_ring;
+    size_t              sq_ring_sz;
+    void                *cq_ring;
+    size_t              cq_ring_sz;
+    size_t              sqes_sz;
+} uring_t;
+
+int uring_init(uring_t *r, unsigned entries);
+void uring_destroy(uring_t *r);
+struct io_uring_sqe *uring_get_sqe(uring_t *r);
+int uring_enter(uring_t *r, unsigned wait_nr, int64_t timeout);
+struct io_uring_cqe *uring_peek_cqe(uring_t *r);
+void uring_cqe_seen(uring_t *r);
+
+#endif /* __URING_H_INCLUDED__ */
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "wheel.h"
+
+#define WHEEL_EXPIRED   -1
+
+#define level_shift(l)  (WHEEL_BITS * (l))
+#define level_span(l)   ((uint64_t)1 << level_shift(l))
+
+static void list_init(wheel_timer_t *head) {
+    head->prev = head->next = head;
+}
+
+static int list_empty(wheel_timer_t *head) {
+    return head->next == head;
+}
+
+static void list_append(wheel_timer_t *head, wheel_timer_t *t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void list_unlink(wheel_timer_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+void wheel_init(wheel_t *w, int64_t now) {
+    int l, i;
+
+    w->now = (uint64_t)now >> WHEEL_TICK_SHIFT;
+    w->count = 0;
+    for (l = 0; l < WHEEL_LEVELS; ++l) {
+        w->used[l] = 0;
+        for (i = 0; i < WHEEL_SIZE; ++i) {
+            list_init(&w->slots[l][i]);
+        }
+    }
+    list_init(&w->expired);
+}
+
+/* The first tick starting no earlier than `at', timers never fire
+ * before they are due. */
+static uint64_t wheel_tick(int64_t at) {
+    if (at < 0) at = 0;
+    return ((uint64_t)at + (1 << WHEEL_TICK_SHIFT) - 1) >> WHEEL_TICK_SHIFT;
+}
+
+static void wheel_place(wheel_t *w, wheel_timer_t *t) {
+    uint64_t tick = wheel_tick(t->at);
+    int l, i;
+
+    if (tick < w->now) {
+        t->slot = WHEEL_EXPIRED;
+        list_append(&w->expired, t);
+        return;
+    }
+
+    for (l = 0; l < WHEEL_LEVELS - 1; ++l) {
+        if (tick - w->now < level_span(l + 1)) break;
+    }
+    if (tick - w->now >= level_span(WHEEL_LEVELS)) {
+        /* park it in the farthest slot */
+        tick = w->now + level_span(WHEEL_LEVELS) - 1;
+    }
+
+    i = (tick >> level_shift(l)) & WHEEL_MASK;
+    t->slot = l * WHEEL_SIZE + i;
+    list_append(&w->slots[l][i], t);
+    w->used[l] |= (uint64_t)1 << i;
+}
+
+/* Arm `t' to fire at `at', rearming it if it is armed already. */
+void wheel_add(wheel_t *w, wheel_timer_t *t, int64_t at) {
+    wheel_del(w, t);
+    t->at = at;
+    wheel_place(w, t);
+    ++w->count;
+}
+
+void wheel_del(wheel_t *w, wheel_timer_t *t) {
+    int l, i;
+
+    if (!wheel_armed(t)) return;
+    list_unlink(t);
+    --w->count;
+    if (t->slot == WHEEL_EXPIRED) return;
+
+    l = t->slot / WHEEL_SIZE;
+    i = t->slot % WHEEL_SIZE;
+    if (list_empty(&w->slots[l][i])) {
+        w->used[l] &= ~((uint64_t)1 << i);
+    }
+}
+
+/* The earliest tick at which a slot fires or cascades. Slots of
+ * level 0 before the current index and those of the other levels up
+ * to it belong to the next round of their level; the current slot of
+ * a level is still pending if `now' starts it. */
+static uint64_t wheel_next_tick(wheel_t *w) {
+    uint64_t best = UINT64_MAX, bits, above, base, tick;
+    int l, cur, first;
+
+    for (l = 0; l < WHEEL_LEVELS; ++l) {
+        bits = w->used[l];
+        if (!bits) continue;
+
+        cur = (w->now >> level_shift(l)) & WHEEL_MASK;
+        first = (w->now & (level_span(l) - 1)) == 0 ? cur : cur + 1;
+        above = first < WHEEL_SIZE ? bits & (~(uint64_t)0 << first) : 0;
+        base = w->now & ~(level_span(l + 1) - 1);
+
+        if (above) {
+            tick = base + ((uint64_t)__builtin_ctzll(above) << level_shift(l));
+        } else {
+            tick = base + level_span(l + 1) +
+                ((uint64_t)__builtin_ctzll(bits) << level_shift(l));
+        }
+        if (tick < best) best = tick;
+    }
+    return best;
+}
+
+/* Move the timers of a slot down to where they belong now. */
+static void wheel_cascade(wheel_t *w, int l, int i) {
+    wheel_timer_t list, *t;
+
+    if (!(w->used[l] & ((uint64_t)1 << i))) return;
+    w->used[l] &= ~((uint64_t)1 << i);
+
+    /* take over the slot's list */
+    list.next = w->slots[l][i].next;
+    list.prev = w->slots[l][i].prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    list_init(&w->slots[l][i]);
+
+    while (!list_empty(&list)) {
+        t = list.next;
+        list_unlink(t);
+        wheel_place(w, t);
+    }
+}
+
+/* Process tick w->now: cascade the levels it starts a slot of, then
+ * expire its slot of level 0. */
+static void wheel_run(wheel_t *w) {
+    uint64_t k = w->now;
+    wheel_timer_t *t;
+    int l, i;
+
+    for (l = 1; l < WHEEL_LEVELS; ++l) {
+        if (k & (level_span(l) - 1)) break;
+        wheel_cascade(w, l, (k >> level_shift(l)) & WHEEL_MASK);
+    }
+
+    i = k & WHEEL_MASK;
+    if (w->used[0] & ((uint64_t)1 << i)) {
+        w->used[0] &= ~((uint64_t)1 << i);
+        while (!list_empty(&w->slots[0][i])) {
+            t = w->slots[0][i].next;
+            list_unlink(t);
+            t->slot = WHEEL_EXPIRED;
+            list_append(&w->expired, t);
+        }
+    }
+    w->now = k + 1;
+}
+
+/* Return a timer due at `now' and disarm it, or NULL if there is
+ * none. Idle ticks are skipped instead of walked through. */
+wheel_timer_t *wheel_expire(wheel_t *w, int64_t now) {
+    uint64_t target = (uint64_t)now >> WHEEL_TICK_SHIFT;
+    uint64_t next;
+    wheel_timer_t *t;
+
+    while (list_empty(&w->expired) && w->now <= target) {
+        next = w->count ? wheel_next_tick(w) : UINT64_MAX;
+        if (next > target) {
+            w->now = target + 1;
+            break;
+        }
+        w->now = next;
+        wheel_run(w);
+    }
+
+    if (list_empty(&w->expired)) return NULL;
+    t = w->expired.next;
+    list_unlink(t);
+    --w->count;
+    return t;
+}
+
+/* When wheel_expire() may have something to return next, INT64_MAX
+ * if no timer is armed. */
+int64_t wheel_next(wheel_t *w) {
+    if (!list_empty(&w->expired)) return 0;
+    if (!w->count) return INT64_MAX;
+    return (int64_t)(wheel_next_tick(w) << WHEEL_TICK_SHIFT);
+}
+
+/* gcc wheel.c -DWHEEL_TEST_MAIN */
+#ifdef WHEEL_TEST_MAIN
+#include <assert.h>
+
+#define TIMERS  100000
+
+int main(int argc, char **argv) {
+    static wheel_timer_t timers[TIMERS];
+    static wheel_t w;
+    wheel_timer_t *t;
+    int64_t now = 1000000, next;
+    int i, fired = 0;
+
+    wheel_init(&w, now);
+    srandom(7);
+    for (i = 0; i < TIMERS; ++i) {
+        /* from now up to about 10 days, in all levels */
+        wheel_add(&w, &timers[i], now + (random() % 1000) *
+                (1LL << (random() % 30)));
+    }
+    /* cancel and rearm some */
+    for (i = 0; i < TIMERS; i += 3) {
+        wheel_del(&w, &timers[i]);
+        assert(!wheel_armed(&timers[i]));
+    }
+    for (i = 0; i < TIMERS; i += 9) {
+        wheel_add(&w, &timers[i], now + random() % 100000000);
+    }
+
+    while (w.count) {
+        next = wheel_next(&w);
+        assert(next != INT64_MAX);
+        if (next > now) now = next;
+        while ((t = wheel_expire(&w, now))) {
+            /* neither early nor later than a tick */
+            assert(t->at <= now);
+            assert(now - t->at < (1 << WHEEL_TICK_SHIFT));
+            ++fired;
+        }
+    }
+
+    for (i = 0; i < TIMERS; ++i) {
+        assert(!wheel_armed(&timers[i]));
+    }
+    printf("%d timers fired on time\n", fired);
+    exit(0);
+}
+#endif /* WHEEL_TEST_MAIN */
@@ -0,0 +1,40 @@
+#ifndef __WHEEL_H_INCLUDED__
+#define __WHEEL_H_INCLUDED__
+
+#include <stdint.h>
+
+/* A hierarchical timing wheel. Every level has 64 slots, a slot of
+ * level L spans 64^L ticks of 256 us. Timers due beyond the last
+ * level are parked in it and placed again when it cascades. */
+#define WHEEL_BITS          6
+#define WHEEL_SIZE          (1 << WHEEL_BITS)
+#define WHEEL_MASK          (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS        5
+#define WHEEL_TICK_SHIFT    8
+
+typedef struct wheel_timer_st wheel_timer_t;
+
+struct wheel_timer_st {
+    wheel_timer_t   *prev;
+    wheel_timer_t   *next;      /* NULL if not armed */
+    int64_t         at;         /* due time in us, see ustime() */
+    int             slot;       /* level * WHEEL_SIZE + index */
+};
+
+typedef struct wheel_st {
+    uint64_t        now;        /* the next tick to expire */
+    int             count;      /* armed timers */
+    uint64_t        used[WHEEL_LEVELS];     /* non-empty slots */
+    wheel_timer_t   slots[WHEEL_LEVELS][WHEEL_SIZE];
+    wheel_timer_t   expired;
+} wheel_t;
+
+void wheel_init(wheel_t *w, int64_t now);
+void wheel_add(wheel_t *w, wheel_timer_t *t, int64_t at);
+void wheel_del(wheel_t *w, wheel_timer_t *t);
+wheel_timer_t *wheel_expire(wheel_t *w, int64_t now);
+int64_t wheel_next(wheel_t *w);
+
+#define wheel_armed(t)  ((t)->next != NULL)
+
+#endif /* __WHEEL_H_INCLUDED__ */